@@ -28,11 +28,15 @@
 #define LOG_TAG "bcinfo"
 #include <log/log.h>
 
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Bitcode/BitstreamWriter.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <cstdlib>
@@ -70,19 +74,112 @@ static const unsigned int kMinimumCompatibleVersion_LLVM_3_0 = 14;
 static const unsigned int kMinimumCompatibleVersion_LLVM_2_7 = 11;
 
 
+/**
+ * Bumped whenever the translation produces different bitcode for the same
+ * input, so that stale cached translations are no longer picked up.
+ */
+static const unsigned int kTranslationCacheFormat = 1;
+
+
 static void stripUnknownAttributes(llvm::Module *M) {
   for (llvm::Function &F : *M)
     slang::stripUnknownAttributes(F);
 }
 
+/**
+ * Path of the cached translation of \p bitcode for API \p version in
+ * \p cacheDir. The name is a hash of everything the translation depends on.
+ */
+static std::string getCachedTranslationPath(const std::string &cacheDir,
+                                            const char *bitcode,
+                                            size_t bitcodeSize,
+                                            unsigned int version) {
+  uint8_t header[8];
+  for (size_t i = 0; i < 4; i++) {
+    header[i] = static_cast<uint8_t>(kTranslationCacheFormat >> (8 * i));
+    header[4 + i] = static_cast<uint8_t>(version >> (8 * i));
+  }
+
+  llvm::MD5 hash;
+  hash.update(llvm::ArrayRef<uint8_t>(header, sizeof(header)));
+  hash.update(llvm::StringRef(bitcode, bitcodeSize));
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+
+  llvm::SmallString<32> digest;
+  llvm::MD5::stringifyResult(result, digest);
+
+  llvm::SmallString<128> path(cacheDir);
+  llvm::sys::path::append(path, digest.str() + ".bc");
+  return path.str();
+}
+
 BitcodeTranslator::BitcodeTranslator(const char *bitcode, size_t bitcodeSize,
                                      unsigned int version)
     : mBitcode(bitcode), mBitcodeSize(bitcodeSize), mTranslatedBitcode(nullptr),
       mTranslatedBitcodeSize(0), mVersion(version) {
+  BitcodeWrapper wrapper(bitcode, bitcodeSize);
+  if (wrapper.isCompressed()) {
+    // On error, checkInput() complains about the empty bitcode.
+    mBitcode = nullptr;
+    mBitcodeSize = 0;
+    if (decompressBitcode(bitcode, bitcodeSize, &mUncompressedBitcode)) {
+      mBitcode = mUncompressedBitcode.data();
+      mBitcodeSize = mUncompressedBitcode.size();
+    }
+  }
   return;
 }
 
 
+bool BitcodeTranslator::readCachedTranslation(const std::string &path) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> cached =
+      llvm::MemoryBuffer::getFile(path, -1, false);
+  if (!cached) {
+    return false;
+  }
+
+  llvm::StringRef bitcode = cached.get()->getBuffer();
+  BitcodeWrapper wrapper(bitcode.data(), bitcode.size());
+  if (wrapper.getBCFileType() != BC_WRAPPER ||
+      wrapper.getTargetAPI() != kMinimumUntranslatedVersion) {
+    ALOGW("Ignoring corrupt cached translation %s", path.c_str());
+    return false;
+  }
+
+  char *c = new char[bitcode.size()];
+  memcpy(c, bitcode.data(), bitcode.size());
+  mTranslatedBitcode = c;
+  mTranslatedBitcodeSize = bitcode.size();
+  return true;
+}
+
+
+void BitcodeTranslator::writeCachedTranslation(const std::string &path) const {
+  // Write to a temporary file first, so that concurrent translations of the
+  // same bitcode never see a partially written cache entry.
+  int fd;
+  llvm::SmallString<128> tmpPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".%%%%%%", fd, tmpPath)) {
+    ALOGV("Unable to create a cache entry for %s", path.c_str());
+    return;
+  }
+
+  llvm::raw_fd_ostream out(fd, /* shouldClose */ true);
+  out.write(mTranslatedBitcode, mTranslatedBitcodeSize);
+  out.close();
+  if (out.has_error()) {
+    out.clear_error();
+    llvm::sys::fs::remove(tmpPath);
+    return;
+  }
+
+  if (llvm::sys::fs::rename(tmpPath, path)) {
+    llvm::sys::fs::remove(tmpPath);
+  }
+}
+
+
 BitcodeTranslator::~BitcodeTranslator() {
   if (mVersion < kMinimumUntranslatedVersion) {
     // We didn't actually do a translation in the alternate case, so deleting
@@ -94,7 +191,12 @@ BitcodeTranslator::~BitcodeTranslator() {
 }
 
 
-bool BitcodeTranslator::translate() {
+bool BitcodeTranslator::needsTranslation(unsigned int version) {
+  return version >= kMinimumAPIVersion && version < kMinimumUntranslatedVersion;
+}
+
+
+bool BitcodeTranslator::checkInput() const {
   if (!mBitcode || !mBitcodeSize) {
     ALOGE("Invalid/empty bitcode");
     return false;
@@ -115,44 +217,89 @@ bool BitcodeTranslator::translate() {
     return false;
   }
 
-  // We currently don't need to transcode any API version higher than 14 or
-  // the current API version (i.e. 10000)
-  if (mVersion >= kMinimumUntranslatedVersion) {
-    mTranslatedBitcode = mBitcode;
-    mTranslatedBitcodeSize = mBitcodeSize;
-    return true;
-  }
+  return true;
+}
 
-  // Do the actual transcoding by invoking a 2.7-era bitcode reader that can
-  // then write the bitcode back out in a more modern (acceptable) version.
-  std::unique_ptr<llvm::LLVMContext> mContext(new llvm::LLVMContext());
+
+llvm::Module *BitcodeTranslator::parseLegacyBitcode(
+    llvm::LLVMContext &context) const {
+  // Invoke a 2.7 or 3.0-era bitcode reader, which builds a module for the
+  // current LLVM.
   std::unique_ptr<llvm::MemoryBuffer> MEM(
     llvm::MemoryBuffer::getMemBuffer(
       llvm::StringRef(mBitcode, mBitcodeSize), "", false));
-  std::string error;
   llvm::ErrorOr<llvm::MemoryBufferRef> MBOrErr = MEM->getMemBufferRef();
 
   llvm::ErrorOr<llvm::Module *> MOrErr(nullptr);
 
   if (mVersion >= kMinimumCompatibleVersion_LLVM_3_0) {
-    MOrErr = llvm_3_0::parseBitcodeFile(*MBOrErr, *mContext);
+    MOrErr = llvm_3_0::parseBitcodeFile(*MBOrErr, context);
   } else if (mVersion >= kMinimumCompatibleVersion_LLVM_2_7) {
-    MOrErr = llvm_2_7::parseBitcodeFile(*MBOrErr, *mContext);
+    MOrErr = llvm_2_7::parseBitcodeFile(*MBOrErr, context);
   } else {
     ALOGE("No compatible bitcode reader for API version %d", mVersion);
-    return false;
+    return nullptr;
   }
 
   if (std::error_code EC = MOrErr.getError()) {
     ALOGE("Could not parse bitcode file");
     ALOGE("%s", EC.message().c_str());
-    return false;
+    return nullptr;
   }
 
-  // Module ownership is handled by the context, so we don't need to free it.
   llvm::Module *module = MOrErr.get();
-
   stripUnknownAttributes(module);
+  return module;
+}
+
+
+std::unique_ptr<llvm::Module>
+BitcodeTranslator::translateToModule(llvm::LLVMContext &context) {
+  if (!checkInput()) {
+    return nullptr;
+  }
+
+  if (!needsTranslation(mVersion)) {
+    ALOGE("Bitcode for API version %u does not need translation", mVersion);
+    return nullptr;
+  }
+
+  return std::unique_ptr<llvm::Module>(parseLegacyBitcode(context));
+}
+
+
+bool BitcodeTranslator::translate() {
+  if (!checkInput()) {
+    return false;
+  }
+
+  BitcodeWrapper BCWrapper(mBitcode, mBitcodeSize);
+
+  // We currently don't need to transcode any API version higher than 14 or
+  // the current API version (i.e. 10000)
+  if (mVersion >= kMinimumUntranslatedVersion) {
+    mTranslatedBitcode = mBitcode;
+    mTranslatedBitcodeSize = mBitcodeSize;
+    return true;
+  }
+
+  std::string cachePath;
+  if (!mCacheDir.empty()) {
+    cachePath = getCachedTranslationPath(mCacheDir, mBitcode, mBitcodeSize,
+                                         mVersion);
+    if (readCachedTranslation(cachePath)) {
+      return true;
+    }
+  }
+
+  // Do the actual transcoding by reading the bitcode with an old reader, and
+  // then writing it back out in a more modern (acceptable) version.
+  std::unique_ptr<llvm::LLVMContext> mContext(new llvm::LLVMContext());
+  // Module ownership is handled by the context, so we don't need to free it.
+  llvm::Module *module = parseLegacyBitcode(*mContext);
+  if (module == nullptr) {
+    return false;
+  }
 
   std::string Buffer;
 
@@ -177,6 +324,10 @@ bool BitcodeTranslator::translate() {
 
   mTranslatedBitcode = c;
 
+  if (!cachePath.empty()) {
+    writeCachedTranslation(cachePath);
+  }
+
   return true;
 }
 
@@ -18,7 +18,14 @@
 #include "bcinfo/Wrap/bitcode_wrapperer.h"
 #include "bcinfo/Wrap/in_memory_wrapper_input.h"
 
+#define LOG_TAG "bcinfo"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/Compression.h"
+
+#include <log/log.h>
 
 #include <cstdlib>
 #include <cstring>
@@ -29,7 +36,8 @@ BitcodeWrapper::BitcodeWrapper(const char *bitcode, size_t bitcodeSize)
     : mFileType(BC_NOT_BC), mBitcode(bitcode),
       mBitcodeSize(bitcodeSize),
       mHeaderVersion(0), mTargetAPI(0), mCompilerVersion(0),
-      mOptimizationLevel(3) {
+      mOptimizationLevel(3), mPayloadOffset(0), mPayloadSize(0),
+      mUncompressedSize(0) {
   InMemoryWrapperInput inMem(mBitcode, mBitcodeSize);
   BitcodeWrapperer wrapperer(&inMem, nullptr);
   if (wrapperer.IsInputBitcodeWrapper()) {
@@ -38,6 +46,9 @@ BitcodeWrapper::BitcodeWrapper(const char *bitcode, size_t bitcodeSize)
     mTargetAPI = wrapperer.getAndroidTargetAPI();
     mCompilerVersion = wrapperer.getAndroidCompilerVersion();
     mOptimizationLevel = wrapperer.getAndroidOptimizationLevel();
+    mPayloadOffset = wrapperer.getWrappedBitcodeOffset();
+    mPayloadSize = wrapperer.getWrappedBitcodeSize();
+    mUncompressedSize = wrapperer.getAndroidUncompressedSize();
   } else if (wrapperer.IsInputBitcodeFile()) {
     mFileType = BC_RAW;
   }
@@ -53,5 +64,70 @@ bool BitcodeWrapper::unwrap() {
   return mFileType != BC_NOT_BC;
 }
 
+
+bool decompressBitcode(const char *bitcode, size_t bitcodeSize,
+                       std::vector<char> *out) {
+  BitcodeWrapper wrapper(bitcode, bitcodeSize);
+  if (!wrapper.isCompressed()) {
+    ALOGE("Bitcode payload is not compressed");
+    return false;
+  }
+  if (wrapper.getPayloadOffset() > bitcodeSize ||
+      wrapper.getPayloadSize() > bitcodeSize - wrapper.getPayloadOffset()) {
+    ALOGE("Compressed bitcode payload is truncated");
+    return false;
+  }
+
+  llvm::SmallVector<char, 0> uncompressed;
+  llvm::StringRef payload(bitcode + wrapper.getPayloadOffset(),
+                          wrapper.getPayloadSize());
+  if (llvm::zlib::uncompress(payload, uncompressed,
+                             wrapper.getUncompressedSize()) !=
+      llvm::zlib::StatusOK) {
+    ALOGE("Unable to decompress the bitcode payload");
+    return false;
+  }
+
+  AndroidBitcodeWrapper header;
+  size_t headerSize = writeAndroidBitcodeWrapper(
+      &header, uncompressed.size(), wrapper.getTargetAPI(),
+      wrapper.getCompilerVersion(), wrapper.getOptimizationLevel());
+  out->resize(headerSize + uncompressed.size());
+  memcpy(out->data(), &header, headerSize);
+  memcpy(out->data() + headerSize, uncompressed.data(), uncompressed.size());
+  return true;
+}
+
+
+bool compressBitcode(const char *bitcode, size_t bitcodeSize,
+                     uint32_t targetAPI, uint32_t compilerVersion,
+                     uint32_t optimizationLevel, std::vector<char> *out) {
+  if (!llvm::zlib::isAvailable()) {
+    ALOGE("Bitcode compression is not supported by this build");
+    return false;
+  }
+
+  llvm::SmallVector<char, 0> compressed;
+  if (llvm::zlib::compress(llvm::StringRef(bitcode, bitcodeSize), compressed,
+                           llvm::zlib::BestSizeCompression) !=
+      llvm::zlib::StatusOK) {
+    ALOGE("Unable to compress the bitcode");
+    return false;
+  }
+
+  AndroidCompressedBitcodeWrapper header;
+  writeAndroidBitcodeWrapper(&header.Wrapper, compressed.size(), targetAPI,
+                             compilerVersion, optimizationLevel);
+  header.Wrapper.BitcodeOffset = sizeof(header);
+  header.UncompressedSizeTag = BCHeaderField::kAndroidUncompressedSize;
+  header.UncompressedSizeLen = 4;
+  header.UncompressedSize = bitcodeSize;
+
+  out->resize(sizeof(header) + compressed.size());
+  memcpy(out->data(), &header, sizeof(header));
+  memcpy(out->data() + sizeof(header), compressed.data(), compressed.size());
+  return true;
+}
+
 }  // namespace bcinfo
 
@@ -29,6 +29,7 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/MemoryBuffer.h"
 
 #ifdef __ANDROID__
@@ -36,9 +37,25 @@
 #endif
 
 #include <cstdlib>
+#include <cstring>
 
 namespace bcinfo {
 
+// Hands out NUL-terminated copies of strings, carved out of a few large
+// slabs. They are all freed at once with the pool.
+class MetadataStringPool {
+ public:
+  const char *save(llvm::StringRef S) {
+    char *c = mAllocator.Allocate<char>(S.size() + 1);
+    memcpy(c, S.data(), S.size());
+    c[S.size()] = '\0';
+    return c;
+  }
+
+ private:
+  llvm::BumpPtrAllocator mAllocator;
+};
+
 namespace {
 
 llvm::StringRef getStringOperand(const llvm::Metadata *node) {
@@ -59,19 +76,17 @@ bool extractUIntFromMetadataString(uint32_t *value,
   return false;
 }
 
-const char *createStringFromValue(llvm::Metadata *m) {
-  auto ref = getStringOperand(m);
-  char *c = new char[ref.size() + 1];
-  memcpy(c, ref.data(), ref.size());
-  c[ref.size()] = '\0';
-  return c;
+const char *createStringFromValue(MetadataStringPool &Strings,
+                                  llvm::Metadata *m) {
+  return Strings.save(getStringOperand(m));
 }
 
-const char *createStringFromOptionalValue(llvm::MDNode *n, unsigned opndNum) {
+const char *createStringFromOptionalValue(MetadataStringPool &Strings,
+                                          llvm::MDNode *n, unsigned opndNum) {
   llvm::Metadata *opnd;
   if (opndNum >= n->getNumOperands() || !(opnd = n->getOperand(opndNum)))
     return nullptr;
-  return createStringFromValue(opnd);
+  return createStringFromValue(Strings, opnd);
 }
 
 // Collect metadata from NamedMDNodes that contain a list of names
@@ -79,6 +94,8 @@ const char *createStringFromOptionalValue(llvm::MDNode *n, unsigned opndNum) {
 //
 // Inputs:
 //
+// Strings - The pool holding the strings of NameList
+//
 // NamedMetadata - An LLVM metadata node, each of whose operands have
 // a string as their first entry
 //
@@ -97,7 +114,8 @@ const char *createStringFromOptionalValue(llvm::MDNode *n, unsigned opndNum) {
 //
 // An error occurs if one of the metadata operands doesn't have a
 // first entry.
-bool populateNameMetadata(const llvm::NamedMDNode *NameMetadata,
+bool populateNameMetadata(MetadataStringPool &Strings,
+                          const llvm::NamedMDNode *NameMetadata,
                           const char **&NameList, size_t &Count) {
   if (!NameMetadata) {
     NameList = nullptr;
@@ -116,12 +134,9 @@ bool populateNameMetadata(const llvm::NamedMDNode *NameMetadata,
   for (size_t i = 0; i < Count; i++) {
     llvm::MDNode *Name = NameMetadata->getOperand(i);
     if (Name && Name->getNumOperands() > 0) {
-      NameList[i] = createStringFromValue(Name->getOperand(0));
+      NameList[i] = createStringFromValue(Strings, Name->getOperand(0));
     } else {
       ALOGE("Metadata operand does not contain a name string");
-      for (size_t AllocatedIndex = 0; AllocatedIndex < i; AllocatedIndex++) {
-        delete [] NameList[AllocatedIndex];
-      }
       delete [] NameList;
       NameList = nullptr;
       Count = 0;
@@ -135,6 +150,10 @@ bool populateNameMetadata(const llvm::NamedMDNode *NameMetadata,
 
 } // end anonymous namespace
 
+// Name of the pragma declaring the X extent a ForEach kernel is always
+// launched over, as "#pragma rs_fixed_extent(<kernel>, <extent>)".
+static const char FixedExtentPragmaName[] = "rs_fixed_extent";
+
 // Name of metadata node where pragma info resides (should be synced with
 // slang.cpp)
 static const llvm::StringRef PragmaMetadataName = "#pragma";
@@ -166,6 +185,11 @@ static const llvm::StringRef ObjectSlotMetadataName = "#rs_object_slots";
 
 static const llvm::StringRef ThreadableMetadataName = "#rs_is_threadable";
 
+// Name of metadata node listing the exported kernels that must not run on
+// multiple threads (should be synced with libbcc/lib/RSIsThreadablePass.cpp)
+static const llvm::StringRef NonThreadableKernelMetadataName =
+    "#rs_non_threadable_kernels";
+
 // Name of metadata node where the checksum for this build is stored.  (should
 // be synced with libbcc/lib/Core/Source.cpp)
 static const llvm::StringRef ChecksumMetadataName = "#rs_build_checksum";
@@ -179,32 +203,47 @@ const char MetadataExtractor::kWrapperMetadataName[] = "#rs_wrapper";
 
 MetadataExtractor::MetadataExtractor(const char *bitcode, size_t bitcodeSize)
     : mModule(nullptr), mBitcode(bitcode), mBitcodeSize(bitcodeSize),
+      mStrings(new MetadataStringPool()),
       mExportVarCount(0), mExportFuncCount(0), mExportForEachSignatureCount(0),
       mExportReduceCount(0), mExportVarNameList(nullptr),
       mExportFuncNameList(nullptr), mExportForEachNameList(nullptr),
       mExportForEachSignatureList(nullptr),
       mExportForEachInputCountList(nullptr),
+      mExportForEachFixedExtentList(nullptr),
       mExportReduceList(nullptr),
       mPragmaCount(0), mPragmaKeyList(nullptr), mPragmaValueList(nullptr),
       mObjectSlotCount(0), mObjectSlotList(nullptr),
       mRSFloatPrecision(RS_FP_Full), mIsThreadable(true),
+      mNonThreadableKernelCount(0), mNonThreadableKernelNameList(nullptr),
       mBuildChecksum(nullptr), mHasDebugInfo(false) {
   BitcodeWrapper wrapper(bitcode, bitcodeSize);
   mCompilerVersion = wrapper.getCompilerVersion();
   mOptimizationLevel = wrapper.getOptimizationLevel();
+  if (wrapper.isCompressed()) {
+    // On error, extract() complains about the empty bitcode.
+    mBitcode = nullptr;
+    mBitcodeSize = 0;
+    if (decompressBitcode(bitcode, bitcodeSize, &mUncompressedBitcode)) {
+      mBitcode = mUncompressedBitcode.data();
+      mBitcodeSize = mUncompressedBitcode.size();
+    }
+  }
 }
 
 MetadataExtractor::MetadataExtractor(const llvm::Module *module)
     : mModule(module), mBitcode(nullptr), mBitcodeSize(0),
+      mStrings(new MetadataStringPool()),
       mExportVarCount(0), mExportFuncCount(0), mExportForEachSignatureCount(0),
       mExportReduceCount(0), mExportVarNameList(nullptr),
       mExportFuncNameList(nullptr), mExportForEachNameList(nullptr),
       mExportForEachSignatureList(nullptr),
       mExportForEachInputCountList(nullptr),
+      mExportForEachFixedExtentList(nullptr),
       mExportReduceList(nullptr),
       mPragmaCount(0), mPragmaKeyList(nullptr), mPragmaValueList(nullptr),
       mObjectSlotCount(0), mObjectSlotList(nullptr),
       mRSFloatPrecision(RS_FP_Full), mIsThreadable(true),
+      mNonThreadableKernelCount(0), mNonThreadableKernelNameList(nullptr),
       mBuildChecksum(nullptr) {
   const llvm::NamedMDNode *const wrapperMDNode = module->getNamedMetadata(kWrapperMetadataName);
   bccAssert((wrapperMDNode != nullptr) && (wrapperMDNode->getNumOperands() == 1));
@@ -218,30 +257,13 @@ MetadataExtractor::MetadataExtractor(const llvm::Module *module)
 
 
 MetadataExtractor::~MetadataExtractor() {
-  if (mExportVarNameList) {
-    for (size_t i = 0; i < mExportVarCount; i++) {
-        delete [] mExportVarNameList[i];
-        mExportVarNameList[i] = nullptr;
-    }
-  }
+  // The strings of all the lists are freed along with mStrings.
   delete [] mExportVarNameList;
   mExportVarNameList = nullptr;
 
-  if (mExportFuncNameList) {
-    for (size_t i = 0; i < mExportFuncCount; i++) {
-        delete [] mExportFuncNameList[i];
-        mExportFuncNameList[i] = nullptr;
-    }
-  }
   delete [] mExportFuncNameList;
   mExportFuncNameList = nullptr;
 
-  if (mExportForEachNameList) {
-    for (size_t i = 0; i < mExportForEachSignatureCount; i++) {
-        delete [] mExportForEachNameList[i];
-        mExportForEachNameList[i] = nullptr;
-    }
-  }
   delete [] mExportForEachNameList;
   mExportForEachNameList = nullptr;
 
@@ -251,19 +273,12 @@ MetadataExtractor::~MetadataExtractor() {
   delete [] mExportForEachInputCountList;
   mExportForEachInputCountList = nullptr;
 
+  delete [] mExportForEachFixedExtentList;
+  mExportForEachFixedExtentList = nullptr;
+
   delete [] mExportReduceList;
   mExportReduceList = nullptr;
 
-  for (size_t i = 0; i < mPragmaCount; i++) {
-    if (mPragmaKeyList) {
-      delete [] mPragmaKeyList[i];
-      mPragmaKeyList[i] = nullptr;
-    }
-    if (mPragmaValueList) {
-      delete [] mPragmaValueList[i];
-      mPragmaValueList[i] = nullptr;
-    }
-  }
   delete [] mPragmaKeyList;
   mPragmaKeyList = nullptr;
   delete [] mPragmaValueList;
@@ -272,7 +287,8 @@ MetadataExtractor::~MetadataExtractor() {
   delete [] mObjectSlotList;
   mObjectSlotList = nullptr;
 
-  delete [] mBuildChecksum;
+  delete [] mNonThreadableKernelNameList;
+  mNonThreadableKernelNameList = nullptr;
 
   return;
 }
@@ -321,16 +337,16 @@ void MetadataExtractor::populatePragmaMetadata(
     return;
   }
 
-  const char **TmpKeyList = new const char*[mPragmaCount];
-  const char **TmpValueList = new const char*[mPragmaCount];
+  const char **TmpKeyList = new const char*[mPragmaCount]();
+  const char **TmpValueList = new const char*[mPragmaCount]();
 
   for (size_t i = 0; i < mPragmaCount; i++) {
     llvm::MDNode *Pragma = PragmaMetadata->getOperand(i);
     if (Pragma != nullptr && Pragma->getNumOperands() == 2) {
       llvm::Metadata *PragmaKeyMDS = Pragma->getOperand(0);
-      TmpKeyList[i] = createStringFromValue(PragmaKeyMDS);
+      TmpKeyList[i] = createStringFromValue(*mStrings, PragmaKeyMDS);
       llvm::Metadata *PragmaValueMDS = Pragma->getOperand(1);
-      TmpValueList[i] = createStringFromValue(PragmaValueMDS);
+      TmpValueList[i] = createStringFromValue(*mStrings, PragmaValueMDS);
     }
   }
 
@@ -383,6 +399,45 @@ void MetadataExtractor::populatePragmaMetadata(
     }
   }
 #endif
+
+  // Look the ForEach kernels with a fixed X extent up, which are expected to
+  // be populated already.
+  std::unique_ptr<uint32_t[]> FixedExtentList;
+  for (size_t i = 0; i < mPragmaCount; i++) {
+    if (!mPragmaKeyList[i] || !mPragmaValueList[i] ||
+        strcmp(mPragmaKeyList[i], FixedExtentPragmaName) != 0) {
+      continue;
+    }
+
+    llvm::StringRef Value(mPragmaValueList[i]);
+    size_t Comma = Value.rfind(',');
+    uint32_t Extent = 0;
+    if (Comma == llvm::StringRef::npos ||
+        Value.substr(Comma + 1).trim().getAsInteger(10, Extent) ||
+        Extent == 0) {
+      ALOGE("Invalid value '%s' for pragma %s", mPragmaValueList[i],
+            FixedExtentPragmaName);
+      continue;
+    }
+    llvm::StringRef Kernel = Value.substr(0, Comma).trim();
+
+    size_t Index = 0;
+    while (Index < mExportForEachSignatureCount &&
+           Kernel != mExportForEachNameList[Index]) {
+      Index++;
+    }
+    if (Index == mExportForEachSignatureCount) {
+      ALOGW("Pragma %s names unknown kernel '%s'", FixedExtentPragmaName,
+            Kernel.str().c_str());
+      continue;
+    }
+
+    if (!FixedExtentList) {
+      FixedExtentList.reset(new uint32_t[mExportForEachSignatureCount]());
+    }
+    FixedExtentList[Index] = Extent;
+  }
+  mExportForEachFixedExtentList = FixedExtentList.release();
 }
 
 uint32_t MetadataExtractor::calculateNumInputs(const llvm::Function *Function,
@@ -415,15 +470,13 @@ bool MetadataExtractor::populateForEachMetadata(
     // section for ForEach. We generate a full signature for a "root" function
     // which means that we need to set the bottom 5 bits in the mask.
     mExportForEachSignatureCount = 1;
-    char **TmpNameList = new char*[mExportForEachSignatureCount];
-    size_t RootLen = strlen(kRoot) + 1;
-    TmpNameList[0] = new char[RootLen];
-    strncpy(TmpNameList[0], kRoot, RootLen);
+    const char **TmpNameList = new const char*[mExportForEachSignatureCount];
+    TmpNameList[0] = mStrings->save(kRoot);
 
     uint32_t *TmpSigList = new uint32_t[mExportForEachSignatureCount];
     TmpSigList[0] = 0x1f;
 
-    mExportForEachNameList = (const char**)TmpNameList;
+    mExportForEachNameList = TmpNameList;
     mExportForEachSignatureList = TmpSigList;
     return true;
   }
@@ -460,7 +513,7 @@ bool MetadataExtractor::populateForEachMetadata(
     for (size_t i = 0; i < mExportForEachSignatureCount; i++) {
       llvm::MDNode *Name = Names->getOperand(i);
       if (Name != nullptr && Name->getNumOperands() == 1) {
-        TmpNameList[i] = createStringFromValue(Name->getOperand(0));
+        TmpNameList[i] = createStringFromValue(*mStrings, Name->getOperand(0));
 
         // Note that looking up the function by name can fail: One of
         // the uses of MetadataExtractor is as part of the
@@ -482,9 +535,7 @@ bool MetadataExtractor::populateForEachMetadata(
       ALOGE("mExportForEachSignatureCount = %zu, but should be 1",
             mExportForEachSignatureCount);
     }
-    char *RootName = new char[5];
-    strncpy(RootName, "root", 5);
-    TmpNameList[0] = RootName;
+    TmpNameList[0] = mStrings->save("root");
   }
 
   delete [] mExportForEachNameList;
@@ -516,7 +567,7 @@ bool MetadataExtractor::populateReduceMetadata(const llvm::NamedMDNode *ReduceMe
       return false;
     }
 
-    TmpReduceList[i].mReduceName = createStringFromValue(Node->getOperand(0));
+    TmpReduceList[i].mReduceName = createStringFromValue(*mStrings, Node->getOperand(0));
 
     if (!extractUIntFromMetadataString(&TmpReduceList[i].mAccumulatorDataSize,
                                        Node->getOperand(1))) {
@@ -529,7 +580,7 @@ bool MetadataExtractor::populateReduceMetadata(const llvm::NamedMDNode *ReduceMe
       ALOGE("Malformed accumulator node in reduce metadata");
       return false;
     }
-    TmpReduceList[i].mAccumulatorName = createStringFromValue(AccumulatorNode->getOperand(0));
+    TmpReduceList[i].mAccumulatorName = createStringFromValue(*mStrings, AccumulatorNode->getOperand(0));
     if (!extractUIntFromMetadataString(&TmpReduceList[i].mSignature,
                                        AccumulatorNode->getOperand(1))) {
       ALOGE("Non-integer signature value in reduce metadata");
@@ -549,10 +600,10 @@ bool MetadataExtractor::populateReduceMetadata(const llvm::NamedMDNode *ReduceMe
     // want to treat the accumulator argument as an input.
     TmpReduceList[i].mInputCount = (Func ? calculateNumInputs(Func, TmpReduceList[i].mSignature) - 1 : 0);
 
-    TmpReduceList[i].mInitializerName = createStringFromOptionalValue(Node, 3);
-    TmpReduceList[i].mCombinerName = createStringFromOptionalValue(Node, 4);
-    TmpReduceList[i].mOutConverterName = createStringFromOptionalValue(Node, 5);
-    TmpReduceList[i].mHalterName = createStringFromOptionalValue(Node, 6);
+    TmpReduceList[i].mInitializerName = createStringFromOptionalValue(*mStrings, Node, 3);
+    TmpReduceList[i].mCombinerName = createStringFromOptionalValue(*mStrings, Node, 4);
+    TmpReduceList[i].mOutConverterName = createStringFromOptionalValue(*mStrings, Node, 5);
+    TmpReduceList[i].mHalterName = createStringFromOptionalValue(*mStrings, Node, 6);
   }
 
   mExportReduceList = TmpReduceList.release();
@@ -582,6 +633,19 @@ void MetadataExtractor::readThreadableFlag(
     mIsThreadable = false;
 }
 
+bool MetadataExtractor::isKernelThreadable(const char *name) const {
+  if (!mIsThreadable && mNonThreadableKernelCount == 0) {
+    // Bitcode from before the analysis was done per kernel.
+    return false;
+  }
+  for (size_t i = 0; i < mNonThreadableKernelCount; i++) {
+    if (strcmp(mNonThreadableKernelNameList[i], name) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void MetadataExtractor::readBuildChecksumMetadata(
     const llvm::NamedMDNode *ChecksumMetadata) {
 
@@ -596,7 +660,7 @@ void MetadataExtractor::readBuildChecksumMetadata(
   if (mdValue == nullptr)
     return;
 
-  mBuildChecksum = createStringFromValue(mdValue);
+  mBuildChecksum = createStringFromValue(*mStrings, mdValue);
 }
 
 bool MetadataExtractor::extract() {
@@ -615,15 +679,24 @@ bool MetadataExtractor::extract() {
         llvm::StringRef(mBitcode, mBitcodeSize), "", false));
     std::string error;
 
+    // Only the named metadata and the function prototypes are looked at, so
+    // the module is loaded lazily and its function bodies are never read.
     llvm::ErrorOr<std::unique_ptr<llvm::Module> > errval =
-        llvm::parseBitcodeFile(MEM.get()->getMemBufferRef(), *mContext);
+        llvm::getLazyBitcodeModule(std::move(MEM), *mContext);
     if (std::error_code ec = errval.getError()) {
         ALOGE("Could not parse bitcode file");
         ALOGE("%s", ec.message().c_str());
         return false;
     }
 
-    mModule = errval.get().release();
+    std::unique_ptr<llvm::Module> module = std::move(errval.get());
+    if (std::error_code ec = module->materializeMetadata()) {
+        ALOGE("Could not read metadata from bitcode file");
+        ALOGE("%s", ec.message().c_str());
+        return false;
+    }
+
+    mModule = module.release();
     shouldNullModule = true;
   }
 
@@ -643,18 +716,20 @@ bool MetadataExtractor::extract() {
       mModule->getNamedMetadata(ObjectSlotMetadataName);
   const llvm::NamedMDNode *ThreadableMetadata =
       mModule->getNamedMetadata(ThreadableMetadataName);
+  const llvm::NamedMDNode *NonThreadableKernelMetadata =
+      mModule->getNamedMetadata(NonThreadableKernelMetadataName);
   const llvm::NamedMDNode *ChecksumMetadata =
       mModule->getNamedMetadata(ChecksumMetadataName);
   const llvm::NamedMDNode *DebugInfoMetadata =
       mModule->getNamedMetadata(DebugInfoMetadataName);
 
-  if (!populateNameMetadata(ExportVarMetadata, mExportVarNameList,
+  if (!populateNameMetadata(*mStrings, ExportVarMetadata, mExportVarNameList,
                             mExportVarCount)) {
     ALOGE("Could not populate export variable metadata");
     goto err;
   }
 
-  if (!populateNameMetadata(ExportFuncMetadata, mExportFuncNameList,
+  if (!populateNameMetadata(*mStrings, ExportFuncMetadata, mExportFuncNameList,
                             mExportFuncCount)) {
     ALOGE("Could not populate export function metadata");
     goto err;
@@ -679,6 +754,14 @@ bool MetadataExtractor::extract() {
   }
 
   readThreadableFlag(ThreadableMetadata);
+
+  if (!populateNameMetadata(*mStrings, NonThreadableKernelMetadata,
+                            mNonThreadableKernelNameList,
+                            mNonThreadableKernelCount)) {
+    ALOGE("Could not populate non-threadable kernel metadata");
+    goto err;
+  }
+
   readBuildChecksumMetadata(ChecksumMetadata);
 
   mHasDebugInfo = DebugInfoMetadata != nullptr;
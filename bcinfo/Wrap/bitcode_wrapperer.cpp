@@ -68,6 +68,7 @@ BitcodeWrapperer::BitcodeWrapperer(WrapperInput* infile, WrapperOutput* outfile)
       android_target_api_(kAndroidTargetAPI),
       android_compiler_version_(kAndroidDefaultCompilerVersion),
       android_optimization_level_(kAndroidDefaultOptimizationLevel),
+      android_uncompressed_size_(0),
       pnacl_bc_version_(0),
       error_(false) {
   buffer_.resize(kBitcodeWrappererBufferSize);
@@ -250,6 +251,12 @@ bool BitcodeWrapperer::ParseWrapperHeader() {
             android_optimization_level_ = tempIntField.val;
           }
           break;
+        case BCHeaderField::kAndroidUncompressedSize:
+          if (field.Write((uint8_t*)&tempIntField,
+                          sizeof(tempIntField))) {
+            android_uncompressed_size_ = tempIntField.val;
+          }
+          break;
         default:
           // Ignore other field types for now
           break;
@@ -329,6 +336,11 @@ bool BitcodeWrapperer::BufferCopyInToOut(uint32_t size) {
   return buffer_size_ == 0;
 }
 
+bool BitcodeWrapperer::CopyInToOut(uint32_t pos, uint32_t size) {
+  uint32_t spliced = outfile_->Splice(infile_, pos, size);
+  return Seek(pos + spliced) && BufferCopyInToOut(size - spliced);
+}
+
 void BitcodeWrapperer::AddHeaderField(BCHeaderField* field) {
   header_fields_.push_back(*field);
   wrapper_bc_offset_ += field->GetTotalSize();
@@ -369,8 +381,7 @@ void BitcodeWrapperer::PrintWrapperHeader() {
 bool BitcodeWrapperer::GenerateWrappedBitcodeFile() {
   if (!error_ &&
       WriteBitcodeWrapperHeader() &&
-      Seek(infile_bc_offset_) &&
-      BufferCopyInToOut(wrapper_bc_size_)) {
+      CopyInToOut(infile_bc_offset_, wrapper_bc_size_)) {
     off_t dangling = wrapper_bc_size_ & 3;
     if (dangling) {
       return outfile_->Write((const uint8_t*) "\0\0\0\0", 4 - dangling);
@@ -381,6 +392,14 @@ bool BitcodeWrapperer::GenerateWrappedBitcodeFile() {
 }
 
 bool BitcodeWrapperer::GenerateRawBitcodeFile() {
-  return !error_ && Seek(infile_bc_offset_) &&
-      BufferCopyInToOut(wrapper_bc_size_);
+  return !error_ && CopyInToOut(infile_bc_offset_, wrapper_bc_size_);
+}
+
+bool BitcodeWrapperer::RewriteWrapperHeader() {
+  // A raw input has no header to rewrite (its infile_bc_offset_ is 0).
+  if (error_ || infile_bc_offset_ == 0 ||
+      wrapper_bc_offset_ != infile_bc_offset_) {
+    return false;
+  }
+  return WriteBitcodeWrapperHeader();
 }
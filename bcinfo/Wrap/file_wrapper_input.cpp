@@ -62,3 +62,7 @@ off_t FileWrapperInput::Size() {
 bool FileWrapperInput::Seek(uint32_t pos) {
   return fseek(_file, (long) pos, SEEK_SET) == 0; // NOLINT
 }
+
+int FileWrapperInput::GetFileDescriptor() {
+  return fileno(_file);
+}
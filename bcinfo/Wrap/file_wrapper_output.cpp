@@ -16,11 +16,18 @@
 
 #include <stdlib.h>
 
+#if defined(__linux__)
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
+
 #include "bcinfo/Wrap/file_wrapper_output.h"
+#include "bcinfo/Wrap/wrapper_input.h"
 
-FileWrapperOutput::FileWrapperOutput(const char* name)
+FileWrapperOutput::FileWrapperOutput(const char* name, bool update)
     : _name(name) {
-  _file = fopen(name, "wb");
+  _file = fopen(name, update ? "r+b" : "wb");
   if (nullptr == _file) {
     fprintf(stderr, "Unable to open: %s\n", name);
     exit(1);
@@ -46,3 +53,41 @@ bool FileWrapperOutput::Write(const uint8_t* buffer, size_t buffer_size) {
     return true;
   }
 }
+
+size_t FileWrapperOutput::Splice(WrapperInput* input, uint32_t pos,
+                                 uint32_t size) {
+#if defined(__linux__)
+  int in_fd = (input != nullptr) ? input->GetFileDescriptor() : -1;
+  if (in_fd < 0 || size == 0 || fflush(_file) != 0) {
+    return 0;
+  }
+  int out_fd = fileno(_file);
+  off_t offset = pos;
+  size_t spliced = 0;
+  while (spliced < size) {
+    ssize_t sent = sendfile(out_fd, in_fd, &offset, size - spliced);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      break;
+    }
+    spliced += sent;
+  }
+  if (spliced > 0) {
+    // sendfile moved the descriptor past the stream's idea of its
+    // position, so bring the stream back in sync before further writes.
+    off_t end = lseek(out_fd, 0, SEEK_CUR);
+    if (end < 0 || fseeko(_file, end, SEEK_SET) != 0) {
+      fprintf(stderr, "Unable to reposition: %s\n", _name);
+      exit(1);
+    }
+  }
+  return spliced;
+#else
+  (void) input;
+  (void) pos;
+  (void) size;
+  return 0;
+#endif
+}
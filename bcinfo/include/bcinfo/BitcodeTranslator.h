@@ -18,6 +18,14 @@
 #define __ANDROID_BCINFO_BITCODETRANSLATOR_H__
 
 #include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class LLVMContext;
+  class Module;
+}
 
 namespace bcinfo {
 
@@ -25,9 +33,19 @@ class BitcodeTranslator {
  private:
   const char *mBitcode;
   size_t mBitcodeSize;
+  // The uncompressed bitcode mBitcode points to, if the input had a
+  // compressed payload.
+  std::vector<char> mUncompressedBitcode;
   const char *mTranslatedBitcode;
   size_t mTranslatedBitcodeSize;
   unsigned int mVersion;
+  std::string mCacheDir;
+
+  bool checkInput() const;
+  llvm::Module *parseLegacyBitcode(llvm::LLVMContext &context) const;
+
+  bool readCachedTranslation(const std::string &path);
+  void writeCachedTranslation(const std::string &path) const;
 
  public:
   /**
@@ -42,6 +60,18 @@ class BitcodeTranslator {
 
   ~BitcodeTranslator();
 
+  /**
+   * Keep the bitcode translated by translate() in \p cacheDir, and reuse it
+   * when later asked to translate the same bitcode for the same API version.
+   * Without a cache directory (the default), legacy bitcode is translated
+   * every time.
+   *
+   * \param cacheDir - existing directory for the translated bitcode.
+   */
+  void setCacheDir(const char *cacheDir) {
+    mCacheDir = (cacheDir != nullptr) ? cacheDir : "";
+  }
+
   /**
    * Translate the supplied bitcode to the latest supported version.
    *
@@ -50,6 +80,22 @@ class BitcodeTranslator {
    */
   bool translate();
 
+  /**
+   * Translate the supplied bitcode straight into a module of \p context,
+   * rather than into bitcode that then has to be parsed again. Only bitcode
+   * for which needsTranslation() holds can be translated this way, and the
+   * module does not carry the information of the bitcode wrapper.
+   *
+   * \return the translated module, or nullptr if an error occurred.
+   */
+  std::unique_ptr<llvm::Module> translateToModule(llvm::LLVMContext &context);
+
+  /**
+   * \return true if bitcode targeting API \p version has to be translated
+   *         before the current bitcode reader can read it.
+   */
+  static bool needsTranslation(unsigned int version);
+
   /**
    * \return translated bitcode.
    */
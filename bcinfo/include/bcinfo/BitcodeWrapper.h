@@ -21,6 +21,7 @@
 
 #include <cstddef>
 #include <stdint.h>
+#include <vector>
 
 namespace bcinfo {
 
@@ -40,6 +41,17 @@ struct AndroidBitcodeWrapper {
   uint32_t OptimizationLevel;
 };
 
+/**
+ * Header of a bitcode wrapper whose payload is compressed: the wrapped bitcode
+ * is zlib-compressed, and UncompressedSize is its size once uncompressed.
+ */
+struct AndroidCompressedBitcodeWrapper {
+  AndroidBitcodeWrapper Wrapper;
+  uint16_t UncompressedSizeTag;
+  uint16_t UncompressedSizeLen;
+  uint32_t UncompressedSize;
+};
+
 enum BCFileType {
   BC_NOT_BC = 0,
   BC_WRAPPER = 1,
@@ -57,6 +69,10 @@ class BitcodeWrapper {
   uint32_t mCompilerVersion;
   uint32_t mOptimizationLevel;
 
+  uint32_t mPayloadOffset;
+  uint32_t mPayloadSize;
+  uint32_t mUncompressedSize;
+
  public:
   /**
    * Reads wrapper information from \p bitcode.
@@ -110,8 +126,70 @@ class BitcodeWrapper {
     return mOptimizationLevel;
   }
 
+  /**
+   * \return true if the wrapped bitcode is compressed, in which case it has to
+   *         go through decompressBitcode() before it can be read.
+   */
+  bool isCompressed() const {
+    return mUncompressedSize != 0;
+  }
+
+  /**
+   * \return size of the wrapped bitcode once uncompressed, or 0 if it isn't
+   *         compressed.
+   */
+  uint32_t getUncompressedSize() const {
+    return mUncompressedSize;
+  }
+
+  /**
+   * \return offset and size of the wrapped bitcode (compressed or not)
+   *         within the input, for a wrapper.
+   */
+  uint32_t getPayloadOffset() const {
+    return mPayloadOffset;
+  }
+
+  uint32_t getPayloadSize() const {
+    return mPayloadSize;
+  }
+
 };
 
+/**
+ * Decompress wrapped bitcode whose payload is compressed (see
+ * BitcodeWrapper::isCompressed()).
+ *
+ * \param bitcode - input bitcode string.
+ * \param bitcodeSize - length of \p bitcode string (in bytes).
+ * \param out - where to write a plain wrapper with the same information,
+ *              followed by the uncompressed bitcode. It can then be used
+ *              wherever \p bitcode would have been.
+ *
+ * \return true on success and false if an error occurred.
+ */
+bool decompressBitcode(const char *bitcode, size_t bitcodeSize,
+                       std::vector<char> *out);
+
+/**
+ * Wrap \p bitcode (raw bitcode, not itself wrapped) into a wrapper with a
+ * compressed payload, for APKs and updates. Readers of the wrapper have to
+ * support compressed payloads.
+ *
+ * \param bitcode - input raw bitcode string.
+ * \param bitcodeSize - length of \p bitcode string (in bytes).
+ * \param targetAPI - target API version for this bitcode.
+ * \param compilerVersion - compiler version that generated this bitcode.
+ * \param optimizationLevel - compiler optimization level for this bitcode.
+ * \param out - where to write the wrapper and the compressed bitcode.
+ *
+ * \return true on success and false if an error occurred (e.g. zlib support
+ *         is not available).
+ */
+bool compressBitcode(const char *bitcode, size_t bitcodeSize,
+                     uint32_t targetAPI, uint32_t compilerVersion,
+                     uint32_t optimizationLevel, std::vector<char> *out);
+
 /**
  * Helper function to emit just the bitcode wrapper returning the number of
  * bytes that were written.
@@ -19,6 +19,7 @@
 
 #include <cstddef>
 #include <memory>
+#include <vector>
 
 #include <stdint.h>
 
@@ -30,6 +31,8 @@ namespace llvm {
 
 namespace bcinfo {
 
+class MetadataStringPool;
+
 enum RSFloatPrecision {
   RS_FP_Full = 0,
   RS_FP_Relaxed = 1,
@@ -50,8 +53,8 @@ enum MetadataSignatureBitval {
 class MetadataExtractor {
  public:
   struct Reduce {
-    // These strings are owned by the Reduce instance, and deleted upon its destruction.
-    // They are assumed to have been allocated by "new []" and hence are deleted by "delete []".
+    // These strings are owned by the MetadataExtractor the Reduce instance
+    // belongs to, and live as long as it does.
     const char *mReduceName;
     const char *mInitializerName;
     const char *mAccumulatorName;
@@ -69,14 +72,6 @@ class MetadataExtractor {
         mOutConverterName(nullptr), mHalterName(nullptr),
         mSignature(0), mInputCount(0), mAccumulatorDataSize(0) {
     }
-    ~Reduce() {
-      delete [] mReduceName;
-      delete [] mInitializerName;
-      delete [] mAccumulatorName;
-      delete [] mCombinerName;
-      delete [] mOutConverterName;
-      delete [] mHalterName;
-    }
 
     Reduce(const Reduce &) = delete;
     void operator=(const Reduce &) = delete;
@@ -86,6 +81,13 @@ class MetadataExtractor {
   const llvm::Module *mModule;
   const char *mBitcode;
   size_t mBitcodeSize;
+  // The uncompressed bitcode mBitcode points to, if the input had a
+  // compressed payload.
+  std::vector<char> mUncompressedBitcode;
+
+  // Storage for all the strings below, which are copied out of the module
+  // together rather than allocated one by one.
+  std::unique_ptr<MetadataStringPool> mStrings;
 
   size_t mExportVarCount;
   size_t mExportFuncCount;
@@ -96,6 +98,7 @@ class MetadataExtractor {
   const char **mExportForEachNameList;
   const uint32_t *mExportForEachSignatureList;
   const uint32_t *mExportForEachInputCountList;
+  const uint32_t *mExportForEachFixedExtentList;
   const Reduce *mExportReduceList;
 
   size_t mPragmaCount;
@@ -113,6 +116,11 @@ class MetadataExtractor {
   // Flag to mark that script is threadable.  True by default.
   bool mIsThreadable;
 
+  // Exported kernels (ForEach kernels and general reductions) that can reach
+  // a non-threadable function.
+  size_t mNonThreadableKernelCount;
+  const char **mNonThreadableKernelNameList;
+
   const char *mBuildChecksum;
 
   bool mHasDebugInfo;
@@ -137,7 +145,8 @@ class MetadataExtractor {
   static const char kWrapperMetadataName[];
 
   /**
-   * Reads metadata from \p bitcode.
+   * Reads metadata from \p bitcode. Only the globals and metadata of the
+   * bitcode are parsed; function bodies are skipped.
    *
    * \param bitcode - input bitcode string.
    * \param bitcodeSize - length of \p bitcode string (in bytes).
@@ -211,6 +220,16 @@ class MetadataExtractor {
     return mExportForEachNameList;
   }
 
+  /**
+   * \return array of the X extents the ForEach kernels are declared to
+   *         always be launched over, with
+   *         "#pragma rs_fixed_extent(<kernel>, <extent>)", or 0 for the
+   *         kernels without such a declaration. nullptr if no kernel has one.
+   */
+  const uint32_t *getExportForEachFixedExtentList() const {
+    return mExportForEachFixedExtentList;
+  }
+
   /**
    * \return array of input parameter counts.
    */
@@ -381,6 +400,29 @@ class MetadataExtractor {
     return mIsThreadable;
   }
 
+  /**
+   * \return number of exported kernels that must not be processed by
+   * multiple threads.
+   */
+  size_t getNonThreadableKernelCount() const {
+    return mNonThreadableKernelCount;
+  }
+
+  /**
+   * \return array of the names of the exported ForEach kernels and general
+   * reductions that must not be processed by multiple threads.
+   */
+  const char **getNonThreadableKernelNameList() const {
+    return mNonThreadableKernelNameList;
+  }
+
+  /**
+   * \return whether the exported ForEach kernel or general reduction \p name
+   * can be processed by multiple threads, even if other kernels of the script
+   * can't.
+   */
+  bool isKernelThreadable(const char *name) const;
+
   /**
    * \return the build checksum extracted from the LLVM metadata
    */
@@ -34,7 +34,10 @@ class BCHeaderField {
     kInvalid = 0,
     kBitcodeHash = 1,
     kAndroidCompilerVersion = 0x4001,
-    kAndroidOptimizationLevel = 0x4002
+    kAndroidOptimizationLevel = 0x4002,
+    // The wrapped bitcode is zlib-compressed; the field holds its size once
+    // uncompressed.
+    kAndroidUncompressedSize = 0x4003
   } Tag;
   typedef uint16_t FixedSubfield;
 
@@ -72,6 +72,14 @@ class BitcodeWrapperer {
   // outfile. Return true on success.
   bool GenerateRawBitcodeFile();
 
+  // Overwrite the wrapper header of a wrapped input file with the
+  // current header data, leaving the bitcode where it is. The outfile
+  // must write to the input file itself (e.g. a FileWrapperOutput opened
+  // for update). Return false, without writing anything, if the input
+  // isn't wrapped or the new header doesn't have the size of the old one;
+  // GenerateWrappedBitcodeFile must then be used instead.
+  bool RewriteWrapperHeader();
+
   // Print current wrapper header fields to stderr for debugging.
   void PrintWrapperHeader();
 
@@ -83,6 +91,10 @@ class BitcodeWrapperer {
     return android_target_api_;
   }
 
+  void setAndroidTargetAPI(uint32_t target_api) {
+    android_target_api_ = target_api;
+  }
+
   uint32_t getAndroidCompilerVersion() {
     return android_compiler_version_;
   }
@@ -91,6 +103,19 @@ class BitcodeWrapperer {
     return android_optimization_level_;
   }
 
+  // 0 unless the wrapped bitcode is compressed.
+  uint32_t getAndroidUncompressedSize() {
+    return android_uncompressed_size_;
+  }
+
+  uint32_t getWrappedBitcodeOffset() {
+    return wrapper_bc_offset_;
+  }
+
+  uint32_t getWrappedBitcodeSize() {
+    return wrapper_bc_size_;
+  }
+
   ~BitcodeWrapperer();
 
  private:
@@ -153,6 +178,11 @@ class BitcodeWrapperer {
   // Copies size bytes of infile to outfile, using the buffer.
   bool BufferCopyInToOut(uint32_t size);
 
+  // Copies size bytes of infile, starting at pos, to outfile. Lets the
+  // outfile splice them directly when it can, and uses the buffer for
+  // whatever is left.
+  bool CopyInToOut(uint32_t pos, uint32_t size);
+
   // Discards the old infile and replaces it with the given file.
   void ReplaceInFile(WrapperInput* new_infile);
 
@@ -204,6 +234,7 @@ class BitcodeWrapperer {
   uint32_t android_target_api_;
   uint32_t android_compiler_version_;
   uint32_t android_optimization_level_;
+  uint32_t android_uncompressed_size_;
 
   // PNaCl bitcode version
   uint32_t pnacl_bc_version_;
@@ -40,6 +40,8 @@ class FileWrapperInput : public WrapperInput {
   // Moves to the given offset within the file. Returns
   // false if unable to move to that position.
   virtual bool Seek(uint32_t pos);
+  // Returns the descriptor of the opened file.
+  virtual int GetFileDescriptor();
  private:
   // The name of the file.
   const char* _name;
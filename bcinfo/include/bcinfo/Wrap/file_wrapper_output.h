@@ -27,13 +27,18 @@
 // Define a class to wrap named files. */
 class FileWrapperOutput : public WrapperOutput {
  public:
-  explicit FileWrapperOutput(const char* name);
+  // Opens the named file for output. If update is true, the file must
+  // exist and is overwritten from its beginning without being truncated,
+  // e.g. to rewrite a wrapper header in place.
+  explicit FileWrapperOutput(const char* name, bool update = false);
   ~FileWrapperOutput();
   // Writes a single byte, returning false if unable to write.
   virtual bool Write(uint8_t byte);
   // Writes the specified number of bytes in the buffer to
   // output. Returns false if unable to write.
   virtual bool Write(const uint8_t* buffer, size_t buffer_size);
+  // Copies bytes of a file-backed input with sendfile, where available.
+  virtual size_t Splice(WrapperInput* input, uint32_t pos, uint32_t size);
  private:
   // The name of the file
   const char* _name;
@@ -42,6 +42,9 @@ class WrapperInput {
   // Moves to the given offset within the input region. Returns false
   // if unable to move to that position.
   virtual bool Seek(uint32_t pos) = 0;
+  // Returns the file descriptor the input is read from, or -1 if the
+  // input isn't backed by a file.
+  virtual int GetFileDescriptor() { return -1; }
  private:
   DISALLOW_CLASS_COPY_AND_ASSIGN(WrapperInput);
 };
@@ -26,6 +26,8 @@
 
 #include "bcinfo/Wrap/support_macros.h"
 
+class WrapperInput;
+
 // The following is a generic interface to a file/memory region
 // that contains a generated bitcode file, wrapped bitcode file,
 // or a data file.
@@ -38,6 +40,13 @@ class WrapperOutput {
   // Writes the specified number of bytes in the buffer to
   // output. Returns false if unable to write.
   virtual bool Write(const uint8_t* buffer, size_t buffer_size);
+  // Copies up to size bytes, starting at offset pos of input, to
+  // output without going through a user-space buffer. Returns the
+  // number of bytes copied, which may be 0 if the output can't do
+  // this for the given input; the caller copies the rest itself.
+  virtual size_t Splice(WrapperInput* input, uint32_t pos, uint32_t size) {
+    return 0;
+  }
  private:
   DISALLOW_CLASS_COPY_AND_ASSIGN(WrapperOutput);
 };
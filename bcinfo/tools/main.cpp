@@ -43,15 +43,27 @@
 
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 // This file corresponds to the standalone bcinfo tool. It prints a variety of
 // information about a supplied bitcode input file.
+//
+// Given several input files, a manifest (-m) or -J, it instead runs in batch
+// mode: the files are processed on a pool of -j worker threads, each with its
+// own LLVMContext, and a single JSON document describing all of them is
+// printed to stdout.
 
 std::string inFile;
 std::string outFile;
 std::string infoFile;
+std::string cacheDir;
+std::string manifestFile;
+std::vector<std::string> inFiles;
 
 extern int opterr;
 extern int optind;
@@ -59,10 +71,35 @@ extern int optind;
 bool translateFlag = false;
 bool infoFlag = false;
 bool verbose = true;
+bool jsonFlag = false;
+bool batchMode = false;
+unsigned int numThreads = 0;
+
+static bool readManifest(const std::string &manifest) {
+  std::ifstream in(manifest.c_str());
+  if (!in) {
+    fprintf(stderr, "Could not open manifest %s\n", manifest.c_str());
+    return false;
+  }
+
+  // One input file per line; empty lines and lines starting with '#' are
+  // skipped.
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    inFiles.push_back(line);
+  }
+  return true;
+}
 
 static int parseOption(int argc, char** argv) {
   int c;
-  while ((c = getopt(argc, argv, "itv")) != -1) {
+  while ((c = getopt(argc, argv, "itvc:j:m:J")) != -1) {
     opterr = 0;
 
     switch(c) {
@@ -84,6 +121,26 @@ static int parseOption(int argc, char** argv) {
         verbose = true;
         break;
 
+      case 'c':
+        // Cache translated legacy bitcode in this directory.
+        cacheDir = optarg;
+        break;
+
+      case 'j':
+        // Number of worker threads in batch mode.
+        numThreads = strtoul(optarg, nullptr, 10);
+        break;
+
+      case 'm':
+        // Read the input files from this manifest.
+        manifestFile = optarg;
+        break;
+
+      case 'J':
+        // Print a JSON description, even for a single input file.
+        jsonFlag = true;
+        break;
+
       default:
         // Critical error occurs
         return 0;
@@ -91,12 +148,25 @@ static int parseOption(int argc, char** argv) {
     }
   }
 
-  if(optind >= argc) {
+  for (int i = optind; i < argc; i++) {
+    inFiles.push_back(argv[i]);
+  }
+
+  if (!manifestFile.empty() && !readManifest(manifestFile)) {
+    return 0;
+  }
+
+  if (inFiles.empty()) {
     fprintf(stderr, "input file required\n");
     return 0;
   }
 
-  inFile = argv[optind];
+  batchMode = jsonFlag || !manifestFile.empty() || inFiles.size() > 1;
+  if (batchMode) {
+    return 1;
+  }
+
+  inFile = inFiles[0];
 
   int l = inFile.length();
   if (l > 3 && inFile[l-3] == '.' && inFile[l-2] == 'b' && inFile[l-1] == 'c') {
@@ -294,12 +364,294 @@ static void releaseBitcode(const char **bitcode) {
 }
 
 
+static std::string jsonString(const char *str) {
+  if (str == nullptr) {
+    return "null";
+  }
+
+  std::string out = "\"";
+  for (const char *p = str; *p; p++) {
+    unsigned char c = *p;
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          out += escaped;
+        } else {
+          out += c;
+        }
+        break;
+    }
+  }
+  out += "\"";
+  return out;
+}
+
+
+static std::string jsonNameList(const char **list, size_t count) {
+  std::string out = "[";
+  for (size_t i = 0; i < count; i++) {
+    if (i) {
+      out += ", ";
+    }
+    out += jsonString(list[i]);
+  }
+  out += "]";
+  return out;
+}
+
+
+static std::string batchInfo(const std::string &path, unsigned int version,
+                             const bcinfo::BitcodeWrapper &bcWrapper,
+                             const bcinfo::MetadataExtractor &ME) {
+  char number[32];
+  std::string json = "{\"file\": " + jsonString(path.c_str());
+
+  snprintf(number, sizeof(number), "%u", version);
+  json += std::string(", \"targetAPI\": ") + number;
+  snprintf(number, sizeof(number), "%u", bcWrapper.getCompilerVersion());
+  json += std::string(", \"compilerVersion\": ") + number;
+  snprintf(number, sizeof(number), "%u", bcWrapper.getOptimizationLevel());
+  json += std::string(", \"optimizationLevel\": ") + number;
+
+  json += ", \"floatPrecision\": ";
+  switch (ME.getRSFloatPrecision()) {
+  case bcinfo::RS_FP_Full:
+    json += "\"full\"";
+    break;
+  case bcinfo::RS_FP_Relaxed:
+    json += "\"relaxed\"";
+    break;
+  default:
+    json += "null";
+    break;
+  }
+
+  json += std::string(", \"threadable\": ") +
+          (ME.isThreadable() ? "true" : "false");
+  json += ", \"nonThreadableKernels\": " +
+          jsonNameList(ME.getNonThreadableKernelNameList(),
+                       ME.getNonThreadableKernelCount());
+  json += ", \"buildChecksum\": " + jsonString(ME.getBuildChecksum());
+
+  json += ", \"exportVars\": " +
+          jsonNameList(ME.getExportVarNameList(), ME.getExportVarCount());
+  json += ", \"exportFuncs\": " +
+          jsonNameList(ME.getExportFuncNameList(), ME.getExportFuncCount());
+
+  json += ", \"exportForEach\": [";
+  const char **nameList = ME.getExportForEachNameList();
+  const uint32_t *sigList = ME.getExportForEachSignatureList();
+  const uint32_t *inputCountList = ME.getExportForEachInputCountList();
+  for (size_t i = 0; i < ME.getExportForEachSignatureCount(); i++) {
+    snprintf(number, sizeof(number), "%u", sigList[i]);
+    json += std::string(i ? ", " : "") + "{\"name\": " +
+            jsonString(nameList[i]) + ", \"signature\": " + number;
+    snprintf(number, sizeof(number), "%u", inputCountList[i]);
+    json += std::string(", \"inputCount\": ") + number + "}";
+  }
+  json += "]";
+
+  json += ", \"exportReduce\": [";
+  const bcinfo::MetadataExtractor::Reduce *reduceList =
+      ME.getExportReduceList();
+  for (size_t i = 0; i < ME.getExportReduceCount(); i++) {
+    const bcinfo::MetadataExtractor::Reduce &reduce = reduceList[i];
+    snprintf(number, sizeof(number), "%u", reduce.mSignature);
+    json += std::string(i ? ", " : "") + "{\"name\": " +
+            jsonString(reduce.mReduceName) + ", \"signature\": " + number;
+    snprintf(number, sizeof(number), "%u", reduce.mInputCount);
+    json += std::string(", \"inputCount\": ") + number;
+    snprintf(number, sizeof(number), "%u", reduce.mAccumulatorDataSize);
+    json += std::string(", \"accumulatorDataSize\": ") + number;
+    json += ", \"initializer\": " + jsonString(reduce.mInitializerName);
+    json += ", \"accumulator\": " + jsonString(reduce.mAccumulatorName);
+    json += ", \"combiner\": " + jsonString(reduce.mCombinerName);
+    json += ", \"outconverter\": " + jsonString(reduce.mOutConverterName);
+    json += ", \"halter\": " + jsonString(reduce.mHalterName) + "}";
+  }
+  json += "]";
+
+  json += ", \"pragmas\": [";
+  const char **keyList = ME.getPragmaKeyList();
+  const char **valueList = ME.getPragmaValueList();
+  for (size_t i = 0; i < ME.getPragmaCount(); i++) {
+    json += std::string(i ? ", " : "") + "{\"key\": " +
+            jsonString(keyList[i]) + ", \"value\": " +
+            jsonString(valueList[i]) + "}";
+  }
+  json += "]";
+
+  json += ", \"objectSlots\": [";
+  const uint32_t *slotList = ME.getObjectSlotList();
+  for (size_t i = 0; i < ME.getObjectSlotCount(); i++) {
+    snprintf(number, sizeof(number), "%u", slotList[i]);
+    json += std::string(i ? ", " : "") + number;
+  }
+  json += "]";
+
+  return json;
+}
+
+
+// Describes the bitcode file at path, as a JSON object without its closing
+// brace. Any module is created in ctx, the context of the calling worker.
+// Returns false if the file could not be processed, in which case the object
+// only holds the file name and the error.
+static bool processBatchFile(llvm::LLVMContext &ctx, const std::string &path,
+                             std::string &json) {
+  std::string error;
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > bufferOrError =
+      llvm::MemoryBuffer::getFile(path, -1, false);
+  if (std::error_code ec = bufferOrError.getError()) {
+    error = ec.message();
+  } else {
+    const char *bitcode = bufferOrError.get()->getBufferStart();
+    size_t bitcodeSize = bufferOrError.get()->getBufferSize();
+
+    unsigned int version = 0;
+    bcinfo::BitcodeWrapper bcWrapper(bitcode, bitcodeSize);
+    if (bcWrapper.getBCFileType() == bcinfo::BC_WRAPPER) {
+      version = bcWrapper.getTargetAPI();
+    } else if (translateFlag) {
+      version = 12;
+    }
+
+    bcinfo::BitcodeTranslator BT(bitcode, bitcodeSize, version);
+    if (!cacheDir.empty()) {
+      BT.setCacheDir(cacheDir.c_str());
+    }
+
+    // Legacy bitcode is translated straight into a module unless translations
+    // are cached, since the cache holds bitcode.
+    std::unique_ptr<llvm::Module> module;
+    if (bcinfo::BitcodeTranslator::needsTranslation(version) &&
+        cacheDir.empty()) {
+      module = BT.translateToModule(ctx);
+      if (!module) {
+        error = "failed to translate bitcode";
+      }
+    } else if (!BT.translate()) {
+      error = "failed to translate bitcode";
+    } else {
+      std::unique_ptr<llvm::MemoryBuffer> mem =
+          llvm::MemoryBuffer::getMemBuffer(
+              llvm::StringRef(BT.getTranslatedBitcode(),
+                              BT.getTranslatedBitcodeSize()),
+              path, false);
+      // Only the metadata is needed, so function bodies are never read.
+      llvm::ErrorOr<std::unique_ptr<llvm::Module> > moduleOrError =
+          llvm::getLazyBitcodeModule(std::move(mem), ctx);
+      std::error_code ec = moduleOrError.getError();
+      if (!ec) {
+        module = std::move(moduleOrError.get());
+        ec = module->materializeMetadata();
+      }
+      if (ec) {
+        module.reset();
+        error = ec.message().empty() ? "failed to parse bitcode file"
+                                     : ec.message();
+      }
+    }
+
+    if (module) {
+      bcinfo::MetadataExtractor ME(module.get());
+      if (ME.extract()) {
+        json = batchInfo(path, version, bcWrapper, ME);
+        return true;
+      }
+      error = "failed to get metadata";
+    }
+  }
+
+  json = "{\"file\": " + jsonString(path.c_str()) +
+         ", \"error\": " + jsonString(error.c_str());
+  return false;
+}
+
+
+static int runBatch() {
+  llvm::llvm_shutdown_obj called_on_exit;
+
+  unsigned int threads = numThreads;
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (threads > inFiles.size()) {
+    threads = inFiles.size();
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point batchStart = Clock::now();
+
+  std::vector<std::string> results(inFiles.size());
+  std::vector<char> succeeded(inFiles.size(), 0);
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    llvm::LLVMContext ctx;
+    for (size_t i = next++; i < inFiles.size(); i = next++) {
+      Clock::time_point start = Clock::now();
+      succeeded[i] = processBatchFile(ctx, inFiles[i], results[i]);
+      std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+      char timing[64];
+      snprintf(timing, sizeof(timing), ", \"timeMs\": %.3f}", elapsed.count());
+      results[i] += timing;
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int i = 1; i < threads; i++) {
+    pool.push_back(std::thread(worker));
+  }
+  worker();
+  for (std::thread &t : pool) {
+    t.join();
+  }
+
+  std::chrono::duration<double, std::milli> total = Clock::now() - batchStart;
+
+  size_t failures = 0;
+  printf("{\"files\": [");
+  for (size_t i = 0; i < results.size(); i++) {
+    printf("%s\n  %s", i ? "," : "", results[i].c_str());
+    if (!succeeded[i]) {
+      failures++;
+    }
+  }
+  printf("\n], \"threads\": %u, \"failures\": %zu, \"totalTimeMs\": %.3f}\n",
+         threads, failures, total.count());
+
+  return failures ? 7 : 0;
+}
+
+
 int main(int argc, char** argv) {
   if(!parseOption(argc, argv)) {
     fprintf(stderr, "failed to parse option\n");
     return 1;
   }
 
+  if (batchMode) {
+    return runBatch();
+  }
+
   const char *bitcode = nullptr;
   size_t bitcodeSize = readBitcode(&bitcode);
 
@@ -323,6 +675,9 @@ int main(int argc, char** argv) {
 
   std::unique_ptr<bcinfo::BitcodeTranslator> BT;
   BT.reset(new bcinfo::BitcodeTranslator(bitcode, bitcodeSize, version));
+  if (!cacheDir.empty()) {
+    BT->setCacheDir(cacheDir.c_str());
+  }
   if (!BT->translate()) {
     fprintf(stderr, "failed to translate bitcode\n");
     return 3;
@@ -17,6 +17,9 @@
 #ifndef BCC_CONTEXT_H
 #define BCC_CONTEXT_H
 
+#include <stddef.h>
+#include <string>
+
 namespace llvm {
   class LLVMContext;
 }
@@ -36,12 +39,59 @@ public:
   BCCContext();
   ~BCCContext();
 
+  // The LLVMContext is replaced when the context is recycled (see below), so
+  // the reference shouldn't be kept beyond the lifetime of the Sources using
+  // it.
   llvm::LLVMContext &getLLVMContext();
   const llvm::LLVMContext &getLLVMContext() const;
 
   void addSource(Source &pSource);
   void removeSource(Source &pSource);
 
+  // Replace the LLVMContext with a new one, releasing the types, constants
+  // and metadata it uniqued for everything loaded into it so far, which
+  // otherwise accumulate for as long as the context lives. The runtime
+  // libraries stay cached, but are parsed again on next use. Only possible
+  // while no Source of this context is alive, and no other IR created in it
+  // is either. Returns false (and does nothing) if a Source is still alive.
+  bool recycle();
+
+  // Bytes of bitcode loaded into the current LLVMContext (by the Sources and
+  // runtime libraries of this context), as an estimate of the memory it
+  // retains.
+  size_t getRetainedBitcodeSize() const;
+
+  // Recycle the context automatically once getRetainedBitcodeSize() reaches
+  // pThreshold, when its last Source is destroyed. Meant for long-lived
+  // contexts that compile one script after the other, which then keep a flat
+  // memory profile. 0 (the default) turns this off.
+  void setRecycleThreshold(size_t pThreshold);
+
+  // Return a new Source holding a private, fully materialized copy of the
+  // runtime library (e.g. libclcore.bc) at pPath. The library is parsed once
+  // per context and re-read only when the file's size or modification time
+  // changes. All the contexts of the process share the bitcode and the
+  // summary (see below) of each version of a library, so compilations on
+  // several threads read and summarize it only once. With pLazy set, the copy is instead loaded lazily from the
+  // cached bitcode (see Source::CreateFromBuffer()), so that merging it into
+  // a script only parses the functions that the script needs.
+  //
+  // With a non-zero pImportLimit, the copy is meant for linking against a
+  // shared object built from the same library. Only the bodies worth
+  // inlining are kept: those of functions marked alwaysinline or inlinehint,
+  // and of functions of at most pImportLimit instructions as judged from a
+  // per-library summary computed once per context (or read from the library
+  // if it is a runtime snapshot, see bcc/RuntimeSnapshot.h). They are made
+  // available_externally, so they are never emitted into the script's
+  // object, and the other externally visible functions become declarations.
+  // Returns nullptr on error.
+  Source *loadRuntimeLibrary(const std::string &pPath, bool pLazy = false,
+                             unsigned pImportLimit = 0);
+
+  // Drop every runtime library cached by loadRuntimeLibrary() in this
+  // context.
+  void invalidateRuntimeLibraries();
+
   // Global BCCContext
   static BCCContext *GetOrCreateGlobalContext();
   static void DestroyGlobalContext();
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_BUILD_STATS_H
+#define BCC_BUILD_STATS_H
+
+#include <chrono>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+  class raw_ostream;
+}
+
+namespace bcc {
+
+// Where the time of a single RSCompilerDriver build went. All times are wall
+// clock milliseconds; phases that did not run are reported as 0.
+class BuildStats {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // A (phase name, milliseconds) pair for each group of passes run by
+  // Compiler::runPasses(), in execution order.
+  typedef std::vector<std::pair<std::string, double>> PassTimes;
+
+  // Machine code statistics of an expanded function, taken once code
+  // generation is done with it.
+  struct KernelCodeStats {
+    std::string mFunction;
+    uint64_t mStackSize;
+    unsigned mSpills;
+    unsigned mReloads;
+    unsigned mInstructions;
+  };
+
+  // Number of IR instructions of a function at a point of the pass pipeline
+  // (see Compiler::setIRDump()).
+  struct IRSize {
+    std::string mPoint;
+    std::string mFunction;
+    unsigned mInstructions;
+  };
+
+private:
+  bool mCacheHit;
+  double mTotalTime;
+  double mParseTime;
+  double mLinkRuntimeTime;
+  PassTimes mPassTimes;
+  double mCodeGenTime;
+  uint64_t mOutputBytes;
+
+  // Expanded functions (e.g. "root.expand") that still call their kernel
+  // after optimization, because the kernel couldn't be inlined.
+  std::vector<std::string> mMissedInlines;
+
+  // Only collected when Compiler::setKernelReport() asks for it.
+  std::vector<KernelCodeStats> mKernelCodeStats;
+
+  // Only collected when Compiler::setIRDump() asks for it.
+  std::vector<IRSize> mIRSizes;
+
+  // Number of steps of Compiler::MemoryFallback the build took to stay within
+  // its memory budget (see RSCompilerDriver::setMemoryBudget()).
+  unsigned mMemoryFallback;
+
+  // Growth of the process' peak resident set size during the build, in KiB.
+  // 0 if the peak was already reached before the build started.
+  long mPeakRSSDelta;
+
+  Clock::time_point mBuildStart;
+  long mPeakRSSAtStart;
+  Clock::time_point mPhaseStart;
+
+public:
+  BuildStats() { reset(); }
+
+  // Forget everything recorded so far and start timing a new build.
+  void reset();
+
+  // Stop timing the build started by reset().
+  void finish();
+
+  static double MillisecondsSince(Clock::time_point pStart);
+
+  void setCacheHit(bool pCacheHit) { mCacheHit = pCacheHit; }
+  void addParseTime(double pTime) { mParseTime += pTime; }
+  void addLinkRuntimeTime(double pTime) { mLinkRuntimeTime += pTime; }
+  void addCodeGenTime(double pTime) { mCodeGenTime += pTime; }
+  void addOutputBytes(uint64_t pBytes) { mOutputBytes += pBytes; }
+  void addMissedInline(const std::string &pExpandedFunction)
+  { mMissedInlines.push_back(pExpandedFunction); }
+  void addKernelCodeStats(const KernelCodeStats &pStats)
+  { mKernelCodeStats.push_back(pStats); }
+  void addIRSize(const IRSize &pSize) { mIRSizes.push_back(pSize); }
+  void setMemoryFallback(unsigned pFallback) { mMemoryFallback = pFallback; }
+
+  // Phase bookkeeping for the pass pipeline: beginPhases() starts the clock
+  // and each endPhase() attributes the time since the previous call to
+  // pName.
+  void beginPhases();
+  void endPhase(const char *pName);
+
+  bool isCacheHit() const { return mCacheHit; }
+  double getTotalTime() const { return mTotalTime; }
+  double getParseTime() const { return mParseTime; }
+  double getLinkRuntimeTime() const { return mLinkRuntimeTime; }
+  const PassTimes &getPassTimes() const { return mPassTimes; }
+  double getCodeGenTime() const { return mCodeGenTime; }
+  uint64_t getOutputBytes() const { return mOutputBytes; }
+  const std::vector<std::string> &getMissedInlines() const
+  { return mMissedInlines; }
+  const std::vector<KernelCodeStats> &getKernelCodeStats() const
+  { return mKernelCodeStats; }
+  const std::vector<IRSize> &getIRSizes() const { return mIRSizes; }
+  unsigned getMemoryFallback() const { return mMemoryFallback; }
+  long getPeakRSSDelta() const { return mPeakRSSDelta; }
+
+  // Print the statistics as a single JSON object.
+  void writeJSON(llvm::raw_ostream &pOut) const;
+};
+
+} // end namespace bcc
+
+#endif // BCC_BUILD_STATS_H
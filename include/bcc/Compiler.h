@@ -17,11 +17,23 @@
 #ifndef BCC_COMPILER_H
 #define BCC_COMPILER_H
 
+#include <llvm/ADT/ArrayRef.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace llvm {
 
 class raw_ostream;
 class raw_pwrite_stream;
 class DataLayout;
+class Module;
 class TargetMachine;
 
 namespace legacy {
@@ -32,6 +44,7 @@ class PassManager;
 
 namespace bcc {
 
+class BuildStats;
 class CompilerConfig;
 class Script;
 
@@ -40,13 +53,19 @@ class Script;
 //===----------------------------------------------------------------------===//
 // 1. A compiler instance can be constructed provided an "initial config."
 // 2. A compiler can later be re-configured using config().
-// 3. Once config() is invoked, it'll re-create TargetMachine instance (i.e.,
-//    mTarget) according to the configuration supplied. TargetMachine instance
-//    is *shared* across the different calls to compile() before the next call
-//    to config().
+// 3. Once config() is invoked, it'll select the TargetMachine instance (i.e.,
+//    mTarget) matching the configuration supplied, creating it if needed.
+//    TargetMachine instance is *shared* across the different calls to
+//    compile() before the next call to config(). The last few TargetMachines
+//    are kept in a pool, so switching back and forth between configurations
+//    (e.g. relaxed and full precision scripts) doesn't rebuild them.
 // 4. Once a compiler instance is created, you can use the compile() service
 //    to compile the file over and over again. Each call uses TargetMachine
 //    instance to construct the compilation passes.
+// 5. All per-compile settings live in the Compiler instance. Distinct
+//    instances may compile concurrently, provided each compiles modules from
+//    its own BCCContext (LLVM contexts are not thread-safe). A single instance
+//    must not be used from several threads at once.
 class Compiler {
 public:
   enum ErrorCode {
@@ -69,24 +88,128 @@ public:
 
     kErrInvalidTargetMachine,
 
-    kErrInvalidLayout
+    kErrInvalidLayout,
+
+    kErrInvalidProfile,
+
+    kErrCancelled
   };
 
   static const char *GetErrorString(enum ErrorCode pErrCode);
 
+  // The successive steps by which a compilation trades code quality for
+  // memory under RSCompilerDriver::setMemoryBudget(). Each step also takes
+  // the ones before it.
+  enum MemoryFallback {
+    kNoMemoryFallback,
+
+    // Inline with a lower threshold, and use streaming code generation (see
+    // setStreamingCodeGen()).
+    kReduceInlining,
+
+    // Leave out the LTO pipeline (and the vectorizers).
+    kSkipLTO,
+
+    // Generate code at CodeGenOpt::None. This one is up to the configuration
+    // of the TargetMachine: the driver lowers its optimization level.
+    kNoOptimization
+  };
+
+  // Points of the pass pipeline at which setIRDump() dumps and measures the
+  // IR.
+  enum IRDumpPoint {
+    // Once the kernels are expanded.
+    kIRDumpAfterExpand = 1 << 0,
+
+    // Once the LTO pipeline is done. Only optimized builds run it.
+    kIRDumpAfterLTO = 1 << 1,
+
+    // The IR handed to code generation.
+    kIRDumpBeforeCodeGen = 1 << 2,
+
+    kIRDumpAllPoints = kIRDumpAfterExpand | kIRDumpAfterLTO |
+                       kIRDumpBeforeCodeGen
+  };
+
+  // Name of pPoint in dump file names and statistics, such as
+  // "after-expand".
+  static const char *GetIRDumpPointName(IRDumpPoint pPoint);
+
 private:
   llvm::TargetMachine *mTarget;
+
+  // Recently used TargetMachines keyed by the configuration they were created
+  // from, most recently used last. mTarget is always one of them.
+  std::vector<std::pair<std::string, llvm::TargetMachine *>> mTargetPool;
+
+  // Maximum number of TargetMachines kept in mTargetPool.
+  static const size_t kMaxPooledTargetMachines = 4;
+
+  // Copy of the configuration mTarget was created from, used to create the
+  // per-thread TargetMachines needed for parallel code generation and for the
+  // IR-level options (e.g. the kernel vector width) of the pass pipeline.
+  std::unique_ptr<CompilerConfig> mCodeGenConfig;
+
   // Optimization is enabled by default.
   bool mEnableOpt;
 
-  enum ErrorCode runPasses(Script &pScript, llvm::raw_pwrite_stream &pResult);
+  // Do we merge global variables on ARM? See
+  // RSCompilerDriver::setEnableGlobalMerge().
+  bool mEnableGlobalMerge;
+
+  // See setEnableGlobalLayout().
+  bool mEnableGlobalLayout;
+
+  // If non-null, pass pipeline and code generation timings are added to it.
+  BuildStats *mStats;
+
+  // Also add the machine code statistics of the expanded functions to mStats.
+  bool mKernelReport;
+
+  // See setStreamingCodeGen().
+  bool mStreamingCodeGen;
+
+  // See setCancellationFlag().
+  const std::atomic<bool> *mCancelled;
+
+  // See setMemoryFallback().
+  MemoryFallback mMemoryFallback;
+
+  // See setIRDump() and setIRDumpPathPrefix().
+  unsigned mIRDumpPoints;
+  std::vector<std::string> mIRDumpKernels;
+  bool mIRDumpFiles;
+  bool mIRCountInstructions;
+  std::string mIRDumpPathPrefix;
+
+  // See setOptimizationRemarksPath().
+  std::string mRemarksPath;
+
+  // Add the dump of pPoint to pPM if setIRDump() asked for it. Returns
+  // whether it did.
+  bool addIRDumpPass(llvm::legacy::PassManager &pPM, IRDumpPoint pPoint);
+
+  // Profile-guided optimization. See RSCompilerDriver::setProfileGenerate()
+  // and RSCompilerDriver::setProfileUse().
+  std::string mProfileGeneratePath;
+  std::string mProfileUsePath;
+
+  // pKeepIR is set if the IR fed to code generation is still needed
+  // afterwards (see setStreamingCodeGen()).
+  enum ErrorCode runPasses(Script &pScript,
+                           llvm::ArrayRef<llvm::raw_pwrite_stream *> pResults,
+                           bool pKeepIR);
+  enum ErrorCode runParallelCodeGen(Script &pScript,
+                                    llvm::ArrayRef<llvm::raw_pwrite_stream *> pResults);
 
   bool addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassManager &pPM);
-  void addExpandKernelPass(llvm::legacy::PassManager &pPM);
+  void addExpandKernelPass(Script &pScript, llvm::legacy::PassManager &pPM);
   void addDebugInfoPass(Script &pScript, llvm::legacy::PassManager &pPM);
   void addGlobalInfoPass(Script &pScript, llvm::legacy::PassManager &pPM);
   void addInvariantPass(llvm::legacy::PassManager &pPM);
   void addInvokeHelperPass(llvm::legacy::PassManager &pPM);
+  void addVectorizePasses(llvm::legacy::PassManager &pPM, bool pRelaxed);
+  bool addProfilePasses(llvm::legacy::PassManager &pPM);
 
 public:
   Compiler();
@@ -101,12 +224,109 @@ public:
   enum ErrorCode compile(Script &pScript, llvm::raw_pwrite_stream &pResult,
                          llvm::raw_ostream *IRStream);
 
+  // Compile a script, splitting the optimized module into pResults.size()
+  // partitions that are code generated on separate threads. Partition i is
+  // written to pResults[i]; the partial objects must all be linked into the
+  // final shared object. With a single stream this is the same as the
+  // overload above.
+  enum ErrorCode compile(Script &pScript,
+                         llvm::ArrayRef<llvm::raw_pwrite_stream *> pResults,
+                         llvm::raw_ostream *IRStream);
+
+  // Compile pModule, a copy of the runtime library, into a shared runtime
+  // object defining the functions and variables named in pExports for the
+  // objects linked against it (see RSCompilerDriver::buildApp()). The rest of
+  // the library is internalized, and dropped unless pExports need it. None
+  // of the RenderScript passes run: the library comes optimized.
+  enum ErrorCode compileSharedRuntime(llvm::Module &pModule,
+                                      const std::set<std::string> &pExports,
+                                      llvm::raw_pwrite_stream &pResult);
+
   const llvm::TargetMachine& getTargetMachine() const
   { return *mTarget; }
 
   void enableOpt(bool pEnable = true)
   { mEnableOpt = pEnable; }
 
+  void setEnableGlobalMerge(bool pEnable)
+  { mEnableGlobalMerge = pEnable; }
+
+  // Move the globals each expanded kernel reads in its loops into a
+  // cache-line-aligned block of their own, most read first, when optimizing
+  // (see RSCompilerDriver::setEnableGlobalLayout()).
+  void setEnableGlobalLayout(bool pEnable)
+  { mEnableGlobalLayout = pEnable; }
+
+  void setProfileGenerate(const std::string &pPath)
+  { mProfileGeneratePath = pPath; }
+
+  void setProfileUse(const std::string &pPath)
+  { mProfileUsePath = pPath; }
+
+  // Record the timings of subsequent compile() calls into pStats (nullptr to
+  // stop recording). The caller keeps ownership.
+  void setBuildStats(BuildStats *pStats)
+  { mStats = pStats; }
+
+  // Record the stack frame size, spill and reload counts and instruction
+  // count of every expanded kernel function into the BuildStats given to
+  // setBuildStats(). Not available with parallel code generation.
+  void setKernelReport(bool pEnable)
+  { mKernelReport = pEnable; }
+
+  // Release the IR and the machine IR of each function as soon as its code
+  // has been emitted, rather than once the whole object is written, to lower
+  // the peak memory use of code generation. The module passed to compile()
+  // is then left with the bodies of its functions dropped. Only applies to
+  // single-partition builds without debug info, and not when the IR is
+  // written to an IRStream.
+  void setStreamingCodeGen(bool pEnable)
+  { mStreamingCodeGen = pEnable; }
+
+  // Have subsequent compile() calls fail with kErrCancelled once *pFlag is
+  // set (nullptr: never), which another thread may do at any time. The flag
+  // is checked before the passes run, between the phases of the pipeline,
+  // and before code generation; the first phase boundary that finds it set
+  // drops the function bodies, so the remaining passes finish at once. The
+  // caller keeps ownership.
+  void setCancellationFlag(const std::atomic<bool> *pFlag)
+  { mCancelled = pFlag; }
+
+  bool isCancelled() const
+  { return (mCancelled != nullptr) && mCancelled->load(); }
+
+  // Lower the memory use of subsequent compile() calls as described by
+  // pFallback.
+  void setMemoryFallback(MemoryFallback pFallback)
+  { mMemoryFallback = pFallback; }
+
+  // At each of pPoints (a mask of IRDumpPoint) of subsequent compile()
+  // calls, look at the functions of the kernels in pKernels: a kernel "foo"
+  // selects "foo" and the functions made from it ("foo.expand", ...), and no
+  // kernels select every defined function. With pDumpFiles their IR is
+  // written to "<prefix>.<point>.ll" (see setIRDumpPathPrefix()), and with
+  // pCountInstructions their IR instruction counts are added to the
+  // BuildStats given to setBuildStats().
+  void setIRDump(unsigned pPoints, const std::vector<std::string> &pKernels,
+                 bool pDumpFiles, bool pCountInstructions) {
+    mIRDumpPoints = pPoints;
+    mIRDumpKernels = pKernels;
+    mIRDumpFiles = pDumpFiles;
+    mIRCountInstructions = pCountInstructions;
+  }
+
+  // Path prefix of the files setIRDump() writes during the next compile()
+  // calls. Nothing is written while it is empty.
+  void setIRDumpPathPrefix(const std::string &pPrefix)
+  { mIRDumpPathPrefix = pPrefix; }
+
+  // Write the optimization remarks (inlining, vectorization, ...) the passes
+  // of the next compile() calls make about the functions of the script, and
+  // about the functions made from its kernels, to pPath as YAML. Nothing is
+  // collected while it is empty.
+  void setOptimizationRemarksPath(const std::string &pPath)
+  { mRemarksPath = pPath; }
+
   ~Compiler();
 
   // Compare undefined external functions in pScript against a 'whitelist' of
@@ -115,6 +335,26 @@ public:
   enum ErrorCode screenGlobalFunctions(Script &pScript);
 
   void translateGEPs(Script &pScript);
+
+  // For a relaxed-precision pScript built with auto-vectorization, declare
+  // the float2 and float4 variants of the runtime math functions it calls,
+  // which the loop vectorizer may switch the calls to. This happens before
+  // linking the runtime, so that the variants get linked in, and they are
+  // kept in llvm.compiler.used until vectorization is done. The compiler must
+  // already be configured for pScript.
+  void declareRuntimeVectorFunctions(Script &pScript);
+
+  // Run the function-level simplification passes over pModule alone, as
+  // RSCompilerDriver::buildScriptGroup() does for each source before linking
+  // them. No function gets removed or renamed, so the RenderScript metadata
+  // of pModule stays valid. Modules of distinct LLVMContexts may be
+  // pre-optimized concurrently.
+  static void preOptimize(llvm::Module &pModule);
+
+  // Specialize pScript on the values of the exported globals in pValues
+  // (name to bytes of the value): see RSCompilerDriver::setSpecializedGlobals().
+  void specializeGlobals(Script &pScript,
+                         const std::map<std::string, std::vector<uint8_t>> &pValues);
 };
 
 } // end namespace bcc
@@ -18,6 +18,7 @@
 #define BCC_SUPPORT_COMPILER_CONFIG_H
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <llvm/ADT/Optional.h>
@@ -58,6 +59,55 @@ private:
   // be a list of strings starting with '+' (enable) or '-' (disable).
   std::string mFeatureString;
 
+  // Number of elements the main loop of an expanded forEach kernel processes
+  // per iteration. 0 picks a width from the target's vector registers; 1 (the
+  // default) keeps the plain one-element-per-iteration loop.
+  unsigned mKernelVectorWidth;
+
+  // Number of independent partial accumulators the expanded accumulator of a
+  // general reduction keeps, so that consecutive accumulator calls don't
+  // depend on each other. 1 (the default) keeps a single accumulator.
+  unsigned mReduceAccumulators;
+
+  // Distance in bytes ahead of the current element at which the loops of
+  // expanded kernels prefetch their inputs and output, or 0 to not prefetch.
+  // Defaults to a value suited to the target CPU; scripts can override it
+  // with "#pragma rs_prefetch_distance".
+  unsigned mPrefetchDistance;
+
+  // Also generate "<kernel>.expand.tiled" entry points that iterate over a 2D
+  // tile of cells, for drivers that schedule kernels in 2D blocks or that
+  // cover many narrow rows per call.
+  bool mTiledKernels;
+
+  // Run the loop unroll/scalarizer/SLP vectorizer pipeline after LTO. On by
+  // default for the architectures where it has been validated (arm64 and
+  // x86_64).
+  bool mAutoVectorize;
+
+  // Optional. Overrides the LLVM defaults for the cost thresholds of the loop
+  // unroller and of the SLP vectorizer used by the auto-vectorization
+  // pipeline.
+  llvm::Optional<unsigned> mLoopUnrollThreshold;
+  llvm::Optional<int> mSLPVectorizeThreshold;
+
+  // Size-focused output: every function and global gets its own section, so
+  // that the linker can garbage collect unreferenced ones, and functions
+  // with identical bodies (e.g. the .expand wrappers of kernels with the same
+  // signature) are merged after LTO.
+  bool mOptimizeForSize;
+
+  // Generate code for the CPU we run on: its name and the features it
+  // reports are used instead of the fixed defaults of the target, as long
+  // as the target is the host's own architecture.
+  bool mUseHostCPU;
+
+  // Optional. Target CPU and "+feature,..." string of each extra version of
+  // the expanded kernels to emit, best first. The dynamic linker picks the
+  // first one the device supports when the script is loaded, or else the
+  // version built for the configuration above (arm64 only).
+  std::vector<std::pair<std::string, std::string>> mKernelVariants;
+
   //===--------------------------------------------------------------------===//
   // These are generated by CompilerConfig during initialize().
   //===--------------------------------------------------------------------===//
@@ -118,6 +168,64 @@ public:
   { return mFeatureString; }
   void setFeatureString(const std::vector<std::string> &pAttrs);
 
+  inline unsigned getKernelVectorWidth() const
+  { return mKernelVectorWidth; }
+  inline void setKernelVectorWidth(unsigned pWidth)
+  { mKernelVectorWidth = pWidth; }
+
+  inline unsigned getReduceAccumulators() const
+  { return mReduceAccumulators; }
+  inline void setReduceAccumulators(unsigned pAccumulators)
+  { mReduceAccumulators = pAccumulators; }
+
+  inline unsigned getPrefetchDistance() const
+  { return mPrefetchDistance; }
+  inline void setPrefetchDistance(unsigned pDistance)
+  { mPrefetchDistance = pDistance; }
+
+  inline bool getTiledKernels() const
+  { return mTiledKernels; }
+  inline void setTiledKernels(bool pTiledKernels)
+  { mTiledKernels = pTiledKernels; }
+
+  inline bool getAutoVectorize() const
+  { return mAutoVectorize; }
+  inline void setAutoVectorize(bool pAutoVectorize)
+  { mAutoVectorize = pAutoVectorize; }
+
+  inline llvm::Optional<unsigned> getLoopUnrollThreshold() const
+  { return mLoopUnrollThreshold; }
+  inline void setLoopUnrollThreshold(unsigned pThreshold)
+  { mLoopUnrollThreshold = pThreshold; }
+
+  // The SLP vectorizer only reads its threshold from a process-wide option,
+  // so compilers running concurrently with different values here optimize
+  // one at a time.
+  inline llvm::Optional<int> getSLPVectorizeThreshold() const
+  { return mSLPVectorizeThreshold; }
+  inline void setSLPVectorizeThreshold(int pThreshold)
+  { mSLPVectorizeThreshold = pThreshold; }
+
+  inline bool getOptimizeForSize() const
+  { return mOptimizeForSize; }
+  void setOptimizeForSize(bool pOptimizeForSize);
+
+  inline bool getUseHostCPU() const
+  { return mUseHostCPU; }
+  inline void setUseHostCPU(bool pUseHostCPU) {
+    mUseHostCPU = pUseHostCPU;
+    // Reinitialize, as setFullPrecision() does, to update mCPU and
+    // mFeatureString.
+    initializeArch();
+  }
+
+  inline const std::vector<std::pair<std::string, std::string>> &
+  getKernelVariants() const
+  { return mKernelVariants; }
+  inline void addKernelVariant(const std::string &pCPU,
+                               const std::string &pFeatures)
+  { mKernelVariants.emplace_back(pCPU, pFeatures); }
+
   explicit CompilerConfig(const std::string &pTriple);
 
   virtual ~CompilerConfig() { }
@@ -17,12 +17,23 @@
 #ifndef BCC_SUPPORT_INITIALIZATION_H
 #define BCC_SUPPORT_INITIALIZATION_H
 
+#include <string>
+
 namespace bcc {
 
 namespace init {
 
+// Initialize the LLVM passes used by libbcc. Safe to call any number of
+// times, from any thread.
 void Initialize();
 
+// Initialize the LLVM backend generating code for pTriple (its target info,
+// MC layer and asm printer) if it hasn't been already, leaving the other
+// backends alone. CompilerConfig does this for its triple. Safe to call from
+// any thread. Returns false if libbcc isn't built to generate code for
+// pTriple.
+bool InitializeTarget(const std::string &pTriple);
+
 } // end namespace init
 
 } // end namespace bcc
@@ -17,18 +17,32 @@
 #ifndef BCC_RS_COMPILER_DRIVER_H
 #define BCC_RS_COMPILER_DRIVER_H
 
+#include "bcc/BuildStats.h"
 #include "bcc/Compiler.h"
 #include "bcc/Script.h"
 
 #include "bcinfo/MetadataExtractor.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace bcc {
 
 class BCCContext;
+class CompilationCacheKey;
 class CompilerConfig;
 class RSCompilerDriver;
 class Source;
@@ -38,6 +52,81 @@ typedef void (*RSCompilerDriverInit_t) (bcc::RSCompilerDriver *);
 // Name of the function that we attempt to dynamically load/execute.
 #define RS_COMPILER_DRIVER_INIT_FN rsCompilerDriverInit
 
+// Called from a background thread once the optimized rebuild of pObjectPath
+// scheduled by a tiered build() has finished. If pSuccess is true, the object
+// at pObjectPath has been replaced by the optimized one.
+typedef std::function<void(const char *pObjectPath, bool pSuccess)>
+    RSTieredBuildCallback;
+
+// A data edge of a script group: the output of the forEach kernel mProducer
+// feeds input mInput of the forEach kernel mConsumer. Kernels are given as a
+// pair of the index of their Source and their forEach slot.
+struct ScriptGroupEdge {
+  std::pair<int, int> mProducer;
+  std::pair<int, int> mConsumer;
+  unsigned mInput;
+};
+
+// A forEach kernel of a script group (mConsumer) reading the output of another
+// one (mProducer) through the rs_allocation global mAllocation, possibly at
+// other cells than its own, as blurs and convolutions do. Fusing them gives
+// the kernel mName: see fuseStencilKernels() in RSScriptGroupFusion.h.
+struct ScriptGroupStencilFusion {
+  std::pair<int, int> mProducer;
+  std::pair<int, int> mConsumer;
+  std::string mAllocation;
+  std::string mName;
+};
+
+// A script of an app, for RSCompilerDriver::buildApp(): its resource name,
+// bitcode and build checksum, as build() takes them.
+struct RSAppScript {
+  std::string mResName;
+  const char *mBitcode;
+  size_t mBitcodeSize;
+  std::string mBuildChecksum;
+};
+
+// A build started by RSCompilerDriver::buildAsync() or
+// RSCompilerDriver::buildScriptGroupAsync(). The handle may be used from any
+// thread.
+class RSAsyncBuild {
+private:
+  friend class RSCompilerDriver;
+
+  std::atomic<bool> mCancelled;
+  std::promise<bool> mPromise;
+  std::shared_future<bool> mResult;
+
+public:
+  RSAsyncBuild() : mCancelled(false), mResult(mPromise.get_future().share()) { }
+
+  // Ask the build to stop and return right away. A build still waiting for
+  // a worker never starts; a running one stops at its next cancellation
+  // point (see Compiler::setCancellationFlag()). Either way it fails, and
+  // leaves no partial output behind.
+  void cancel() {
+    mCancelled = true;
+  }
+
+  bool isCancelled() const {
+    return mCancelled;
+  }
+
+  bool isDone() const {
+    return mResult.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  // Block until the build is done, and return whether it succeeded.
+  bool wait() const {
+    return mResult.get();
+  }
+};
+
+// Independent RSCompilerDriver instances may build on different threads at the
+// same time, as long as each one uses its own BCCContext. A single driver (or
+// BCCContext) must only be used by one thread at a time.
 class RSCompilerDriver {
 private:
   CompilerConfig *mConfig;
@@ -46,6 +135,10 @@ private:
   // Are we compiling under an RS debug context with additional checks?
   bool mDebugContext;
 
+  // Do we optimize scripts with debug information instead of building them
+  // at CodeGenOpt::None? See setOptimizedDebug().
+  bool mOptimizedDebug;
+
   // Callback before linking with the runtime library.
   RSLinkRuntimeCallback mLinkRuntimeCallback;
 
@@ -56,6 +149,9 @@ private:
   // and work with.
   bool mEnableGlobalMerge;
 
+  // See setEnableGlobalLayout().
+  bool mEnableGlobalLayout;
+
   // Specifies whether we should embed global variable information in the
   // code via special RS variables that can be examined later by the driver.
   bool mEmbedGlobalInfo;
@@ -64,10 +160,139 @@ private:
   // when potentially embedding information about globals.
   bool mEmbedGlobalInfoSkipConstant;
 
+  // Specifies whether buildForCompatLib() should also embed the RS info in
+  // the binary form of bcc/RSInfoBinary.h.
+  bool mEmbedBinaryInfo;
+
+  // Should build() reuse a previously compiled object when none of the inputs
+  // that determine its contents have changed?
+  bool mEnableCache;
+
+  // See setCacheBudget().
+  uint64_t mCacheBudget;
+
+  // See setComputeBuildChecksum().
+  bool mComputeBuildChecksum;
+
+  // Number of threads buildScriptGroup() optimizes its sources on, each on
+  // its own, before linking them; 0 links them unoptimized.
+  unsigned mScriptGroupPreOptJobs;
+
+  // Largest runtime function (in instructions) whose body build() and
+  // buildScriptGroup() import; 0 imports all the needed ones.
+  unsigned mRuntimeImportLimit;
+
+  // In tiered mode, build() first produces a CodeGenOpt::None object and then
+  // rebuilds it at the requested optimization level in the background.
+  bool mTieredCompilation;
+  RSTieredBuildCallback mTieredCallback;
+  std::vector<std::shared_ptr<RSAsyncBuild>> mTieredBuilds;
+
+  // A build queued by buildAsync() or buildScriptGroupAsync(): mRun builds
+  // with mDriver, a copy of the settings at the time of the call.
+  struct AsyncJob {
+    std::shared_ptr<RSAsyncBuild> mBuild;
+    std::unique_ptr<RSCompilerDriver> mDriver;
+    std::function<bool(RSCompilerDriver &)> mRun;
+  };
+
+  // The worker pool of the asynchronous builds: see setAsyncBuildJobs().
+  unsigned mAsyncBuildJobs;
+  std::mutex mAsyncLock;
+  std::condition_variable mAsyncAvailable;
+  std::deque<AsyncJob> mAsyncJobs;
+  bool mAsyncShutdown;
+  std::vector<std::thread> mAsyncWorkers;
+
+  // Profile-guided optimization: see setProfileGenerate() and
+  // setProfileUse().
+  std::string mProfileGeneratePath;
+  std::string mProfileUsePath;
+
+  // Exported globals the scripts are specialized on: see
+  // setSpecializedGlobals().
+  std::map<std::string, std::vector<uint8_t>> mSpecializedGlobals;
+
+  // Statistics of the most recent build(), buildScriptGroup() or
+  // buildForCompatLib() call.
+  BuildStats mLastBuildStats;
+
+  // Add the machine code statistics of the kernels to mLastBuildStats: see
+  // setKernelReport().
+  bool mKernelReport;
+
+  // See setStreamingCodeGen().
+  bool mStreamingCodeGen;
+
+  // See setIRDump().
+  unsigned mIRDumpPoints;
+  std::vector<std::string> mIRDumpKernels;
+  bool mIRDumpFiles;
+  bool mIRCountInstructions;
+
+  // See setOptimizationRemarks().
+  bool mOptimizationRemarks;
+
+  // See setMemoryBudget().
+  size_t mMemoryBudget;
+
+  // Pick the first step of Compiler::MemoryFallback at which compiling
+  // pScript, once linked against the runtime, is expected to fit in
+  // mMemoryBudget, and set the compiler (and mConfig) up for it. Returns
+  // true if mCompiler has to be reconfigured.
+  bool setupMemoryFallback(const Script &pScript);
+
+  // Compute the key identifying the object build() would produce for the
+  // given inputs. Returns false if a key could not be computed (e.g. the
+  // runtime library could not be read), in which case the cache is bypassed.
+  bool computeCacheKey(const char *pBitcode, size_t pBitcodeSize,
+                       const char *pBuildChecksum, const char *pRuntimePath,
+                       std::string *pKey) const;
+
+  // Same as above for the object buildScriptGroup() would produce.
+  bool computeScriptGroupCacheKey(
+      const std::vector<Source*>& pSources, const char *pBuildChecksum,
+      const char *pRuntimePath, const char *pRuntimeRelaxedPath,
+      const std::list<std::list<std::pair<int, int>>>& pToFuse,
+      const std::list<std::string>& pFused,
+      const std::list<std::list<std::pair<int, int>>>& pInvokes,
+      const std::list<std::string>& pInvokeBatchNames,
+      const std::list<std::list<std::pair<int, int>>>& pToFuseIntoReduce,
+      const std::list<std::string>& pFusedReduces,
+      const std::list<ScriptGroupStencilFusion>& pStencilFusions,
+      const std::list<std::list<std::pair<int, int>>>& pToFuseFanOut,
+      const std::list<std::string>& pFusedFanOuts,
+      std::string *pKey) const;
+
+  // Adds everything besides the inputs that determines the generated code to
+  // pKey: the compiler, the target configuration pConfig and the driver
+  // settings. Returns false if that cannot be done (e.g. the profile could not
+  // be read).
+  bool addBuildSettingsToCacheKey(CompilationCacheKey &pKey,
+                                  const CompilerConfig &pConfig) const;
+
+  // Return the configuration setupConfig() would set up for a script with the
+  // given float precision, leaving mConfig as it is. Unlike mConfig, it does
+  // not depend on which script was built last. Returns nullptr if out of
+  // memory.
+  std::unique_ptr<CompilerConfig> createScriptConfig(bool pFullPrecision) const;
+
+  // Compile the definitions of pRuntimePath named in pSymbols into the shared
+  // runtime object at pOutputPath (see buildApp()).
+  bool buildSharedRuntime(BCCContext &pContext, const char *pOutputPath,
+                          const char *pRuntimePath,
+                          const std::set<std::string> &pSymbols);
+
   // Setup the compiler config for the given script. Return true if mConfig has
   // been changed and false if it remains unchanged.
   bool setupConfig(const Script &pScript);
 
+  // Embeds the build checksum, screens, links with the runtime and configures
+  // the compiler for pScript: everything the compile steps have in common.
+  Compiler::ErrorCode prepareScript(Script &pScript, const char *pScriptName,
+                                    const char *pRuntimePath,
+                                    const char *pBuildChecksum);
+
   // Compiles the provided bitcode, placing the binary at pOutputPath.
   // - If pDumpIR is true, a ".ll" file will also be created.
   Compiler::ErrorCode compileScript(Script& pScript, const char* pScriptName,
@@ -76,6 +301,60 @@ private:
                                     const char* pBuildChecksum,
                                     bool pDumpIR);
 
+  // Same as compileScript(), but appends the object to pObject instead of
+  // creating any file.
+  Compiler::ErrorCode compileScriptToStream(Script &pScript,
+                                            const char *pScriptName,
+                                            llvm::raw_pwrite_stream &pObject,
+                                            const char *pRuntimePath,
+                                            const char *pBuildChecksum);
+
+  // Loads the bitcode and compiles it to pOutputPath, or into pObject if it
+  // is non-null (pOutputPath and pDumpIR are unused then). If pForceOptNone is
+  // true, the optimization level stored in the bitcode wrapper is ignored and
+  // the object is built at CodeGenOpt::None.
+  bool compileBitcode(BCCContext &pContext, const char *pResName,
+                      const char *pOutputPath, llvm::raw_pwrite_stream *pObject,
+                      const char *pBitcode,
+                      size_t pBitcodeSize, const char *pBuildChecksum,
+                      const char *pRuntimePath, bool pDumpIR,
+                      bool pForceOptNone);
+
+  // With mComputeBuildChecksum, point *pBuildChecksum at the checksum of
+  // computeBuildChecksum(), kept in *pStorage, unless the caller gave one.
+  // Returns false if it could not be computed.
+  bool resolveBuildChecksum(const char *pResName, const char *pBitcode,
+                            size_t pBitcodeSize, const char *pRuntimePath,
+                            const char **pBuildChecksum,
+                            std::string *pStorage) const;
+
+  // Record the use of the object at pObjectPath in the cache directory
+  // pCacheDir and evict others to stay within mCacheBudget, if set.
+  void recordCacheUse(const char *pCacheDir, const char *pObjectPath);
+
+  // Queue a rebuild of pOutputPath at the bitcode's own optimization level on
+  // the async build pool (see setAsyncBuildJobs()). A non-empty pCacheKey is
+  // recorded for the object once it has been replaced. The rebuild is dropped
+  // if the quick object was replaced, or got a key, in the meantime.
+  void scheduleOptimizedBuild(const char *pResName, const char *pOutputPath,
+                              const char *pBitcode, size_t pBitcodeSize,
+                              const char *pBuildChecksum,
+                              const char *pRuntimePath,
+                              const std::string &pCacheKey);
+
+  // A new driver with the build settings of this one, for builds on other
+  // threads. Neither tiered compilation nor the callbacks are copied.
+  std::unique_ptr<RSCompilerDriver> cloneSettings() const;
+
+  // Queue pRun for the worker pool, and start a worker if there are fewer
+  // than mAsyncBuildJobs.
+  std::shared_ptr<RSAsyncBuild>
+  scheduleAsyncBuild(std::function<bool(RSCompilerDriver &)> pRun);
+
+  // Body of the async build workers: run queued builds until the driver is
+  // destroyed.
+  void runAsyncBuilds();
+
 public:
   RSCompilerDriver();
   ~RSCompilerDriver();
@@ -92,6 +371,21 @@ public:
     mDebugContext = v;
   }
 
+  // Set to true to build scripts with debug information (which slang emits
+  // at -O0) with optimization, in the spirit of -Og: the LTO and kernel
+  // expansion passes run as usual and the debug information is kept, but
+  // code generation runs at CodeGenOpt::Less, frame pointers are kept and
+  // globals are not merged, so that line tables, variable locations and
+  // stack traces stay usable. This makes profiles of debuggable builds
+  // representative of release builds.
+  void setOptimizedDebug(bool v) {
+    mOptimizedDebug = v;
+  }
+
+  bool getOptimizedDebug() const {
+    return mOptimizedDebug;
+  }
+
   void setLinkRuntimeCallback(RSLinkRuntimeCallback c) {
     mLinkRuntimeCallback = c;
   }
@@ -111,6 +405,18 @@ public:
     return mEnableGlobalMerge;
   }
 
+  // Group the globals each expanded kernel reads in its loops into one
+  // cache-line-aligned block, most read first, so that they share cache
+  // lines and an address computation. On by default; like global merging,
+  // it is left out of optimized debug builds.
+  void setEnableGlobalLayout(bool v) {
+    mEnableGlobalLayout = v;
+  }
+
+  bool getEnableGlobalLayout() const {
+    return mEnableGlobalLayout;
+  }
+
   const CompilerConfig * getConfig() const {
     return mConfig;
   }
@@ -137,6 +443,252 @@ public:
     return mEmbedGlobalInfoSkipConstant;
   }
 
+  // Set to true if the embedded RS info should also be given in a binary form
+  // that the runtime can use in place.
+  void setEmbedBinaryInfo(bool v) {
+    mEmbedBinaryInfo = v;
+  }
+
+  // Returns true if the embedded RS info is also given in binary form.
+  bool getEmbedBinaryInfo() const {
+    return mEmbedBinaryInfo;
+  }
+
+  // Set to false to always recompile in build() and buildScriptGroup(), even
+  // when an up-to-date object exists in the cache directory.
+  void setEnableCache(bool v) {
+    mEnableCache = v;
+  }
+
+  // Returns true if build() may reuse previously compiled objects.
+  bool getEnableCache() const {
+    return mEnableCache;
+  }
+
+  // Keep the cache directory of build() within about pBytes: each build
+  // records the size and the use of its object in an index file there, and
+  // the least recently used other objects are removed once the directory
+  // goes over budget. Stale lock files are cleaned up at the same time. 0
+  // (the default) means no budget, and no index is kept.
+  void setCacheBudget(uint64_t pBytes) {
+    mCacheBudget = pBytes;
+  }
+
+  uint64_t getCacheBudget() const {
+    return mCacheBudget;
+  }
+
+  // Set to true to have build() embed the checksum of computeBuildChecksum()
+  // whenever its caller doesn't supply one, so that every runtime validates
+  // its cached objects against the same cheap key.
+  void setComputeBuildChecksum(bool v) {
+    mComputeBuildChecksum = v;
+  }
+
+  bool getComputeBuildChecksum() const {
+    return mComputeBuildChecksum;
+  }
+
+  // Compute a build checksum (16 hexadecimal digits) over the bitcode, the
+  // runtime library at pRuntimePath, the compiler version, the settings of
+  // this driver and the target configuration the script gets (see
+  // createScriptConfig()), with a fast non-cryptographic hash. The runtime library is
+  // mapped rather than read. Returns false if the runtime library can't be
+  // read.
+  bool computeBuildChecksum(const char *pBitcode, size_t pBitcodeSize,
+                            const char *pRuntimePath,
+                            std::string *pChecksum) const;
+
+  // Have buildScriptGroup() run the function-level optimizations over each
+  // source in a context of its own, pJobs sources at a time, before linking
+  // them. This leaves only the cross-module fusion and inlining to the
+  // serial optimization of the merged module. 0 (the default) turns this
+  // off; mostly useful for large script groups.
+  void setScriptGroupPreOptJobs(unsigned pJobs) {
+    mScriptGroupPreOptJobs = pJobs;
+  }
+
+  unsigned getScriptGroupPreOptJobs() const {
+    return mScriptGroupPreOptJobs;
+  }
+
+  // Link the scripts that build() and buildScriptGroup() compile against a
+  // shared, prebuilt runtime instead of copying runtime code into each
+  // object. Only the bodies worth inlining are imported from the runtime
+  // library: those of functions marked alwaysinline or inlinehint and of
+  // functions of at most pLimit instructions. They are only used for
+  // inlining and never emitted; every other runtime function stays an
+  // external reference. Objects get smaller and LTO time depends on the
+  // script rather than on the runtime, but the objects must be linked against
+  // a shared object built from the same runtime library. buildForCompatLib()
+  // always imports everything it needs. 0 (the default) turns this off.
+  void setRuntimeImportLimit(unsigned pLimit) {
+    mRuntimeImportLimit = pLimit;
+  }
+
+  unsigned getRuntimeImportLimit() const {
+    return mRuntimeImportLimit;
+  }
+
+  // Build instrumented objects: the expanded kernels and the invokables (and
+  // whatever they call) count how often their edges and calls are taken,
+  // and write a raw profile to pPath when the process exits. The script's
+  // shared object must be linked with the LLVM profile runtime. An empty
+  // path turns instrumentation off. Only applies to optimized builds.
+  void setProfileGenerate(const std::string &pPath) {
+    mProfileGeneratePath = pPath;
+  }
+
+  const std::string &getProfileGenerate() const {
+    return mProfileGeneratePath;
+  }
+
+  // Optimize builds for the profile at pPath, an indexed profile merged with
+  // llvm-profdata from the raw profiles of an instrumented build of the same
+  // scripts. It guides inlining, block layout and loop unrolling. An empty
+  // path turns this off. Only applies to optimized builds.
+  void setProfileUse(const std::string &pPath) {
+    mProfileUsePath = pPath;
+  }
+
+  const std::string &getProfileUse() const {
+    return mProfileUsePath;
+  }
+
+  // Specialize the scripts built by build() on the values of some of their
+  // exported globals, given as a map from global name to the bytes of its
+  // value (in the layout of the target). The runtime must set the globals to
+  // these values and never change them afterwards. Uses of the globals in
+  // the script then see the constant value, which the optimizer can fold.
+  // Globals the script writes to itself are not specialized. The object
+  // cache tells the specialized variants apart.
+  void setSpecializedGlobals(
+      const std::map<std::string, std::vector<uint8_t>> &pValues) {
+    mSpecializedGlobals = pValues;
+  }
+
+  const std::map<std::string, std::vector<uint8_t>> &getSpecializedGlobals() const {
+    return mSpecializedGlobals;
+  }
+
+  // Also collect the stack frame size, spill and reload counts and machine
+  // instruction count of every expanded kernel function into the build
+  // statistics. Builds served from the compilation cache have no such
+  // statistics.
+  void setKernelReport(bool pEnable) {
+    mKernelReport = pEnable;
+  }
+
+  bool getKernelReport() const {
+    return mKernelReport;
+  }
+
+  // Look at the IR of the kernels in pKernels (all functions if empty) at
+  // the points of the pass pipeline in pPoints, a mask of
+  // Compiler::IRDumpPoint: see Compiler::setIRDump(). With pDumpFiles, the
+  // IR at each point is written next to the object, to
+  // "<object>.<point>.ll", and such builds bypass the compilation cache;
+  // builds into a stream write no files. With pCountInstructions, the IR
+  // instruction counts of these functions go into the build statistics.
+  void setIRDump(unsigned pPoints, const std::vector<std::string> &pKernels,
+                 bool pDumpFiles, bool pCountInstructions) {
+    mIRDumpPoints = pPoints;
+    mIRDumpKernels = pKernels;
+    mIRDumpFiles = pDumpFiles;
+    mIRCountInstructions = pCountInstructions;
+  }
+
+  unsigned getIRDumpPoints() const {
+    return mIRDumpPoints;
+  }
+
+  // Write the optimization remarks about the script's functions and kernels
+  // (missed vectorization, failed inlining, ...) next to the object, to
+  // "<object>.opt.yaml" (see Compiler::setOptimizationRemarksPath()). Such
+  // builds bypass the compilation cache; builds into a stream write no
+  // remarks.
+  void setOptimizationRemarks(bool pEnable) {
+    mOptimizationRemarks = pEnable;
+  }
+
+  bool getOptimizationRemarks() const {
+    return mOptimizationRemarks;
+  }
+
+  // Emit the object function by function, releasing the IR and machine IR of
+  // each function right after its code, so that code generation doesn't hold
+  // the whole optimized module on top of the machine code (see
+  // Compiler::setStreamingCodeGen()). Meant for large scripts and script
+  // groups on low-memory devices; the object is the same. Has no effect with
+  // debug info, or when the IR is dumped.
+  void setStreamingCodeGen(bool pEnable) {
+    mStreamingCodeGen = pEnable;
+  }
+
+  bool getStreamingCodeGen() const {
+    return mStreamingCodeGen;
+  }
+
+  // Keep the memory a build is expected to need, judged from the size of the
+  // script once linked against the runtime, within about pBytes: each step of
+  // Compiler::MemoryFallback is taken in turn (less inlining and streaming
+  // code generation, then no LTO, then no optimization at all) until the
+  // estimate fits. This trades kernel performance for not being killed in
+  // the middle of a compile on a low-memory device. The estimate is coarse;
+  // the last step is taken even if it is still over budget. 0 (the default)
+  // means no budget. The steps taken are in getLastBuildStats().
+  void setMemoryBudget(size_t pBytes) {
+    mMemoryBudget = pBytes;
+  }
+
+  size_t getMemoryBudget() const {
+    return mMemoryBudget;
+  }
+
+  // Per-phase timings, output size and memory growth of the most recent
+  // build. An optimized rebuild scheduled by tiered compilation is not
+  // included.
+  const BuildStats &getLastBuildStats() const {
+    return mLastBuildStats;
+  }
+
+  // Enable tiered compilation: build() returns as soon as a quick
+  // CodeGenOpt::None object is in place, and an optimized rebuild then
+  // atomically replaces it from the async build pool (see
+  // setAsyncBuildJobs()), invoking pCallback (if any) when done. Bitcode that
+  // asks for -O0 is built once, as usual.
+  void setTieredCompilation(bool v, RSTieredBuildCallback pCallback = nullptr) {
+    mTieredCompilation = v;
+    mTieredCallback = pCallback;
+  }
+
+  bool getTieredCompilation() const {
+    return mTieredCompilation;
+  }
+
+  // Block until every optimized rebuild scheduled so far has finished. The
+  // destructor does this as well.
+  void waitForOptimizedBuilds();
+
+  // Have the builds of this driver fail with Compiler::kErrCancelled once
+  // *pFlag is set (nullptr: never), e.g. from another thread when the app is
+  // sent to the background. The caller keeps ownership.
+  void setCancellationFlag(const std::atomic<bool> *pFlag) {
+    mCompiler.setCancellationFlag(pFlag);
+  }
+
+  // Number of worker threads buildAsync(), buildScriptGroupAsync() and the
+  // optimized rebuilds of tiered compilation run on, one at a time each
+  // (default: 1; 0: one per CPU). Workers are started as builds are queued,
+  // up to this number.
+  void setAsyncBuildJobs(unsigned pJobs) {
+    mAsyncBuildJobs = pJobs;
+  }
+
+  unsigned getAsyncBuildJobs() const {
+    return mAsyncBuildJobs;
+  }
+
   // FIXME: This method accompany with loadScript and compileScript should
   //        all be const-methods. They're not now because the getAddress() in
   //        SymbolResolverInterface is not a const-method.
@@ -147,6 +699,70 @@ public:
              RSLinkRuntimeCallback pLinkRuntimeCallback = nullptr,
              bool pDumpIR = false);
 
+  // Same as above, but writes the object into pObject (for instance a
+  // raw_svector_ostream, or a raw_fd_ostream on a memfd) without touching the
+  // file system. There is no cache lookup, tiering or code generation
+  // splitting in this mode.
+  bool build(BCCContext &pContext, const char *pResName,
+             const char *pBitcode, size_t pBitcodeSize,
+             const char *pBuildChecksum, const char *pRuntimePath,
+             llvm::raw_pwrite_stream &pObject,
+             RSLinkRuntimeCallback pLinkRuntimeCallback = nullptr);
+
+  // As build(), but queued for the driver's worker pool (see
+  // setAsyncBuildJobs()) and returning right away. The build runs with its
+  // own BCCContext and a copy of the driver's settings at the time of the
+  // call, without tiered compilation; the bitcode and the strings are
+  // copied. Outputs are only published by successful builds, so a cancelled
+  // one leaves the previous object (if any) in place. Returns nullptr if the
+  // build could not be queued. The destructor waits for the queued builds.
+  std::shared_ptr<RSAsyncBuild>
+  buildAsync(const char *pCacheDir, const char *pResName, const char *pBitcode,
+             size_t pBitcodeSize, const char *pBuildChecksum,
+             const char *pRuntimePath,
+             RSLinkRuntimeCallback pLinkRuntimeCallback = nullptr);
+
+  // Runtime import limit of the scripts buildApp() builds when none is set
+  // with setRuntimeImportLimit().
+  static const unsigned kAppRuntimeImportLimit = 64;
+
+  // Build all of an app's scripts in one session, so that they share a
+  // single copy of the runtime code they use. Each script is built by
+  // build() into {pCacheDir}/{mResName}.o, linked against a shared runtime
+  // as with setRuntimeImportLimit(). Then {pCacheDir}/{pSharedRuntimeName}.o
+  // is built from pRuntimePath: it holds one copy of every runtime function
+  // and variable any of the objects refers to, with default visibility, for
+  // the app to load before its scripts. Scripts with an up-to-date object are
+  // not recompiled, but the shared runtime always is. Tiered compilation is
+  // suspended during the call.
+  bool buildApp(BCCContext &pContext, const char *pCacheDir,
+                const std::vector<RSAppScript> &pScripts,
+                const char *pRuntimePath, const char *pSharedRuntimeName,
+                RSLinkRuntimeCallback pLinkRuntimeCallback = nullptr);
+
+  // Picks the kernels of the script group with the given edges to fuse,
+  // chaining kernels whose output only feeds the first input of one other
+  // kernel, most bytes saved per cell first. Outputs of the whole group in
+  // pGroupOutputs are never fused away. The plan is returned in the form of
+  // the toFuse and fused arguments of buildScriptGroup(), and pBytesSaved
+  // (if given) receives the estimated memory traffic saved per cell by each
+  // fused kernel.
+  static bool planScriptGroupFusion(
+      const std::vector<Source*>& pSources,
+      const std::vector<ScriptGroupEdge>& pEdges,
+      const std::vector<std::pair<int, int>>& pGroupOutputs,
+      std::list<std::list<std::pair<int, int>>>* pToFuse,
+      std::list<std::string>* pFused,
+      std::list<size_t>* pBytesSaved = nullptr);
+
+  // Each list of toFuseIntoReduce names forEach kernels followed by a general
+  // reduction (as source-and-slot pairs); the kernels are fused into the
+  // accumulator of a new reduction named by the matching fusedReduces entry.
+  // Each of stencilFusions fuses a kernel into a consumer reading its output
+  // at neighbouring cells, recomputing the output for each cell read.
+  // Each list of toFuseFanOut names a forEach kernel followed by the kernels
+  // taking its output as first input; they are fused into a kernel with one
+  // output per consumer, named by the matching fusedFanOuts entry.
   bool buildScriptGroup(
       BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
       const char* pRuntimeRelaxedPath, bool dumpIR, const char* buildChecksum,
@@ -154,12 +770,39 @@ public:
       const std::list<std::list<std::pair<int, int>>>& toFuse,
       const std::list<std::string>& fused,
       const std::list<std::list<std::pair<int, int>>>& invokes,
-      const std::list<std::string>& invokeBatchNames);
+      const std::list<std::string>& invokeBatchNames,
+      const std::list<std::list<std::pair<int, int>>>& toFuseIntoReduce = {},
+      const std::list<std::string>& fusedReduces = {},
+      const std::list<ScriptGroupStencilFusion>& stencilFusions = {},
+      const std::list<std::list<std::pair<int, int>>>& toFuseFanOut = {},
+      const std::list<std::string>& fusedFanOuts = {});
+
+  // As buildScriptGroup(), but queued for the driver's worker pool as with
+  // buildAsync(). The sources are written out as bitcode before this returns,
+  // and the build loads them into a BCCContext of its own, so the caller may
+  // go on using Context and the sources right away.
+  std::shared_ptr<RSAsyncBuild> buildScriptGroupAsync(
+      BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
+      const char* pRuntimeRelaxedPath, const char* buildChecksum,
+      const std::vector<Source*>& sources,
+      const std::list<std::list<std::pair<int, int>>>& toFuse,
+      const std::list<std::string>& fused,
+      const std::list<std::list<std::pair<int, int>>>& invokes,
+      const std::list<std::string>& invokeBatchNames,
+      const std::list<std::list<std::pair<int, int>>>& toFuseIntoReduce = {},
+      const std::list<std::string>& fusedReduces = {},
+      const std::list<ScriptGroupStencilFusion>& stencilFusions = {},
+      const std::list<std::list<std::pair<int, int>>>& toFuseFanOut = {},
+      const std::list<std::string>& fusedFanOuts = {});
 
   // Returns true if script is successfully compiled.
   bool buildForCompatLib(Script &pScript, const char *pOut,
                          const char *pBuildChecksum, const char *pRuntimePath,
                          bool pDumpIR);
+
+  // Same as above, but writes the object into pObject instead of a file.
+  bool buildForCompatLib(Script &pScript, llvm::raw_pwrite_stream &pObject,
+                         const char *pBuildChecksum, const char *pRuntimePath);
 };
 
 } // end namespace bcc
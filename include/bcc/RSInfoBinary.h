@@ -0,0 +1,155 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_RS_INFO_BINARY_H
+#define BCC_RS_INFO_BINARY_H
+
+#include <stdint.h>
+
+namespace bcc {
+
+// Binary form of the .rs.info text, embedded next to it as the kRsInfoBinary
+// variable when requested. It holds the same information, laid out so that a
+// runtime can use it in place from the mapped object file instead of parsing
+// text:
+//
+//   RSInfoBinaryHeader
+//   the tables, each at the offset given for it in the header
+//   the string pool
+//
+// All fields are little-endian uint32_t and the blob is 8-byte aligned, so
+// every table is naturally aligned. Offsets of tables are from the start of
+// the blob. Strings are referred to by their offset in the string pool, where
+// they are NUL-terminated and stored only once; kRSInfoBinaryNoString stands
+// for a missing string.
+//
+// Readers must check mMagic and mVersion, and should use mHeaderSize rather
+// than sizeof(RSInfoBinaryHeader) to find what follows the header: later
+// versions only ever append fields to the header and add tables.
+
+extern const char kRsInfoBinary[];
+
+enum {
+  kRSInfoBinaryMagic = 0x42495352,  // "RSIB"
+  kRSInfoBinaryVersion = 1,
+  kRSInfoBinaryNoString = 0xffffffff,
+};
+
+enum RSInfoBinaryFlags {
+  kRSInfoBinaryThreadable = 0x1,
+};
+
+// Flags of RSInfoBinaryKernelCost, also used by the kernelCostCount section
+// of the text form.
+enum RSInfoBinaryKernelCostFlags {
+  // The work on an element has loops of its own.
+  kRSInfoBinaryKernelHasLoops = 0x1,
+  // The work on an element calls functions, e.g. runtime functions or a
+  // kernel that was not inlined, whose cost isn't counted.
+  kRSInfoBinaryKernelHasCalls = 0x2,
+};
+
+// A table of mCount entries starting at mOffset.
+struct RSInfoBinaryTable {
+  uint32_t mCount;
+  uint32_t mOffset;
+};
+
+struct RSInfoBinaryHeader {
+  uint32_t mMagic;
+  uint32_t mVersion;
+  uint32_t mHeaderSize;
+  uint32_t mTotalSize;
+  uint32_t mFlags;
+
+  // Strings.
+  uint32_t mBuildChecksum;
+  uint32_t mBccVersion;
+  uint32_t mSlangVersion;
+
+  // Entries are string offsets (uint32_t).
+  RSInfoBinaryTable mExportVars;
+  RSInfoBinaryTable mExportFuncs;
+  // Entries are RSInfoBinaryForEach.
+  RSInfoBinaryTable mExportForEachs;
+  // Entries are RSInfoBinaryReduce.
+  RSInfoBinaryTable mExportReduces;
+  // Entries are slot numbers (uint32_t).
+  RSInfoBinaryTable mObjectSlots;
+  // Entries are RSInfoBinaryPragma.
+  RSInfoBinaryTable mPragmas;
+  // Entries are string offsets (uint32_t) of kernel names.
+  RSInfoBinaryTable mNonThreadableKernels;
+  // mCount is the size of the string pool in bytes.
+  RSInfoBinaryTable mStringPool;
+  // Entries are RSInfoBinaryKernelCost.
+  RSInfoBinaryTable mKernelCosts;
+  // Entries are RSInfoBinaryTreeCombinableReduce.
+  RSInfoBinaryTable mTreeCombinableReduces;
+};
+
+struct RSInfoBinaryForEach {
+  uint32_t mSignature;
+  uint32_t mName;
+};
+
+struct RSInfoBinaryReduce {
+  uint32_t mSignature;
+  uint32_t mAccumulatorDataSize;
+  uint32_t mName;
+  uint32_t mInitializerName;
+  uint32_t mAccumulatorName;
+  // Always present: the name of the generated combiner if the script has
+  // none.
+  uint32_t mCombinerName;
+  uint32_t mOutConverterName;
+  uint32_t mHalterName;
+};
+
+// Static estimate of the work of a forEach or reduce kernel on one element,
+// taken from its optimized expanded function, for the runtime to size chunks
+// and pick a thread count with.
+struct RSInfoBinaryKernelCost {
+  uint32_t mName;
+  // IR instructions executed per element.
+  uint32_t mInstructions;
+  // Of these, loads, stores and memory intrinsics.
+  uint32_t mMemoryOps;
+  // RSInfoBinaryKernelCostFlags.
+  uint32_t mFlags;
+};
+
+// A general reduction whose partial accumulators the runtime may combine in
+// a tree, in parallel, rather than one by one. Its multi-combiner,
+//
+//   void multiCombiner(accumType *accum, const uint8_t *others,
+//                      uint32_t count, uint32_t stride);
+//
+// merges the count partial accumulators found stride bytes apart from
+// others, none of them overlapping accum, into accum.
+struct RSInfoBinaryTreeCombinableReduce {
+  uint32_t mName;
+  uint32_t mMultiCombinerName;
+};
+
+struct RSInfoBinaryPragma {
+  uint32_t mKey;
+  uint32_t mValue;
+};
+
+} // end namespace bcc
+
+#endif // BCC_RS_INFO_BINARY_H
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_RUNTIME_SNAPSHOT_H
+#define BCC_RUNTIME_SNAPSHOT_H
+
+namespace bcc {
+
+// A runtime snapshot is a runtime library (e.g. libclcore.bc) prepared ahead
+// of time for one target by "bcc_strip_attr -snapshot-triple": its functions
+// have no target-cpu/target-features attributes, its target triple is set,
+// it has been verified, and it carries the per-function summary that
+// BCCContext::loadRuntimeLibrary() would otherwise compute by parsing every
+// function body. It is plain bitcode, so it is still loaded lazily.
+//
+// Script::LinkRuntime() links "<library>" + kRuntimeSnapshotSuffix instead of
+// the library when that file is at least as recent as the library and was
+// made for the script's architecture.
+//
+// These are header-only so that bcc_strip_attr doesn't need libbcc.
+
+static const char kRuntimeSnapshotSuffix[] = ".snapshot";
+
+// Named metadata holding the target triple the snapshot was made for.
+static const char kRuntimeSnapshotMetadataName[] = "#rs_runtime_snapshot";
+
+// Named metadata with a (name, instruction count) pair for each externally
+// visible function the snapshot defines.
+static const char kRuntimeSnapshotSizesMetadataName[] =
+    "#rs_runtime_function_sizes";
+
+} // end namespace bcc
+
+#endif // BCC_RUNTIME_SNAPSHOT_H
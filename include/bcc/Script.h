@@ -22,6 +22,9 @@
 #include <llvm/Support/CodeGen.h>
 #include "bcc/Source.h"
 
+#include <set>
+#include <string>
+
 namespace llvm {
 class Module;
 }
@@ -56,6 +59,26 @@ private:
   // when potentially embedding information about globals.
   bool mEmbedGlobalInfoSkipConstant;
 
+  // Specifies whether the embedded info should also be given in the binary
+  // form of bcc/RSInfoBinary.h.
+  bool mEmbedBinaryInfo;
+
+  // Is this a build of a script with debug information that is optimized
+  // for profiling (see RSCompilerDriver::setOptimizedDebug())?
+  bool mOptimizedDebug;
+
+  // Is this script built to run with a RenderScript debug context, against
+  // the runtime that checks every allocation access?
+  bool mDebugContext;
+
+  // If non-zero, LinkRuntime() only imports runtime functions of at most
+  // this many instructions (see BCCContext::loadRuntimeLibrary()).
+  unsigned mRuntimeImportLimit;
+
+  // Names of the functions defined by the script itself, recorded by
+  // LinkRuntime() before the runtime library is linked in.
+  std::set<std::string> mScriptFunctions;
+
 public:
   explicit Script(Source *pSource);
 
@@ -105,6 +128,36 @@ public:
     return mEmbedGlobalInfoSkipConstant;
   }
 
+  // Set to true if the embedded info should also be given in binary form.
+  void setEmbedBinaryInfo(bool pEnable) { mEmbedBinaryInfo = pEnable; }
+
+  // Returns true if the embedded info should also be given in binary form.
+  bool getEmbedBinaryInfo() const { return mEmbedBinaryInfo; }
+
+  // Set to true if this debuggable script is optimized, keeping its debug
+  // information usable.
+  void setOptimizedDebug(bool pEnable) { mOptimizedDebug = pEnable; }
+
+  // Returns true if this debuggable script is optimized.
+  bool getOptimizedDebug() const { return mOptimizedDebug; }
+
+  // Set to true if this script is built to run with a debug context.
+  void setDebugContext(bool pEnable) { mDebugContext = pEnable; }
+
+  bool getDebugContext() const { return mDebugContext; }
+
+  // Only import runtime functions of at most pLimit instructions when
+  // linking the runtime library (0 imports all of them).
+  void setRuntimeImportLimit(unsigned pLimit) { mRuntimeImportLimit = pLimit; }
+
+  unsigned getRuntimeImportLimit() const { return mRuntimeImportLimit; }
+
+  // The functions the script defined before LinkRuntime(); empty if the
+  // runtime was not linked.
+  const std::set<std::string> &getScriptFunctions() const {
+    return mScriptFunctions;
+  }
+
   // Merge (or link) another source into the current source associated with
   // this Script object. Return false on error.
   //
@@ -17,9 +17,13 @@
 #ifndef BCC_SOURCE_H
 #define BCC_SOURCE_H
 
+#include <memory>
 #include <string>
 
+#include <sys/types.h>
+
 namespace llvm {
+  class MemoryBuffer;
   class Module;
 }
 
@@ -46,18 +50,65 @@ private:
   // getting linked with a different llvm::Module).
   bool mIsModuleDestroyed;
 
+  // If true, the functions of mModule are only materialized when merging it
+  // into another source needs them (see merge()).
+  bool mIsLazy;
+
+  // If true, mModule was verified ahead of time, so materializing it doesn't
+  // verify it again.
+  bool mIsPreverified;
+
 private:
   Source(const char* name, BCCContext &pContext, llvm::Module &pModule,
          bool pNoDelete = false);
 
+  // Create a Source object from the lazily loaded pModule, which it takes
+  // ownership of.
+  static Source *CreateFromLazyModule(BCCContext &pContext, const char *name,
+                                      llvm::Module &pModule,
+                                      uint32_t compilerVersion,
+                                      uint32_t optimizationLevel);
+
+  // Create a Source object from the bitcode in pInput, which it takes
+  // ownership of.
+  static Source *CreateFromMemoryBuffer(BCCContext &pContext, const char *pName,
+                                        std::unique_ptr<llvm::MemoryBuffer> pInput,
+                                        bool pLazy);
+
+  // Materialize the functions of the lazily loaded mModule that pUser refers
+  // to, directly or not, and turn all the others into declarations. Returns
+  // false on error.
+  bool materializeNeededBy(const llvm::Module &pUser);
+
 public:
+  // With pLazy set, the bitcode is only read up front for its globals and
+  // metadata, and function bodies are left unparsed until merge() needs them.
+  // This is meant for libraries (e.g. libclcore.bc) linked into a script
+  // that only uses few of their functions. The bitcode is then copied, so
+  // pBitcode need not outlive the Source.
+  // Legacy bitcode (targeting API 11 to 15) is translated into a module
+  // directly, and always loaded in full.
   static Source *CreateFromBuffer(BCCContext &pContext,
                                   const char *pName,
                                   const char *pBitcode,
-                                  size_t pBitcodeSize);
+                                  size_t pBitcodeSize,
+                                  bool pLazy = false);
 
+  // The file is mapped rather than read where possible, and the bitcode is
+  // parsed straight from the mapped pages.
   static Source *CreateFromFile(BCCContext &pContext,
-                                const std::string &pPath);
+                                const std::string &pPath,
+                                bool pLazy = false);
+
+  // Like CreateFromFile(), for the pSize bytes of bitcode at pOffset in the
+  // open file pFd (e.g. a script stored uncompressed in an APK). pFd is not
+  // closed, and need not stay open once this returns.
+  static Source *CreateFromFd(BCCContext &pContext,
+                              const char *pName,
+                              int pFd,
+                              size_t pSize,
+                              off_t pOffset,
+                              bool pLazy = false);
 
   // Create a Source object from an existing module. If pNoDelete
   // is true, destructor won't call delete on the given module.
@@ -72,7 +123,11 @@ public:
 
   // Merge the current source with pSource. pSource
   // will be destroyed after successfully merged. Return false on error.
-  bool merge(Source &pSource);
+  // If pSource was loaded lazily, only the functions the current source
+  // needs from it are materialized and linked. With pOnlyNeeded set, only
+  // the definitions of pSource that the current source refers to (directly
+  // or not) are linked in either case.
+  bool merge(Source &pSource, bool pOnlyNeeded = false);
 
   unsigned getCompilerVersion() const;
 
@@ -84,6 +139,9 @@ public:
   inline const BCCContext &getContext() const
   { return mContext; }
 
+  // The metadata extracted so far is kept, so pModule is expected to carry
+  // the same named metadata as the module it replaces (otherwise call
+  // invalidateMetadata()).
   void setModule(llvm::Module *pModule);
 
   inline llvm::Module &getModule()
@@ -95,16 +153,26 @@ public:
   // when it's created using CreateFromBuffer and pPath if CreateFromFile().
   const std::string &getIdentifier() const;
 
-  void addBuildChecksumMetadata(const char *) const;
+  void addBuildChecksumMetadata(const char *);
 
   // Get whether debugging has been enabled for this module by checking
   // for presence of debug info in the module.
   bool getDebugInfoEnabled() const;
 
-  // Extract metadata from mModule using MetadataExtractor.
+  // Extract metadata from mModule using MetadataExtractor. The result is
+  // cached, so this only walks the metadata of mModule again after
+  // invalidateMetadata().
   bool extractMetadata();
   bcinfo::MetadataExtractor* getMetadata() const { return mMetadata; }
 
+  // Drop the cached metadata. This has to be called whenever the named
+  // metadata of mModule changes; merge() and addBuildChecksumMetadata() do.
+  void invalidateMetadata();
+
+  // Mark mModule as verified ahead of time, e.g. as a runtime snapshot (see
+  // bcc/RuntimeSnapshot.h).
+  void setPreverified(bool pPreverified) { mIsPreverified = pPreverified; }
+
   // Mark mModule was destroyed in the process of linking with a different
   // llvm::Module
   void markModuleDestroyed() { mIsModuleDestroyed = true; }
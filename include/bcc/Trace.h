@@ -0,0 +1,57 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_TRACE_H
+#define BCC_TRACE_H
+
+namespace bcc {
+
+// Trace sections around the phases of a build (loading the bitcode, linking
+// the runtime, each group of passes, code generation, waiting for the output
+// lock, ...), so that bcc's share of, say, an app startup shows up on the
+// same timeline as the rest of the system. On Android they are emitted with
+// ATRACE under the RenderScript tag, for systrace and Perfetto; anywhere,
+// they are also handed to the callbacks given to setTraceCallbacks().
+// Sections nest, and begin and end on the same thread.
+
+typedef void (*TraceBeginCallback)(const char *pName);
+typedef void (*TraceEndCallback)();
+
+// Install callbacks that receive every trace section, from any thread, or
+// remove them by passing nullptr. pName is only valid during the call.
+void setTraceCallbacks(TraceBeginCallback pBegin, TraceEndCallback pEnd);
+
+// Returns true if trace sections are currently being collected, so that work
+// done only for tracing can be skipped otherwise.
+bool isTraceEnabled();
+
+void beginTraceSection(const char *pName);
+void endTraceSection();
+
+// A trace section lasting as long as the object.
+class TraceScope {
+public:
+  explicit TraceScope(const char *pName) { beginTraceSection(pName); }
+  ~TraceScope() { endTraceSection(); }
+
+private:
+  TraceScope(const TraceScope &) = delete;
+  void operator=(const TraceScope &) = delete;
+};
+
+} // end namespace bcc
+
+#endif // BCC_TRACE_H
@@ -18,15 +18,22 @@
 
 #include "BCCContextImpl.h"
 #include "Log.h"
+#include "bcc/RuntimeSnapshot.h"
 #include "bcc/Source.h"
 
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <mutex>
 #include <new>
 
 using namespace bcc;
 
 static BCCContext *GlobalContext = nullptr;
+static std::mutex GlobalContextMutex;
 
 BCCContext *BCCContext::GetOrCreateGlobalContext() {
+  std::lock_guard<std::mutex> lock(GlobalContextMutex);
   if (GlobalContext == nullptr) {
     GlobalContext = new (std::nothrow) BCCContext();
     if (GlobalContext == nullptr) {
@@ -37,14 +44,20 @@ BCCContext *BCCContext::GetOrCreateGlobalContext() {
 }
 
 void BCCContext::DestroyGlobalContext() {
-  delete GlobalContext;
-  GlobalContext = nullptr;
+  BCCContext *context;
+  {
+    std::lock_guard<std::mutex> lock(GlobalContextMutex);
+    context = GlobalContext;
+    GlobalContext = nullptr;
+  }
+  delete context;
 }
 
 BCCContext::BCCContext() : mImpl(new BCCContextImpl(*this)) { }
 
 BCCContext::~BCCContext() {
   delete mImpl;
+  std::lock_guard<std::mutex> lock(GlobalContextMutex);
   if (this == GlobalContext) {
     // We're deleting the context returned from GetOrCreateGlobalContext().
     // Reset the GlobalContext.
@@ -55,11 +68,115 @@ BCCContext::~BCCContext() {
 void BCCContext::addSource(Source &pSource)
 { mImpl->mOwnSources.insert(&pSource); }
 
-void BCCContext::removeSource(Source &pSource)
-{ mImpl->mOwnSources.erase(&pSource); }
+void BCCContext::removeSource(Source &pSource) {
+  mImpl->mOwnSources.erase(&pSource);
+  if (mImpl->mOwnSources.empty() && (mImpl->mRecycleThreshold != 0) &&
+      (mImpl->mRetainedBitcodeSize >= mImpl->mRecycleThreshold)) {
+    ALOGV("Recycling the LLVMContext after %u bytes of bitcode",
+          static_cast<unsigned>(mImpl->mRetainedBitcodeSize));
+    recycle();
+  }
+}
+
+bool BCCContext::recycle() {
+  if (!mImpl->mOwnSources.empty()) {
+    return false;
+  }
+  // The parsed runtime libraries belong to the old LLVMContext; their bitcode
+  // stays cached, and is parsed again on next use.
+  for (auto &library : mImpl->mRuntimeLibraries) {
+    library.second.mModule.reset();
+  }
+  mImpl->mLLVMContext.reset(new llvm::LLVMContext());
+  mImpl->mRetainedBitcodeSize = 0;
+  return true;
+}
+
+size_t BCCContext::getRetainedBitcodeSize() const
+{ return mImpl->mRetainedBitcodeSize; }
+
+void BCCContext::setRecycleThreshold(size_t pThreshold)
+{ mImpl->mRecycleThreshold = pThreshold; }
+
+Source *BCCContext::loadRuntimeLibrary(const std::string &pPath, bool pLazy,
+                                       unsigned pImportLimit) {
+  BCCContextImpl::RuntimeLibrary *library =
+      mImpl->getRuntimeLibrary(pPath, /* pParse */!pLazy);
+  if (library == nullptr) {
+    return nullptr;
+  }
+
+  const llvm::StringMap<unsigned> *summary = nullptr;
+  if (pImportLimit != 0) {
+    summary = mImpl->getRuntimeLibrarySummary(*library, pPath);
+    if (summary == nullptr) {
+      return nullptr;
+    }
+  }
+
+  Source *result = nullptr;
+  if (pLazy) {
+    result = Source::CreateFromBuffer(*this, pPath.c_str(),
+                                      library->mBitcode->getBufferStart(),
+                                      library->mBitcode->getBufferSize(),
+                                      /* pLazy */true);
+  } else {
+    // Linking consumes the runtime module, so every caller gets its own copy.
+    std::unique_ptr<llvm::Module> copy = llvm::CloneModule(library->mModule.get());
+    if (copy == nullptr) {
+      ALOGE("Out of memory when copying Renderscript library '%s'!",
+            pPath.c_str());
+      return nullptr;
+    }
+
+    result = Source::CreateFromModule(*this, pPath.c_str(), *copy,
+                                      library->mCompilerVersion,
+                                      library->mOptimizationLevel,
+                                      /* pNoDelete */false);
+    if (result != nullptr) {
+      // Ownership of the module has been passed to result.
+      copy.release();
+    }
+  }
+
+  if (result != nullptr && library->mIsSnapshot) {
+    // The snapshot's own metadata would only be appended to the script's.
+    llvm::Module &module = result->getModule();
+    for (const char *name : { kRuntimeSnapshotMetadataName,
+                              kRuntimeSnapshotSizesMetadataName }) {
+      if (llvm::NamedMDNode *node = module.getNamedMetadata(name)) {
+        module.eraseNamedMetadata(node);
+      }
+    }
+    result->setPreverified(true);
+  }
+
+  if (result != nullptr && summary != nullptr) {
+    for (llvm::Function &function : result->getModule()) {
+      if (function.isDeclaration() || !function.hasExternalLinkage()) {
+        continue;
+      }
+      bool inlinable = function.hasFnAttribute(llvm::Attribute::AlwaysInline) ||
+                       function.hasFnAttribute(llvm::Attribute::InlineHint);
+      if (inlinable || summary->lookup(function.getName()) <= pImportLimit) {
+        // The body is only there to be inlined; the shared runtime provides
+        // the definition, so no copy of it ends up in the object.
+        function.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      } else {
+        // Dropping a body that was never materialized also keeps it from
+        // being parsed at all.
+        function.deleteBody();
+      }
+    }
+  }
+  return result;
+}
+
+void BCCContext::invalidateRuntimeLibraries()
+{ mImpl->mRuntimeLibraries.clear(); }
 
 llvm::LLVMContext &BCCContext::getLLVMContext()
-{ return mImpl->mLLVMContext; }
+{ return *mImpl->mLLVMContext; }
 
 const llvm::LLVMContext &BCCContext::getLLVMContext() const
-{ return mImpl->mLLVMContext; }
+{ return *mImpl->mLLVMContext; }
@@ -16,18 +16,270 @@
 
 #include "BCCContextImpl.h"
 
+#include <sys/stat.h>
+#include <map>
+#include <mutex>
 #include <vector>
 
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/Support/MemoryBuffer.h>
 
+#include "Log.h"
+#include "bcc/RuntimeSnapshot.h"
 #include "bcc/Source.h"
+#include "bcinfo/BitcodeWrapper.h"
 
 using namespace bcc;
 
+namespace {
+
+// The context-independent parts of a runtime library, shared by all the
+// contexts of the process (see BCCContextImpl::RuntimeLibrary).
+struct SharedRuntimeLibrary {
+  std::shared_ptr<const llvm::MemoryBuffer> mBitcode;
+  std::shared_ptr<const llvm::StringMap<unsigned>> mFunctionSizes;
+  time_t mModificationTime;
+  off_t mSize;
+  bool mIsSnapshot;
+};
+
+std::mutex SharedRuntimeLibrariesMutex;
+std::map<std::string, SharedRuntimeLibrary> SharedRuntimeLibraries;
+
+// Fill in the shared parts of pEntry, the entry for pPath, if another context
+// has read the version of the library described by pStat already. Returns
+// false otherwise.
+bool getSharedRuntimeLibrary(const std::string &pPath, const struct stat &pStat,
+                             BCCContextImpl::RuntimeLibrary &pEntry) {
+  std::lock_guard<std::mutex> lock(SharedRuntimeLibrariesMutex);
+  auto shared = SharedRuntimeLibraries.find(pPath);
+  if (shared == SharedRuntimeLibraries.end() ||
+      shared->second.mModificationTime != pStat.st_mtime ||
+      shared->second.mSize != pStat.st_size) {
+    return false;
+  }
+  pEntry.mBitcode = shared->second.mBitcode;
+  pEntry.mFunctionSizes = shared->second.mFunctionSizes;
+  pEntry.mIsSnapshot = shared->second.mIsSnapshot;
+  return true;
+}
+
+// Return the summary that another context computed for the bitcode of
+// pEntry, the entry for pPath, if any.
+std::shared_ptr<const llvm::StringMap<unsigned>>
+getSharedRuntimeLibrarySummary(const std::string &pPath,
+                               const BCCContextImpl::RuntimeLibrary &pEntry) {
+  std::lock_guard<std::mutex> lock(SharedRuntimeLibrariesMutex);
+  auto shared = SharedRuntimeLibraries.find(pPath);
+  if (shared == SharedRuntimeLibraries.end() ||
+      shared->second.mBitcode != pEntry.mBitcode) {
+    return nullptr;
+  }
+  return shared->second.mFunctionSizes;
+}
+
+// Make the shared parts of pEntry, the entry for pPath, available to the
+// other contexts.
+void shareRuntimeLibrary(const std::string &pPath,
+                         const BCCContextImpl::RuntimeLibrary &pEntry) {
+  std::lock_guard<std::mutex> lock(SharedRuntimeLibrariesMutex);
+  SharedRuntimeLibrary &shared = SharedRuntimeLibraries[pPath];
+  shared.mBitcode = pEntry.mBitcode;
+  shared.mFunctionSizes = pEntry.mFunctionSizes;
+  shared.mModificationTime = pEntry.mModificationTime;
+  shared.mSize = pEntry.mSize;
+  shared.mIsSnapshot = pEntry.mIsSnapshot;
+}
+
+} // end anonymous namespace
+
 BCCContextImpl::~BCCContextImpl() {
+  // The context is going away: don't recycle it along the way.
+  mRecycleThreshold = 0;
+
   // Another temporary container is needed to store the Source objects that we
   // are going to destroy. Since the destruction of Source object will call
   // removeSource() and change the content of OwnSources.
   std::vector<Source *> Sources(mOwnSources.begin(), mOwnSources.end());
   llvm::DeleteContainerPointers(Sources);
 }
+
+BCCContextImpl::RuntimeLibrary *
+BCCContextImpl::getRuntimeLibrary(const std::string &pPath, bool pParse) {
+  struct stat file_stat;
+  if (::stat(pPath.c_str(), &file_stat) != 0) {
+    ALOGE("Unable to stat Renderscript library '%s'!", pPath.c_str());
+    mRuntimeLibraries.erase(pPath);
+    return nullptr;
+  }
+
+  auto cached = mRuntimeLibraries.find(pPath);
+  if (cached != mRuntimeLibraries.end() &&
+      ((cached->second.mModificationTime != file_stat.st_mtime) ||
+       (cached->second.mSize != file_stat.st_size))) {
+    // The library changed on disk.
+    mRuntimeLibraries.erase(cached);
+    cached = mRuntimeLibraries.end();
+  }
+
+  if (cached == mRuntimeLibraries.end()) {
+    RuntimeLibrary entry;
+    entry.mModificationTime = file_stat.st_mtime;
+    entry.mSize = file_stat.st_size;
+    if (!getSharedRuntimeLibrary(pPath, file_stat, entry)) {
+      // Map the library rather than reading it; the bitcode reader doesn't
+      // need a null terminator.
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+          llvm::MemoryBuffer::getFile(pPath, /* FileSize */-1,
+                                      /* RequiresNullTerminator */false);
+      if (mb_or_error.getError()) {
+        ALOGE("Failed to load bitcode from path %s! (%s)", pPath.c_str(),
+              mb_or_error.getError().message().c_str());
+        return nullptr;
+      }
+      entry.mBitcode = std::move(mb_or_error.get());
+      // The cached bitcode is parsed over and over, so keep it uncompressed.
+      bcinfo::BitcodeWrapper file_wrapper(entry.mBitcode->getBufferStart(),
+                                          entry.mBitcode->getBufferSize());
+      if (file_wrapper.isCompressed()) {
+        std::vector<char> uncompressed;
+        if (!bcinfo::decompressBitcode(entry.mBitcode->getBufferStart(),
+                                       entry.mBitcode->getBufferSize(),
+                                       &uncompressed)) {
+          ALOGE("Unable to decompress Renderscript library '%s'!",
+                pPath.c_str());
+          return nullptr;
+        }
+        entry.mBitcode = llvm::MemoryBuffer::getMemBufferCopy(
+            llvm::StringRef(uncompressed.data(), uncompressed.size()), pPath);
+      }
+      entry.mIsSnapshot = false;
+      if (llvm::StringRef(pPath).endswith(kRuntimeSnapshotSuffix) &&
+          !readRuntimeSnapshot(entry, pPath)) {
+        return nullptr;
+      }
+      shareRuntimeLibrary(pPath, entry);
+    }
+
+    bcinfo::BitcodeWrapper wrapper(entry.mBitcode->getBufferStart(),
+                                   entry.mBitcode->getBufferSize());
+    entry.mCompilerVersion = wrapper.getCompilerVersion();
+    entry.mOptimizationLevel = wrapper.getOptimizationLevel();
+    cached = mRuntimeLibraries.emplace(pPath, std::move(entry)).first;
+  }
+
+  RuntimeLibrary &entry = cached->second;
+  if (pParse && entry.mModule == nullptr) {
+    // Parse eagerly: every clone needs the complete module anyway.
+    mRetainedBitcodeSize += entry.mBitcode->getBufferSize();
+    llvm::ErrorOr<std::unique_ptr<llvm::Module>> module_or_error =
+        llvm::parseBitcodeFile(entry.mBitcode->getMemBufferRef(), *mLLVMContext);
+    if (std::error_code ec = module_or_error.getError()) {
+      ALOGE("Unable to parse the given bitcode file `%s'! (%s)", pPath.c_str(),
+            ec.message().c_str());
+      return nullptr;
+    }
+    entry.mModule = std::move(module_or_error.get());
+  }
+  return &entry;
+}
+
+bool BCCContextImpl::readRuntimeSnapshot(RuntimeLibrary &pEntry,
+                                         const std::string &pPath) {
+  // Only the module-level records and the metadata are read; the function
+  // bodies stay unparsed.
+  llvm::ErrorOr<std::unique_ptr<llvm::Module>> module_or_error =
+      llvm::getLazyBitcodeModule(
+          llvm::MemoryBuffer::getMemBuffer(pEntry.mBitcode->getMemBufferRef(),
+                                           /* RequiresNullTerminator */false),
+          *mLLVMContext);
+  if (std::error_code ec = module_or_error.getError()) {
+    ALOGE("Unable to parse the given bitcode file `%s'! (%s)", pPath.c_str(),
+          ec.message().c_str());
+    return false;
+  }
+  llvm::Module &module = *module_or_error.get();
+  if (std::error_code ec = module.materializeMetadata()) {
+    ALOGE("Unable to load the metadata of `%s'! (%s)", pPath.c_str(),
+          ec.message().c_str());
+    return false;
+  }
+
+  const llvm::NamedMDNode *marker =
+      module.getNamedMetadata(kRuntimeSnapshotMetadataName);
+  const llvm::NamedMDNode *sizes_node =
+      module.getNamedMetadata(kRuntimeSnapshotSizesMetadataName);
+  if (marker == nullptr || sizes_node == nullptr) {
+    ALOGE("`%s' is not a Renderscript runtime snapshot!", pPath.c_str());
+    return false;
+  }
+
+  std::unique_ptr<llvm::StringMap<unsigned>> sizes(new llvm::StringMap<unsigned>());
+  for (const llvm::MDNode *entry : sizes_node->operands()) {
+    if (entry->getNumOperands() != 2) {
+      continue;
+    }
+    const llvm::MDString *name =
+        llvm::dyn_cast<llvm::MDString>(entry->getOperand(0));
+    const llvm::MDString *size =
+        llvm::dyn_cast<llvm::MDString>(entry->getOperand(1));
+    unsigned long long value;
+    if (name == nullptr || size == nullptr ||
+        llvm::getAsUnsignedInteger(size->getString(), 10, value)) {
+      continue;
+    }
+    (*sizes)[name->getString()] = static_cast<unsigned>(value);
+  }
+
+  pEntry.mFunctionSizes = std::move(sizes);
+  pEntry.mIsSnapshot = true;
+  return true;
+}
+
+const llvm::StringMap<unsigned> *
+BCCContextImpl::getRuntimeLibrarySummary(RuntimeLibrary &pEntry,
+                                         const std::string &pPath) {
+  if (pEntry.mFunctionSizes == nullptr) {
+    pEntry.mFunctionSizes = getSharedRuntimeLibrarySummary(pPath, pEntry);
+  }
+  if (pEntry.mFunctionSizes != nullptr) {
+    return pEntry.mFunctionSizes.get();
+  }
+
+  // The summary needs every body, so use the parsed module if there is one
+  // and parse a throwaway one otherwise. The result is shared, so this
+  // normally happens once per library in the process.
+  std::unique_ptr<llvm::Module> parsed;
+  const llvm::Module *module = pEntry.mModule.get();
+  if (module == nullptr) {
+    mRetainedBitcodeSize += pEntry.mBitcode->getBufferSize();
+    llvm::ErrorOr<std::unique_ptr<llvm::Module>> module_or_error =
+        llvm::parseBitcodeFile(pEntry.mBitcode->getMemBufferRef(), *mLLVMContext);
+    if (std::error_code ec = module_or_error.getError()) {
+      ALOGE("Unable to parse the given bitcode file `%s'! (%s)", pPath.c_str(),
+            ec.message().c_str());
+      return nullptr;
+    }
+    parsed = std::move(module_or_error.get());
+    module = parsed.get();
+  }
+
+  std::unique_ptr<llvm::StringMap<unsigned>> sizes(new llvm::StringMap<unsigned>());
+  for (const llvm::Function &function : *module) {
+    if (function.isDeclaration() || function.hasLocalLinkage()) {
+      continue;
+    }
+    unsigned size = 0;
+    for (const llvm::BasicBlock &block : function) {
+      size += block.size();
+    }
+    (*sizes)[function.getName()] = size;
+  }
+
+  pEntry.mFunctionSizes = std::move(sizes);
+  shareRuntimeLibrary(pPath, pEntry);
+  return pEntry.mFunctionSizes.get();
+}
@@ -18,7 +18,17 @@
 #define BCC_CORE_CONTEXT_IMPL_H
 
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <memory>
+#include <string>
 
 namespace bcc {
 
@@ -30,13 +40,66 @@ class Source;
  */
 class BCCContextImpl {
 public:
-  llvm::LLVMContext mLLVMContext;
+  // Replaced by BCCContext::recycle().
+  std::unique_ptr<llvm::LLVMContext> mLLVMContext;
+
+  // Bytes of bitcode loaded into mLLVMContext so far, as an estimate of the
+  // types, constants and metadata it retains (see BCCContext::recycle()).
+  size_t mRetainedBitcodeSize;
+
+  // See BCCContext::setRecycleThreshold().
+  size_t mRecycleThreshold;
 
   // The set of sources that initialized in this context. They will be destroyed
   // automatically when this context is gone.
   llvm::SmallPtrSet<Source *, 2> mOwnSources;
 
-  explicit BCCContextImpl(BCCContext &pContext) { }
+  // A runtime library read from disk, kept pristine so that it can be cloned
+  // (or lazily loaded again) for every script linked against it.
+  //
+  // The bitcode and the summary do not depend on the LLVMContext, and are
+  // shared with the other contexts of the process that use the same library
+  // (see getSharedRuntimeLibrary() in BCCContextImpl.cpp), so that contexts
+  // compiling on several threads read and summarize each library only once.
+  struct RuntimeLibrary {
+    std::shared_ptr<const llvm::MemoryBuffer> mBitcode;
+    // Parsed on first use by a non-lazy load.
+    std::unique_ptr<llvm::Module> mModule;
+    // Used to detect that the file changed on disk since it was parsed.
+    time_t mModificationTime;
+    off_t mSize;
+    // Bitcode wrapper information of the library.
+    uint32_t mCompilerVersion;
+    uint32_t mOptimizationLevel;
+    // Summary of the library: the number of instructions of each externally
+    // visible function it defines. Computed on first use by
+    // getRuntimeLibrarySummary(), or read from a snapshot.
+    std::shared_ptr<const llvm::StringMap<unsigned>> mFunctionSizes;
+    // Whether the library is a runtime snapshot (see bcc/RuntimeSnapshot.h),
+    // which needs no verification.
+    bool mIsSnapshot;
+  };
+
+  // Runtime libraries keyed by path.
+  std::map<std::string, RuntimeLibrary> mRuntimeLibraries;
+
+  // Return the up-to-date cache entry for pPath, (re)reading it if needed.
+  // With pParse set, the entry's module is parsed too. Returns nullptr on
+  // error.
+  RuntimeLibrary *getRuntimeLibrary(const std::string &pPath, bool pParse);
+
+  // Read the marker and the summary of the runtime snapshot pEntry, the
+  // entry for pPath. Returns false if it is not a valid snapshot.
+  bool readRuntimeSnapshot(RuntimeLibrary &pEntry, const std::string &pPath);
+
+  // Return the summary of pEntry (see RuntimeLibrary::mFunctionSizes), the
+  // entry for pPath, computing it if needed. Returns nullptr on error.
+  const llvm::StringMap<unsigned> *getRuntimeLibrarySummary(RuntimeLibrary &pEntry,
+                                                             const std::string &pPath);
+
+  explicit BCCContextImpl(BCCContext &pContext)
+      : mLLVMContext(new llvm::LLVMContext()), mRetainedBitcodeSize(0),
+        mRecycleThreshold(0) { }
   ~BCCContextImpl();
 };
 
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/BuildStats.h"
+
+#include <llvm/Support/raw_ostream.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+// Peak resident set size of this process in KiB, or 0 if unknown.
+long getPeakRSS() {
+#ifndef _WIN32
+  struct rusage usage;
+  if (::getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+    // Darwin reports bytes rather than KiB.
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+  }
+#endif
+  return 0;
+}
+
+} // end anonymous namespace
+
+namespace bcc {
+
+void BuildStats::reset() {
+  mCacheHit = false;
+  mTotalTime = 0;
+  mParseTime = 0;
+  mLinkRuntimeTime = 0;
+  mPassTimes.clear();
+  mCodeGenTime = 0;
+  mOutputBytes = 0;
+  mMissedInlines.clear();
+  mKernelCodeStats.clear();
+  mIRSizes.clear();
+  mMemoryFallback = 0;
+  mPeakRSSDelta = 0;
+
+  mBuildStart = Clock::now();
+  mPeakRSSAtStart = getPeakRSS();
+  mPhaseStart = mBuildStart;
+}
+
+void BuildStats::finish() {
+  mTotalTime = MillisecondsSince(mBuildStart);
+  mPeakRSSDelta = getPeakRSS() - mPeakRSSAtStart;
+}
+
+double BuildStats::MillisecondsSince(Clock::time_point pStart) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - pStart)
+      .count();
+}
+
+void BuildStats::beginPhases() {
+  mPhaseStart = Clock::now();
+}
+
+void BuildStats::endPhase(const char *pName) {
+  Clock::time_point now = Clock::now();
+  mPassTimes.emplace_back(
+      pName, std::chrono::duration<double, std::milli>(now - mPhaseStart)
+                 .count());
+  mPhaseStart = now;
+}
+
+void BuildStats::writeJSON(llvm::raw_ostream &pOut) const {
+  pOut << "{\n"
+       << "  \"cache_hit\": " << (mCacheHit ? "true" : "false") << ",\n"
+       << "  \"total_ms\": " << mTotalTime << ",\n"
+       << "  \"parse_ms\": " << mParseTime << ",\n"
+       << "  \"link_runtime_ms\": " << mLinkRuntimeTime << ",\n"
+       << "  \"passes\": [";
+  // Phase names are fixed identifiers chosen by Compiler::runPasses(), so
+  // they never need escaping.
+  for (size_t i = 0; i < mPassTimes.size(); i++) {
+    pOut << ((i == 0) ? "\n" : ",\n")
+         << "    { \"name\": \"" << mPassTimes[i].first << "\", \"ms\": "
+         << mPassTimes[i].second << " }";
+  }
+  pOut << (mPassTimes.empty() ? "],\n" : "\n  ],\n")
+       << "  \"codegen_ms\": " << mCodeGenTime << ",\n"
+       << "  \"output_bytes\": " << mOutputBytes << ",\n"
+       << "  \"missed_inlines\": [";
+  // Function names are RenderScript identifiers, which never need escaping.
+  for (size_t i = 0; i < mMissedInlines.size(); i++) {
+    pOut << ((i == 0) ? "" : ", ") << "\"" << mMissedInlines[i] << "\"";
+  }
+  pOut << "],\n"
+       << "  \"kernel_code\": [";
+  for (size_t i = 0; i < mKernelCodeStats.size(); i++) {
+    const KernelCodeStats &stats = mKernelCodeStats[i];
+    pOut << ((i == 0) ? "\n" : ",\n")
+         << "    { \"function\": \"" << stats.mFunction << "\", "
+         << "\"stack_bytes\": " << stats.mStackSize << ", "
+         << "\"spills\": " << stats.mSpills << ", "
+         << "\"reloads\": " << stats.mReloads << ", "
+         << "\"instructions\": " << stats.mInstructions << " }";
+  }
+  pOut << (mKernelCodeStats.empty() ? "],\n" : "\n  ],\n")
+       << "  \"ir_sizes\": [";
+  for (size_t i = 0; i < mIRSizes.size(); i++) {
+    const IRSize &size = mIRSizes[i];
+    pOut << ((i == 0) ? "\n" : ",\n")
+         << "    { \"point\": \"" << size.mPoint << "\", "
+         << "\"function\": \"" << size.mFunction << "\", "
+         << "\"instructions\": " << size.mInstructions << " }";
+  }
+  pOut << (mIRSizes.empty() ? "],\n" : "\n  ],\n")
+       << "  \"memory_fallback\": " << mMemoryFallback << ",\n"
+       << "  \"peak_rss_delta_kb\": " << mPeakRSSDelta << "\n"
+       << "}\n";
+}
+
+} // end namespace bcc
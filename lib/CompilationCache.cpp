@@ -0,0 +1,513 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CompilationCache.h"
+
+#include "FileMutex.h"
+#include "Log.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
+namespace {
+
+const char kCacheKeySuffix[] = ".key";
+
+std::string getKeyPath(const char *pObjectPath) {
+  std::string path(pObjectPath);
+  path.append(kCacheKeySuffix);
+  return path;
+}
+
+const uint64_t kPrime1 = 11400714785074694791ULL;
+const uint64_t kPrime2 = 14029467366897019727ULL;
+const uint64_t kPrime3 = 1609587929392839161ULL;
+const uint64_t kPrime4 = 9650029242287828579ULL;
+const uint64_t kPrime5 = 2870177450012600261ULL;
+
+inline uint64_t rotateLeft(uint64_t pValue, unsigned pBits) {
+  return (pValue << pBits) | (pValue >> (64 - pBits));
+}
+
+inline uint64_t hashRound(uint64_t pLane, uint64_t pInput) {
+  pLane += pInput * kPrime2;
+  pLane = rotateLeft(pLane, 31);
+  return pLane * kPrime1;
+}
+
+inline uint64_t mergeRound(uint64_t pHash, uint64_t pLane) {
+  pHash ^= hashRound(0, pLane);
+  return pHash * kPrime1 + kPrime4;
+}
+
+inline uint64_t read64(const uint8_t *pData) {
+  return llvm::support::endian::read64le(pData);
+}
+
+const char kCacheIndexName[] = "bcc_cache.index";
+const char kCacheIndexHeader[] = "bcc-cache-index 1";
+const char kObjectSuffix[] = ".o";
+const char kLockSuffix[] = ".lock";
+
+// A lock file nobody holds is normally removed by its last user (FileMutex
+// deletes it on close), so one that is also older than this many seconds was
+// left behind by a process that died. The age keeps us from racing with a
+// process that has just created a lock and not taken it yet.
+const time_t kStaleLockAge = 60;
+
+struct CacheIndexEntry {
+  time_t mLastUse;
+  // Bytes of the object and of its key.
+  uint64_t mSize;
+};
+
+// Keyed by the file name of the object in the cache directory.
+typedef std::map<std::string, CacheIndexEntry> CacheIndex;
+
+// The index is a header line followed by one "<last use> <size> <name>" line
+// per object, the last use in seconds since the epoch. Malformed lines are
+// ignored, and a missing or unrecognized index is simply empty.
+void readCacheIndex(const std::string &pPath, CacheIndex &pIndex) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(pPath);
+  if (!buffer) {
+    return;
+  }
+
+  llvm::SmallVector<llvm::StringRef, 64> lines;
+  buffer.get()->getBuffer().split(lines, '\n', -1, /* KeepEmpty */ false);
+  if (lines.empty() || lines[0] != kCacheIndexHeader) {
+    ALOGV("Ignoring the unrecognized cache index %s", pPath.c_str());
+    return;
+  }
+
+  for (size_t i = 1; i < lines.size(); i++) {
+    std::pair<llvm::StringRef, llvm::StringRef> use = lines[i].split(' ');
+    std::pair<llvm::StringRef, llvm::StringRef> size = use.second.split(' ');
+    unsigned long long last_use, bytes;
+    if (use.first.getAsInteger(10, last_use) ||
+        size.first.getAsInteger(10, bytes) || size.second.empty()) {
+      continue;
+    }
+    CacheIndexEntry &entry = pIndex[size.second.str()];
+    entry.mLastUse = static_cast<time_t>(last_use);
+    entry.mSize = bytes;
+  }
+}
+
+bool writeCacheIndex(const std::string &pPath, const CacheIndex &pIndex) {
+  // Readers never see a partial index. The temporary name is fixed since the
+  // index is only written under its lock.
+  std::string temp_path = pPath + ".tmp";
+  {
+    std::error_code error;
+    llvm::raw_fd_ostream out(temp_path, error, llvm::sys::fs::F_None);
+    if (error) {
+      ALOGE("Unable to open %s for write! (%s)", temp_path.c_str(),
+            error.message().c_str());
+      return false;
+    }
+
+    out << kCacheIndexHeader << '\n';
+    for (const auto &entry : pIndex) {
+      out << static_cast<uint64_t>(entry.second.mLastUse) << ' '
+          << entry.second.mSize << ' ' << entry.first << '\n';
+    }
+    out.close();
+    if (out.has_error()) {
+      out.clear_error();
+      llvm::sys::fs::remove(temp_path);
+      return false;
+    }
+  }
+
+  if (llvm::sys::fs::rename(temp_path, pPath)) {
+    llvm::sys::fs::remove(temp_path);
+    return false;
+  }
+  return true;
+}
+
+#ifndef _WIN32
+enum LockState {
+  kLockAbsent,
+  kLockFree,
+  kLockHeld
+};
+
+// Probe the FileMutex lock file at pLockPath without creating it or waiting
+// for it.
+LockState probeLock(const std::string &pLockPath) {
+  int fd = ::open(pLockPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return kLockAbsent;
+  }
+
+  // Any failure other than contention is taken as held too, so that nothing
+  // is removed on its account.
+  LockState state = kLockHeld;
+  if (::flock(fd, LOCK_EX | LOCK_NB) == 0) {
+    state = kLockFree;
+    ::flock(fd, LOCK_UN);
+  }
+  ::close(fd);
+  return state;
+}
+#endif
+
+} // end anonymous namespace
+
+namespace bcc {
+
+FastHash::FastHash(uint64_t pSeed) : mBufferSize(0), mTotalSize(0) {
+  mLanes[0] = pSeed + kPrime1 + kPrime2;
+  mLanes[1] = pSeed + kPrime2;
+  mLanes[2] = pSeed;
+  mLanes[3] = pSeed - kPrime1;
+}
+
+void FastHash::update(llvm::ArrayRef<uint8_t> pData) {
+  const uint8_t *data = pData.data();
+  size_t size = pData.size();
+  mTotalSize += size;
+
+  if (mBufferSize > 0) {
+    size_t fill = std::min(size, sizeof(mBuffer) - mBufferSize);
+    memcpy(mBuffer + mBufferSize, data, fill);
+    mBufferSize += fill;
+    data += fill;
+    size -= fill;
+    if (mBufferSize < sizeof(mBuffer)) {
+      return;
+    }
+    for (unsigned i = 0; i < 4; i++) {
+      mLanes[i] = hashRound(mLanes[i], read64(mBuffer + 8 * i));
+    }
+    mBufferSize = 0;
+  }
+
+  // The four lanes don't depend on each other.
+  uint64_t v0 = mLanes[0], v1 = mLanes[1], v2 = mLanes[2], v3 = mLanes[3];
+  for (; size >= 32; data += 32, size -= 32) {
+    v0 = hashRound(v0, read64(data));
+    v1 = hashRound(v1, read64(data + 8));
+    v2 = hashRound(v2, read64(data + 16));
+    v3 = hashRound(v3, read64(data + 24));
+  }
+  mLanes[0] = v0;
+  mLanes[1] = v1;
+  mLanes[2] = v2;
+  mLanes[3] = v3;
+
+  memcpy(mBuffer, data, size);
+  mBufferSize = size;
+}
+
+uint64_t FastHash::final() const {
+  uint64_t hash;
+  if (mTotalSize >= 32) {
+    hash = rotateLeft(mLanes[0], 1) + rotateLeft(mLanes[1], 7) +
+           rotateLeft(mLanes[2], 12) + rotateLeft(mLanes[3], 18);
+    for (unsigned i = 0; i < 4; i++) {
+      hash = mergeRound(hash, mLanes[i]);
+    }
+  } else {
+    // mLanes[2] still holds the seed.
+    hash = mLanes[2] + kPrime5;
+  }
+  hash += mTotalSize;
+
+  const uint8_t *data = mBuffer;
+  size_t size = mBufferSize;
+  for (; size >= 8; data += 8, size -= 8) {
+    hash ^= hashRound(0, read64(data));
+    hash = rotateLeft(hash, 27) * kPrime1 + kPrime4;
+  }
+  if (size >= 4) {
+    hash ^= static_cast<uint64_t>(llvm::support::endian::read32le(data)) *
+            kPrime1;
+    hash = rotateLeft(hash, 23) * kPrime2 + kPrime3;
+    data += 4;
+    size -= 4;
+  }
+  for (; size > 0; data++, size--) {
+    hash ^= *data * kPrime5;
+    hash = rotateLeft(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+void CompilationCacheKey::update(llvm::ArrayRef<uint8_t> pData) {
+  if (mKind == kFastHash) {
+    mFastHash.update(pData);
+  } else {
+    mHash.update(pData);
+  }
+}
+
+void CompilationCacheKey::add(llvm::StringRef pData) {
+  add(static_cast<uint64_t>(pData.size()));
+  update(llvm::ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t *>(pData.data()), pData.size()));
+}
+
+void CompilationCacheKey::add(uint64_t pValue) {
+  uint8_t bytes[sizeof(pValue)];
+  for (size_t i = 0; i < sizeof(pValue); i++) {
+    bytes[i] = static_cast<uint8_t>(pValue >> (8 * i));
+  }
+  update(llvm::ArrayRef<uint8_t>(bytes, sizeof(bytes)));
+}
+
+bool CompilationCacheKey::addFile(const char *pPath) {
+  if (pPath == nullptr) {
+    return false;
+  }
+
+  // Not requiring a terminating NUL lets MemoryBuffer map any file that is
+  // large enough instead of copying it.
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(pPath, /* FileSize */-1,
+                                  /* RequiresNullTerminator */false);
+  if (!buffer) {
+    ALOGV("Unable to read %s for the compilation cache key (%s)", pPath,
+          buffer.getError().message().c_str());
+    return false;
+  }
+
+  add(buffer.get()->getBuffer());
+  return true;
+}
+
+std::string CompilationCacheKey::finish() {
+  if (mKind == kFastHash) {
+    char digest[17];
+    snprintf(digest, sizeof(digest), "%016llx",
+             static_cast<unsigned long long>(mFastHash.final()));
+    return digest;
+  }
+
+  llvm::MD5::MD5Result result;
+  mHash.final(result);
+
+  llvm::SmallString<32> digest;
+  llvm::MD5::stringifyResult(result, digest);
+  return digest.str();
+}
+
+bool isCacheEntryValid(const char *pObjectPath, const std::string &pKey) {
+  llvm::sys::fs::file_status status;
+  if (llvm::sys::fs::status(pObjectPath, status) ||
+      !llvm::sys::fs::is_regular_file(status) || status.getSize() == 0) {
+    return false;
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> stored =
+      llvm::MemoryBuffer::getFile(getKeyPath(pObjectPath));
+  if (!stored) {
+    return false;
+  }
+
+  return stored.get()->getBuffer() == pKey;
+}
+
+bool writeCacheEntryKey(const char *pObjectPath, const std::string &pKey) {
+  std::string path = getKeyPath(pObjectPath);
+
+  std::error_code error;
+  llvm::raw_fd_ostream out(path, error, llvm::sys::fs::F_None);
+  if (error) {
+    ALOGE("Unable to open %s for write! (%s)", path.c_str(),
+          error.message().c_str());
+    return false;
+  }
+
+  out << pKey;
+  out.close();
+  if (out.has_error()) {
+    out.clear_error();
+    llvm::sys::fs::remove(path);
+    return false;
+  }
+  return true;
+}
+
+bool hasCacheEntryKey(const char *pObjectPath) {
+  return llvm::sys::fs::exists(getKeyPath(pObjectPath));
+}
+
+void invalidateCacheEntry(const char *pObjectPath) {
+  llvm::sys::fs::remove(getKeyPath(pObjectPath));
+}
+
+bool updateCacheDirectory(const char *pCacheDir, const char *pObjectPath,
+                          uint64_t pBudget) {
+  llvm::SmallString<80> index_path(pCacheDir);
+  llvm::sys::path::append(index_path, kCacheIndexName);
+
+#ifndef _WIN32
+  // Builds in other processes share the directory and its index.
+  FileMutex index_mutex(index_path.str());
+  if (index_mutex.hasError() || !index_mutex.waitMutex()) {
+    ALOGW("Unable to lock the cache index %s (%s)", index_path.c_str(),
+          index_mutex.getErrorMessage().c_str());
+    return false;
+  }
+#endif
+
+  CacheIndex index;
+  readCacheIndex(index_path.str(), index);
+
+  const time_t now = ::time(nullptr);
+  const std::string current = llvm::sys::path::filename(pObjectPath);
+
+  // Take the sizes from the directory itself: objects may have been rebuilt
+  // or removed behind the index's back, and ones it doesn't know about yet
+  // are given their modification time as last use.
+  CacheIndex present;
+  std::vector<std::string> stale_locks;
+  std::error_code error;
+  for (llvm::sys::fs::directory_iterator it(pCacheDir, error), end;
+       !error && it != end; it.increment(error)) {
+    const std::string path = it->path();
+    llvm::StringRef name = llvm::sys::path::filename(path);
+    struct stat file_stat;
+    if (::stat(path.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+
+#ifndef _WIN32
+    if (name.endswith(kLockSuffix)) {
+      if (now - file_stat.st_mtime >= kStaleLockAge &&
+          probeLock(path) == kLockFree) {
+        stale_locks.push_back(path);
+      }
+      continue;
+    }
+#endif
+
+    if (!name.endswith(kObjectSuffix)) {
+      continue;
+    }
+
+    CacheIndexEntry &entry = present[name];
+    entry.mSize = file_stat.st_size;
+    struct stat key_stat;
+    if (::stat(getKeyPath(path.c_str()).c_str(), &key_stat) == 0) {
+      entry.mSize += key_stat.st_size;
+    }
+    CacheIndex::const_iterator known = index.find(name);
+    entry.mLastUse = (known != index.end()) ? known->second.mLastUse
+                                            : file_stat.st_mtime;
+  }
+  if (error) {
+    ALOGW("Unable to list the cache directory %s (%s)", pCacheDir,
+          error.message().c_str());
+    return false;
+  }
+
+  uint64_t total = 0;
+  for (auto &entry : present) {
+    if (entry.first == current) {
+      entry.second.mLastUse = now;
+    }
+    total += entry.second.mSize;
+  }
+
+  if (pBudget > 0 && total > pBudget) {
+    std::vector<CacheIndex::iterator> lru;
+    for (CacheIndex::iterator it = present.begin(); it != present.end(); ++it) {
+      if (it->first != current) {
+        lru.push_back(it);
+      }
+    }
+    std::sort(lru.begin(), lru.end(),
+              [](CacheIndex::iterator pA, CacheIndex::iterator pB) {
+                if (pA->second.mLastUse != pB->second.mLastUse) {
+                  return pA->second.mLastUse < pB->second.mLastUse;
+                }
+                return pA->first < pB->first;
+              });
+
+    for (CacheIndex::iterator it : lru) {
+      if (total <= pBudget) {
+        break;
+      }
+
+      llvm::SmallString<80> object_path(pCacheDir);
+      llvm::sys::path::append(object_path, it->first);
+#ifndef _WIN32
+      // Someone is building (or about to reuse) it.
+      if (probeLock(std::string(object_path.str()) + kLockSuffix) ==
+          kLockHeld) {
+        continue;
+      }
+#endif
+
+      // Drop the key first, so an object that fails to go away is at worst
+      // rebuilt rather than trusted.
+      invalidateCacheEntry(object_path.c_str());
+      if (llvm::sys::fs::remove(object_path.str())) {
+        continue;
+      }
+      ALOGV("Evicted %s from the cache (%llu bytes)", object_path.c_str(),
+            static_cast<unsigned long long>(it->second.mSize));
+      total -= it->second.mSize;
+      present.erase(it);
+    }
+
+    if (total > pBudget) {
+      ALOGW("Cache directory %s is still over its budget (%llu > %llu bytes)",
+            pCacheDir, static_cast<unsigned long long>(total),
+            static_cast<unsigned long long>(pBudget));
+    }
+  }
+
+  for (const std::string &lock : stale_locks) {
+    ALOGV("Removing the stale lock file %s", lock.c_str());
+    llvm::sys::fs::remove(lock);
+  }
+
+  return writeCacheIndex(index_path.str(), present);
+}
+
+} // end namespace bcc
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_COMPILATION_CACHE_H
+#define BCC_COMPILATION_CACHE_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MD5.h>
+
+#include <stdint.h>
+#include <string>
+
+namespace bcc {
+
+// Streaming 64-bit xxHash (XXH64). It is several times faster than MD5 on
+// large inputs, since it runs four independent lanes over each 32 bytes that
+// the processor (or the vectorizer) can process in parallel. It is not
+// cryptographic and only meant to notice that an input changed.
+class FastHash {
+private:
+  uint64_t mLanes[4];
+  uint8_t mBuffer[32];
+  size_t mBufferSize;
+  uint64_t mTotalSize;
+
+public:
+  explicit FastHash(uint64_t pSeed = 0);
+
+  void update(llvm::ArrayRef<uint8_t> pData);
+
+  // The hash of everything updated so far. The hash may be updated further.
+  uint64_t final() const;
+};
+
+// Accumulates everything that influences the contents of a compiled object
+// into a single digest. Every piece of data is length-prefixed so that two
+// different sequences of inputs can never produce the same byte stream.
+class CompilationCacheKey {
+public:
+  enum HashKind {
+    // 128-bit MD5 digest, for the cache entries.
+    kMD5Hash,
+    // 64-bit FastHash digest, for the build checksum.
+    kFastHash
+  };
+
+private:
+  HashKind mKind;
+  llvm::MD5 mHash;
+  FastHash mFastHash;
+
+  void update(llvm::ArrayRef<uint8_t> pData);
+
+public:
+  explicit CompilationCacheKey(HashKind pKind = kMD5Hash) : mKind(pKind) { }
+
+  void add(llvm::StringRef pData);
+
+  void add(uint64_t pValue);
+
+  // Hash the contents of the file at pPath, mapped into memory rather than
+  // read when it is large enough. Returns false if the file could not be
+  // read, in which case the key must not be used.
+  bool addFile(const char *pPath);
+
+  // Returns the hexadecimal digest. The key must not be modified afterwards.
+  std::string finish();
+};
+
+// A compiled object at pObjectPath is considered up to date when its sidecar
+// key file (pObjectPath + ".key") exists and holds exactly pKey, and the
+// object itself is a non-empty regular file.
+bool isCacheEntryValid(const char *pObjectPath, const std::string &pKey);
+
+// Record pKey as the key for the object at pObjectPath. Must only be called
+// once the object has been completely written.
+bool writeCacheEntryKey(const char *pObjectPath, const std::string &pKey);
+
+// Is a key recorded for pObjectPath, whether or not it matches the object?
+bool hasCacheEntryKey(const char *pObjectPath);
+
+// Remove the key for pObjectPath so that a partially written object is never
+// mistaken for a valid cache entry.
+void invalidateCacheEntry(const char *pObjectPath);
+
+// Record that the object at pObjectPath, in the cache directory pCacheDir,
+// has just been built or reused, then keep the directory within pBudget bytes
+// (0: no budget) by removing the least recently used other objects along with
+// their keys. The size and the last use of each object are kept in an index
+// file in pCacheDir. Lock files that FileMutex left behind (a process died
+// holding them) are removed on the way. Objects whose lock is held are never
+// evicted. Returns false if the index could not be updated, which only costs
+// the accuracy of later evictions.
+bool updateCacheDirectory(const char *pCacheDir, const char *pObjectPath,
+                          uint64_t pBudget);
+
+} // end namespace bcc
+
+#endif // BCC_COMPILATION_CACHE_H
@@ -16,22 +16,43 @@
 
 #include "Assert.h"
 #include "Log.h"
+#include "RSStubsWhiteList.h"
 #include "RSTransforms.h"
 #include "RSUtils.h"
 #include "rsDefines.h"
 
+#include "bcc/BuildStats.h"
 #include "bcc/Compiler.h"
 #include "bcc/CompilerConfig.h"
 #include "bcc/Config.h"
+#include "bcc/RSInfoBinary.h"
 #include "bcc/Script.h"
 #include "bcc/Source.h"
+#include "bcc/Trace.h"
 #include "bcinfo/MetadataExtractor.h"
 
 #include <llvm/Analysis/Passes.h>
+#include <llvm/Analysis/ScalarEvolutionAliasAnalysis.h>
+#include <llvm/Analysis/ScopedNoAliasAA.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/CodeGen/MachineFrameInfo.h>
+#include <llvm/CodeGen/MachineFunctionPass.h>
+#include <llvm/CodeGen/MachineInstr.h>
+#include <llvm/CodeGen/MachineMemOperand.h>
+#include <llvm/CodeGen/PseudoSourceValue.h>
 #include <llvm/CodeGen/RegAllocRegistry.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticPrinter.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/ProfileData/InstrProfReader.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/DataLayout.h>
@@ -39,14 +60,524 @@
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Instrumentation.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
 #include <llvm/Transforms/Vectorize.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <mutex>
 #include <string>
 #include <set>
+#include <thread>
+
+#if defined(PROVIDE_ARM_CODEGEN)
+extern llvm::cl::opt<bool> EnableGlobalMerge;
+#endif
 
 namespace {
 
+// Inlining threshold of the LTO pipeline under Compiler::kReduceInlining,
+// rather than the default of 225: kernels are small and still get inlined
+// into their expanded functions, but the runtime functions mostly don't.
+const int kReducedInlineThreshold = 75;
+
+// LLVM reads some code generation settings from process-wide state while a
+// TargetMachine builds its codegen pipeline. Compilers on different threads
+// hold this lock while publishing their settings and building the pipeline.
+std::mutex gCodeGenSetupMutex;
+
+// Publish the process-wide settings codegen pipeline construction reads.
+// gCodeGenSetupMutex must be held until the pipeline has been built.
+void publishCodeGenSettings(llvm::CodeGenOpt::Level pOptLevel,
+                            bool pEnableGlobalMerge) {
+  // Adjust register allocation policy according to the optimization level.
+  //  createFastRegisterAllocator: fast but bad quality
+  //  createLinearScanRegisterAllocator: not so fast but good quality
+  if (pOptLevel == llvm::CodeGenOpt::None) {
+    llvm::RegisterRegAlloc::setDefault(llvm::createFastRegisterAllocator);
+  } else {
+    llvm::RegisterRegAlloc::setDefault(llvm::createGreedyRegisterAllocator);
+  }
+
+#if defined(PROVIDE_ARM_CODEGEN)
+  EnableGlobalMerge = pEnableGlobalMerge;
+#endif
+}
+
+// Closes a phase of the transform pipeline for BuildStats (if given) and
+// the trace, and opens the trace section of the next phase, if any. The
+// legacy pass manager runs module passes strictly in order, so the time
+// between two markers is the time spent in the passes added between them.
+class PhaseMarkerPass : public llvm::ModulePass {
+private:
+  bcc::BuildStats *mStats;
+  const char *mPhase;
+  bool mTrace;
+  const char *mNextPhase;
+
+public:
+  static char ID;
+
+  PhaseMarkerPass(bcc::BuildStats *pStats, const char *pPhase, bool pTrace)
+      : ModulePass(ID), mStats(pStats), mPhase(pPhase), mTrace(pTrace),
+        mNextPhase(nullptr) { }
+
+  void setNextPhase(const char *pPhase) { mNextPhase = pPhase; }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+  }
+
+  bool runOnModule(llvm::Module &M) override {
+    if (mStats != nullptr) {
+      mStats->endPhase(mPhase);
+    }
+    if (mTrace) {
+      bcc::endTraceSection();
+      if (mNextPhase != nullptr) {
+        bcc::beginTraceSection(mNextPhase);
+      }
+    }
+    return false;
+  }
+};
+
+char PhaseMarkerPass::ID = 0;
+
+// Added at each phase boundary of the transform pipeline of a compile() that
+// may be cancelled (see Compiler::setCancellationFlag()). The legacy pass
+// manager can't stop early, so once cancelled the first one drops the bodies
+// of the module's functions, leaving nothing for the remaining passes to do.
+class CancellationPointPass : public llvm::ModulePass {
+private:
+  const std::atomic<bool> *mCancelled;
+
+public:
+  static char ID;
+
+  explicit CancellationPointPass(const std::atomic<bool> *pCancelled)
+      : ModulePass(ID), mCancelled(pCancelled) { }
+
+  bool runOnModule(llvm::Module &M) override {
+    if (!mCancelled->load()) {
+      return false;
+    }
+    bool changed = false;
+    for (llvm::Function &F : M) {
+      if (!F.isDeclaration()) {
+        F.deleteBody();
+        changed = true;
+      }
+    }
+    return changed;
+  }
+};
+
+char CancellationPointPass::ID = 0;
+
+// Added after the code generation passes, which leave each MachineFunction
+// alive until its last user is done, to record the final machine code
+// statistics of the expanded functions.
+class KernelReportPass : public llvm::MachineFunctionPass {
+private:
+  bcc::BuildStats *mStats;
+
+public:
+  static char ID;
+
+  explicit KernelReportPass(bcc::BuildStats *pStats)
+      : MachineFunctionPass(ID), mStats(pStats) { }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+    MachineFunctionPass::getAnalysisUsage(AU);
+  }
+
+  bool runOnMachineFunction(llvm::MachineFunction &MF) override {
+    if (MF.getName().find(".expand") == llvm::StringRef::npos) {
+      return false;
+    }
+
+    const llvm::MachineFrameInfo *MFI = MF.getFrameInfo();
+    bcc::BuildStats::KernelCodeStats stats = {
+      MF.getName(), MFI->getStackSize(), 0, 0, 0
+    };
+    for (const llvm::MachineBasicBlock &MBB : MF) {
+      for (const llvm::MachineInstr &MI : MBB) {
+        if (MI.isDebugValue() || MI.isCFIInstruction() || MI.isLabel() ||
+            MI.isKill() || MI.isImplicitDef()) {
+          continue;
+        }
+        stats.mInstructions++;
+
+        // As for the "Spill" and "Reload" comments of verbose assembly: an
+        // access to a spill slot, which the memory operands still record.
+        for (const llvm::MachineMemOperand *MMO : MI.memoperands()) {
+          const auto *PSV =
+              llvm::dyn_cast_or_null<llvm::FixedStackPseudoSourceValue>(
+                  MMO->getPseudoValue());
+          if (PSV == nullptr ||
+              !MFI->isSpillSlotObjectIndex(PSV->getFrameIndex())) {
+            continue;
+          }
+          if (MMO->isStore()) {
+            stats.mSpills++;
+          } else if (MMO->isLoad()) {
+            stats.mReloads++;
+          }
+          break;
+        }
+      }
+    }
+    mStats->addKernelCodeStats(stats);
+    return false;
+  }
+};
+
+char KernelReportPass::ID = 0;
+
+// Added last to the code generation passes for streaming code generation:
+// drops the IR of each function once its machine code has been emitted.
+// Since this pass doesn't preserve the MachineFunction, the pass manager then
+// frees that too, so neither outlives the emission of the function. The
+// linkage is kept, as the functions emitted later may still refer to the
+// symbol, whose name depends on it.
+class ReleaseFunctionIRPass : public llvm::FunctionPass {
+public:
+  static char ID;
+
+  ReleaseFunctionIRPass() : FunctionPass(ID) { }
+
+  bool runOnFunction(llvm::Function &F) override {
+    // Blocks whose address is taken may still be referred to from elsewhere.
+    for (const llvm::BasicBlock &BB : F) {
+      if (BB.hasAddressTaken()) {
+        return false;
+      }
+    }
+    F.dropAllReferences();
+    return true;
+  }
+};
+
+char ReleaseFunctionIRPass::ID = 0;
+
+// Writes the IR of the selected functions (or of the whole module if none
+// are selected) to a file, and records their instruction counts in
+// BuildStats (if given). See Compiler::setIRDump().
+class IRDumpPass : public llvm::ModulePass {
+private:
+  const char *mPoint;
+  std::string mPath;
+  std::vector<std::string> mKernels;
+  bcc::BuildStats *mStats;
+
+  bool isSelected(llvm::StringRef pName) const {
+    if (mKernels.empty()) {
+      return true;
+    }
+    for (const std::string &kernel : mKernels) {
+      if (pName == kernel ||
+          (pName.startswith(kernel) && pName.size() > kernel.size() &&
+           pName[kernel.size()] == '.')) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  static char ID;
+
+  IRDumpPass(const char *pPoint, const std::string &pPath,
+             const std::vector<std::string> &pKernels, bcc::BuildStats *pStats)
+      : ModulePass(ID), mPoint(pPoint), mPath(pPath), mKernels(pKernels),
+        mStats(pStats) { }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+  }
+
+  bool runOnModule(llvm::Module &M) override {
+    if (!mPath.empty()) {
+      std::error_code EC;
+      llvm::raw_fd_ostream out(mPath, EC, llvm::sys::fs::F_Text);
+      if (EC) {
+        ALOGW("Unable to write the IR to %s (%s)", mPath.c_str(),
+              EC.message().c_str());
+      } else if (mKernels.empty()) {
+        M.print(out, nullptr);
+      } else {
+        for (llvm::Function &F : M) {
+          if (!F.isDeclaration() && isSelected(F.getName())) {
+            F.print(out);
+          }
+        }
+      }
+    }
+
+    if (mStats != nullptr) {
+      for (llvm::Function &F : M) {
+        if (F.isDeclaration() || !isSelected(F.getName())) {
+          continue;
+        }
+        unsigned instructions = 0;
+        for (const llvm::BasicBlock &BB : F) {
+          instructions += BB.size();
+        }
+        mStats->addIRSize({ mPoint, F.getName(), instructions });
+      }
+    }
+    return false;
+  }
+};
+
+char IRDumpPass::ID = 0;
+
+// Collects the optimization remarks about the functions of a script while it
+// is alive, as the diagnostic handler of the script's context, in the YAML
+// form of LLVM's optimization records. Other diagnostics go to the handler
+// it replaced, or to the log if there was none.
+class RemarkCollector {
+private:
+  llvm::LLVMContext &mContext;
+  llvm::LLVMContext::DiagnosticHandlerTy mOldHandler;
+  void *mOldContext;
+  const std::set<std::string> &mScriptFunctions;
+  std::string mRemarks;
+  llvm::raw_string_ostream mOut;
+
+  static void Handle(const llvm::DiagnosticInfo &pInfo, void *pCollector) {
+    static_cast<RemarkCollector *>(pCollector)->handle(pInfo);
+  }
+
+  // The YAML tag of a remark of pKind, or nullptr if pKind isn't a remark.
+  static const char *GetRemarkTag(int pKind) {
+    switch (pKind) {
+    case llvm::DK_OptimizationRemark:
+      return "Passed";
+    case llvm::DK_OptimizationRemarkMissed:
+      return "Missed";
+    case llvm::DK_OptimizationRemarkAnalysis:
+    case llvm::DK_OptimizationRemarkAnalysisFPCommute:
+    case llvm::DK_OptimizationRemarkAnalysisAliasing:
+      return "Analysis";
+    case llvm::DK_OptimizationFailure:
+      return "Failure";
+    default:
+      return nullptr;
+    }
+  }
+
+  // Whether pName is a function of the script, or was made from one (such
+  // as "root.expand" from "root").
+  bool isScriptFunction(llvm::StringRef pName) const {
+    if (mScriptFunctions.empty()) {
+      return true;
+    }
+    return mScriptFunctions.count(pName) != 0 ||
+           mScriptFunctions.count(pName.split('.').first) != 0;
+  }
+
+  void writeQuoted(llvm::StringRef pValue) {
+    mOut << '\'';
+    for (char c : pValue) {
+      if (c == '\'') {
+        mOut << '\'';
+      }
+      mOut << c;
+    }
+    mOut << '\'';
+  }
+
+  void handle(const llvm::DiagnosticInfo &pInfo) {
+    const char *tag = GetRemarkTag(pInfo.getKind());
+    if (tag == nullptr) {
+      forward(pInfo);
+      return;
+    }
+
+    const auto &remark =
+        static_cast<const llvm::DiagnosticInfoOptimizationBase &>(pInfo);
+    const llvm::Function &F = remark.getFunction();
+    if (!isScriptFunction(F.getName())) {
+      return;
+    }
+
+    mOut << "--- !" << tag << "\nPass:            ";
+    writeQuoted(remark.getPassName());
+    if (remark.isLocationAvailable()) {
+      llvm::StringRef file;
+      unsigned line = 0, column = 0;
+      remark.getLocation(&file, &line, &column);
+      mOut << "\nDebugLoc:        { File: ";
+      writeQuoted(file);
+      mOut << ", Line: " << line << ", Column: " << column << " }";
+    }
+    mOut << "\nFunction:        ";
+    writeQuoted(F.getName());
+    mOut << "\nMessage:         ";
+    writeQuoted(remark.getMsg().str());
+    mOut << "\n...\n";
+  }
+
+  void forward(const llvm::DiagnosticInfo &pInfo) {
+    if (mOldHandler != nullptr) {
+      mOldHandler(pInfo, mOldContext);
+      return;
+    }
+
+    std::string message;
+    llvm::raw_string_ostream stream(message);
+    llvm::DiagnosticPrinterRawOStream printer(stream);
+    pInfo.print(printer);
+    stream.flush();
+    switch (pInfo.getSeverity()) {
+    case llvm::DS_Error:
+      ALOGE("%s", message.c_str());
+      break;
+    case llvm::DS_Warning:
+      ALOGW("%s", message.c_str());
+      break;
+    default:
+      ALOGV("%s", message.c_str());
+      break;
+    }
+  }
+
+public:
+  RemarkCollector(llvm::LLVMContext &pContext,
+                  const std::set<std::string> &pScriptFunctions)
+      : mContext(pContext), mOldHandler(pContext.getDiagnosticHandler()),
+        mOldContext(pContext.getDiagnosticContext()),
+        mScriptFunctions(pScriptFunctions), mOut(mRemarks) {
+    // Remarks are only shown when asked for with -pass-remarks and the like,
+    // but all of them are wanted here.
+    mContext.setDiagnosticHandler(Handle, this, /* RespectFilters */false);
+  }
+
+  ~RemarkCollector() {
+    mContext.setDiagnosticHandler(mOldHandler, mOldContext);
+  }
+
+  // Write the remarks collected so far to pPath.
+  void write(const std::string &pPath) {
+    std::error_code EC;
+    llvm::raw_fd_ostream out(pPath, EC, llvm::sys::fs::F_Text);
+    if (EC) {
+      ALOGW("Unable to write the optimization remarks to %s (%s)",
+            pPath.c_str(), EC.message().c_str());
+      return;
+    }
+    out << mOut.str();
+  }
+};
+
+// Returns the name of the kernel the expanded function pName was generated
+// from, or an empty string if pName isn't an expanded function.
+llvm::StringRef getExpandedKernelName(llvm::StringRef pName) {
+  static const llvm::StringRef kSuffixes[] = { ".expand", ".expand.tiled" };
+  for (llvm::StringRef suffix : kSuffixes) {
+    if (pName.endswith(suffix)) {
+      return pName.drop_back(suffix.size());
+    }
+  }
+  return llvm::StringRef();
+}
+
+// Record every expanded function that still calls its kernel after LTO,
+// i.e. whose kernel the inliner left out of line. Such a kernel costs a call
+// per element, which is usually a large slowdown.
+void reportMissedKernelInlines(llvm::Module &pModule, bcc::BuildStats *pStats) {
+  for (llvm::Function &function : pModule) {
+    llvm::StringRef kernel_name = getExpandedKernelName(function.getName());
+    if (kernel_name.empty()) {
+      continue;
+    }
+
+    bool missed = false;
+    for (llvm::BasicBlock &block : function) {
+      for (llvm::Instruction &inst : block) {
+        llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+        llvm::Function *callee = call ? call->getCalledFunction() : nullptr;
+        if (callee && callee->getName() == kernel_name) {
+          missed = true;
+        }
+      }
+    }
+
+    if (missed) {
+      ALOGW("Kernel %s was not inlined into %s", kernel_name.str().c_str(),
+            function.getName().str().c_str());
+      if (pStats != nullptr) {
+        pStats->addMissedInline(function.getName());
+      }
+    }
+  }
+}
+
+// The SLP vectorizer has no per-pass threshold; it reads the process-wide
+// -slp-threshold option while it runs. Returns nullptr if the option isn't
+// registered.
+llvm::cl::opt<int> *getSLPThresholdOption() {
+  static llvm::cl::opt<int> *option = []() -> llvm::cl::opt<int> * {
+    llvm::StringMap<llvm::cl::Option *> &options =
+        llvm::cl::getRegisteredOptions();
+    auto found = options.find("slp-threshold");
+    if (found == options.end()) {
+      return nullptr;
+    }
+    return static_cast<llvm::cl::opt<int> *>(found->second);
+  }();
+  return option;
+}
+
+// Pass pipeline runs that need different -slp-threshold values take turns,
+// while runs that agree on the value share it.
+std::mutex gSLPThresholdMutex;
+std::condition_variable gSLPThresholdReleased;
+unsigned gSLPThresholdUsers = 0;
+
+// Publishes the SLP vectorizer threshold of a pass pipeline run and keeps it
+// in effect until destroyed. With no threshold, falls back to the value the
+// option had before bcc first changed it.
+class SLPThresholdScope {
+  llvm::cl::opt<int> *mOption;
+
+public:
+  explicit SLPThresholdScope(llvm::Optional<int> pThreshold)
+      : mOption(getSLPThresholdOption()) {
+    if (mOption == nullptr) {
+      return;
+    }
+    static const int default_threshold = mOption->getValue();
+    int threshold = pThreshold.hasValue() ? *pThreshold : default_threshold;
+
+    std::unique_lock<std::mutex> lock(gSLPThresholdMutex);
+    gSLPThresholdReleased.wait(lock, [&]() {
+      return gSLPThresholdUsers == 0 || mOption->getValue() == threshold;
+    });
+    mOption->setValue(threshold);
+    ++gSLPThresholdUsers;
+  }
+
+  ~SLPThresholdScope() {
+    if (mOption == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(gSLPThresholdMutex);
+    if (--gSLPThresholdUsers == 0) {
+      gSLPThresholdReleased.notify_all();
+    }
+  }
+};
+
 // Name of metadata node where list of exported types resides
 // (should be synced with slang_rs_metadata.h)
 static const llvm::StringRef ExportedTypeMetadataName = "#rs_export_type";
@@ -111,6 +642,186 @@ bool validateLayoutOfExportedTypes(const llvm::Module &module,
   return allOk;
 }
 
+// Build the key identifying the TargetMachine created for pConfig in
+// Compiler::mTargetPool.
+std::string getTargetMachineKey(const bcc::CompilerConfig &pConfig) {
+  std::string key;
+  llvm::raw_string_ostream os(key);
+  llvm::Optional<llvm::Reloc::Model> reloc = pConfig.getRelocationModel();
+  os << pConfig.getTriple() << '|'
+     << pConfig.getCPU() << '|'
+     << pConfig.getFeatureString() << '|'
+     << static_cast<int>(pConfig.getOptimizationLevel()) << '|'
+     << (reloc.hasValue() ? static_cast<int>(*reloc) : -1) << '|'
+     << static_cast<int>(pConfig.getCodeModel()) << '|'
+     << static_cast<int>(pConfig.getTargetOptions().FloatABIType) << '|'
+     << pConfig.getTargetOptions().FunctionSections << '|'
+     << pConfig.getTargetOptions().DataSections;
+  return os.str();
+}
+
+
+// Return the runtime function named pName if it is in the stub white list,
+// or nullptr.
+const char *findRuntimeFunction(const std::string &pName) {
+  const char *const *end = stubList + stubListSize;
+  const char *const *lower = std::lower_bound(
+      stubList, end, pName, [](const char *pEntry, const std::string &pKey) {
+        return strcmp(pEntry, pKey.c_str()) < 0;
+      });
+  return (lower != end && pName == *lower) ? *lower : nullptr;
+}
+
+// Map the scalar float native_* and half_* runtime functions to their
+// float2 and float4 variants, so that the loop vectorizer can call them for
+// several cells at once. The geometric functions are left out: their vector
+// variants are not elementwise.
+const std::vector<llvm::VecDesc> &getRuntimeVectorFunctions() {
+  static const std::vector<llvm::VecDesc> functions = []() {
+    static const char *const kNotElementwise[] = {
+      "native_distance", "native_length", "native_normalize",
+    };
+    static const unsigned kWidths[] = { 2, 4 };
+
+    std::vector<llvm::VecDesc> result;
+    for (size_t i = 0; i < stubListSize; ++i) {
+      // Itanium mangling: "_Z" <length> <name> <parameters>.
+      const char *scalar = stubList[i];
+      if (strncmp(scalar, "_Z", 2) != 0) {
+        continue;
+      }
+      char *name = nullptr;
+      unsigned long length = strtoul(scalar + 2, &name, 10);
+      if (length == 0 || strlen(name) < length) {
+        continue;
+      }
+      std::string base(name, length);
+      std::string params(name + length);
+      if (base.compare(0, 7, "native_") != 0 &&
+          base.compare(0, 5, "half_") != 0) {
+        continue;
+      }
+      if (std::find(std::begin(kNotElementwise), std::end(kNotElementwise),
+                    base) != std::end(kNotElementwise)) {
+        continue;
+      }
+      if (params != "f" && params != "ff") {
+        continue;
+      }
+
+      std::string prefix(scalar, name + length - scalar);
+      for (unsigned width : kWidths) {
+        std::string vector = prefix + "Dv" + std::to_string(width) + "_f";
+        if (params == "ff") {
+          vector += "S_";
+        }
+        if (const char *found = findRuntimeFunction(vector)) {
+          result.push_back({scalar, found, width});
+        }
+      }
+    }
+    return result;
+  }();
+  return functions;
+}
+
+// Whether pName is the float2 or float4 variant of a runtime math function
+// in getRuntimeVectorFunctions().
+bool isRuntimeVectorFunction(llvm::StringRef pName) {
+  static const std::set<std::string> names = []() {
+    std::set<std::string> result;
+    for (const llvm::VecDesc &desc : getRuntimeVectorFunctions()) {
+      result.insert(desc.VectorFnName);
+    }
+    return result;
+  }();
+  return names.count(pName.str()) != 0;
+}
+
+// The values of pModule's llvm.compiler.used list, in order.
+std::vector<llvm::GlobalValue *> getCompilerUsed(llvm::Module &pModule) {
+  std::vector<llvm::GlobalValue *> result;
+  llvm::GlobalVariable *used = pModule.getGlobalVariable("llvm.compiler.used");
+  if (used == nullptr || !used->hasInitializer()) {
+    return result;
+  }
+  const llvm::ConstantArray *values =
+      llvm::dyn_cast<llvm::ConstantArray>(used->getInitializer());
+  if (values == nullptr) {
+    return result;
+  }
+  for (const llvm::Use &value : values->operands()) {
+    result.push_back(llvm::cast<llvm::GlobalValue>(value->stripPointerCasts()));
+  }
+  return result;
+}
+
+// Replace pModule's llvm.compiler.used list by pValues.
+void setCompilerUsed(llvm::Module &pModule,
+                     const std::vector<llvm::GlobalValue *> &pValues) {
+  if (llvm::GlobalVariable *used = pModule.getGlobalVariable("llvm.compiler.used")) {
+    used->eraseFromParent();
+  }
+  if (pValues.empty()) {
+    return;
+  }
+  llvm::PointerType *int8PtrTy = llvm::Type::getInt8PtrTy(pModule.getContext());
+  std::vector<llvm::Constant *> values;
+  for (llvm::GlobalValue *value : pValues) {
+    values.push_back(
+        llvm::ConstantExpr::getPointerBitCastOrAddrSpaceCast(value, int8PtrTy));
+  }
+  llvm::ArrayType *type = llvm::ArrayType::get(int8PtrTy, values.size());
+  llvm::GlobalVariable *used =
+      new llvm::GlobalVariable(pModule, type, /* isConstant */false,
+                               llvm::GlobalValue::AppendingLinkage,
+                               llvm::ConstantArray::get(type, values),
+                               "llvm.compiler.used");
+  used->setSection("llvm.metadata");
+}
+
+// Whether declareRuntimeVectorFunctions() made pModule keep any vector
+// variants.
+bool keepsRuntimeVectorFunctions(llvm::Module &pModule) {
+  std::vector<llvm::GlobalValue *> used = getCompilerUsed(pModule);
+  return std::any_of(used.begin(), used.end(),
+                     [](const llvm::GlobalValue *pValue) {
+    return isRuntimeVectorFunction(pValue->getName());
+  });
+}
+
+// Added once the vectorizer has run, to undo
+// Compiler::declareRuntimeVectorFunctions(): the vector variants no longer
+// need to be kept, and are internal to the script like the rest of the
+// runtime library linked into it. Global DCE then drops the unused ones.
+class ReleaseRuntimeVectorFunctionsPass : public llvm::ModulePass {
+public:
+  static char ID;
+
+  ReleaseRuntimeVectorFunctionsPass() : ModulePass(ID) { }
+
+  bool runOnModule(llvm::Module &M) override {
+    std::vector<llvm::GlobalValue *> used = getCompilerUsed(M);
+    auto released = std::stable_partition(used.begin(), used.end(),
+                                          [](const llvm::GlobalValue *pValue) {
+      return !isRuntimeVectorFunction(pValue->getName());
+    });
+    if (released == used.end()) {
+      return false;
+    }
+    for (auto I = released; I != used.end(); ++I) {
+      if (!(*I)->isDeclaration()) {
+        (*I)->setLinkage(llvm::GlobalValue::InternalLinkage);
+      }
+    }
+    used.erase(released, used.end());
+    setCompilerUsed(M, used);
+    return true;
+  }
+};
+
+char ReleaseRuntimeVectorFunctionsPass::ID = 0;
+
 }  // end unnamed namespace
 
 using namespace bcc;
@@ -147,6 +858,10 @@ const char *Compiler::GetErrorString(enum ErrorCode pErrCode) {
     return "Invalid/unexpected llvm::TargetMachine.";
   case kErrInvalidLayout:
     return "Invalid layout (RenderScript ABI and native ABI are incompatible)";
+  case kErrInvalidProfile:
+    return "Failed to read the profile for profile-guided optimization.";
+  case kErrCancelled:
+    return "The build was cancelled.";
   }
 
   // This assert should never be reached as the compiler verifies that the
@@ -155,15 +870,48 @@ const char *Compiler::GetErrorString(enum ErrorCode pErrCode) {
   return  "";
 }
 
+const char *Compiler::GetIRDumpPointName(IRDumpPoint pPoint) {
+  switch (pPoint) {
+  case kIRDumpAfterExpand:
+    return "after-expand";
+  case kIRDumpAfterLTO:
+    return "after-lto";
+  case kIRDumpBeforeCodeGen:
+    return "before-codegen";
+  case kIRDumpAllPoints:
+    break;
+  }
+
+  bccAssert(false && "Unknown IR dump point");
+  return "";
+}
+
 //===----------------------------------------------------------------------===//
 // Instance Methods
 //===----------------------------------------------------------------------===//
-Compiler::Compiler() : mTarget(nullptr), mEnableOpt(true) {
+Compiler::Compiler() : mTarget(nullptr), mEnableOpt(true),
+                       mEnableGlobalMerge(true), mEnableGlobalLayout(true),
+                       mStats(nullptr),
+                       mKernelReport(false), mStreamingCodeGen(false),
+                       mCancelled(nullptr),
+                       mMemoryFallback(kNoMemoryFallback),
+                       mIRDumpPoints(0), mIRDumpFiles(false),
+                       mIRCountInstructions(false) {
   return;
 }
 
 Compiler::Compiler(const CompilerConfig &pConfig) : mTarget(nullptr),
-                                                    mEnableOpt(true) {
+                                                    mEnableOpt(true),
+                                                    mEnableGlobalMerge(true),
+                                                    mEnableGlobalLayout(true),
+                                                    mStats(nullptr),
+                                                    mKernelReport(false),
+                                                    mStreamingCodeGen(false),
+                                                    mCancelled(nullptr),
+                                                    mMemoryFallback(kNoMemoryFallback),
+                                                    mIRDumpPoints(0),
+                                                    mIRDumpFiles(false),
+                                                    mIRCountInstructions(false) {
   const std::string &triple = pConfig.getTriple();
 
   enum ErrorCode err = config(pConfig);
@@ -181,7 +929,20 @@ enum Compiler::ErrorCode Compiler::config(const CompilerConfig &pConfig) {
     return kInvalidConfigNoTarget;
   }
 
-  llvm::TargetMachine *new_target =
+  std::string key = getTargetMachineKey(pConfig);
+
+  llvm::TargetMachine *new_target = nullptr;
+  for (auto I = mTargetPool.begin(), E = mTargetPool.end(); I != E; ++I) {
+    if (I->first == key) {
+      // Move the entry to the most recently used position.
+      new_target = I->second;
+      mTargetPool.erase(I);
+      break;
+    }
+  }
+
+  if (new_target == nullptr) {
+    new_target =
       (pConfig.getTarget())->createTargetMachine(pConfig.getTriple(),
                                                  pConfig.getCPU(),
                                                  pConfig.getFeatureString(),
@@ -190,81 +951,208 @@ enum Compiler::ErrorCode Compiler::config(const CompilerConfig &pConfig) {
                                                  pConfig.getCodeModel(),
                                                  pConfig.getOptimizationLevel());
 
-  if (new_target == nullptr) {
-    return ((mTarget != nullptr) ? kErrSwitchTargetMachine :
-                                   kErrCreateTargetMachine);
+    if (new_target == nullptr) {
+      return ((mTarget != nullptr) ? kErrSwitchTargetMachine :
+                                     kErrCreateTargetMachine);
+    }
+
+    if (mTargetPool.size() >= kMaxPooledTargetMachines) {
+      // Evict the least recently used TargetMachine. It can't be mTarget,
+      // which is always the most recently used one.
+      delete mTargetPool.front().second;
+      mTargetPool.erase(mTargetPool.begin());
+    }
   }
 
-  // Replace the old TargetMachine.
-  delete mTarget;
+  mTargetPool.emplace_back(key, new_target);
   mTarget = new_target;
 
-  // Adjust register allocation policy according to the optimization level.
-  //  createFastRegisterAllocator: fast but bad quality
-  //  createLinearScanRegisterAllocator: not so fast but good quality
-  if ((pConfig.getOptimizationLevel() == llvm::CodeGenOpt::None)) {
-    llvm::RegisterRegAlloc::setDefault(llvm::createFastRegisterAllocator);
-  } else {
-    llvm::RegisterRegAlloc::setDefault(llvm::createGreedyRegisterAllocator);
-  }
+  // Parallel code generation creates one TargetMachine per worker thread.
+  mCodeGenConfig.reset(new CompilerConfig(pConfig));
 
   return kSuccess;
 }
 
 Compiler::~Compiler() {
-  delete mTarget;
+  for (auto &entry : mTargetPool) {
+    delete entry.second;
+  }
 }
 
 
+bool Compiler::addIRDumpPass(llvm::legacy::PassManager &pPM,
+                             IRDumpPoint pPoint) {
+  if ((mIRDumpPoints & pPoint) == 0) {
+    return false;
+  }
+  const char *name = GetIRDumpPointName(pPoint);
+  std::string path;
+  if (mIRDumpFiles && !mIRDumpPathPrefix.empty()) {
+    path = mIRDumpPathPrefix + "." + name + ".ll";
+  }
+  BuildStats *stats = mIRCountInstructions ? mStats : nullptr;
+  if (path.empty() && stats == nullptr) {
+    return false;
+  }
+  pPM.add(new IRDumpPass(name, path, mIRDumpKernels, stats));
+  return true;
+}
+
 // This function has complete responsibility for creating and executing the
 // exact list of compiler passes.
-enum Compiler::ErrorCode Compiler::runPasses(Script &script,
-                                             llvm::raw_pwrite_stream &pResult) {
+enum Compiler::ErrorCode
+Compiler::runPasses(Script &script,
+                    llvm::ArrayRef<llvm::raw_pwrite_stream *> pResults,
+                    bool pKeepIR) {
   // Pass manager for link-time optimization
   llvm::legacy::PassManager transformPasses;
 
-  // Empty MCContext.
-  llvm::MCContext *mc_context = nullptr;
-
   transformPasses.add(
       createTargetTransformInfoWrapperPass(mTarget->getTargetIRAnalysis()));
 
+  // Only time and trace the pipeline if asked to; the markers are otherwise
+  // no-ops. Each marker opens the trace section of the phase after it, and
+  // the section of the first phase is opened before the passes run.
+  const bool trace = isTraceEnabled();
+  const char *first_phase = nullptr;
+  PhaseMarkerPass *last_marker = nullptr;
+  auto endPhase = [this, trace, &transformPasses, &first_phase,
+                   &last_marker](const char *pPhase) {
+    if (mCancelled != nullptr) {
+      transformPasses.add(new CancellationPointPass(mCancelled));
+    }
+    if (mStats == nullptr && !trace) {
+      return;
+    }
+    if (last_marker != nullptr) {
+      last_marker->setNextPhase(pPhase);
+    } else {
+      first_phase = pPhase;
+    }
+    last_marker = new PhaseMarkerPass(mStats, pPhase, trace);
+    transformPasses.add(last_marker);
+  };
+
+  // The custom passes below share the RenderScript metadata cached by the
+  // source instead of each extracting it again.
+  Source &source = script.getSource();
+  if (!source.extractMetadata()) {
+    ALOGE("Could not extract metadata for module!");
+    return kErrCustomPasses;
+  }
+
+  // Optimized debug builds are meant to be profiled, so keep the frame
+  // pointers that stack unwinding relies on.
+  if (script.getOptimizedDebug()) {
+    for (llvm::Function &F : source.getModule()) {
+      if (!F.isDeclaration()) {
+        F.addFnAttr("no-frame-pointer-elim", "true");
+      }
+    }
+  }
+
+  // Tell the loop vectorizer about the vector variants of the imprecise math
+  // functions for scripts that are not bound to full precision.
+  const bool relaxed =
+      source.getMetadata()->getRSFloatPrecision() != bcinfo::RS_FP_Full;
+  if (relaxed) {
+    llvm::TargetLibraryInfoImpl TLII(mTarget->getTargetTriple());
+    TLII.addVectorizableFunctions(getRuntimeVectorFunctions());
+    transformPasses.add(new llvm::TargetLibraryInfoWrapperPass(TLII));
+  }
+  // See declareRuntimeVectorFunctions().
+  const bool keepsVectorFunctions =
+      keepsRuntimeVectorFunctions(source.getModule());
+
   // Add some initial custom passes.
   addInvokeHelperPass(transformPasses);
-  addExpandKernelPass(transformPasses);
+  addExpandKernelPass(script, transformPasses);
   addDebugInfoPass(script, transformPasses);
+  endPhase("kernel-expand");
+  // The dumps get phases of their own, so that they aren't taken for time
+  // spent optimizing.
+  if (addIRDumpPass(transformPasses, kIRDumpAfterExpand)) {
+    endPhase("ir-dump");
+  }
   addInvariantPass(transformPasses);
+  endPhase("invariant");
   if (mTarget->getOptLevel() != llvm::CodeGenOpt::None) {
     if (!addInternalizeSymbolsPass(script, transformPasses))
       return kErrCustomPasses;
+    endPhase("internalize");
   }
   addGlobalInfoPass(script, transformPasses);
+  endPhase("global-info");
 
   if (mTarget->getOptLevel() == llvm::CodeGenOpt::None) {
     transformPasses.add(llvm::createGlobalOptimizerPass());
     transformPasses.add(llvm::createConstantMergePass());
+    endPhase("global-opt");
+
+    // Nothing gets vectorized (the memory budget may have dropped the
+    // optimization level after the runtime was linked).
+    if (keepsVectorFunctions) {
+      transformPasses.add(new ReleaseRuntimeVectorFunctionsPass());
+      transformPasses.add(llvm::createGlobalDCEPass());
+      endPhase("vectorize-cleanup");
+    }
 
   } else {
-    // FIXME: Figure out which passes should be executed.
-    llvm::PassManagerBuilder Builder;
-    Builder.Inliner = llvm::createFunctionInliningPass();
-    Builder.populateLTOPassManager(transformPasses);
-
-    /* FIXME: Reenable autovectorization after rebase.
-       bug 19324423
-    // Add vectorization passes after LTO passes are in
-    // additional flag: -unroll-runtime
-    transformPasses.add(llvm::createLoopUnrollPass(-1, 16, 0, 1));
-    // Need to pass appropriate flags here: -scalarize-load-store
-    transformPasses.add(llvm::createScalarizerPass());
-    transformPasses.add(llvm::createCFGSimplificationPass());
-    transformPasses.add(llvm::createScopedNoAliasAAPass());
-    transformPasses.add(llvm::createScalarEvolutionAliasAnalysisPass());
-    // additional flags: -slp-vectorize-hor -slp-vectorize-hor-store (unnecessary?)
-    transformPasses.add(llvm::createSLPVectorizerPass());
-    transformPasses.add(llvm::createDeadCodeEliminationPass());
-    transformPasses.add(llvm::createInstructionCombiningPass());
-    */
+    if (!mProfileGeneratePath.empty() || !mProfileUsePath.empty()) {
+      if (!addProfilePasses(transformPasses))
+        return kErrInvalidProfile;
+      endPhase("pgo");
+    }
+
+    if (mMemoryFallback < kSkipLTO) {
+      // FIXME: Figure out which passes should be executed.
+      llvm::PassManagerBuilder Builder;
+      Builder.Inliner = (mMemoryFallback == kReduceInlining) ?
+          llvm::createFunctionInliningPass(kReducedInlineThreshold) :
+          llvm::createFunctionInliningPass();
+      Builder.populateLTOPassManager(transformPasses);
+      endPhase("lto");
+      if (addIRDumpPass(transformPasses, kIRDumpAfterLTO)) {
+        endPhase("ir-dump");
+      }
+
+      // The debug runtime checks each allocation access; check the accesses
+      // of the (now inlined) kernels once per loop instead, and split the
+      // loops on the outcome.
+      if (script.getDebugContext()) {
+        transformPasses.add(createRSHoistBoundsChecksPass());
+        transformPasses.add(llvm::createLoopUnswitchPass());
+        transformPasses.add(llvm::createCFGSimplificationPass());
+        endPhase("bounds-checks");
+      }
+    }
+
+    // Add vectorization passes after LTO passes are in.
+    if (mCodeGenConfig && mCodeGenConfig->getAutoVectorize() &&
+        mMemoryFallback < kSkipLTO) {
+      addVectorizePasses(transformPasses, relaxed);
+      endPhase("vectorize");
+    }
+    if (keepsVectorFunctions) {
+      transformPasses.add(new ReleaseRuntimeVectorFunctionsPass());
+      transformPasses.add(llvm::createGlobalDCEPass());
+      endPhase("vectorize-cleanup");
+    }
+
+    // Fold functions that ended up identical, such as the .expand functions
+    // of kernels with the same signature once the kernels are inlined.
+    // Exported ones become thunks, so the driver still finds every symbol.
+    if (mCodeGenConfig && mCodeGenConfig->getOptimizeForSize()) {
+      transformPasses.add(llvm::createMergeFunctionsPass());
+      endPhase("merge-functions");
+    }
+
+    // Lay the globals out once the kernels are inlined into their expanded
+    // functions, so it is known which ones their loops read.
+    if (mEnableGlobalLayout) {
+      transformPasses.add(createRSGlobalLayoutPass());
+      endPhase("global-layout");
+    }
   }
 
   // These passes have to come after LTO, since we don't want to examine
@@ -272,35 +1160,222 @@ enum Compiler::ErrorCode Compiler::runPasses(Script &script,
   if (llvm::Triple(getTargetMachine().getTargetTriple()).getArch() == llvm::Triple::x86_64 ||
       llvm::Triple(getTargetMachine().getTargetTriple()).getArch() == llvm::Triple::mips64el)
     transformPasses.add(createRSX86_64CallConvPass());  // Add pass to correct calling convention for X86-64 and mips64.
-  transformPasses.add(createRSIsThreadablePass());      // Add pass to mark script as threadable.
+  transformPasses.add(createRSIsThreadablePass(source.getMetadata()));  // Add pass to mark script and kernels as threadable.
+  endPhase("threadability");
+
+  // Emit the per-CPU versions of the kernels once their threadability is
+  // known, since it looks the expanded functions up by name. splitCodeGen()
+  // cannot clone indirect functions, so parallel builds only get the
+  // default version.
+  if (mCodeGenConfig && !mCodeGenConfig->getKernelVariants().empty()) {
+    if (pResults.size() > 1) {
+      ALOGW("Kernel variants are not supported with parallel code generation");
+    } else {
+      transformPasses.add(createRSKernelMultiVersionPass(
+          mCodeGenConfig->getKernelVariants(),
+          mCodeGenConfig->getFeatureString(), source.getMetadata()));
+      endPhase("kernel-multiversion");
+    }
+  }
 
   // RSEmbedInfoPass needs to come after we have scanned for non-threadable
   // functions.
-  if (script.getEmbedInfo())
-    transformPasses.add(createRSEmbedInfoPass());
+  if (script.getEmbedInfo()) {
+    transformPasses.add(createRSEmbedInfoPass(source.getMetadata(),
+                                              script.getEmbedBinaryInfo()));
+    endPhase("embed-info");
+  }
+
+  if (addIRDumpPass(transformPasses, kIRDumpBeforeCodeGen)) {
+    endPhase("ir-dump");
+  }
 
   // Execute the passes.
-  transformPasses.run(script.getSource().getModule());
+  if (mStats != nullptr) {
+    mStats->beginPhases();
+  }
+  {
+    TraceScope trace_passes("bcc: optimize");
+    // The SLP vectorizer reads its threshold while the passes run.
+    std::unique_ptr<SLPThresholdScope> slp_threshold;
+    if (mCodeGenConfig && mCodeGenConfig->getAutoVectorize()) {
+      slp_threshold.reset(new SLPThresholdScope(
+          mCodeGenConfig->getSLPVectorizeThreshold()));
+    }
+    std::unique_ptr<RemarkCollector> remarks;
+    if (!mRemarksPath.empty()) {
+      remarks.reset(new RemarkCollector(source.getModule().getContext(),
+                                        script.getScriptFunctions()));
+    }
+    if (trace && first_phase != nullptr) {
+      beginTraceSection(first_phase);
+    }
+    transformPasses.run(source.getModule());
+    if (isCancelled()) {
+      return kErrCancelled;
+    }
+    if (remarks) {
+      remarks->write(mRemarksPath);
+    }
+  }
+  // At least RSIsThreadablePass added to the named metadata.
+  source.invalidateMetadata();
+  if (mTarget->getOptLevel() != llvm::CodeGenOpt::None) {
+    reportMissedKernelInlines(script.getSource().getModule(), mStats);
+  }
+
+  TraceScope trace_codegen("bcc: codegen");
+  BuildStats::Clock::time_point codegen_start = BuildStats::Clock::now();
+  if (pResults.size() > 1) {
+    if (mKernelReport) {
+      ALOGW("No kernel report is collected with parallel code generation");
+    }
+    enum ErrorCode err = runParallelCodeGen(script, pResults);
+    if (mStats != nullptr) {
+      mStats->addCodeGenTime(BuildStats::MillisecondsSince(codegen_start));
+    }
+    return err;
+  }
+  llvm::raw_pwrite_stream &pResult = *pResults.front();
 
   // Run backend separately to avoid interference between debug metadata
   // generation and backend initialization.
   llvm::legacy::PassManager codeGenPasses;
 
-  // Add passes to the pass manager to emit machine code through MC layer.
-  if (mTarget->addPassesToEmitMC(codeGenPasses, mc_context, pResult,
-                                 /* DisableVerify */false)) {
-    return kPrepareCodeGenPass;
+  // Empty MCContext.
+  llvm::MCContext *mc_context = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(gCodeGenSetupMutex);
+    publishCodeGenSettings(mTarget->getOptLevel(), mEnableGlobalMerge);
+
+    // Add passes to the pass manager to emit machine code through MC layer.
+    if (mTarget->addPassesToEmitMC(codeGenPasses, mc_context, pResult,
+                                   /* DisableVerify */false)) {
+      return kPrepareCodeGenPass;
+    }
+  }
+  if (mKernelReport && mStats != nullptr) {
+    codeGenPasses.add(new KernelReportPass(mStats));
+  }
+  // The debug info emitted at the end of the module still needs the
+  // functions.
+  const bool streaming = mStreamingCodeGen ||
+                         (mMemoryFallback != kNoMemoryFallback);
+  if (streaming && !pKeepIR && !script.getSource().getDebugInfoEnabled()) {
+    codeGenPasses.add(new ReleaseFunctionIRPass());
   }
 
   // Execute the passes.
   codeGenPasses.run(script.getSource().getModule());
 
+  if (mStats != nullptr) {
+    mStats->addCodeGenTime(BuildStats::MillisecondsSince(codegen_start));
+  }
+
+  return kSuccess;
+}
+
+enum Compiler::ErrorCode
+Compiler::runParallelCodeGen(Script &script,
+                             llvm::ArrayRef<llvm::raw_pwrite_stream *> pResults) {
+  bccAssert(mCodeGenConfig != nullptr);
+  const CompilerConfig &config = *mCodeGenConfig;
+
+  // Every worker thread code generates its partition with its own
+  // TargetMachine in its own LLVMContext.
+  auto createTargetMachine = [&config]() {
+    return std::unique_ptr<llvm::TargetMachine>(
+        config.getTarget()->createTargetMachine(config.getTriple(),
+                                                config.getCPU(),
+                                                config.getFeatureString(),
+                                                config.getTargetOptions(),
+                                                config.getRelocationModel(),
+                                                config.getCodeModel(),
+                                                config.getOptimizationLevel()));
+  };
+
+  // SplitModule() consumes the module it is given, whereas the Source may
+  // not own its module (e.g. for script groups), so hand it a copy. The
+  // original stays intact for the optional IR dump.
+  std::unique_ptr<llvm::Module> module =
+      llvm::CloneModule(&script.getSource().getModule());
+  if (module == nullptr) {
+    return kErrCustomPasses;
+  }
+
+  // The partitions all belong to the context of the module, so they are
+  // serialized here and parsed back by the workers into contexts of their
+  // own. Local symbols stay local: the partial objects are linked together
+  // afterwards and must not export anything new.
+  std::vector<std::string> bitcodes;
+  llvm::SplitModule(std::move(module), pResults.size(),
+                    [&bitcodes](std::unique_ptr<llvm::Module> pPart) {
+                      bitcodes.emplace_back();
+                      llvm::raw_string_ostream os(bitcodes.back());
+                      llvm::WriteBitcodeToFile(pPart.get(), os);
+                    },
+                    /* PreserveLocals */true);
+
+  const llvm::CodeGenOpt::Level opt_level = mTarget->getOptLevel();
+  const bool enable_global_merge = mEnableGlobalMerge;
+  // Not a vector<bool>: the threads set distinct elements concurrently.
+  std::vector<char> failed(bitcodes.size(), false);
+  auto codegen = [&](size_t i) {
+    llvm::LLVMContext context;
+    llvm::ErrorOr<std::unique_ptr<llvm::Module>> part = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(bitcodes[i], "<codegen-partition>"), context);
+    if (!part) {
+      failed[i] = true;
+      return;
+    }
+
+    std::unique_ptr<llvm::TargetMachine> target;
+    llvm::legacy::PassManager codeGenPasses;
+    {
+      // Only building the pipeline reads the process-wide settings, so the
+      // partitions are still code generated in parallel.
+      std::lock_guard<std::mutex> lock(gCodeGenSetupMutex);
+      target = createTargetMachine();
+      publishCodeGenSettings(opt_level, enable_global_merge);
+      if (target == nullptr ||
+          target->addPassesToEmitFile(codeGenPasses, *pResults[i],
+                                      llvm::TargetMachine::CGFT_ObjectFile)) {
+        failed[i] = true;
+        return;
+      }
+    }
+    codeGenPasses.run(**part);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < bitcodes.size(); i++) {
+    threads.emplace_back(codegen, i);
+  }
+  if (!bitcodes.empty()) {
+    codegen(0);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+    return kPrepareCodeGenPass;
+  }
   return kSuccess;
 }
 
 enum Compiler::ErrorCode Compiler::compile(Script &script,
                                            llvm::raw_pwrite_stream &pResult,
                                            llvm::raw_ostream *IRStream) {
+  llvm::raw_pwrite_stream *results[] = { &pResult };
+  return compile(script, results, IRStream);
+}
+
+enum Compiler::ErrorCode
+Compiler::compile(Script &script,
+                  llvm::ArrayRef<llvm::raw_pwrite_stream *> pResults,
+                  llvm::raw_ostream *IRStream) {
   llvm::Module &module = script.getSource().getModule();
   enum ErrorCode err;
 
@@ -354,7 +1429,16 @@ enum Compiler::ErrorCode Compiler::compile(Script &script,
     }
   }
 
-  if ((err = runPasses(script, pResult)) != kSuccess) {
+  if (pResults.empty()) {
+    return kErrPrepareOutput;
+  }
+
+  if (isCancelled()) {
+    return kErrCancelled;
+  }
+
+  if ((err = runPasses(script, pResults,
+                       /* pKeepIR */IRStream != nullptr)) != kSuccess) {
     return err;
   }
 
@@ -365,15 +1449,60 @@ enum Compiler::ErrorCode Compiler::compile(Script &script,
   return kSuccess;
 }
 
+enum Compiler::ErrorCode
+Compiler::compileSharedRuntime(llvm::Module &pModule,
+                               const std::set<std::string> &pExports,
+                               llvm::raw_pwrite_stream &pResult) {
+  if (mTarget == nullptr) {
+    return kErrNoTargetMachine;
+  }
+
+  pModule.setTargetTriple(getTargetMachine().getTargetTriple().str());
+  pModule.setDataLayout(getTargetMachine().createDataLayout());
+  if (pModule.getMaterializer() != nullptr) {
+    std::error_code ec = pModule.materializeAll();
+    if (ec) {
+      ALOGE("Failed to materialize the module `%s'! (%s)",
+            pModule.getModuleIdentifier().c_str(), ec.message().c_str());
+      return kErrMaterialization;
+    }
+  }
+
+  {
+    TraceScope trace("bcc: optimize shared runtime");
+    llvm::legacy::PassManager transformPasses;
+    transformPasses.add(llvm::createInternalizePass(
+        [&pExports](const llvm::GlobalValue &GV) {
+          return pExports.count(GV.getName()) > 0;
+        }));
+    transformPasses.add(llvm::createGlobalDCEPass());
+    transformPasses.run(pModule);
+  }
+
+  TraceScope trace_codegen("bcc: codegen shared runtime");
+  llvm::legacy::PassManager codeGenPasses;
+  llvm::MCContext *mc_context = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(gCodeGenSetupMutex);
+    publishCodeGenSettings(mTarget->getOptLevel(), mEnableGlobalMerge);
+    if (mTarget->addPassesToEmitMC(codeGenPasses, mc_context, pResult,
+                                   /* DisableVerify */false)) {
+      return kPrepareCodeGenPass;
+    }
+  }
+  codeGenPasses.run(pModule);
+
+  return kSuccess;
+}
+
 bool Compiler::addInternalizeSymbolsPass(Script &script, llvm::legacy::PassManager &pPM) {
   // Add a pass to internalize the symbols that don't need to have global
   // visibility.
-  llvm::Module &module = script.getSource().getModule();
-  bcinfo::MetadataExtractor me(&module);
-  if (!me.extract()) {
+  if (!script.getSource().extractMetadata()) {
     bccAssert(false && "Could not extract metadata for module!");
     return false;
   }
+  const bcinfo::MetadataExtractor &me = *script.getSource().getMetadata();
 
   // Set of symbols that should not be internalized.
   std::set<std::string> export_symbols;
@@ -383,11 +1512,13 @@ bool Compiler::addInternalizeSymbolsPass(Script &script, llvm::legacy::PassManag
     kInit,               // Initialization routine called implicitly on startup.
     kRsDtor,             // Static global destructor for a script instance.
     kRsInfo,             // Variable containing string of RS metadata info.
+    kRsInfoBinary,       // Optional binary form of the RS metadata info.
     kRsGlobalEntries,    // Optional number of global variables.
     kRsGlobalNames,      // Optional global variable name info.
     kRsGlobalAddresses,  // Optional global variable address info.
     kRsGlobalSizes,      // Optional global variable size info.
     kRsGlobalProperties, // Optional global variable properties.
+    kRsGlobalNameIndex,  // Optional hash table over the global names.
     nullptr              // Must be nullptr-terminated.
   };
   const char **special_functions = sf;
@@ -423,10 +1554,12 @@ bool Compiler::addInternalizeSymbolsPass(Script &script, llvm::legacy::PassManag
   // until createInternalizePass() is finished making its own copy of
   // the visible symbols.
   std::vector<std::string> keep_funcs;
-  keep_funcs.reserve(exportForEachCount + exportReduceCount*4);
+  keep_funcs.reserve(exportForEachCount*2 + exportReduceCount*5);
 
   for (i = 0; i < exportForEachCount; ++i) {
     keep_funcs.push_back(std::string(exportForEachNameList[i]) + ".expand");
+    // Only present if CompilerConfig::setTiledKernels() was used.
+    keep_funcs.push_back(std::string(exportForEachNameList[i]) + ".expand.tiled");
   }
   auto keepFuncsPushBackIfPresent = [&keep_funcs](const char *Name) {
     if (Name) keep_funcs.push_back(Name);
@@ -439,6 +1572,8 @@ bool Compiler::addInternalizeSymbolsPass(Script &script, llvm::legacy::PassManag
     } else {
       keep_funcs.push_back(nameReduceCombinerFromAccumulator(exportReduceList[i].mAccumulatorName));
     }
+    // Only present for small accumulators.
+    keep_funcs.push_back(nameReduceMultiCombiner(keep_funcs.back()));
     keepFuncsPushBackIfPresent(exportReduceList[i].mOutConverterName);
   }
 
@@ -446,8 +1581,12 @@ bool Compiler::addInternalizeSymbolsPass(Script &script, llvm::legacy::PassManag
     export_symbols.insert(symbol_name);
   }
 
+  // Runtime functions imported only for inlining (see
+  // RSCompilerDriver::setRuntimeImportLimit()) must keep referring to the
+  // shared runtime's definitions.
   auto IsExportedSymbol = [=](const llvm::GlobalValue &GV) {
-    return export_symbols.count(GV.getName()) > 0;
+    return GV.hasAvailableExternallyLinkage() ||
+           export_symbols.count(GV.getName()) > 0;
   };
 
   pPM.add(llvm::createInternalizePass(IsExportedSymbol));
@@ -467,10 +1606,93 @@ void Compiler::addDebugInfoPass(Script &script, llvm::legacy::PassManager &pPM)
     pPM.add(createRSAddDebugInfoPass());
 }
 
-void Compiler::addExpandKernelPass(llvm::legacy::PassManager &pPM) {
+void Compiler::addExpandKernelPass(Script &script, llvm::legacy::PassManager &pPM) {
   // Expand ForEach and reduce on CPU path to reduce launch overhead.
   bool pEnableStepOpt = true;
-  pPM.add(createRSKernelExpandPass(pEnableStepOpt));
+  // Widened loop bodies, loops versioned on packed allocations and partial
+  // reduction accumulators only pay off once they are optimized, so
+  // unoptimized builds keep a single scalar loop.
+  unsigned pVectorWidth = 1;
+  bool pSpecializeSteps = false;
+  unsigned pReduceAccumulators = 1;
+  unsigned pPrefetchDistance = 0;
+  // Kernels are only inlined into their expansion by the LTO pipeline.
+  bool pForceInlineKernels = false;
+  if (mCodeGenConfig && mCodeGenConfig->getOptimizationLevel() != llvm::CodeGenOpt::None) {
+    pVectorWidth = mCodeGenConfig->getKernelVectorWidth();
+    pSpecializeSteps = true;
+    pReduceAccumulators = mCodeGenConfig->getReduceAccumulators();
+    pPrefetchDistance = mCodeGenConfig->getPrefetchDistance();
+    pForceInlineKernels = true;
+  }
+  bool pEnableTiledExpand = mCodeGenConfig && mCodeGenConfig->getTiledKernels();
+  pPM.add(createRSKernelExpandPass(pEnableStepOpt, pVectorWidth,
+                                   pEnableTiledExpand, pSpecializeSteps,
+                                   pReduceAccumulators, pPrefetchDistance,
+                                   pForceInlineKernels,
+                                   script.getSource().getMetadata()));
+}
+
+bool Compiler::addProfilePasses(llvm::legacy::PassManager &pPM) {
+  // Drop the runtime functions nothing calls after internalization, so that
+  // only the expanded kernels, the invokables and the code they reach get
+  // counters. Instrumentation and profile use must see the same functions
+  // for the profile to match, so both go through this.
+  pPM.add(llvm::createGlobalDCEPass());
+
+  if (!mProfileGeneratePath.empty()) {
+    // Edge and call counters, written to mProfileGeneratePath by the profile
+    // runtime (which the script's shared object must be linked with) when
+    // the process exits.
+    pPM.add(llvm::createPGOInstrumentationGenLegacyPass());
+    llvm::InstrProfOptions options;
+    options.InstrProfileOutput = mProfileGeneratePath;
+    pPM.add(llvm::createInstrProfilingLegacyPass(options));
+  }
+
+  if (!mProfileUsePath.empty()) {
+    // The pass reports a profile it cannot read through the LLVMContext's
+    // diagnostic handler, which exits the process by default, so open it
+    // here first. This catches missing, truncated and corrupt files alike.
+    llvm::Expected<std::unique_ptr<llvm::IndexedInstrProfReader>> reader =
+        llvm::IndexedInstrProfReader::create(mProfileUsePath);
+    if (!reader) {
+      ALOGE("Unable to read profile %s: %s", mProfileUsePath.c_str(),
+            llvm::toString(reader.takeError()).c_str());
+      return false;
+    }
+    // Annotates the branches and calls with the profile's counts, which the
+    // LTO inliner, loop unroller and block placement then take into account.
+    pPM.add(llvm::createPGOInstrumentationUseLegacyPass(mProfileUsePath));
+  }
+
+  return true;
+}
+
+void Compiler::addVectorizePasses(llvm::legacy::PassManager &pPM, bool pRelaxed) {
+  // With relaxed precision, the kernel loops may call vector variants of the
+  // runtime math functions (see getRuntimeVectorFunctions()), which only the
+  // loop vectorizer knows how to use.
+  if (pRelaxed) {
+    pPM.add(llvm::createLoopVectorizePass(/* NoUnrolling */true,
+                                          /* AlwaysVectorize */true));
+  }
+
+  // Unroll the (expanded kernel) loops so that the SLP vectorizer sees
+  // straight-line code with enough independent operations to form vectors.
+  llvm::Optional<unsigned> unroll_threshold =
+      mCodeGenConfig->getLoopUnrollThreshold();
+  int threshold = unroll_threshold.hasValue() ?
+      static_cast<int>(*unroll_threshold) : -1;
+  pPM.add(llvm::createLoopUnrollPass(threshold, /* Count */16,
+                                     /* AllowPartial */0, /* Runtime */1));
+  pPM.add(llvm::createScalarizerPass());
+  pPM.add(llvm::createCFGSimplificationPass());
+  pPM.add(llvm::createScopedNoAliasAAWrapperPass());
+  pPM.add(llvm::createSCEVAAWrapperPass());
+  pPM.add(llvm::createSLPVectorizerPass());
+  pPM.add(llvm::createDeadCodeEliminationPass());
+  pPM.add(llvm::createInstructionCombiningPass());
 }
 
 void Compiler::addGlobalInfoPass(Script &script, llvm::legacy::PassManager &pPM) {
@@ -517,3 +1739,74 @@ void Compiler::translateGEPs(Script &script) {
   // Materialization done in screenGlobalFunctions above.
   pPM.run(script.getSource().getModule());
 }
+
+void Compiler::declareRuntimeVectorFunctions(Script &script) {
+  if (mCodeGenConfig == nullptr || !mCodeGenConfig->getAutoVectorize() ||
+      mTarget->getOptLevel() == llvm::CodeGenOpt::None) {
+    return;
+  }
+  Source &source = script.getSource();
+  if (!source.extractMetadata() ||
+      source.getMetadata()->getRSFloatPrecision() == bcinfo::RS_FP_Full) {
+    return;
+  }
+
+  llvm::Module &module = source.getModule();
+  std::vector<llvm::GlobalValue *> used = getCompilerUsed(module);
+  const size_t count = used.size();
+  for (const llvm::VecDesc &desc : getRuntimeVectorFunctions()) {
+    llvm::Function *scalar = module.getFunction(desc.ScalarFnName);
+    if (scalar == nullptr || !scalar->isDeclaration()) {
+      continue;
+    }
+
+    // Every float of the scalar function is a vector of floats in the
+    // variant.
+    llvm::FunctionType *scalarType = scalar->getFunctionType();
+    if (!scalarType->getReturnType()->isFloatTy()) {
+      continue;
+    }
+    llvm::Type *vectorTy =
+        llvm::VectorType::get(scalarType->getReturnType(),
+                              desc.VectorizationFactor);
+    std::vector<llvm::Type *> params(scalarType->getNumParams(), vectorTy);
+    if (std::any_of(scalarType->param_begin(), scalarType->param_end(),
+                    [](const llvm::Type *pType) { return !pType->isFloatTy(); })) {
+      continue;
+    }
+
+    llvm::Function *vector = llvm::dyn_cast<llvm::Function>(
+        module.getOrInsertFunction(desc.VectorFnName,
+                                   llvm::FunctionType::get(vectorTy, params,
+                                                           false)));
+    if (vector != nullptr &&
+        std::find(used.begin(), used.end(), vector) == used.end()) {
+      used.push_back(vector);
+    }
+  }
+  if (used.size() != count) {
+    setCompilerUsed(module, used);
+  }
+}
+
+void Compiler::preOptimize(llvm::Module &pModule) {
+  // Function passes only: reduction initializers and combiners, for one, are
+  // internal functions that only the metadata refers to, which the inliner
+  // or global DCE would delete.
+  llvm::legacy::PassManager pPM;
+  pPM.add(llvm::createSROAPass());
+  pPM.add(llvm::createEarlyCSEPass());
+  pPM.add(llvm::createInstructionCombiningPass());
+  pPM.add(llvm::createCFGSimplificationPass());
+  pPM.add(llvm::createDeadCodeEliminationPass());
+  pPM.run(pModule);
+}
+
+void Compiler::specializeGlobals(
+    Script &script, const std::map<std::string, std::vector<uint8_t>> &pValues) {
+  llvm::legacy::PassManager pPM;
+  pPM.add(createRSSpecializeGlobalsPass(pValues));
+
+  // Materialization done in screenGlobalFunctions above.
+  pPM.run(script.getSource().getModule());
+}
@@ -20,7 +20,14 @@
 #include "Properties.h"
 
 #include "bcc/Config.h"
+#include "bcc/Initialization.h"
 
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <sstream>
+
+#include <llvm/ADT/Triple.h>
 #include <llvm/CodeGen/SchedulerRegistry.h>
 #include <llvm/MC/SubtargetFeature.h>
 #include <llvm/Support/Host.h>
@@ -28,6 +35,91 @@
 
 using namespace bcc;
 
+namespace {
+
+// Prefetch distance used for in-order ARM cores: a few cache lines, which
+// covers the memory latency for the typical per-element cost of a kernel.
+const unsigned kInOrderARMPrefetchDistance = 256;
+
+bool isInOrderARMCPU(const std::string &pCPU) {
+  static const char *const kInOrderCPUs[] = {
+    "cortex-a5", "cortex-a7", "cortex-a8", "cortex-a53", "cortex-a55",
+  };
+  for (const char *cpu : kInOrderCPUs) {
+    if (pCPU == cpu) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Host CPU features that llvm::sys::getHostCPUFeatures() doesn't report on
+// AArch64, as named in the "Features" line of /proc/cpuinfo and by LLVM.
+// (The dot product instructions are not supported by this LLVM.)
+void AddAArch64HostCPUFeatures(std::vector<std::string> *attributes) {
+#if defined(__linux__)
+  FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+  if (cpuinfo == nullptr) {
+    return;
+  }
+
+  std::set<std::string> flags;
+  char line[1024];
+  while (fgets(line, sizeof(line), cpuinfo) != nullptr) {
+    if (strncmp(line, "Features", 8) != 0) {
+      continue;
+    }
+    const char *colon = strchr(line, ':');
+    if (colon == nullptr) {
+      continue;
+    }
+    std::istringstream tokens(colon + 1);
+    std::string flag;
+    while (tokens >> flag) {
+      flags.insert(flag);
+    }
+    break;
+  }
+  fclose(cpuinfo);
+
+  if (flags.count("atomics")) {
+    attributes->push_back("+lse");
+  }
+  if (flags.count("fphp") && flags.count("asimdhp")) {
+    attributes->push_back("+fullfp16");
+  }
+#endif  // __linux__
+}
+
+// Add the name and the features of the host CPU to the configuration of a
+// target of architecture pArch, if it is the host's. The features go first
+// so that the ones the target disables on purpose stay disabled.
+void AddHostCPUFeatures(llvm::Triple::ArchType pArch, std::string *pCPU,
+                        std::vector<std::string> *attributes) {
+  if (llvm::Triple(llvm::sys::getProcessTriple()).getArch() != pArch) {
+    return;
+  }
+
+  std::string cpu = llvm::sys::getHostCPUName();
+  if (!cpu.empty() && cpu != "generic") {
+    *pCPU = cpu;
+  }
+
+  std::vector<std::string> host;
+  llvm::StringMap<bool> features;
+  if (llvm::sys::getHostCPUFeatures(features)) {
+    for (const auto &f : features) {
+      host.push_back((f.second ? '+' : '-') + f.first().str());
+    }
+  }
+  if (pArch == llvm::Triple::aarch64) {
+    AddAArch64HostCPUFeatures(&host);
+  }
+  attributes->insert(attributes->begin(), host.begin(), host.end());
+}
+
+} // end anonymous namespace
+
 #if defined (PROVIDE_X86_CODEGEN) && !defined(__HOST__)
 
 namespace {
@@ -50,7 +142,9 @@ void AddX86NativeCPUFeatures(std::vector<std::string>* attributes) {
 #endif // (PROVIDE_X86_CODEGEN) && !defined(__HOST__)
 
 CompilerConfig::CompilerConfig(const std::string &pTriple)
-  : mTriple(pTriple), mFullPrecision(true), mTarget(nullptr) {
+  : mTriple(pTriple), mFullPrecision(true), mKernelVectorWidth(1),
+    mReduceAccumulators(1), mPrefetchDistance(0), mTiledKernels(false), mAutoVectorize(false),
+    mOptimizeForSize(false), mUseHostCPU(false), mTarget(nullptr) {
   //===--------------------------------------------------------------------===//
   // Default setting of target options
   //===--------------------------------------------------------------------===//
@@ -78,10 +172,34 @@ CompilerConfig::CompilerConfig(const std::string &pTriple)
   initializeTarget();
   initializeArch();
 
+  //===--------------------------------------------------------------------===//
+  // Default setting for auto-vectorization
+  //===--------------------------------------------------------------------===//
+  // This is not part of initializeArch() since that runs again whenever the
+  // float precision changes, which must not undo setAutoVectorize().
+  mAutoVectorize = (mArchType == llvm::Triple::aarch64 ||
+                    mArchType == llvm::Triple::x86_64);
+
+  //===--------------------------------------------------------------------===//
+  // Default setting for software prefetching
+  //===--------------------------------------------------------------------===//
+  // In-order ARM cores don't run far enough ahead of the loads of a kernel
+  // loop to keep the memory system busy, so they get explicit prefetches.
+  // Out-of-order cores have hardware prefetchers that do at least as well.
+  if (mArchType == llvm::Triple::arm || mArchType == llvm::Triple::aarch64) {
+    if (isInOrderARMCPU(mCPU)) {
+      mPrefetchDistance = kInOrderARMPrefetchDistance;
+    }
+  }
+
   return;
 }
 
 bool CompilerConfig::initializeTarget() {
+  // Only the backend of mTriple is initialized: an unsupported triple is left
+  // for lookupTarget() to report.
+  init::InitializeTarget(mTriple);
+
   std::string error;
   mTarget = llvm::TargetRegistry::lookupTarget(mTriple, error);
   if (mTarget != nullptr) {
@@ -230,6 +348,10 @@ bool CompilerConfig::initializeArch() {
     return false;
   }
 
+  if (mUseHostCPU) {
+    AddHostCPUFeatures(mArchType, &mCPU, &attributes);
+  }
+
   setFeatureString(attributes);
   return true;
 }
@@ -246,3 +368,9 @@ void CompilerConfig::setFeatureString(const std::vector<std::string> &pAttrs) {
   mFeatureString = f.getString();
   return;
 }
+
+void CompilerConfig::setOptimizeForSize(bool pOptimizeForSize) {
+  mOptimizeForSize = pOptimizeForSize;
+  mTargetOpts.FunctionSections = pOptimizeForSize;
+  mTargetOpts.DataSections = pOptimizeForSize;
+}
@@ -171,8 +171,11 @@ bool FileBase::lock(enum LockModeEnum pMode,
           // Error occurred when check the file integrity or re-open the file.
           return false;
         } else {
-          // Wait a while before the next try.
-          ::usleep(pRetryInterval);
+          // Wait a while before the next try. A blocking lock request waits
+          // for the new holder in flock() itself.
+          if (pNonblocking) {
+            ::usleep(pRetryInterval);
+          }
           retry++;
           continue;
         }
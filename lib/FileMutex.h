@@ -35,6 +35,12 @@ public:
     return FileBase::lock(FileBase::kWriteLock, true, FileBase::kDefaultMaxRetryLock,
                           FileBase::kDefaultRetryLockInterval);
   }
+
+  // Block in the kernel until the lock is granted instead of polling for it.
+  inline bool waitMutex() {
+    return FileBase::lock(FileBase::kWriteLock, false, FileBase::kDefaultMaxRetryLock,
+                          FileBase::kDefaultRetryLockInterval);
+  }
 };
 
 } // namespace bcc
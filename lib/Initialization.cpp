@@ -20,7 +20,9 @@
 #include "bcc/Config.h"
 
 #include <cstdlib>
+#include <mutex>
 
+#include <llvm/ADT/Triple.h>
 #include <llvm/InitializePasses.h>
 #include <llvm/PassRegistry.h>
 #include <llvm/Support/ErrorHandling.h>
@@ -34,24 +36,13 @@ void llvm_error_handler(void *pUserData, const std::string &pMessage,
   ::exit(1);
 }
 
-} // end anonymous namespace
-
-void bcc::init::Initialize() {
-  static bool is_initialized = false;
-
-  if (is_initialized) {
-    return;
-  }
+std::once_flag gInitializeOnce;
 
+void InitializeOnce() {
   // Setup error handler for LLVM.
   llvm::remove_fatal_error_handler();
   llvm::install_fatal_error_handler(llvm_error_handler, nullptr);
 
-
-  llvm::InitializeAllTargets();
-  llvm::InitializeAllTargetMCs();
-  llvm::InitializeAllAsmPrinters();
-
   llvm::PassRegistry &Registry = *llvm::PassRegistry::getPassRegistry();
   llvm::initializeCore(Registry);
   llvm::initializeScalarOpts(Registry);
@@ -65,8 +56,87 @@ void bcc::init::Initialize() {
   llvm::initializeCodeGenPreparePass(Registry);
   llvm::initializeAtomicExpandPass(Registry);
   llvm::initializeRewriteSymbolsPass(Registry);
+}
+
+// Registering a backend updates the target registry, which isn't
+// synchronized, so backends are only initialized under this lock.
+std::mutex gBackendsLock;
+
+enum Backend {
+  kARMBackend     = 1 << 0,
+  kAArch64Backend = 1 << 1,
+  kMipsBackend    = 1 << 2,
+  kX86Backend     = 1 << 3,
+};
 
-  is_initialized = true;
+// The backends initialized so far, guarded by gBackendsLock.
+unsigned gInitializedBackends = 0;
 
-  return;
+#define INITIALIZE_BACKEND(TargetName)              \
+  do {                                              \
+    LLVMInitialize##TargetName##TargetInfo();       \
+    LLVMInitialize##TargetName##Target();           \
+    LLVMInitialize##TargetName##TargetMC();         \
+    LLVMInitialize##TargetName##AsmPrinter();       \
+  } while (false)
+
+} // end anonymous namespace
+
+void bcc::init::Initialize() {
+  // Drivers on different threads may race to get here first.
+  std::call_once(gInitializeOnce, InitializeOnce);
+}
+
+bool bcc::init::InitializeTarget(const std::string &pTriple) {
+  unsigned backend;
+  switch (llvm::Triple(pTriple).getArch()) {
+#if defined(PROVIDE_ARM_CODEGEN)
+  case llvm::Triple::arm:
+  case llvm::Triple::thumb:
+    backend = kARMBackend;
+    break;
+#endif
+#if defined(PROVIDE_ARM64_CODEGEN)
+  case llvm::Triple::aarch64:
+    backend = kAArch64Backend;
+    break;
+#endif
+#if defined(PROVIDE_MIPS_CODEGEN)
+  case llvm::Triple::mips:
+  case llvm::Triple::mipsel:
+  case llvm::Triple::mips64:
+  case llvm::Triple::mips64el:
+    backend = kMipsBackend;
+    break;
+#endif
+#if defined(PROVIDE_X86_CODEGEN)
+  case llvm::Triple::x86:
+  case llvm::Triple::x86_64:
+    backend = kX86Backend;
+    break;
+#endif
+  default:
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(gBackendsLock);
+  if (gInitializedBackends & backend) {
+    return true;
+  }
+  switch (backend) {
+#if defined(PROVIDE_ARM_CODEGEN)
+  case kARMBackend: INITIALIZE_BACKEND(ARM); break;
+#endif
+#if defined(PROVIDE_ARM64_CODEGEN)
+  case kAArch64Backend: INITIALIZE_BACKEND(AArch64); break;
+#endif
+#if defined(PROVIDE_MIPS_CODEGEN)
+  case kMipsBackend: INITIALIZE_BACKEND(Mips); break;
+#endif
+#if defined(PROVIDE_X86_CODEGEN)
+  case kX86Backend: INITIALIZE_BACKEND(X86); break;
+#endif
+  }
+  gInitializedBackends |= backend;
+  return true;
 }
@@ -53,6 +53,12 @@ public:
       indexVarType(nullptr) {
   }
 
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    // This pass only adds debug intrinsics and metadata, so the analyses
+    // computed for the kernels can be kept for the passes that follow it.
+    AU.setPreservesCFG();
+  }
+
   virtual bool runOnModule(llvm::Module &Module) {
     // Gather information about this bcc module.
     bcinfo::MetadataExtractor me(&Module);
@@ -74,6 +80,8 @@ public:
       const std::string expandName = std::string(name) + ".expand";
       if (llvm::Function *const func = Module.getFunction(expandName))
         expandFuncs.insert(func);
+      if (llvm::Function *const func = Module.getFunction(expandName + ".tiled"))
+        expandFuncs.insert(func);
     };
 
     for (size_t i = 0; i < nForEachKernels; ++i)
@@ -17,60 +17,364 @@
 #include "bcc/RSCompilerDriver.h"
 
 #include "Assert.h"
+#include "CompilationCache.h"
 #include "FileMutex.h"
 #include "Log.h"
 #include "RSScriptGroupFusion.h"
 #include "slang_version.h"
 
 #include "bcc/BCCContext.h"
+#include "bcc/BuildStats.h"
 #include "bcc/Compiler.h"
 #include "bcc/CompilerConfig.h"
 #include "bcc/Config.h"
 #include "bcc/Initialization.h"
 #include "bcc/Script.h"
 #include "bcc/Source.h"
+#include "bcc/Trace.h"
 #include "bcinfo/BitcodeWrapper.h"
 #include "bcinfo/MetadataExtractor.h"
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include "llvm/Linker/Linker.h"
+#include <llvm/Object/ObjectFile.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
 
+#include <algorithm>
+#include <atomic>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace bcc;
 
+namespace {
+
+// An output file that is written under a unique temporary name next to its
+// final path and only renamed into place by commit(). Readers therefore never
+// see a partially written object, and concurrent writers of the same output
+// don't need to lock each other out: the last complete one wins.
+class AtomicOutputFile {
+private:
+  std::string mPath;
+  llvm::SmallString<128> mTempPath;
+  std::unique_ptr<llvm::raw_fd_ostream> mStream;
+
+public:
+  explicit AtomicOutputFile(const std::string &pPath) : mPath(pPath) { }
+
+  ~AtomicOutputFile() {
+    discard();
+  }
+
+  bool open() {
+    int fd;
+    std::error_code error =
+        llvm::sys::fs::createUniqueFile(mPath + "-%%%%%%%%.tmp", fd, mTempPath);
+    if (error) {
+      ALOGE("Unable to open %s for write! (%s)", mPath.c_str(),
+            error.message().c_str());
+      mTempPath.clear();
+      return false;
+    }
+    mStream.reset(new llvm::raw_fd_ostream(fd, /* shouldClose */true));
+    return true;
+  }
+
+  llvm::raw_fd_ostream &getStream() {
+    return *mStream;
+  }
+
+  // Number of bytes written so far.
+  uint64_t getSize() const {
+    return mStream->tell();
+  }
+
+  // Flush the temporary file and atomically replace mPath with it.
+  bool commit() {
+    mStream->close();
+    if (mStream->has_error()) {
+      mStream->clear_error();
+      ALOGE("Unable to write %s!", mPath.c_str());
+      return false;
+    }
+
+    std::error_code error = llvm::sys::fs::rename(mTempPath, mPath);
+    if (error) {
+      ALOGE("Unable to move %s into place! (%s)", mPath.c_str(),
+            error.message().c_str());
+      return false;
+    }
+    mTempPath.clear();
+    return true;
+  }
+
+  // Drop the temporary file, leaving whatever is at mPath untouched.
+  void discard() {
+    if (mStream != nullptr) {
+      mStream->close();
+      mStream->clear_error();
+      mStream.reset();
+    }
+    if (!mTempPath.empty()) {
+      llvm::sys::fs::remove(mTempPath);
+      mTempPath.clear();
+    }
+  }
+};
+
+// Is pPath still the file pStatus was taken of? A rename over it changes the
+// unique ID; a rewrite in place changes the size or modification time.
+bool isSameFile(const std::string &pPath,
+                const llvm::sys::fs::file_status &pStatus) {
+  llvm::sys::fs::file_status status;
+  return !llvm::sys::fs::status(pPath, status) &&
+         status.getUniqueID() == pStatus.getUniqueID() &&
+         status.getSize() == pStatus.getSize() &&
+         status.getLastModificationTime() == pStatus.getLastModificationTime();
+}
+
+// Resets the driver's BuildStats when a build starts and finishes them on
+// every exit path.
+class BuildStatsScope {
+private:
+  BuildStats &mStats;
+
+public:
+  explicit BuildStatsScope(BuildStats &pStats) : mStats(pStats) {
+    mStats.reset();
+  }
+
+  ~BuildStatsScope() {
+    mStats.finish();
+  }
+};
+
+// Rough size of an IR instruction of a linked script, with its operands and
+// its share of the constants and metadata, used to estimate the memory a
+// build needs (see RSCompilerDriver::setMemoryBudget()).
+const uint64_t kIRBytesPerInstruction = 128;
+
+// Peak memory of a build, in tenths of the size of the linked module, for
+// each step of Compiler::MemoryFallback: the inliner grows the module, and
+// code generation holds the machine IR on top of it unless it streams.
+const uint64_t kPeakMemoryFactors[] = { 40, 25, 18, 12 };
+
+// Runs Compiler::preOptimize() over each of pSources in an LLVMContext of its
+// own, on pJobs threads, and replaces the module of each source with the
+// result. The modules of pSources all belong to the same context, so they
+// are only serialized and parsed back on the calling thread. A source whose
+// bitcode cannot be read back is left as it is.
+void preOptimizeSources(BCCContext &pContext, const std::vector<Source*> &pSources,
+                        unsigned pJobs) {
+  std::vector<std::string> bitcodes(pSources.size());
+  for (size_t i = 0; i < pSources.size(); i++) {
+    llvm::raw_string_ostream os(bitcodes[i]);
+    llvm::WriteBitcodeToFile(&pSources[i]->getModule(), os);
+  }
+
+  // Not a vector<bool>: the threads set distinct elements concurrently.
+  std::vector<char> optimized(pSources.size(), false);
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i = next++; i < bitcodes.size(); i = next++) {
+      llvm::LLVMContext context;
+      llvm::ErrorOr<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(
+          llvm::MemoryBufferRef(bitcodes[i], pSources[i]->getName()), context);
+      if (!module) {
+        continue;
+      }
+      Compiler::preOptimize(**module);
+      std::string bitcode;
+      llvm::raw_string_ostream os(bitcode);
+      llvm::WriteBitcodeToFile(module->get(), os);
+      bitcodes[i] = std::move(os.str());
+      optimized[i] = true;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < std::min<size_t>(pJobs, pSources.size()); i++) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < pSources.size(); i++) {
+    if (!optimized[i]) {
+      ALOGW("Unable to pre-optimize script group source %s",
+            pSources[i]->getName().c_str());
+      continue;
+    }
+    llvm::ErrorOr<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(bitcodes[i], pSources[i]->getIdentifier()),
+        pContext.getLLVMContext());
+    if (!module) {
+      ALOGW("Unable to pre-optimize script group source %s",
+            pSources[i]->getName().c_str());
+      continue;
+    }
+    pSources[i]->setModule(module->release());
+  }
+}
+
+// A Source written out as bitcode, to be loaded into a BCCContext on another
+// thread (see RSCompilerDriver::buildScriptGroupAsync()).
+class SerializedSource {
+private:
+  std::string mName;
+  std::string mIdentifier;
+  std::string mBitcode;
+  unsigned mCompilerVersion;
+  unsigned mOptimizationLevel;
+
+public:
+  SerializedSource() : mCompilerVersion(0), mOptimizationLevel(0) { }
+
+  // Must run on the thread that owns the context of pSource.
+  void serialize(const Source &pSource) {
+    mName = pSource.getName();
+    mIdentifier = pSource.getIdentifier();
+    pSource.getWrapperInformation(&mCompilerVersion, &mOptimizationLevel);
+    llvm::raw_string_ostream os(mBitcode);
+    llvm::WriteBitcodeToFile(&pSource.getModule(), os);
+    os.flush();
+  }
+
+  // A new Source in pContext with the module, name and wrapper information
+  // of the serialized one, or nullptr on error.
+  Source *load(BCCContext &pContext) const {
+    llvm::ErrorOr<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(mBitcode, mIdentifier), pContext.getLLVMContext());
+    if (!module) {
+      ALOGE("Unable to load script group source %s! (%s)", mName.c_str(),
+            module.getError().message().c_str());
+      return nullptr;
+    }
+
+    // Source::CreateFromModule() adds the wrapper metadata back.
+    llvm::NamedMDNode *wrapper = (*module)->getNamedMetadata(
+        bcinfo::MetadataExtractor::kWrapperMetadataName);
+    if (wrapper != nullptr) {
+      (*module)->eraseNamedMetadata(wrapper);
+    }
+    Source *source = Source::CreateFromModule(pContext, mName.c_str(),
+                                              **module, mCompilerVersion,
+                                              mOptimizationLevel);
+    if (source != nullptr) {
+      module->release();
+    }
+    return source;
+  }
+};
+
+// Add the names of the symbols the object at pObjectPath refers to without
+// defining them to pSymbols. Returns false if the object can't be read.
+bool addUndefinedSymbols(const std::string &pObjectPath,
+                         std::set<std::string> &pSymbols) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(pObjectPath, /* FileSize */-1,
+                                  /* RequiresNullTerminator */false);
+  if (buffer.getError()) {
+    ALOGE("Unable to read %s! (%s)", pObjectPath.c_str(),
+          buffer.getError().message().c_str());
+    return false;
+  }
+
+  llvm::Expected<std::unique_ptr<llvm::object::ObjectFile>> object =
+      llvm::object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+  if (!object) {
+    ALOGE("Unable to read the symbols of %s! (%s)", pObjectPath.c_str(),
+          llvm::toString(object.takeError()).c_str());
+    return false;
+  }
+
+  for (const llvm::object::SymbolRef &symbol : (*object)->symbols()) {
+    if (!(symbol.getFlags() & llvm::object::SymbolRef::SF_Undefined)) {
+      continue;
+    }
+    llvm::Expected<llvm::StringRef> name = symbol.getName();
+    if (!name) {
+      llvm::consumeError(name.takeError());
+      continue;
+    }
+    if (!name->empty()) {
+      pSymbols.insert(*name);
+    }
+  }
+  return true;
+}
+
+// Whether the script in pBitcode is bound to full float precision, as
+// setupConfig() will find once it is loaded.
+bool isFullPrecisionBitcode(const char *pBitcode, size_t pBitcodeSize) {
+  bcinfo::MetadataExtractor me(pBitcode, pBitcodeSize);
+  return !me.extract() || me.getRSFloatPrecision() == bcinfo::RS_FP_Full;
+}
+
+} // end anonymous namespace
+
 RSCompilerDriver::RSCompilerDriver() :
-    mConfig(nullptr), mCompiler(), mDebugContext(false),
+    mConfig(nullptr), mCompiler(), mDebugContext(false), mOptimizedDebug(false),
     mLinkRuntimeCallback(nullptr), mEnableGlobalMerge(true),
-    mEmbedGlobalInfo(false), mEmbedGlobalInfoSkipConstant(false) {
+    mEnableGlobalLayout(true), mEmbedGlobalInfo(false),
+    mEmbedGlobalInfoSkipConstant(false),
+    mEmbedBinaryInfo(false), mEnableCache(true), mCacheBudget(0),
+    mComputeBuildChecksum(false),
+    mScriptGroupPreOptJobs(0),
+    mRuntimeImportLimit(0),
+    mTieredCompilation(false),
+    mTieredCallback(), mAsyncBuildJobs(1), mAsyncShutdown(false),
+    mKernelReport(false), mStreamingCodeGen(false),
+    mIRDumpPoints(0), mIRDumpFiles(false), mIRCountInstructions(false),
+    mOptimizationRemarks(false),
+    mMemoryBudget(0) {
   init::Initialize();
+  mCompiler.setBuildStats(&mLastBuildStats);
 }
 
 RSCompilerDriver::~RSCompilerDriver() {
+  waitForOptimizedBuilds();
+  {
+    std::lock_guard<std::mutex> lock(mAsyncLock);
+    mAsyncShutdown = true;
+  }
+  mAsyncAvailable.notify_all();
+  for (std::thread &worker : mAsyncWorkers) {
+    worker.join();
+  }
   delete mConfig;
 }
 
 
-#if defined(PROVIDE_ARM_CODEGEN)
-extern llvm::cl::opt<bool> EnableGlobalMerge;
-#endif
-
 bool RSCompilerDriver::setupConfig(const Script &pScript) {
   bool changed = false;
 
   const llvm::CodeGenOpt::Level script_opt_level = pScript.getOptimizationLevel();
 
-#if defined(PROVIDE_ARM_CODEGEN)
-  EnableGlobalMerge = mEnableGlobalMerge;
-#endif
+  // Merged globals can't be told apart in a debugger.
+  mCompiler.setEnableGlobalMerge(mEnableGlobalMerge && !pScript.getOptimizedDebug());
+  mCompiler.setEnableGlobalLayout(mEnableGlobalLayout && !pScript.getOptimizedDebug());
+  mCompiler.setProfileGenerate(mProfileGeneratePath);
+  mCompiler.setProfileUse(mProfileUsePath);
+  mCompiler.setKernelReport(mKernelReport);
+  mCompiler.setStreamingCodeGen(mStreamingCodeGen);
+  mCompiler.setIRDump(mIRDumpPoints, mIRDumpKernels, mIRDumpFiles,
+                      mIRCountInstructions);
 
   if (mConfig != nullptr) {
     // Renderscript bitcode may have their optimization flag configuration
@@ -91,12 +395,13 @@ bool RSCompilerDriver::setupConfig(const Script &pScript) {
   }
 
 #if defined(PROVIDE_ARM_CODEGEN)
-  bcinfo::MetadataExtractor me(&pScript.getSource().getModule());
-  if (!me.extract()) {
+  if (!pScript.getSource().extractMetadata()) {
     bccAssert("Could not extract RS pragma metadata for module!");
   }
 
-  bool script_full_prec = (me.getRSFloatPrecision() == bcinfo::RS_FP_Full);
+  const bcinfo::MetadataExtractor *me = pScript.getSource().getMetadata();
+  bool script_full_prec = (me == nullptr ||
+                           me->getRSFloatPrecision() == bcinfo::RS_FP_Full);
   if (mConfig->getFullPrecision() != script_full_prec) {
     mConfig->setFullPrecision(script_full_prec);
     changed = true;
@@ -106,11 +411,282 @@ bool RSCompilerDriver::setupConfig(const Script &pScript) {
   return changed;
 }
 
-Compiler::ErrorCode RSCompilerDriver::compileScript(Script& pScript, const char* pScriptName,
-                                                    const char* pOutputPath,
-                                                    const char* pRuntimePath,
-                                                    const char* pBuildChecksum,
-                                                    bool pDumpIR) {
+bool RSCompilerDriver::setupMemoryFallback(const Script &pScript) {
+  mCompiler.setMemoryFallback(Compiler::kNoMemoryFallback);
+  if (mMemoryBudget == 0 ||
+      mConfig->getOptimizationLevel() == llvm::CodeGenOpt::None) {
+    return false;
+  }
+
+  uint64_t instructions = 0;
+  for (const llvm::Function &function : pScript.getSource().getModule()) {
+    for (const llvm::BasicBlock &block : function) {
+      instructions += block.size();
+    }
+  }
+  const uint64_t module_size = instructions * kIRBytesPerInstruction;
+
+  Compiler::MemoryFallback fallback = Compiler::kNoMemoryFallback;
+  while (fallback != Compiler::kNoOptimization &&
+         module_size * kPeakMemoryFactors[fallback] / 10 > mMemoryBudget) {
+    fallback = static_cast<Compiler::MemoryFallback>(fallback + 1);
+  }
+  mLastBuildStats.setMemoryFallback(fallback);
+  if (fallback == Compiler::kNoMemoryFallback) {
+    return false;
+  }
+
+  ALOGW("Compiling %s with memory fallback %d to fit a budget of %u KiB",
+        pScript.getSource().getIdentifier().c_str(), fallback,
+        static_cast<unsigned>(mMemoryBudget / 1024));
+  mCompiler.setMemoryFallback(fallback);
+  if (fallback == Compiler::kNoOptimization) {
+    // setupConfig() restores the level of the script on the next build.
+    mConfig->setOptimizationLevel(llvm::CodeGenOpt::None);
+    return true;
+  }
+  return false;
+}
+
+std::unique_ptr<CompilerConfig>
+RSCompilerDriver::createScriptConfig(bool pFullPrecision) const {
+  std::unique_ptr<CompilerConfig> config(
+      (mConfig != nullptr)
+          ? new (std::nothrow) CompilerConfig(*mConfig)
+          : new (std::nothrow) CompilerConfig(DEFAULT_TARGET_TRIPLE_STRING));
+  if (config == nullptr) {
+    return nullptr;
+  }
+#if defined(PROVIDE_ARM_CODEGEN)
+  if (config->getFullPrecision() != pFullPrecision) {
+    config->setFullPrecision(pFullPrecision);
+  }
+#endif
+  return config;
+}
+
+bool RSCompilerDriver::addBuildSettingsToCacheKey(
+    CompilationCacheKey &pKey, const CompilerConfig &pConfig) const {
+  // The compiler itself.
+  pKey.add(LLVM_VERSION_STRING);
+
+  // The target configuration. The optimization level is left out on purpose:
+  // build() always takes it from the bitcode wrapper, and buildScriptGroup()
+  // always optimizes aggressively.
+  pKey.add(pConfig.getTriple());
+  pKey.add(pConfig.getCPU());
+  pKey.add(pConfig.getFeatureString());
+  pKey.add(static_cast<uint64_t>(pConfig.getCodeModel()));
+  llvm::Optional<llvm::Reloc::Model> reloc = pConfig.getRelocationModel();
+  pKey.add(reloc.hasValue() ? static_cast<uint64_t>(*reloc) + 1 : 0);
+  pKey.add(static_cast<uint64_t>(pConfig.getKernelVectorWidth()));
+  pKey.add(static_cast<uint64_t>(pConfig.getReduceAccumulators()));
+  pKey.add(static_cast<uint64_t>(pConfig.getPrefetchDistance()));
+  pKey.add(static_cast<uint64_t>(pConfig.getTiledKernels()));
+  pKey.add(static_cast<uint64_t>(pConfig.getAutoVectorize()));
+  pKey.add(static_cast<uint64_t>(pConfig.getOptimizeForSize()));
+  pKey.add(static_cast<uint64_t>(pConfig.getKernelVariants().size()));
+  for (const auto &variant : pConfig.getKernelVariants()) {
+    pKey.add(variant.first);
+    pKey.add(variant.second);
+  }
+  llvm::Optional<unsigned> unroll = pConfig.getLoopUnrollThreshold();
+  pKey.add(unroll.hasValue() ? static_cast<uint64_t>(*unroll) + 1 : 0);
+  llvm::Optional<int> slp = pConfig.getSLPVectorizeThreshold();
+  pKey.add(static_cast<uint64_t>(slp.hasValue()));
+  pKey.add(static_cast<uint64_t>(static_cast<int64_t>(slp.hasValue() ? *slp : 0)));
+
+  // Driver settings that change the generated code.
+  pKey.add(static_cast<uint64_t>(mDebugContext));
+  pKey.add(static_cast<uint64_t>(mOptimizedDebug));
+  pKey.add(static_cast<uint64_t>(mRuntimeImportLimit));
+  pKey.add(static_cast<uint64_t>(mEnableGlobalMerge));
+  pKey.add(static_cast<uint64_t>(mEnableGlobalLayout));
+  pKey.add(static_cast<uint64_t>(mMemoryBudget));
+  pKey.add(static_cast<uint64_t>(mEmbedGlobalInfo));
+  pKey.add(static_cast<uint64_t>(mEmbedGlobalInfoSkipConstant));
+  pKey.add(static_cast<uint64_t>(mEmbedBinaryInfo));
+  pKey.add(static_cast<uint64_t>(mLinkRuntimeCallback != nullptr));
+  pKey.add(mProfileGeneratePath);
+
+  // The values the scripts are specialized on.
+  pKey.add(static_cast<uint64_t>(mSpecializedGlobals.size()));
+  for (const auto &global : mSpecializedGlobals) {
+    pKey.add(global.first);
+    pKey.add(llvm::StringRef(reinterpret_cast<const char *>(global.second.data()),
+                             global.second.size()));
+  }
+
+  // The profile guiding the build, if any. Without it the build fails anyway.
+  pKey.add(static_cast<uint64_t>(!mProfileUsePath.empty()));
+  if (!mProfileUsePath.empty() && !pKey.addFile(mProfileUsePath.c_str())) {
+    return false;
+  }
+
+  return true;
+}
+
+bool RSCompilerDriver::computeCacheKey(const char *pBitcode,
+                                       size_t pBitcodeSize,
+                                       const char *pBuildChecksum,
+                                       const char *pRuntimePath,
+                                       std::string *pKey) const {
+  CompilationCacheKey key;
+
+  // The input bitcode. This also covers the optimization level setupConfig()
+  // takes from the wrapper.
+  key.add(llvm::StringRef(pBitcode, pBitcodeSize));
+  key.add(llvm::StringRef((pBuildChecksum != nullptr) ? pBuildChecksum : ""));
+
+  // The target configuration this script gets, whatever was built before it.
+  std::unique_ptr<CompilerConfig> config =
+      createScriptConfig(isFullPrecisionBitcode(pBitcode, pBitcodeSize));
+  if (config == nullptr || !addBuildSettingsToCacheKey(key, *config)) {
+    return false;
+  }
+
+  // The runtime library the script is linked against.
+  if (!key.addFile(pRuntimePath)) {
+    return false;
+  }
+
+  *pKey = key.finish();
+  return true;
+}
+
+bool RSCompilerDriver::computeBuildChecksum(const char *pBitcode,
+                                            size_t pBitcodeSize,
+                                            const char *pRuntimePath,
+                                            std::string *pChecksum) const {
+  CompilationCacheKey checksum(CompilationCacheKey::kFastHash);
+
+  checksum.add(llvm::StringRef(pBitcode, pBitcodeSize));
+  // Like the cache key, the checksum must not depend on the build order.
+  std::unique_ptr<CompilerConfig> config =
+      createScriptConfig(isFullPrecisionBitcode(pBitcode, pBitcodeSize));
+  if (config == nullptr || !addBuildSettingsToCacheKey(checksum, *config) ||
+      !checksum.addFile(pRuntimePath)) {
+    return false;
+  }
+
+  *pChecksum = checksum.finish();
+  return true;
+}
+
+bool RSCompilerDriver::resolveBuildChecksum(const char *pResName,
+                                            const char *pBitcode,
+                                            size_t pBitcodeSize,
+                                            const char *pRuntimePath,
+                                            const char **pBuildChecksum,
+                                            std::string *pStorage) const {
+  if (!mComputeBuildChecksum ||
+      (*pBuildChecksum != nullptr && (*pBuildChecksum)[0] != '\0')) {
+    return true;
+  }
+
+  if (!computeBuildChecksum(pBitcode, pBitcodeSize, pRuntimePath, pStorage)) {
+    ALOGE("Unable to compute the build checksum of %s", pResName);
+    return false;
+  }
+  *pBuildChecksum = pStorage->c_str();
+  return true;
+}
+
+namespace {
+
+void addPlansToCacheKey(CompilationCacheKey &pKey,
+                        const std::list<std::list<std::pair<int, int>>>& pPlans,
+                        const std::list<std::string>& pNames) {
+  pKey.add(static_cast<uint64_t>(pPlans.size()));
+  for (const std::list<std::pair<int, int>>& plan : pPlans) {
+    pKey.add(static_cast<uint64_t>(plan.size()));
+    for (const std::pair<int, int>& p : plan) {
+      pKey.add(static_cast<uint64_t>(static_cast<int64_t>(p.first)));
+      pKey.add(static_cast<uint64_t>(static_cast<int64_t>(p.second)));
+    }
+  }
+  pKey.add(static_cast<uint64_t>(pNames.size()));
+  for (const std::string& name : pNames) {
+    pKey.add(name);
+  }
+}
+
+} // end anonymous namespace
+
+bool RSCompilerDriver::computeScriptGroupCacheKey(
+    const std::vector<Source*>& pSources, const char *pBuildChecksum,
+    const char *pRuntimePath, const char *pRuntimeRelaxedPath,
+    const std::list<std::list<std::pair<int, int>>>& pToFuse,
+    const std::list<std::string>& pFused,
+    const std::list<std::list<std::pair<int, int>>>& pInvokes,
+    const std::list<std::string>& pInvokeBatchNames,
+    const std::list<std::list<std::pair<int, int>>>& pToFuseIntoReduce,
+    const std::list<std::string>& pFusedReduces,
+    const std::list<ScriptGroupStencilFusion>& pStencilFusions,
+    const std::list<std::list<std::pair<int, int>>>& pToFuseFanOut,
+    const std::list<std::string>& pFusedFanOuts,
+    std::string *pKey) const {
+  CompilationCacheKey key;
+
+  // The sources are only available as modules, so their bitcode is
+  // regenerated. That is still much cheaper than optimizing the group.
+  key.add(static_cast<uint64_t>(pSources.size()));
+  for (const Source* source : pSources) {
+    std::string bitcode;
+    llvm::raw_string_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(&source->getModule(), os);
+    key.add(os.str());
+  }
+  key.add(llvm::StringRef((pBuildChecksum != nullptr) ? pBuildChecksum : ""));
+
+  // What gets fused and renamed.
+  addPlansToCacheKey(key, pToFuse, pFused);
+  addPlansToCacheKey(key, pInvokes, pInvokeBatchNames);
+  addPlansToCacheKey(key, pToFuseIntoReduce, pFusedReduces);
+  key.add(static_cast<uint64_t>(pStencilFusions.size()));
+  for (const ScriptGroupStencilFusion& stencil : pStencilFusions) {
+    for (const std::pair<int, int>& p : { stencil.mProducer, stencil.mConsumer }) {
+      key.add(static_cast<uint64_t>(static_cast<int64_t>(p.first)));
+      key.add(static_cast<uint64_t>(static_cast<int64_t>(p.second)));
+    }
+    key.add(stencil.mAllocation);
+    key.add(stencil.mName);
+  }
+  addPlansToCacheKey(key, pToFuseFanOut, pFusedFanOuts);
+  key.add(static_cast<uint64_t>(mScriptGroupPreOptJobs > 0));
+
+  // The merged module is relaxed if any of the sources is.
+  bool full_precision = true;
+  for (Source* source : pSources) {
+    if (source->getMetadata() == nullptr && !source->extractMetadata()) {
+      return false;
+    }
+    if (source->getMetadata()->getRSFloatPrecision() != bcinfo::RS_FP_Full) {
+      full_precision = false;
+    }
+  }
+  std::unique_ptr<CompilerConfig> config = createScriptConfig(full_precision);
+  if (config == nullptr || !addBuildSettingsToCacheKey(key, *config)) {
+    return false;
+  }
+
+  // The runtime libraries the group may be linked against.
+  if (!key.addFile(pRuntimePath)) {
+    return false;
+  }
+  key.add(static_cast<uint64_t>(strcmp(pRuntimeRelaxedPath, "") != 0));
+  if (strcmp(pRuntimeRelaxedPath, "") && !key.addFile(pRuntimeRelaxedPath)) {
+    return false;
+  }
+
+  *pKey = key.finish();
+  return true;
+}
+
+Compiler::ErrorCode RSCompilerDriver::prepareScript(Script &pScript,
+                                                    const char *pScriptName,
+                                                    const char *pRuntimePath,
+                                                    const char *pBuildChecksum) {
   // embed build checksum metadata into the source
   if (pBuildChecksum != nullptr && strlen(pBuildChecksum) > 0) {
     pScript.getSource().addBuildChecksumMetadata(pBuildChecksum);
@@ -118,8 +694,17 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(Script& pScript, const char*
 
   // Verify that the only external functions in pScript are Renderscript
   // functions.  Fail if verification returns an error.
-  if (mCompiler.screenGlobalFunctions(pScript) != Compiler::kSuccess) {
-    return Compiler::kErrInvalidSource;
+  {
+    TraceScope trace("bcc: screenGlobalFunctions");
+    if (mCompiler.screenGlobalFunctions(pScript) != Compiler::kSuccess) {
+      return Compiler::kErrInvalidSource;
+    }
+  }
+
+  // Fold the bound values of exported globals into the script. This happens
+  // before linking the runtime, which has no such globals.
+  if (!mSpecializedGlobals.empty()) {
+    mCompiler.specializeGlobals(pScript, mSpecializedGlobals);
   }
 
   // For (32-bit) x86, translate GEPs on structs or arrays of structs to GEPs on
@@ -133,84 +718,151 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(Script& pScript, const char*
   // rules.
   if (!pScript.isStructExplicitlyPaddedBySlang() &&
       (mCompiler.getTargetMachine().getTargetTriple().getArch() == llvm::Triple::x86)) {
+    TraceScope trace("bcc: translateGEPs");
     mCompiler.translateGEPs(pScript);
   }
 
+  // Setup the config to the compiler. This happens before linking the
+  // runtime, since what gets linked in depends on this script's configuration.
+  bool compiler_need_reconfigure = setupConfig(pScript);
+
+  if (mConfig == nullptr) {
+    ALOGE("Failed to setup config for RS compiler to compile %s!",
+          pScriptName);
+    return Compiler::kErrInvalidSource;
+  }
+
+  if (compiler_need_reconfigure) {
+    Compiler::ErrorCode err = mCompiler.config(*mConfig);
+    if (err != Compiler::kSuccess) {
+      ALOGE("Failed to config the RS compiler for %s! (%s)", pScriptName,
+            Compiler::GetErrorString(err));
+      return Compiler::kErrInvalidSource;
+    }
+  }
+
+  // Linking the runtime only brings in what the script refers to, which has to
+  // include the vector math functions the vectorizer may call.
+  mCompiler.declareRuntimeVectorFunctions(pScript);
+
   //===--------------------------------------------------------------------===//
   // Link RS script with Renderscript runtime.
   //===--------------------------------------------------------------------===//
-  if (!pScript.LinkRuntime(pRuntimePath)) {
+  BuildStats::Clock::time_point link_start = BuildStats::Clock::now();
+  bool linked;
+  {
+    TraceScope trace("bcc: LinkRuntime");
+    linked = pScript.LinkRuntime(pRuntimePath);
+  }
+  mLastBuildStats.addLinkRuntimeTime(BuildStats::MillisecondsSince(link_start));
+  if (!linked) {
     ALOGE("Failed to link script '%s' with Renderscript runtime %s!",
           pScriptName, pRuntimePath);
     return Compiler::kErrInvalidSource;
   }
 
-  {
-    // FIXME(srhines): Windows compilation can't use locking like this, but
-    // we also don't need to worry about concurrent writers of the same file.
-#ifndef _WIN32
-    //===------------------------------------------------------------------===//
-    // Acquire the write lock for writing output object file.
-    //===------------------------------------------------------------------===//
-    FileMutex write_output_mutex(pOutputPath);
-
-    if (write_output_mutex.hasError() || !write_output_mutex.lockMutex()) {
-      ALOGE("Unable to acquire the lock for writing %s! (%s)",
-            pOutputPath, write_output_mutex.getErrorMessage().c_str());
-      return Compiler::kErrInvalidOutputFileState;
-    }
-#endif
-
-    // Open the output file for write.
-    std::error_code error;
-    llvm::raw_fd_ostream out_stream(pOutputPath, error, llvm::sys::fs::F_RW);
-    if (error) {
-      ALOGE("Unable to open %s for write! (%s)", pOutputPath,
-            error.message().c_str());
-      return Compiler::kErrPrepareOutput;
+  // The memory footprint is estimated from the linked module, so the fallback
+  // can only be picked now.
+  if (setupMemoryFallback(pScript)) {
+    Compiler::ErrorCode err = mCompiler.config(*mConfig);
+    if (err != Compiler::kSuccess) {
+      ALOGE("Failed to config the RS compiler for %s! (%s)", pScriptName,
+            Compiler::GetErrorString(err));
+      return Compiler::kErrInvalidSource;
     }
+  }
 
-    // Setup the config to the compiler.
-    bool compiler_need_reconfigure = setupConfig(pScript);
+  return Compiler::kSuccess;
+}
 
-    if (mConfig == nullptr) {
-      ALOGE("Failed to setup config for RS compiler to compile %s!",
-            pOutputPath);
-      return Compiler::kErrInvalidSource;
-    }
+Compiler::ErrorCode RSCompilerDriver::compileScript(Script& pScript, const char* pScriptName,
+                                                    const char* pOutputPath,
+                                                    const char* pRuntimePath,
+                                                    const char* pBuildChecksum,
+                                                    bool pDumpIR) {
+  Compiler::ErrorCode err = prepareScript(pScript, pScriptName, pRuntimePath,
+                                          pBuildChecksum);
+  if (err != Compiler::kSuccess) {
+    return err;
+  }
 
-    if (compiler_need_reconfigure) {
-      Compiler::ErrorCode err = mCompiler.config(*mConfig);
-      if (err != Compiler::kSuccess) {
-        ALOGE("Failed to config the RS compiler for %s! (%s)",pOutputPath,
-              Compiler::GetErrorString(err));
-        return Compiler::kErrInvalidSource;
-      }
+  {
+    // Open the output file for write. It is only moved into place once the
+    // compilation succeeded.
+    AtomicOutputFile output(pOutputPath);
+    if (!output.open()) {
+      return Compiler::kErrPrepareOutput;
     }
 
     std::unique_ptr<llvm::raw_fd_ostream> IRStream;
+    std::string ir_path;
     if (pDumpIR) {
-      std::string path(pOutputPath);
-      path.append(".ll");
+      ir_path = std::string(pOutputPath) + ".ll";
+      std::error_code error;
       IRStream.reset(new llvm::raw_fd_ostream(
-          path.c_str(), error, llvm::sys::fs::F_RW | llvm::sys::fs::F_Text));
+          ir_path.c_str(), error, llvm::sys::fs::F_RW | llvm::sys::fs::F_Text));
       if (error) {
-        ALOGE("Unable to open %s for write! (%s)", path.c_str(),
+        ALOGE("Unable to open %s for write! (%s)", ir_path.c_str(),
               error.message().c_str());
         return Compiler::kErrPrepareOutput;
       }
     }
 
     // Run the compiler.
+    mCompiler.setIRDumpPathPrefix(pOutputPath);
+    mCompiler.setOptimizationRemarksPath(
+        mOptimizationRemarks ? std::string(pOutputPath) + ".opt.yaml"
+                             : std::string());
     Compiler::ErrorCode compile_result =
-        mCompiler.compile(pScript, out_stream, IRStream.get());
+        mCompiler.compile(pScript, output.getStream(), IRStream.get());
 
+    if (compile_result == Compiler::kErrCancelled) {
+      // Leave nothing of the cancelled build behind.
+      if (IRStream) {
+        IRStream.reset();
+        llvm::sys::fs::remove(ir_path);
+      }
+      ALOGV("Cancelled the build of %s", pOutputPath);
+      return compile_result;
+    }
     if (compile_result != Compiler::kSuccess) {
       ALOGE("Unable to compile the source to file %s! (%s)", pOutputPath,
             Compiler::GetErrorString(compile_result));
       return Compiler::kErrInvalidSource;
     }
+
+    mLastBuildStats.addOutputBytes(output.getSize());
+    if (!output.commit()) {
+      return Compiler::kErrInvalidOutputFileState;
+    }
+  }
+
+  return Compiler::kSuccess;
+}
+
+Compiler::ErrorCode
+RSCompilerDriver::compileScriptToStream(Script &pScript,
+                                        const char *pScriptName,
+                                        llvm::raw_pwrite_stream &pObject,
+                                        const char *pRuntimePath,
+                                        const char *pBuildChecksum) {
+  Compiler::ErrorCode err = prepareScript(pScript, pScriptName, pRuntimePath,
+                                          pBuildChecksum);
+  if (err != Compiler::kSuccess) {
+    return err;
+  }
+
+  uint64_t start_offset = pObject.tell();
+  mCompiler.setIRDumpPathPrefix(std::string());
+  mCompiler.setOptimizationRemarksPath(std::string());
+  Compiler::ErrorCode compile_result = mCompiler.compile(pScript, pObject,
+                                                         nullptr);
+  if (compile_result != Compiler::kSuccess) {
+    ALOGE("Unable to compile the source %s! (%s)", pScriptName,
+          Compiler::GetErrorString(compile_result));
+    return Compiler::kErrInvalidSource;
   }
+  mLastBuildStats.addOutputBytes(pObject.tell() - start_offset);
 
   return Compiler::kSuccess;
 }
@@ -224,7 +876,9 @@ bool RSCompilerDriver::build(BCCContext &pContext,
                              const char *pRuntimePath,
                              RSLinkRuntimeCallback pLinkRuntimeCallback,
                              bool pDumpIR) {
-    //  android::StopWatch build_time("bcc: RSCompilerDriver::build time");
+  BuildStatsScope stats_scope(mLastBuildStats);
+  TraceScope trace_build("bcc: build");
+
   //===--------------------------------------------------------------------===//
   // Check parameters.
   //===--------------------------------------------------------------------===//
@@ -249,30 +903,393 @@ bool RSCompilerDriver::build(BCCContext &pContext,
   llvm::sys::path::append(output_path, pResName);
   llvm::sys::path::replace_extension(output_path, ".o");
 
+  if (pLinkRuntimeCallback) {
+    setLinkRuntimeCallback(pLinkRuntimeCallback);
+  }
+
+  std::string computed_checksum;
+  if (!resolveBuildChecksum(pResName, pBitcode, pBitcodeSize, pRuntimePath,
+                            &pBuildChecksum, &computed_checksum)) {
+    return false;
+  }
+
   //===--------------------------------------------------------------------===//
-  // Load the bitcode and create script.
+  // Look for an up-to-date object from a previous build.
   //===--------------------------------------------------------------------===//
-  Source *source = Source::CreateFromBuffer(pContext, pResName,
-                                            pBitcode, pBitcodeSize);
-  if (source == nullptr) {
+  std::string cache_key;
+  // The cache only tracks a single output object, and can't tell what a
+  // link-runtime callback did to it.
+  bool use_cache = mEnableCache && mLinkRuntimeCallback == nullptr &&
+                   !pDumpIR &&
+                   !(mIRDumpFiles && mIRDumpPoints != 0) &&
+                   !mOptimizationRemarks &&
+                   computeCacheKey(pBitcode, pBitcodeSize, pBuildChecksum,
+                                   pRuntimePath, &cache_key);
+  if (use_cache) {
+    if (isCacheEntryValid(output_path.c_str(), cache_key)) {
+      ALOGV("Reusing cached object %s for %s", output_path.c_str(), pResName);
+      mLastBuildStats.setCacheHit(true);
+      recordCacheUse(pCacheDir, output_path.c_str());
+      return true;
+    }
+  }
+
+#ifndef _WIN32
+  // Concurrent builds of the same object don't corrupt each other, since
+  // compileScript() publishes the output atomically, but they do waste work.
+  // Let at most one process compile it while the others sleep in flock() and
+  // then pick up its result. Failing to lock only costs the duplicate work.
+  std::unique_ptr<FileMutex> build_mutex;
+  if (use_cache) {
+    build_mutex.reset(new FileMutex(output_path.c_str()));
+    bool locked = false;
+    if (!build_mutex->hasError()) {
+      TraceScope trace("bcc: wait for output lock");
+      locked = build_mutex->waitMutex();
+    }
+    if (locked && isCacheEntryValid(output_path.c_str(), cache_key)) {
+      ALOGV("Reusing object %s built concurrently for %s",
+            output_path.c_str(), pResName);
+      mLastBuildStats.setCacheHit(true);
+      recordCacheUse(pCacheDir, output_path.c_str());
+      return true;
+    }
+  }
+#endif
+
+  if (use_cache) {
+    // The object is about to be overwritten; make sure an interrupted build
+    // can't leave behind a key that vouches for it.
+    invalidateCacheEntry(output_path.c_str());
+  }
+
+  bcinfo::BitcodeWrapper wrapper(pBitcode, pBitcodeSize);
+  bool tiered = mTieredCompilation &&
+                wrapper.getOptimizationLevel() != llvm::CodeGenOpt::None;
+
+  if (!compileBitcode(pContext, pResName, output_path.c_str(), nullptr,
+                      pBitcode,
+                      pBitcodeSize, pBuildChecksum, pRuntimePath, pDumpIR,
+                      /* pForceOptNone */tiered)) {
+    return false;
+  }
+
+  if (tiered) {
+    // The quick object must never be recorded as the cache entry; the
+    // optimized rebuild writes the key once it has replaced it.
+    scheduleOptimizedBuild(pResName, output_path.c_str(), pBitcode,
+                           pBitcodeSize, pBuildChecksum, pRuntimePath,
+                           use_cache ? cache_key : std::string());
+    recordCacheUse(pCacheDir, output_path.c_str());
+    return true;
+  }
+
+  if (use_cache) {
+    // Failing to record the key only costs a recompile next time.
+    writeCacheEntryKey(output_path.c_str(), cache_key);
+  }
+
+  recordCacheUse(pCacheDir, output_path.c_str());
+  return true;
+}
+
+void RSCompilerDriver::recordCacheUse(const char *pCacheDir,
+                                      const char *pObjectPath) {
+  if (mCacheBudget == 0) {
+    return;
+  }
+  // Failing to keep the index only makes later evictions less accurate.
+  updateCacheDirectory(pCacheDir, pObjectPath, mCacheBudget);
+}
+
+bool RSCompilerDriver::build(BCCContext &pContext, const char *pResName,
+                             const char *pBitcode, size_t pBitcodeSize,
+                             const char *pBuildChecksum,
+                             const char *pRuntimePath,
+                             llvm::raw_pwrite_stream &pObject,
+                             RSLinkRuntimeCallback pLinkRuntimeCallback) {
+  BuildStatsScope stats_scope(mLastBuildStats);
+  TraceScope trace_build("bcc: build");
+
+  if (pResName == nullptr) {
+    ALOGE("Invalid parameter passed to RSCompilerDriver::build()! (resource "
+          "name: (null))");
+    return false;
+  }
+
+  if ((pBitcode == nullptr) || (pBitcodeSize <= 0)) {
+    ALOGE("No bitcode supplied! (bitcode: %p, size of bitcode: %u)",
+          pBitcode, static_cast<unsigned>(pBitcodeSize));
     return false;
   }
 
-  Script script(source);
-  script.setOptimizationLevel(getConfig()->getOptimizationLevel());
   if (pLinkRuntimeCallback) {
     setLinkRuntimeCallback(pLinkRuntimeCallback);
   }
 
+  std::string computed_checksum;
+  if (!resolveBuildChecksum(pResName, pBitcode, pBitcodeSize, pRuntimePath,
+                            &pBuildChecksum, &computed_checksum)) {
+    return false;
+  }
+
+  return compileBitcode(pContext, pResName, nullptr, &pObject, pBitcode,
+                        pBitcodeSize, pBuildChecksum, pRuntimePath,
+                        /* pDumpIR */false, /* pForceOptNone */false);
+}
+
+std::shared_ptr<RSAsyncBuild>
+RSCompilerDriver::buildAsync(const char *pCacheDir, const char *pResName,
+                             const char *pBitcode, size_t pBitcodeSize,
+                             const char *pBuildChecksum,
+                             const char *pRuntimePath,
+                             RSLinkRuntimeCallback pLinkRuntimeCallback) {
+  if ((pCacheDir == nullptr) || (pResName == nullptr) ||
+      (pRuntimePath == nullptr)) {
+    ALOGE("Invalid parameter passed to RSCompilerDriver::buildAsync()! (cache "
+          "dir: %s, resource name: %s)", ((pCacheDir) ? pCacheDir : "(null)"),
+                                         ((pResName) ? pResName : "(null)"));
+    return nullptr;
+  }
+
+  if ((pBitcode == nullptr) || (pBitcodeSize <= 0)) {
+    ALOGE("No bitcode supplied! (bitcode: %p, size of bitcode: %u)",
+          pBitcode, static_cast<unsigned>(pBitcodeSize));
+    return nullptr;
+  }
+
+  // None of the arguments outlive this call.
+  std::string cache_dir(pCacheDir);
+  std::string res_name(pResName);
+  std::string bitcode(pBitcode, pBitcodeSize);
+  std::string checksum(pBuildChecksum ? pBuildChecksum : "");
+  std::string runtime_path(pRuntimePath);
+  return scheduleAsyncBuild([=](RSCompilerDriver &pDriver) {
+    BCCContext context;
+    return pDriver.build(context, cache_dir.c_str(), res_name.c_str(),
+                         bitcode.data(), bitcode.size(), checksum.c_str(),
+                         runtime_path.c_str(), pLinkRuntimeCallback);
+  });
+}
+
+bool RSCompilerDriver::buildApp(BCCContext &pContext, const char *pCacheDir,
+                                const std::vector<RSAppScript> &pScripts,
+                                const char *pRuntimePath,
+                                const char *pSharedRuntimeName,
+                                RSLinkRuntimeCallback pLinkRuntimeCallback) {
+  TraceScope trace_build("bcc: build app");
+
+  if ((pCacheDir == nullptr) || (pSharedRuntimeName == nullptr) ||
+      pScripts.empty()) {
+    ALOGE("Invalid parameter passed to RSCompilerDriver::buildApp()! (cache "
+          "dir: %s, shared runtime name: %s, %u scripts)",
+          ((pCacheDir) ? pCacheDir : "(null)"),
+          ((pSharedRuntimeName) ? pSharedRuntimeName : "(null)"),
+          static_cast<unsigned>(pScripts.size()));
+    return false;
+  }
+
+  // The objects leave the runtime functions they don't import undefined, for
+  // the shared runtime to define. A quick object of a tiered build could
+  // refer to other functions than the optimized one replacing it later, after
+  // the shared runtime has been built.
+  const unsigned import_limit = mRuntimeImportLimit;
+  const bool tiered = mTieredCompilation;
+  if (mRuntimeImportLimit == 0) {
+    mRuntimeImportLimit = kAppRuntimeImportLimit;
+  }
+  mTieredCompilation = false;
+
+  std::set<std::string> symbols;
+  bool success = true;
+  for (const RSAppScript &script : pScripts) {
+    if (!build(pContext, pCacheDir, script.mResName.c_str(), script.mBitcode,
+               script.mBitcodeSize, script.mBuildChecksum.c_str(),
+               pRuntimePath, pLinkRuntimeCallback)) {
+      success = false;
+      break;
+    }
+
+    // {pCacheDir}/{mResName}.o, as build() names it.
+    llvm::SmallString<80> object_path(pCacheDir);
+    llvm::sys::path::append(object_path, script.mResName);
+    llvm::sys::path::replace_extension(object_path, ".o");
+    std::string path(object_path.str());
+    success = addUndefinedSymbols(path, symbols);
+    if (!success) {
+      break;
+    }
+  }
+
+  mRuntimeImportLimit = import_limit;
+  mTieredCompilation = tiered;
+  if (!success) {
+    return false;
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Construct output path.
+  // {pCacheDir}/{pSharedRuntimeName}.o
+  //===--------------------------------------------------------------------===//
+  llvm::SmallString<80> output_path(pCacheDir);
+  llvm::sys::path::append(output_path, pSharedRuntimeName);
+  llvm::sys::path::replace_extension(output_path, ".o");
+
+  if (!buildSharedRuntime(pContext, output_path.c_str(), pRuntimePath,
+                          symbols)) {
+    return false;
+  }
+
+  recordCacheUse(pCacheDir, output_path.c_str());
+  return true;
+}
+
+bool RSCompilerDriver::buildSharedRuntime(BCCContext &pContext,
+                                          const char *pOutputPath,
+                                          const char *pRuntimePath,
+                                          const std::set<std::string> &pSymbols) {
+  BuildStatsScope stats_scope(mLastBuildStats);
+  TraceScope trace_build("bcc: build shared runtime");
+
+  std::unique_ptr<Source> runtime(
+      pContext.loadRuntimeLibrary(pRuntimePath, /* pLazy */true));
+  if (runtime == nullptr) {
+    ALOGE("Failed to load Renderscript library '%s'!", pRuntimePath);
+    return false;
+  }
+  llvm::Module &runtime_module = runtime->getModule();
+
+  // Declare what the objects refer to, so that merging the library only
+  // brings in those definitions and whatever they depend on. The other
+  // undefined symbols are stubs that the driver resolves when loading the
+  // script.
+  llvm::Module *module = new (std::nothrow) llvm::Module(
+      pOutputPath, pContext.getLLVMContext());
+  if (module == nullptr) {
+    ALOGE("Out of memory when creating the shared runtime module!");
+    return false;
+  }
+  module->setTargetTriple(runtime_module.getTargetTriple());
+  module->setDataLayout(runtime_module.getDataLayout());
+
+  std::set<std::string> exports;
+  for (const std::string &name : pSymbols) {
+    const llvm::GlobalValue *value = runtime_module.getNamedValue(name);
+    if ((value == nullptr) || value->isDeclaration() ||
+        value->hasLocalLinkage()) {
+      continue;
+    }
+    if (const llvm::Function *function = llvm::dyn_cast<llvm::Function>(value)) {
+      module->getOrInsertFunction(name, function->getFunctionType());
+    } else if (const llvm::GlobalVariable *variable =
+                   llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+      new llvm::GlobalVariable(*module, variable->getValueType(),
+                               variable->isConstant(),
+                               llvm::GlobalValue::ExternalLinkage,
+                               /* Initializer */nullptr, name);
+    } else {
+      continue;
+    }
+    exports.insert(name);
+  }
+
+  std::unique_ptr<Source> shared(Source::CreateFromModule(
+      pContext, pOutputPath, *module, runtime->getCompilerVersion(),
+      llvm::CodeGenOpt::Aggressive));
+  if (shared == nullptr) {
+    delete module;
+    return false;
+  }
+
+  // Keep the wrapper metadata of the shared module only (see
+  // Script::LinkRuntime()).
+  llvm::NamedMDNode *const wrapperMDNode = runtime_module.getNamedMetadata(
+      bcinfo::MetadataExtractor::kWrapperMetadataName);
+  if (wrapperMDNode != nullptr) {
+    runtime_module.eraseNamedMetadata(wrapperMDNode);
+  }
+  if (!shared->merge(*runtime, /* pOnlyNeeded */true)) {
+    ALOGE("Failed to link Renderscript library '%s'!", pRuntimePath);
+    return false;
+  }
+
+  // Configure the compiler as for a script at the highest optimization level.
+  Script script(shared.get());
+  script.setOptimizationLevel(llvm::CodeGenOpt::Aggressive);
+  bool compiler_need_reconfigure = setupConfig(script);
+  if (mConfig == nullptr) {
+    return false;
+  }
+  if (compiler_need_reconfigure) {
+    Compiler::ErrorCode err = mCompiler.config(*mConfig);
+    if (err != Compiler::kSuccess) {
+      ALOGE("Failed to config the RS compiler for %s! (%s)", pOutputPath,
+            Compiler::GetErrorString(err));
+      return false;
+    }
+  }
+
+  AtomicOutputFile output(pOutputPath);
+  if (!output.open()) {
+    return false;
+  }
+  Compiler::ErrorCode compile_result =
+      mCompiler.compileSharedRuntime(shared->getModule(), exports,
+                                     output.getStream());
+  if (compile_result != Compiler::kSuccess) {
+    ALOGE("Unable to compile the shared runtime %s! (%s)", pOutputPath,
+          Compiler::GetErrorString(compile_result));
+    return false;
+  }
+  mLastBuildStats.addOutputBytes(output.getSize());
+  return output.commit();
+}
+
+bool RSCompilerDriver::compileBitcode(BCCContext &pContext,
+                                      const char *pResName,
+                                      const char *pOutputPath,
+                                      llvm::raw_pwrite_stream *pObject,
+                                      const char *pBitcode,
+                                      size_t pBitcodeSize,
+                                      const char *pBuildChecksum,
+                                      const char *pRuntimePath, bool pDumpIR,
+                                      bool pForceOptNone) {
+  //===--------------------------------------------------------------------===//
+  // Load the bitcode and create script.
+  //===--------------------------------------------------------------------===//
+  BuildStats::Clock::time_point parse_start = BuildStats::Clock::now();
+  Source *source;
+  {
+    TraceScope trace("bcc: load bitcode");
+    source = Source::CreateFromBuffer(pContext, pResName, pBitcode,
+                                      pBitcodeSize);
+  }
+  mLastBuildStats.addParseTime(BuildStats::MillisecondsSince(parse_start));
+  if (source == nullptr) {
+    return false;
+  }
+
+  Script script(source);
+  script.setOptimizationLevel(getConfig()->getOptimizationLevel());
   script.setLinkRuntimeCallback(getLinkRuntimeCallback());
 
   script.setEmbedGlobalInfo(mEmbedGlobalInfo);
   script.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  script.setRuntimeImportLimit(mRuntimeImportLimit);
+  script.setDebugContext(mDebugContext);
 
   // Read optimization level from bitcode wrapper.
   bcinfo::BitcodeWrapper wrapper(pBitcode, pBitcodeSize);
   script.setOptimizationLevel(static_cast<llvm::CodeGenOpt::Level>(
                               wrapper.getOptimizationLevel()));
+  if (mOptimizedDebug && script.getOptimizationLevel() == llvm::CodeGenOpt::None &&
+      source->getDebugInfoEnabled()) {
+    script.setOptimizationLevel(llvm::CodeGenOpt::Less);
+    script.setOptimizedDebug(true);
+  }
+  if (pForceOptNone) {
+    script.setOptimizationLevel(llvm::CodeGenOpt::None);
+  }
 
 // Assertion-enabled builds can't compile legacy bitcode (due to the use of
 // getName() with anonymous structure definitions).
@@ -291,15 +1308,217 @@ bool RSCompilerDriver::build(BCCContext &pContext,
   //===--------------------------------------------------------------------===//
   // Compile the script
   //===--------------------------------------------------------------------===//
-  Compiler::ErrorCode status = compileScript(script, pResName,
-                                             output_path.c_str(),
-                                             pRuntimePath,
-                                             pBuildChecksum,
-                                             pDumpIR);
+  Compiler::ErrorCode status;
+  if (pObject != nullptr) {
+    status = compileScriptToStream(script, pResName, *pObject, pRuntimePath,
+                                   pBuildChecksum);
+  } else {
+    status = compileScript(script, pResName, pOutputPath, pRuntimePath,
+                           pBuildChecksum, pDumpIR);
+  }
 
   return status == Compiler::kSuccess;
 }
 
+void RSCompilerDriver::scheduleOptimizedBuild(const char *pResName,
+                                              const char *pOutputPath,
+                                              const char *pBitcode,
+                                              size_t pBitcodeSize,
+                                              const char *pBuildChecksum,
+                                              const char *pRuntimePath,
+                                              const std::string &pCacheKey) {
+  // The rebuild runs on the async build pool, with its own driver and
+  // BCCContext (see the class comment), so it can't interfere with whatever
+  // the caller compiles next and at most getAsyncBuildJobs() compiles run at
+  // once. Everything it needs is copied, since none of the arguments outlive
+  // build().
+  std::string res_name(pResName);
+  std::string output_path(pOutputPath);
+  std::string bitcode(pBitcode, pBitcodeSize);
+  std::string build_checksum(pBuildChecksum ? pBuildChecksum : "");
+  std::string runtime_path(pRuntimePath);
+  std::string cache_key(pCacheKey);
+  RSTieredBuildCallback callback = mTieredCallback;
+
+  // The rebuild only replaces the quick object this build just published.
+  llvm::sys::fs::file_status quick_status;
+  llvm::sys::fs::status(output_path, quick_status);
+
+  auto rebuild = [=](RSCompilerDriver &pDriver) {
+    // Compile into a temporary file, which is only moved into place once the
+    // quick object turns out to still be the current one.
+    BCCContext context;
+    AtomicOutputFile output(output_path);
+    bool success = output.open() &&
+                   pDriver.compileBitcode(context, res_name.c_str(), nullptr,
+                                          &output.getStream(),
+                                          bitcode.data(), bitcode.size(),
+                                          build_checksum.c_str(),
+                                          runtime_path.c_str(),
+                                          /* pDumpIR */false,
+                                          /* pForceOptNone */false);
+    if (!success) {
+      ALOGE("Optimized rebuild of %s failed; keeping the quick build",
+            res_name.c_str());
+    } else {
+      // Publish under the lock build() compiles under. Without it, a build
+      // of the same output started meanwhile (by this or another process)
+      // could have its object overwritten, or the key of this rebuild
+      // recorded for its object.
+      bool locked = true;
+#ifndef _WIN32
+      FileMutex output_mutex(output_path);
+      locked = !output_mutex.hasError() && output_mutex.waitMutex();
+#endif
+      if (!locked) {
+        ALOGE("Unable to lock %s; dropping its optimized rebuild",
+              output_path.c_str());
+        success = false;
+      } else if (hasCacheEntryKey(output_path.c_str()) ||
+                 !isSameFile(output_path, quick_status)) {
+        ALOGV("%s was rebuilt meanwhile; dropping its optimized rebuild",
+              output_path.c_str());
+        success = false;
+      } else if (!output.commit()) {
+        success = false;
+      } else if (!cache_key.empty()) {
+        // Failing to record the key only costs a recompile next time.
+        writeCacheEntryKey(output_path.c_str(), cache_key);
+      }
+    }
+
+    if (success && pDriver.getCacheBudget() > 0) {
+      // The optimized object doesn't have the size of the quick one.
+      std::string cache_dir = llvm::sys::path::parent_path(output_path);
+      updateCacheDirectory(cache_dir.c_str(), output_path.c_str(),
+                           pDriver.getCacheBudget());
+    }
+
+    if (callback) {
+      callback(output_path.c_str(), success);
+    }
+    return success;
+  };
+
+  // Forget the rebuilds that are already done, so a long-lived driver
+  // doesn't accumulate their handles.
+  mTieredBuilds.erase(
+      std::remove_if(mTieredBuilds.begin(), mTieredBuilds.end(),
+                     [](const std::shared_ptr<RSAsyncBuild> &pBuild) {
+                       return pBuild->isDone();
+                     }),
+      mTieredBuilds.end());
+  mTieredBuilds.push_back(scheduleAsyncBuild(rebuild));
+}
+
+void RSCompilerDriver::waitForOptimizedBuilds() {
+  for (const std::shared_ptr<RSAsyncBuild> &build : mTieredBuilds) {
+    build->wait();
+  }
+  mTieredBuilds.clear();
+}
+
+std::unique_ptr<RSCompilerDriver> RSCompilerDriver::cloneSettings() const {
+  std::unique_ptr<RSCompilerDriver> driver(new RSCompilerDriver());
+  if (mConfig != nullptr) {
+    driver->setConfig(new CompilerConfig(*mConfig));
+  }
+  driver->setDebugContext(mDebugContext);
+  driver->setOptimizedDebug(mOptimizedDebug);
+  driver->setRuntimeImportLimit(mRuntimeImportLimit);
+  driver->setLinkRuntimeCallback(mLinkRuntimeCallback);
+  driver->setEnableGlobalMerge(mEnableGlobalMerge);
+  driver->setEnableGlobalLayout(mEnableGlobalLayout);
+  driver->setEmbedGlobalInfo(mEmbedGlobalInfo);
+  driver->setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  driver->setEmbedBinaryInfo(mEmbedBinaryInfo);
+  driver->setEnableCache(mEnableCache);
+  driver->setScriptGroupPreOptJobs(mScriptGroupPreOptJobs);
+  driver->setProfileGenerate(mProfileGeneratePath);
+  driver->setProfileUse(mProfileUsePath);
+  driver->setSpecializedGlobals(mSpecializedGlobals);
+  driver->setKernelReport(mKernelReport);
+  driver->setIRDump(mIRDumpPoints, mIRDumpKernels, mIRDumpFiles,
+                    mIRCountInstructions);
+  driver->setOptimizationRemarks(mOptimizationRemarks);
+  driver->setStreamingCodeGen(mStreamingCodeGen);
+  driver->setMemoryBudget(mMemoryBudget);
+  driver->setCacheBudget(mCacheBudget);
+  driver->setComputeBuildChecksum(mComputeBuildChecksum);
+  return driver;
+}
+
+std::shared_ptr<RSAsyncBuild>
+RSCompilerDriver::scheduleAsyncBuild(std::function<bool(RSCompilerDriver &)> pRun) {
+  AsyncJob job;
+  job.mBuild = std::make_shared<RSAsyncBuild>();
+  job.mDriver = cloneSettings();
+  job.mRun = std::move(pRun);
+  std::shared_ptr<RSAsyncBuild> build = job.mBuild;
+
+  unsigned max_workers = mAsyncBuildJobs;
+  if (max_workers == 0) {
+    max_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mAsyncLock);
+    mAsyncJobs.push_back(std::move(job));
+    if (mAsyncWorkers.size() < max_workers) {
+      mAsyncWorkers.emplace_back(&RSCompilerDriver::runAsyncBuilds, this);
+    }
+  }
+  mAsyncAvailable.notify_one();
+  return build;
+}
+
+void RSCompilerDriver::runAsyncBuilds() {
+  while (true) {
+    AsyncJob job;
+    {
+      std::unique_lock<std::mutex> lock(mAsyncLock);
+      mAsyncAvailable.wait(lock, [this] {
+        return mAsyncShutdown || !mAsyncJobs.empty();
+      });
+      if (mAsyncJobs.empty()) {
+        return;
+      }
+      job = std::move(mAsyncJobs.front());
+      mAsyncJobs.pop_front();
+    }
+
+    bool success = false;
+    RSCompilerDriver &driver = *job.mDriver;
+    if (job.mBuild->isCancelled()) {
+      ALOGV("Dropping a build cancelled before it started");
+    } else if (driver.mConfig != nullptr &&
+               driver.mCompiler.config(*driver.mConfig) != Compiler::kSuccess) {
+      ALOGE("Failed to config the RS compiler for an asynchronous build!");
+    } else {
+      driver.setCancellationFlag(&job.mBuild->mCancelled);
+      success = job.mRun(driver);
+      if (!success && job.mBuild->isCancelled()) {
+        ALOGV("Cancelled an asynchronous build");
+      }
+    }
+
+    // A cancelled build only returns once its output lock is released and
+    // its temporary files are gone.
+    job.mDriver.reset();
+    job.mBuild->mPromise.set_value(success);
+  }
+}
+
+bool RSCompilerDriver::planScriptGroupFusion(
+    const std::vector<Source*>& pSources,
+    const std::vector<ScriptGroupEdge>& pEdges,
+    const std::vector<std::pair<int, int>>& pGroupOutputs,
+    std::list<std::list<std::pair<int, int>>>* pToFuse,
+    std::list<std::string>* pFused, std::list<size_t>* pBytesSaved) {
+  return planKernelFusion(pSources, pEdges, pGroupOutputs, pToFuse, pFused,
+                          pBytesSaved);
+}
+
 bool RSCompilerDriver::buildScriptGroup(
     BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
     const char* pRuntimeRelaxedPath, bool dumpIR, const char* buildChecksum,
@@ -307,17 +1526,60 @@ bool RSCompilerDriver::buildScriptGroup(
     const std::list<std::list<std::pair<int, int>>>& toFuse,
     const std::list<std::string>& fused,
     const std::list<std::list<std::pair<int, int>>>& invokes,
-    const std::list<std::string>& invokeBatchNames) {
+    const std::list<std::string>& invokeBatchNames,
+    const std::list<std::list<std::pair<int, int>>>& toFuseIntoReduce,
+    const std::list<std::string>& fusedReduces,
+    const std::list<ScriptGroupStencilFusion>& stencilFusions,
+    const std::list<std::list<std::pair<int, int>>>& toFuseFanOut,
+    const std::list<std::string>& fusedFanOuts) {
+  BuildStatsScope stats_scope(mLastBuildStats);
+  TraceScope trace_build("bcc: buildScriptGroup");
 
   // Read and store metadata before linking the modules together
   std::vector<bcinfo::MetadataExtractor*> metadata;
   for (Source* source : sources) {
-    if (!source->extractMetadata()) {
+    // planScriptGroupFusion() may have extracted it already.
+    if (source->getMetadata() == nullptr && !source->extractMetadata()) {
       ALOGE("Cannot extract metadata from module");
       return false;
     }
   }
 
+  // ---------------------------------------------------------------------------
+  // Look for an up-to-date object from a previous build of the same group
+  // ---------------------------------------------------------------------------
+
+  llvm::SmallString<80> output_path(pOutputFilepath);
+  llvm::sys::path::replace_extension(output_path, ".o");
+
+  std::string cache_key;
+  bool use_cache = mEnableCache && mLinkRuntimeCallback == nullptr &&
+                   !dumpIR &&
+                   !(mIRDumpFiles && mIRDumpPoints != 0) &&
+                   !mOptimizationRemarks &&
+                   computeScriptGroupCacheKey(sources, buildChecksum, pRuntimePath,
+                                              pRuntimeRelaxedPath, toFuse, fused,
+                                              invokes, invokeBatchNames,
+                                              toFuseIntoReduce, fusedReduces,
+                                              stencilFusions, toFuseFanOut,
+                                              fusedFanOuts, &cache_key);
+  if (use_cache) {
+    if (isCacheEntryValid(output_path.c_str(), cache_key)) {
+      ALOGV("Reusing cached object %s for the script group", output_path.c_str());
+      mLastBuildStats.setCacheHit(true);
+      return true;
+    }
+    invalidateCacheEntry(output_path.c_str());
+  }
+
+  // ---------------------------------------------------------------------------
+  // Optimize the input modules on their own, in parallel
+  // ---------------------------------------------------------------------------
+
+  if (mScriptGroupPreOptJobs > 0) {
+    preOptimizeSources(Context, sources, mScriptGroupPreOptJobs);
+  }
+
   // ---------------------------------------------------------------------------
   // Link all input modules into a single module
   // ---------------------------------------------------------------------------
@@ -378,17 +1640,82 @@ bool RSCompilerDriver::buildScriptGroup(
   }
 
   // ---------------------------------------------------------------------------
-  // Rename invokes
+  // Create fused fan-out kernels
+  // ---------------------------------------------------------------------------
+
+  auto fanOutInputIter = toFuseFanOut.begin();
+  for (const std::string& nameOfFused : fusedFanOuts) {
+    auto inputKernels = *fanOutInputIter++;
+    std::vector<Source*> sourcesToFuse;
+    std::vector<int> slots;
+
+    for (auto p : inputKernels) {
+      sourcesToFuse.push_back(sources[p.first]);
+      slots.push_back(p.second);
+    }
+
+    if (!fuseFanOutKernels(Context, sourcesToFuse, slots, nameOfFused, &module)) {
+      return false;
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // Create fused reductions
+  // ---------------------------------------------------------------------------
+
+  // The last pair of each list is the reduction, and the others the kernels
+  // fused into its accumulator.
+  auto reduceInputIter = toFuseIntoReduce.begin();
+  for (const std::string& nameOfFused : fusedReduces) {
+    auto inputKernels = *reduceInputIter++;
+    const std::pair<int, int> reduce = inputKernels.back();
+    inputKernels.pop_back();
+
+    std::vector<Source*> sourcesToFuse;
+    std::vector<int> slots;
+
+    for (auto p : inputKernels) {
+      sourcesToFuse.push_back(sources[p.first]);
+      slots.push_back(p.second);
+    }
+
+    if (sourcesToFuse.empty() ||
+        !fuseKernelsIntoReduce(Context, sourcesToFuse, slots, sources[reduce.first],
+                               reduce.second, nameOfFused, &module)) {
+      return false;
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // Create fused stencil kernels
+  // ---------------------------------------------------------------------------
+
+  for (const ScriptGroupStencilFusion& stencil : stencilFusions) {
+    if (!fuseStencilKernels(Context, sources[stencil.mProducer.first],
+                            stencil.mProducer.second,
+                            sources[stencil.mConsumer.first],
+                            stencil.mConsumer.second, stencil.mAllocation,
+                            stencil.mName, &module)) {
+      return false;
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // Create batched invokes
   // ---------------------------------------------------------------------------
 
   auto invokeIter = invokes.begin();
   for (const std::string& newName : invokeBatchNames) {
-    auto inputInvoke = *invokeIter++;
-    auto p = inputInvoke.front();
-    Source* source = sources[p.first];
-    int slot = p.second;
+    auto inputInvokes = *invokeIter++;
+    std::vector<Source*> sourcesToFuse;
+    std::vector<int> slots;
+
+    for (auto p : inputInvokes) {
+      sourcesToFuse.push_back(sources[p.first]);
+      slots.push_back(p.second);
+    }
 
-    if (!renameInvoke(Context, source, slot, newName, &module)) {
+    if (!fuseInvokes(Context, sourcesToFuse, slots, newName, &module)) {
       return false;
     }
   }
@@ -410,36 +1737,101 @@ bool RSCompilerDriver::buildScriptGroup(
   script.setOptimizationLevel(llvm::CodeGenOpt::Level::Aggressive);
   script.setEmbedGlobalInfo(mEmbedGlobalInfo);
   script.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
-
-  llvm::SmallString<80> output_path(pOutputFilepath);
-  llvm::sys::path::replace_extension(output_path, ".o");
+  script.setEmbedBinaryInfo(mEmbedBinaryInfo);
+  script.setRuntimeImportLimit(mRuntimeImportLimit);
+  script.setDebugContext(mDebugContext);
 
   // Pick the right runtime lib
   const char* coreLibPath = pRuntimePath;
   if (strcmp(pRuntimeRelaxedPath, "")) {
-      bcinfo::MetadataExtractor me(&module);
-      me.extract();
-      if (me.getRSFloatPrecision() == bcinfo::RS_FP_Relaxed) {
+      // The metadata extracted here is reused when compiling the script.
+      if (source->extractMetadata() &&
+          source->getMetadata()->getRSFloatPrecision() == bcinfo::RS_FP_Relaxed) {
           coreLibPath = pRuntimeRelaxedPath;
       }
   }
 
-  compileScript(script, pOutputFilepath, output_path.c_str(), coreLibPath,
-                buildChecksum, dumpIR);
+  Compiler::ErrorCode status =
+      compileScript(script, pOutputFilepath, output_path.c_str(), coreLibPath,
+                    buildChecksum, dumpIR);
 
-  return true;
+  if (use_cache && status == Compiler::kSuccess) {
+    // Failing to record the key only costs a recompile next time.
+    writeCacheEntryKey(output_path.c_str(), cache_key);
+  }
+
+  return status == Compiler::kSuccess;
+}
+
+std::shared_ptr<RSAsyncBuild> RSCompilerDriver::buildScriptGroupAsync(
+    BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
+    const char* pRuntimeRelaxedPath, const char* buildChecksum,
+    const std::vector<Source*>& sources,
+    const std::list<std::list<std::pair<int, int>>>& toFuse,
+    const std::list<std::string>& fused,
+    const std::list<std::list<std::pair<int, int>>>& invokes,
+    const std::list<std::string>& invokeBatchNames,
+    const std::list<std::list<std::pair<int, int>>>& toFuseIntoReduce,
+    const std::list<std::string>& fusedReduces,
+    const std::list<ScriptGroupStencilFusion>& stencilFusions,
+    const std::list<std::list<std::pair<int, int>>>& toFuseFanOut,
+    const std::list<std::string>& fusedFanOuts) {
+  if ((pOutputFilepath == nullptr) || (pRuntimePath == nullptr) ||
+      (pRuntimeRelaxedPath == nullptr)) {
+    ALOGE("Invalid parameter passed to "
+          "RSCompilerDriver::buildScriptGroupAsync()!");
+    return nullptr;
+  }
+
+  // The build gets copies of the sources in a context of its own, so that the
+  // caller may go on using Context (whose LLVMContext is not thread-safe) and
+  // the sources. The modules are only serialized here, and parsed back by
+  // the worker.
+  std::shared_ptr<std::vector<SerializedSource>> serialized =
+      std::make_shared<std::vector<SerializedSource>>(sources.size());
+  for (size_t i = 0; i < sources.size(); i++) {
+    (*serialized)[i].serialize(*sources[i]);
+  }
+
+  std::string output_path(pOutputFilepath);
+  std::string runtime_path(pRuntimePath);
+  std::string runtime_relaxed_path(pRuntimeRelaxedPath);
+  const bool has_checksum = buildChecksum != nullptr;
+  std::string checksum(has_checksum ? buildChecksum : "");
+  return scheduleAsyncBuild([=](RSCompilerDriver &pDriver) {
+    // The context deletes the sources loaded into it.
+    BCCContext context;
+    std::vector<Source *> worker_sources;
+    for (const SerializedSource &source : *serialized) {
+      Source *worker_source = source.load(context);
+      if (worker_source == nullptr) {
+        return false;
+      }
+      worker_sources.push_back(worker_source);
+    }
+    return pDriver.buildScriptGroup(
+        context, output_path.c_str(), runtime_path.c_str(),
+        runtime_relaxed_path.c_str(), /* dumpIR */false,
+        has_checksum ? checksum.c_str() : nullptr, worker_sources, toFuse,
+        fused, invokes, invokeBatchNames, toFuseIntoReduce, fusedReduces,
+        stencilFusions, toFuseFanOut, fusedFanOuts);
+  });
 }
 
 bool RSCompilerDriver::buildForCompatLib(Script &pScript, const char *pOut,
                                          const char *pBuildChecksum,
                                          const char *pRuntimePath,
                                          bool pDumpIR) {
+  BuildStatsScope stats_scope(mLastBuildStats);
+  TraceScope trace_build("bcc: buildForCompatLib");
+
   // Embed the info string directly in the ELF, since this path is for an
   // offline (host) compilation.
   pScript.setEmbedInfo(true);
 
   pScript.setEmbedGlobalInfo(mEmbedGlobalInfo);
   pScript.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  pScript.setEmbedBinaryInfo(mEmbedBinaryInfo);
   pScript.setLinkRuntimeCallback(getLinkRuntimeCallback());
 
   Compiler::ErrorCode status = compileScript(pScript, pOut, pOut, pRuntimePath,
@@ -450,3 +1842,26 @@ bool RSCompilerDriver::buildForCompatLib(Script &pScript, const char *pOut,
 
   return true;
 }
+
+bool RSCompilerDriver::buildForCompatLib(Script &pScript,
+                                         llvm::raw_pwrite_stream &pObject,
+                                         const char *pBuildChecksum,
+                                         const char *pRuntimePath) {
+  BuildStatsScope stats_scope(mLastBuildStats);
+  TraceScope trace_build("bcc: buildForCompatLib");
+
+  // Embed the info string directly in the ELF, since this path is for an
+  // offline (host) compilation.
+  pScript.setEmbedInfo(true);
+
+  pScript.setEmbedGlobalInfo(mEmbedGlobalInfo);
+  pScript.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  pScript.setEmbedBinaryInfo(mEmbedBinaryInfo);
+  pScript.setLinkRuntimeCallback(getLinkRuntimeCallback());
+
+  const std::string &name = pScript.getSource().getIdentifier();
+  Compiler::ErrorCode status = compileScriptToStream(pScript, name.c_str(),
+                                                     pObject, pRuntimePath,
+                                                     pBuildChecksum);
+  return status == Compiler::kSuccess;
+}
@@ -21,26 +21,123 @@
 #include "rsDefines.h"
 
 #include "bcc/Config.h"
+#include "bcc/RSInfoBinary.h"
 #include "bcinfo/MetadataExtractor.h"
 
 #include <string>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/LoopInfo.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/Type.h>
 
 using namespace bcc;
 
+namespace bcc {
+
+const char kRsInfoBinary[] = ".rs.info.bin";
+
+}  // end namespace bcc
+
 namespace {
 
+// For testing with opt, where the pass is created without arguments.
+llvm::cl::opt<bool> ClEmbedBinaryInfo(
+    "rs-embed-binary-info", llvm::cl::Hidden,
+    llvm::cl::desc("Also embed the RS info in binary form"));
+
+// Lays out the tables and the string pool of an RSInfoBinaryHeader blob.
+class RSInfoBinaryWriter {
+private:
+  static_assert(sizeof(RSInfoBinaryHeader) % sizeof(uint32_t) == 0,
+                "RSInfoBinaryHeader must be made of whole words");
+
+  RSInfoBinaryHeader mHeader;
+
+  // The header, followed by the tables.
+  std::vector<uint32_t> mWords;
+
+  std::string mPool;
+  llvm::StringMap<uint32_t> mPoolOffsets;
+
+public:
+  RSInfoBinaryWriter()
+      : mHeader(), mWords(sizeof(RSInfoBinaryHeader) / sizeof(uint32_t)) {
+  }
+
+  RSInfoBinaryHeader &header() { return mHeader; }
+
+  // Returns the offset of Str in the string pool, adding it if needed.
+  uint32_t addString(llvm::StringRef Str) {
+    auto Entry = mPoolOffsets.insert(std::make_pair(Str, static_cast<uint32_t>(mPool.size())));
+    if (Entry.second) {
+      mPool.append(Str.begin(), Str.end());
+      mPool.push_back('\0');
+    }
+    return Entry.first->second;
+  }
+
+  // Likewise, or returns kRSInfoBinaryNoString if Str is nullptr.
+  uint32_t addString(const char *Str) {
+    if (Str == nullptr) {
+      return kRSInfoBinaryNoString;
+    }
+    return addString(llvm::StringRef(Str));
+  }
+
+  // Starts Table, whose entries are the words added until the next table.
+  void beginTable(RSInfoBinaryTable &Table, size_t Count) {
+    Table.mCount = Count;
+    Table.mOffset = mWords.size() * sizeof(uint32_t);
+  }
+
+  void addWord(uint32_t Word) { mWords.push_back(Word); }
+
+  // Returns the finished blob.
+  std::vector<uint8_t> finish() {
+    mHeader.mMagic = kRSInfoBinaryMagic;
+    mHeader.mVersion = kRSInfoBinaryVersion;
+    mHeader.mHeaderSize = sizeof(RSInfoBinaryHeader);
+    mHeader.mStringPool.mCount = mPool.size();
+    mHeader.mStringPool.mOffset = mWords.size() * sizeof(uint32_t);
+    mHeader.mTotalSize = mHeader.mStringPool.mOffset + mPool.size();
+    memcpy(mWords.data(), &mHeader, sizeof(mHeader));
+
+    std::vector<uint8_t> Blob;
+    Blob.reserve(mHeader.mTotalSize);
+    for (uint32_t Word : mWords) {
+      for (unsigned i = 0; i < sizeof(uint32_t); i++) {
+        Blob.push_back((Word >> (8 * i)) & 0xff);
+      }
+    }
+    Blob.insert(Blob.end(), mPool.begin(), mPool.end());
+    return Blob;
+  }
+};
+
+// Static per-element cost of a kernel, see RSInfoBinaryKernelCost.
+struct KernelCost {
+  std::string mName;
+  uint32_t mInstructions;
+  uint32_t mMemoryOps;
+  uint32_t mFlags;
+};
+
 /* RSEmbedInfoPass - This pass operates on the entire module and embeds a
  * string constaining relevant metadata directly as a global variable.
  * This information does not need to be consistent across Android releases,
@@ -55,24 +152,211 @@ private:
   llvm::Module *M;
   llvm::LLVMContext *C;
 
+  // Metadata of the module extracted ahead of the pass, or nullptr.
+  const bcinfo::MetadataExtractor *mMetadata;
+
+  // Also embed the information as an RSInfoBinaryHeader blob.
+  bool mBinary;
+
+  // Metadata handed to the pass was extracted before RSIsThreadablePass
+  // recorded whether the script is threadable, so always read that back from
+  // the module.
+  static bool readThreadableFlag(const llvm::Module *module) {
+    const llvm::NamedMDNode *node =
+        module->getNamedMetadata("#rs_is_threadable");
+    if (node == nullptr || node->getNumOperands() == 0) {
+      return true;
+    }
+    const llvm::MDNode *mdNode = node->getOperand(0);
+    if (mdNode == nullptr || mdNode->getNumOperands() == 0) {
+      return true;
+    }
+    const llvm::MDString *value =
+        llvm::dyn_cast_or_null<llvm::MDString>(mdNode->getOperand(0));
+    return value == nullptr || value->getString() != "no";
+  }
+
+  // Likewise for the kernels RSIsThreadablePass found to be non-threadable.
+  static std::vector<llvm::StringRef>
+  readNonThreadableKernels(const llvm::Module *module) {
+    std::vector<llvm::StringRef> kernels;
+    const llvm::NamedMDNode *node =
+        module->getNamedMetadata("#rs_non_threadable_kernels");
+    if (node == nullptr) {
+      return kernels;
+    }
+    for (const llvm::MDNode *mdNode : node->operands()) {
+      if (mdNode == nullptr || mdNode->getNumOperands() == 0) {
+        continue;
+      }
+      if (const llvm::MDString *name =
+              llvm::dyn_cast_or_null<llvm::MDString>(mdNode->getOperand(0))) {
+        kernels.push_back(name->getString());
+      }
+    }
+    return kernels;
+  }
+
+  // The general reductions RSKernelExpandPass generated a multi-combiner
+  // for, as (reduction name, multi-combiner name) pairs in the order of the
+  // metadata. The runtime may combine their partial accumulators in a tree,
+  // in parallel, rather than one by one.
+  static std::vector<std::pair<std::string, std::string>>
+  readTreeCombinableReduces(const llvm::Module *module,
+                            const bcinfo::MetadataExtractor &me) {
+    std::vector<std::pair<std::string, std::string>> reduces;
+    for (size_t i = 0; i < me.getExportReduceCount(); ++i) {
+      const bcinfo::MetadataExtractor::Reduce &reduce =
+          me.getExportReduceList()[i];
+      const std::string multiCombiner = nameReduceMultiCombiner(
+          (reduce.mCombinerName != nullptr)
+              ? std::string(reduce.mCombinerName)
+              : nameReduceCombinerFromAccumulator(reduce.mAccumulatorName));
+      const llvm::Function *F = module->getFunction(multiCombiner);
+      if (F != nullptr && !F->isDeclaration()) {
+        reduces.emplace_back(reduce.mReduceName, multiCombiner);
+      }
+    }
+    return reduces;
+  }
+
+  // The version of slang the module was generated with, or "." if unknown.
+  static llvm::StringRef readSlangVersion(const llvm::Module *module) {
+    if (auto nmd = module->getNamedMetadata("slang.llvm.version")) {
+      if (auto md = nmd->getOperand(0)) {
+        if (const auto ver =
+                llvm::dyn_cast<llvm::MDString>(md->getOperand(0))) {
+          return ver->getString();
+        }
+      }
+    }
+    return ".";
+  }
+
+  // Add the cost of the instructions of pBlock to pCost.
+  static void addBlockCost(const llvm::BasicBlock &pBlock, KernelCost &pCost) {
+    for (const llvm::Instruction &I : pBlock) {
+      if (llvm::isa<llvm::DbgInfoIntrinsic>(I)) {
+        continue;
+      }
+      pCost.mInstructions++;
+      if (I.mayReadOrWriteMemory() &&
+          (llvm::isa<llvm::LoadInst>(I) || llvm::isa<llvm::StoreInst>(I) ||
+           llvm::isa<llvm::AtomicRMWInst>(I) ||
+           llvm::isa<llvm::AtomicCmpXchgInst>(I) ||
+           llvm::isa<llvm::MemIntrinsic>(I))) {
+        pCost.mMemoryOps++;
+      } else if (llvm::isa<llvm::CallInst>(I) &&
+                 !llvm::isa<llvm::IntrinsicInst>(I)) {
+        pCost.mFlags |= kRSInfoBinaryKernelHasCalls;
+      }
+    }
+  }
+
+  // Estimate the per-element cost of the expanded function pFunction. Its
+  // outermost loops are the loops over the cells; when there are several
+  // (e.g. a vector loop and its scalar remainder, or versions of the loop for
+  // packed and unpacked allocations), the cheapest one is assumed to process
+  // one element per iteration. Loops nested in it are counted once.
+  static KernelCost getKernelCost(llvm::StringRef pName,
+                                  llvm::Function &pFunction) {
+    llvm::DominatorTree DT(pFunction);
+    llvm::LoopInfo LI(DT);
+
+    KernelCost best{pName, 0, 0, 0};
+    bool found = false;
+    for (const llvm::Loop *L : LI) {
+      KernelCost cost{pName, 0, 0, 0};
+      for (const llvm::BasicBlock *BB : L->blocks()) {
+        addBlockCost(*BB, cost);
+      }
+      if (!L->getSubLoops().empty()) {
+        cost.mFlags |= kRSInfoBinaryKernelHasLoops;
+      }
+      if (!found || cost.mInstructions < best.mInstructions) {
+        best = cost;
+        found = true;
+      }
+    }
+
+    // Without a loop, e.g. for a launch over a single cell that got folded,
+    // the whole function is the work on an element.
+    if (!found) {
+      for (const llvm::BasicBlock &BB : pFunction) {
+        addBlockCost(BB, best);
+      }
+    }
+    return best;
+  }
+
+  // The costs of the exported forEach and reduce kernels whose expanded
+  // functions are defined in module, in the order of the metadata. Reduce
+  // kernels are named after the reduction and costed by their accumulator.
+  static std::vector<KernelCost>
+  getKernelCosts(llvm::Module *module,
+                 const bcinfo::MetadataExtractor *pMetadata) {
+    std::vector<KernelCost> costs;
+    std::unique_ptr<bcinfo::MetadataExtractor> extracted;
+    if (pMetadata == nullptr) {
+      extracted.reset(new bcinfo::MetadataExtractor(module));
+      if (!extracted->extract()) {
+        bccAssert(false && "Could not extract RS metadata for module!");
+        return costs;
+      }
+      pMetadata = extracted.get();
+    }
+    const bcinfo::MetadataExtractor &me = *pMetadata;
+
+    auto addKernel = [&](const char *name, const char *function) {
+      const std::string expanded = std::string(function) + ".expand";
+      llvm::Function *F = module->getFunction(expanded);
+      // RSKernelMultiVersionPass keeps the original version under this name.
+      if (F == nullptr) {
+        F = module->getFunction(expanded + ".default");
+      }
+      if (F != nullptr && !F->isDeclaration()) {
+        costs.push_back(getKernelCost(name, *F));
+      }
+    };
+    for (size_t i = 0; i < me.getExportForEachSignatureCount(); ++i) {
+      const char *name = me.getExportForEachNameList()[i];
+      addKernel(name, name);
+    }
+    for (size_t i = 0; i < me.getExportReduceCount(); ++i) {
+      const bcinfo::MetadataExtractor::Reduce &reduce =
+          me.getExportReduceList()[i];
+      addKernel(reduce.mReduceName, reduce.mAccumulatorName);
+    }
+    return costs;
+  }
+
 public:
-  RSEmbedInfoPass()
+  explicit RSEmbedInfoPass(const bcinfo::MetadataExtractor *pMetadata = nullptr,
+                           bool pBinary = false)
       : ModulePass(ID),
-        M(nullptr) {
+        M(nullptr), mMetadata(pMetadata),
+        mBinary(pBinary || ClEmbedBinaryInfo) {
   }
 
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
     AU.setPreservesAll();
   }
 
-  static std::string getRSInfoString(const llvm::Module *module) {
+  static std::string getRSInfoString(const llvm::Module *module,
+                                     const bcinfo::MetadataExtractor *pMetadata,
+                                     const std::vector<KernelCost> &costs) {
     std::string str;
     llvm::raw_string_ostream s(str);
-    bcinfo::MetadataExtractor me(module);
-    if (!me.extract()) {
-      bccAssert(false && "Could not extract RS metadata for module!");
-      return std::string("");
+    std::unique_ptr<bcinfo::MetadataExtractor> extracted;
+    if (pMetadata == nullptr) {
+      extracted.reset(new bcinfo::MetadataExtractor(module));
+      if (!extracted->extract()) {
+        bccAssert(false && "Could not extract RS metadata for module!");
+        return std::string("");
+      }
+      pMetadata = extracted.get();
     }
+    const bcinfo::MetadataExtractor &me = *pMetadata;
 
     size_t exportVarCount = me.getExportVarCount();
     size_t exportFuncCount = me.getExportFuncCount();
@@ -90,7 +374,9 @@ public:
     const uint32_t *objectSlotList = me.getObjectSlotList();
     const char **pragmaKeyList = me.getPragmaKeyList();
     const char **pragmaValueList = me.getPragmaValueList();
-    bool isThreadable = me.isThreadable();
+    bool isThreadable = readThreadableFlag(module);
+    std::vector<llvm::StringRef> nonThreadableKernels =
+        readNonThreadableKernels(module);
     const char *buildChecksum = me.getBuildChecksum();
 
     size_t i;
@@ -163,15 +449,7 @@ public:
       // As per `exportReduceCount`'s linewise fields, we use the literal `"."`
       // to signify the empty field. This makes it easy to parse when it's
       // missing.
-      llvm::StringRef slangVersion(".");
-      if (auto nmd = module->getNamedMetadata("slang.llvm.version")) {
-        if (auto md = nmd->getOperand(0)) {
-          if (const auto ver =
-                  llvm::dyn_cast<llvm::MDString>(md->getOperand(0))) {
-            slangVersion = ver->getString();
-          }
-        }
-      }
+      llvm::StringRef slangVersion = readSlangVersion(module);
       s << "versionInfo: 2\n";
       s << "bcc - " << LLVM_VERSION_STRING << "\n";
       s << "slang - " << slangVersion << "\n";
@@ -185,24 +463,166 @@ public:
       }
     }
 
+    // Kept after all the sections above, which older runtimes expect in this
+    // exact order, so that they simply ignore it.
+    s << "nonThreadableKernelCount: " << nonThreadableKernels.size() << "\n";
+    for (llvm::StringRef kernel : nonThreadableKernels) {
+      s << kernel << "\n";
+    }
+
+    // Likewise. Each line is the kernel name, followed by a hyphen followed
+    // by the instructions per element, followed by a hyphen followed by the
+    // memory operations per element, followed by a hyphen followed by the
+    // RSInfoBinaryKernelCostFlags.
+    s << "kernelCostCount: " << costs.size() << "\n";
+    for (const KernelCost &cost : costs) {
+      s << cost.mName << " - " << cost.mInstructions << " - "
+        << cost.mMemoryOps << " - " << cost.mFlags << "\n";
+    }
+
+    // Likewise. Each line is the reduction name, followed by a hyphen
+    // followed by the name of its multi-combiner.
+    const std::vector<std::pair<std::string, std::string>> treeReduces =
+        readTreeCombinableReduces(module, me);
+    s << "treeCombinableReduceCount: " << treeReduces.size() << "\n";
+    for (const auto &reduce : treeReduces) {
+      s << reduce.first << " - " << reduce.second << "\n";
+    }
+
     s.flush();
     return str;
   }
 
+  // The same information as getRSInfoString(), as an RSInfoBinaryHeader blob.
+  static std::vector<uint8_t>
+  getRSInfoBinary(const llvm::Module *module,
+                  const bcinfo::MetadataExtractor *pMetadata,
+                  const std::vector<KernelCost> &costs) {
+    std::unique_ptr<bcinfo::MetadataExtractor> extracted;
+    if (pMetadata == nullptr) {
+      extracted.reset(new bcinfo::MetadataExtractor(module));
+      if (!extracted->extract()) {
+        bccAssert(false && "Could not extract RS metadata for module!");
+        return std::vector<uint8_t>();
+      }
+      pMetadata = extracted.get();
+    }
+    const bcinfo::MetadataExtractor &me = *pMetadata;
+    RSInfoBinaryWriter w;
+    RSInfoBinaryHeader &h = w.header();
+    size_t i;
+
+    h.mFlags = readThreadableFlag(module) ? kRSInfoBinaryThreadable : 0;
+    const char *buildChecksum = me.getBuildChecksum();
+    h.mBuildChecksum = w.addString(
+        (buildChecksum != nullptr && buildChecksum[0]) ? buildChecksum
+                                                       : nullptr);
+    h.mBccVersion = w.addString(LLVM_VERSION_STRING);
+    llvm::StringRef slangVersion = readSlangVersion(module);
+    h.mSlangVersion = (slangVersion == ".")
+                          ? kRSInfoBinaryNoString
+                          : w.addString(slangVersion);
+
+    w.beginTable(h.mExportVars, me.getExportVarCount());
+    for (i = 0; i < me.getExportVarCount(); ++i) {
+      w.addWord(w.addString(me.getExportVarNameList()[i]));
+    }
+
+    w.beginTable(h.mExportFuncs, me.getExportFuncCount());
+    for (i = 0; i < me.getExportFuncCount(); ++i) {
+      w.addWord(w.addString(me.getExportFuncNameList()[i]));
+    }
+
+    w.beginTable(h.mExportForEachs, me.getExportForEachSignatureCount());
+    for (i = 0; i < me.getExportForEachSignatureCount(); ++i) {
+      w.addWord(me.getExportForEachSignatureList()[i]);
+      w.addWord(w.addString(me.getExportForEachNameList()[i]));
+    }
+
+    w.beginTable(h.mExportReduces, me.getExportReduceCount());
+    for (i = 0; i < me.getExportReduceCount(); ++i) {
+      const bcinfo::MetadataExtractor::Reduce &reduce =
+          me.getExportReduceList()[i];
+      w.addWord(reduce.mSignature);
+      w.addWord(reduce.mAccumulatorDataSize);
+      w.addWord(w.addString(reduce.mReduceName));
+      w.addWord(w.addString(reduce.mInitializerName));
+      w.addWord(w.addString(reduce.mAccumulatorName));
+      w.addWord(w.addString(
+          (reduce.mCombinerName != nullptr)
+              ? reduce.mCombinerName
+              : nameReduceCombinerFromAccumulator(reduce.mAccumulatorName)
+                    .c_str()));
+      w.addWord(w.addString(reduce.mOutConverterName));
+      w.addWord(w.addString(reduce.mHalterName));
+    }
+
+    w.beginTable(h.mObjectSlots, me.getObjectSlotCount());
+    for (i = 0; i < me.getObjectSlotCount(); ++i) {
+      w.addWord(me.getObjectSlotList()[i]);
+    }
+
+    w.beginTable(h.mPragmas, me.getPragmaCount());
+    for (i = 0; i < me.getPragmaCount(); ++i) {
+      w.addWord(w.addString(me.getPragmaKeyList()[i]));
+      w.addWord(w.addString(me.getPragmaValueList()[i]));
+    }
+
+    std::vector<llvm::StringRef> nonThreadableKernels =
+        readNonThreadableKernels(module);
+    w.beginTable(h.mNonThreadableKernels, nonThreadableKernels.size());
+    for (llvm::StringRef kernel : nonThreadableKernels) {
+      w.addWord(w.addString(kernel));
+    }
+
+    w.beginTable(h.mKernelCosts, costs.size());
+    for (const KernelCost &cost : costs) {
+      w.addWord(w.addString(cost.mName));
+      w.addWord(cost.mInstructions);
+      w.addWord(cost.mMemoryOps);
+      w.addWord(cost.mFlags);
+    }
+
+    const std::vector<std::pair<std::string, std::string>> treeReduces =
+        readTreeCombinableReduces(module, me);
+    w.beginTable(h.mTreeCombinableReduces, treeReduces.size());
+    for (const auto &reduce : treeReduces) {
+      w.addWord(w.addString(reduce.first));
+      w.addWord(w.addString(reduce.second));
+    }
+
+    return w.finish();
+  }
+
   virtual bool runOnModule(llvm::Module &M) {
     this->M = &M;
     C = &M.getContext();
 
+    // The expanded functions are final by now, so estimate the work of the
+    // kernels on them.
+    const std::vector<KernelCost> Costs = getKernelCosts(&M, mMetadata);
+
     // Embed this as the global variable .rs.info so that it will be
     // accessible from the shared object later.
     llvm::Constant *Init = llvm::ConstantDataArray::getString(*C,
-                                                              getRSInfoString(&M));
+                                                              getRSInfoString(&M, mMetadata, Costs));
     llvm::GlobalVariable *InfoGV =
         new llvm::GlobalVariable(M, Init->getType(), true,
                                  llvm::GlobalValue::ExternalLinkage, Init,
                                  kRsInfo);
     (void) InfoGV;
 
+    if (mBinary) {
+      // The blob is used in place by the runtime, so keep its tables aligned.
+      llvm::Constant *BinaryInit =
+          llvm::ConstantDataArray::get(*C, getRSInfoBinary(&M, mMetadata, Costs));
+      llvm::GlobalVariable *BinaryGV =
+          new llvm::GlobalVariable(M, BinaryInit->getType(), true,
+                                   llvm::GlobalValue::ExternalLinkage,
+                                   BinaryInit, kRsInfoBinary);
+      BinaryGV->setAlignment(8);
+    }
+
     return true;
   }
 
@@ -216,11 +636,15 @@ public:
 
 char RSEmbedInfoPass::ID = 0;
 
+static llvm::RegisterPass<RSEmbedInfoPass> X("rs-embed-info",
+                                             "Embed Renderscript Info Pass");
+
 namespace bcc {
 
 llvm::ModulePass *
-createRSEmbedInfoPass() {
-  return new RSEmbedInfoPass();
+createRSEmbedInfoPass(const bcinfo::MetadataExtractor *pMetadata,
+                      bool pBinary) {
+  return new RSEmbedInfoPass(pMetadata, pBinary);
 }
 
 }  // end namespace bcc
@@ -16,6 +16,7 @@
 
 #include "Assert.h"
 #include "Log.h"
+#include "RSTransforms.h"
 #include "RSUtils.h"
 
 #include "rsDefines.h"
@@ -35,7 +36,7 @@ namespace {
 const bool kDebugGlobalInfo = false;
 
 /* RSGlobalInfoPass: Embeds additional information about RenderScript global
- * variables into the Module. The 5 variables added are specified as follows:
+ * variables into the Module. The 6 variables added are specified as follows:
  * 1) .rs.global_entries
  *    i32 - int
  *    Optional number of global variables.
@@ -62,6 +63,16 @@ const bool kDebugGlobalInfo = false;
  *        17    Static (1 is static, 0 is extern)
  *        16    Constant (1 is const, 0 is non-const)
  *    15 - 0    RsDataType (see frameworks/rs/rsDefines.h for more info)
+ * 6) .rs.global_name_index
+ *    [M + 1 * i32]
+ *    Optional hash table over the names of the N global variables, so that
+ *    they can be looked up without a linear search. Entry 0 is the number of
+ *    slots M, a power of two that is at least twice N. Slot i is entry i + 1,
+ *    and holds 0 if it is empty or k + 1 for the k-th global variable. A name
+ *    is looked for starting at slot (hash(name) & (M - 1)) and then in the
+ *    following slots, wrapping around, until it or an empty slot is found.
+ *    hash is the 32-bit FNV-1a hash of the bytes of the name (see
+ *    hashGlobalName()).
  */
 class RSGlobalInfoPass: public llvm::ModulePass {
 private:
@@ -95,6 +106,36 @@ private:
     return result;
   }
 
+  // The 32-bit FNV-1a hash of Name, used by .rs.global_name_index.
+  static uint32_t hashGlobalName(llvm::StringRef Name) {
+    uint32_t Hash = 2166136261u;
+    for (unsigned char C : Name) {
+      Hash ^= C;
+      Hash *= 16777619u;
+    }
+    return Hash;
+  }
+
+  // Builds the .rs.global_name_index table for Names.
+  static std::vector<uint32_t>
+  buildNameIndex(const std::vector<std::string> &Names) {
+    uint32_t Slots = 1;
+    while (Slots < 2 * Names.size()) {
+      Slots <<= 1;
+    }
+
+    std::vector<uint32_t> Index(Slots + 1, 0);
+    Index[0] = Slots;
+    for (size_t i = 0; i < Names.size(); i++) {
+      uint32_t Slot = hashGlobalName(Names[i]) & (Slots - 1);
+      while (Index[Slot + 1] != 0) {
+        Slot = (Slot + 1) & (Slots - 1);
+      }
+      Index[Slot + 1] = i + 1;
+    }
+    return Index;
+  }
+
 public:
   static char ID;
 
@@ -104,7 +145,9 @@ public:
 
   void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
     // This pass does not use any other analysis passes, but it does
-    // add new global variables.
+    // add new global variables, which take the address of the globals
+    // described. Function bodies are left alone.
+    AU.setPreservesCFG();
   }
 
   bool runOnModule(llvm::Module &M) override {
@@ -252,12 +295,24 @@ public:
     GlobalProperties->setInitializer(GlobalPropertiesInit);
     GlobalProperties->setConstant(true);
 
+    // 6) @.rs.global_name_index = constant [M + 1 * i32] [...]
+    std::vector<uint32_t> NameIndex = buildNameIndex(GVNameStrings);
+    V = M.getOrInsertGlobal(bcc::kRsGlobalNameIndex,
+                            llvm::ArrayType::get(Int32Ty, NameIndex.size()));
+    llvm::GlobalVariable *GlobalNameIndex =
+        llvm::dyn_cast<llvm::GlobalVariable>(V);
+    llvm::Constant *GlobalNameIndexInit =
+        llvm::ConstantDataArray::get(M.getContext(), NameIndex);
+    GlobalNameIndex->setInitializer(GlobalNameIndexInit);
+    GlobalNameIndex->setConstant(true);
+
     if (kDebugGlobalInfo) {
       GlobalEntries->dump();
       GlobalNames->dump();
       GlobalAddresses->dump();
       GlobalSizes->dump();
       GlobalProperties->dump();
+      GlobalNameIndex->dump();
     }
 
     // Upon completion, this pass has always modified the Module.
@@ -274,6 +329,8 @@ static llvm::RegisterPass<RSGlobalInfoPass> X("embed-rs-global-info",
 
 namespace bcc {
 
+const char kRsGlobalNameIndex[] = ".rs.global_name_index";
+
 llvm::ModulePass * createRSGlobalInfoPass(bool pSkipConstants) {
   return new RSGlobalInfoPass(pSkipConstants);
 }
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Log.h"
+#include "RSTransforms.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalAlias.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+
+namespace {
+
+// Alignment of the blocks of globals: the cache line size of the CPUs
+// RenderScript runs on. Globals larger than this are left where they are.
+const unsigned kCacheLineSize = 64;
+
+// Loads weigh 8 times more per level of loop nesting, counting this many
+// levels at most.
+const unsigned kMaxLoopDepth = 4;
+
+/*
+ * RSGlobalLayoutPass
+ *
+ * Globals are otherwise laid out in the order the script declares them, so
+ * the ones a kernel reads in its loop are scattered across cache lines, and
+ * each of them gets an address computation of its own.
+ *
+ * This pass weighs the loads of each global in the loops of each expanded
+ * kernel function by loop depth. Starting with the kernel whose loops load
+ * the most, the globals a kernel reads that no hotter kernel took are moved
+ * into one cache-line-aligned block, most read first. Constant and mutable
+ * globals get separate blocks, so constants stay read-only.
+ *
+ * Every use of a moved global is rewritten to its address in the block. That
+ * includes the tables of RSGlobalInfoPass, so the addresses they report to
+ * the debugger stay right, and the debug info of the global, which describes
+ * it as a part of the block as for LLVM's global merge. Globals with external
+ * linkage are exported to the runtime by name, so they become aliases of
+ * their slot of the block.
+ *
+ * Runs after LTO, once the kernels are inlined into their expanded functions.
+ */
+class RSGlobalLayoutPass : public llvm::ModulePass {
+private:
+  // A kernel's loop reads of the candidate globals.
+  struct Kernel {
+    llvm::Function *mFunction;
+    std::vector<uint64_t> mWeights;  // Indexed like the candidates.
+    uint64_t mTotal;
+  };
+
+  // Whether GV may be moved into a block.
+  static bool isCandidate(const llvm::GlobalVariable &GV,
+                          const llvm::DataLayout &DL) {
+    if (!GV.hasDefinitiveInitializer() || GV.isThreadLocal() ||
+        GV.hasSection() || GV.hasComdat() ||
+        GV.getType()->getAddressSpace() != 0 ||
+        GV.getName().startswith("llvm.") || GV.getName().startswith(".rs.")) {
+      return false;
+    }
+    if (!GV.hasLocalLinkage() && !GV.hasExternalLinkage()) {
+      return false;
+    }
+
+    llvm::Type *Ty = GV.getValueType();
+    uint64_t Size = DL.getTypeAllocSize(Ty);
+    if (Size == 0 || Size > kCacheLineSize) {
+      return false;
+    }
+    // The block lays its members out at their ABI alignment.
+    return GV.getAlignment() <= DL.getABITypeAlignment(Ty);
+  }
+
+  static bool isExpandedFunction(const llvm::Function &F) {
+    return !F.isDeclaration() && (F.getName().endswith(".expand") ||
+                                  F.getName().endswith(".expand.tiled"));
+  }
+
+  // Add the weights of the loads of the candidates in the loops of pKernel.
+  void weighLoopReads(Kernel &pKernel,
+                      const llvm::DenseMap<llvm::GlobalVariable *, unsigned> &pIndex) {
+    llvm::LoopInfo &LI =
+        getAnalysis<llvm::LoopInfoWrapperPass>(*pKernel.mFunction).getLoopInfo();
+    for (llvm::BasicBlock &BB : *pKernel.mFunction) {
+      unsigned Depth = LI.getLoopDepth(&BB);
+      if (Depth == 0) {
+        continue;
+      }
+      uint64_t Weight = uint64_t(1) << (3 * std::min(Depth, kMaxLoopDepth));
+
+      for (llvm::Instruction &I : BB) {
+        llvm::LoadInst *Load = llvm::dyn_cast<llvm::LoadInst>(&I);
+        if (Load == nullptr) {
+          continue;
+        }
+        llvm::GlobalVariable *GV = llvm::dyn_cast<llvm::GlobalVariable>(
+            Load->getPointerOperand()->stripInBoundsConstantOffsets());
+        auto It = (GV != nullptr) ? pIndex.find(GV) : pIndex.end();
+        if (It == pIndex.end()) {
+          continue;
+        }
+        pKernel.mWeights[It->second] += Weight;
+        pKernel.mTotal += Weight;
+      }
+    }
+  }
+
+  // Move pMembers, in this order, into a new block named after pKernel.
+  static void layOutBlock(llvm::Module &M, const llvm::Function &pKernel,
+                          llvm::ArrayRef<llvm::GlobalVariable *> pMembers,
+                          bool pConstant) {
+    std::vector<llvm::Type *> Types;
+    std::vector<llvm::Constant *> Initializers;
+    for (llvm::GlobalVariable *GV : pMembers) {
+      Types.push_back(GV->getValueType());
+      Initializers.push_back(GV->getInitializer());
+    }
+
+    llvm::StructType *BlockTy = llvm::StructType::get(M.getContext(), Types);
+    llvm::GlobalVariable *Block = new llvm::GlobalVariable(
+        M, BlockTy, pConstant, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantStruct::get(BlockTy, Initializers),
+        pKernel.getName() + ".globals");
+    Block->setAlignment(kCacheLineSize);
+
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(M.getContext());
+    for (unsigned i = 0; i < pMembers.size(); i++) {
+      llvm::GlobalVariable *GV = pMembers[i];
+      llvm::Constant *Indices[] = {
+        llvm::ConstantInt::get(Int32Ty, 0),
+        llvm::ConstantInt::get(Int32Ty, i)
+      };
+      llvm::Constant *Slot =
+          llvm::ConstantExpr::getInBoundsGetElementPtr(BlockTy, Block, Indices);
+
+      if (!GV->hasLocalLinkage()) {
+        llvm::GlobalAlias *Alias = llvm::GlobalAlias::create(
+            GV->getValueType(), 0, GV->getLinkage(), "", Slot, &M);
+        Alias->setVisibility(GV->getVisibility());
+        Alias->takeName(GV);
+      }
+
+      GV->replaceAllUsesWith(Slot);
+      GV->eraseFromParent();
+    }
+  }
+
+public:
+  static char ID;
+
+  RSGlobalLayoutPass() : ModulePass(ID) { }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.addRequired<llvm::LoopInfoWrapperPass>();
+  }
+
+  bool runOnModule(llvm::Module &M) override {
+    const llvm::DataLayout &DL = M.getDataLayout();
+
+    // Globals in llvm.used or llvm.compiler.used must keep their symbols.
+    llvm::SmallPtrSet<llvm::GlobalValue *, 8> Used;
+    llvm::collectUsedGlobalVariables(M, Used, /* CompilerUsed */false);
+    llvm::collectUsedGlobalVariables(M, Used, /* CompilerUsed */true);
+
+    std::vector<llvm::GlobalVariable *> Candidates;
+    llvm::DenseMap<llvm::GlobalVariable *, unsigned> Index;
+    for (llvm::GlobalVariable &GV : M.globals()) {
+      if (isCandidate(GV, DL) && !Used.count(&GV)) {
+        Index[&GV] = Candidates.size();
+        Candidates.push_back(&GV);
+      }
+    }
+    if (Candidates.size() < 2) {
+      return false;
+    }
+
+    std::vector<Kernel> Kernels;
+    for (llvm::Function &F : M) {
+      if (!isExpandedFunction(F)) {
+        continue;
+      }
+      Kernel K;
+      K.mFunction = &F;
+      K.mWeights.assign(Candidates.size(), 0);
+      K.mTotal = 0;
+      weighLoopReads(K, Index);
+      if (K.mTotal > 0) {
+        Kernels.push_back(std::move(K));
+      }
+    }
+
+    // The hottest kernels pick their globals first.
+    std::stable_sort(Kernels.begin(), Kernels.end(),
+                     [](const Kernel &A, const Kernel &B) {
+                       return A.mTotal > B.mTotal;
+                     });
+
+    std::vector<bool> Placed(Candidates.size(), false);
+    bool Changed = false;
+    for (const Kernel &K : Kernels) {
+      for (bool Constant : {false, true}) {
+        std::vector<unsigned> Members;
+        for (unsigned i = 0; i < Candidates.size(); i++) {
+          if (!Placed[i] && K.mWeights[i] > 0 &&
+              Candidates[i]->isConstant() == Constant) {
+            Members.push_back(i);
+          }
+        }
+        // A lone global gains nothing from a block.
+        if (Members.size() < 2) {
+          continue;
+        }
+
+        std::stable_sort(Members.begin(), Members.end(),
+                         [&K](unsigned A, unsigned B) {
+                           return K.mWeights[A] > K.mWeights[B];
+                         });
+        std::vector<llvm::GlobalVariable *> Block;
+        for (unsigned i : Members) {
+          Placed[i] = true;
+          Block.push_back(Candidates[i]);
+        }
+
+        ALOGV("Laying out %u globals read by %s in one block",
+              static_cast<unsigned>(Block.size()),
+              K.mFunction->getName().str().c_str());
+        layOutBlock(M, *K.mFunction, Block, Constant);
+        Changed = true;
+      }
+    }
+
+    return Changed;
+  }
+}; // end RSGlobalLayoutPass
+
+char RSGlobalLayoutPass::ID = 0;
+llvm::RegisterPass<RSGlobalLayoutPass> X("rs-global-layout",
+                                         "RS Global Layout Pass");
+
+} // end anonymous namespace
+
+namespace bcc {
+
+llvm::ModulePass *
+createRSGlobalLayoutPass() {
+  return new RSGlobalLayoutPass();
+}
+
+} // end namespace bcc
@@ -0,0 +1,480 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Log.h"
+#include "RSTransforms.h"
+
+#include <cctype>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpander.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+namespace {
+
+const char kGetElementAtPrefix[] = "_Z14rsGetElementAt13rs_allocation";
+const char kGetDimPrefix[] = "_Z19rsAllocationGetDim";
+
+/*
+ * RSHoistBoundsChecksPass
+ *
+ * Scripts built for a RenderScript debug context are linked against the
+ * debug runtime, whose allocation accessors (rsGetElementAt(),
+ * rsSetElementAt() and their typed rsGetElementAt_<type>() and
+ * rsSetElementAt_<type>() forms) check every access against the
+ * allocation's dimensions. Inside the loop of an expanded kernel, that is a
+ * call into the driver per element.
+ *
+ * For an accessor call in a loop whose X coordinate is affine in the loop's
+ * induction variable and whose other arguments are loop invariant, this
+ * pass checks the whole range of cells the loop accesses once, in the
+ * preheader:
+ *
+ *   - the last X coordinate (and the one after the first, see below) is
+ *     below rsAllocationGetDimX(), and the Y and Z coordinates are below
+ *     rsAllocationGetDimY() and rsAllocationGetDimZ();
+ *   - if so, the checked generic rsGetElementAt() is called for the first
+ *     cell and the one after it, which give the address of the first cell
+ *     and the element size;
+ *   - a typed accessor must also access a type of the element's size.
+ *
+ * When the range is in bounds, the call is replaced by a load or store at
+ * its cell's address, worked out from those; otherwise the loop goes
+ * through the checked call as before, so out-of-bound accesses are still
+ * reported one by one. The test on the loop-invariant condition is left for
+ * loop unswitching, which splits the loop into the two versions.
+ *
+ * Calls that pass or return their values indirectly are left alone, as are
+ * allocations that cannot be reloaded in the preheader: on 32-bit targets
+ * the rs_allocation is loaded from its global within the loop, and on
+ * 64-bit ones a copy of it is passed, which both only qualify if the loop
+ * leaves the global unmodified.
+ *
+ * This pass should run after inlining, so that it sees the accessor calls
+ * of the kernels in the loops of their expanded functions.
+ */
+class RSHoistBoundsChecksPass : public llvm::FunctionPass {
+public:
+  static char ID;
+
+  RSHoistBoundsChecksPass() : FunctionPass(ID) { }
+
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.addRequiredID(llvm::LoopSimplifyID);
+    AU.addRequired<llvm::LoopInfoWrapperPass>();
+    AU.addRequired<llvm::ScalarEvolutionWrapperPass>();
+  }
+
+  bool runOnFunction(llvm::Function &F) override {
+    llvm::LoopInfo &LI = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+    llvm::ScalarEvolution &SE = getAnalysis<llvm::ScalarEvolutionWrapperPass>().getSE();
+    const llvm::DataLayout &DL = F.getParent()->getDataLayout();
+
+    // First find all the accesses and expand what they need in the
+    // preheaders, while the loop and scalar evolution information is still
+    // current; only then change the control flow.
+    std::vector<Access> Accesses;
+    for (llvm::BasicBlock &BB : F) {
+      llvm::Loop *L = LI.getLoopFor(&BB);
+      if (!L || !L->getLoopPreheader())
+        continue;
+      for (llvm::Instruction &I : BB) {
+        auto Call = llvm::dyn_cast<llvm::CallInst>(&I);
+        Access A;
+        if (Call && analyzeAccess(Call, L, SE, A))
+          Accesses.push_back(A);
+      }
+    }
+    if (Accesses.empty())
+      return false;
+
+    llvm::SCEVExpander Expander(SE, DL, "bounds");
+    for (Access &A : Accesses) {
+      if (!expandAccess(A, Expander))
+        A.mCall = nullptr;
+    }
+
+    bool Changed = false;
+    for (const Access &A : Accesses) {
+      if (A.mCall) {
+        hoistCheck(A, DL);
+        Changed = true;
+      }
+    }
+    return Changed;
+  }
+
+private:
+  // An accessor call and what it takes to check it in the preheader.
+  struct Access {
+    llvm::CallInst *mCall;
+    bool mIsSet;
+    bool mIsTyped;
+    unsigned mNumCoords;
+    // Preheader terminator, in front of which the check goes.
+    llvm::Instruction *mPreheaderTerm;
+    // First and last X coordinate accessed, zero-extended to 64 bits.
+    const llvm::SCEV *mFirstX;
+    const llvm::SCEV *mLastX;
+    // The global the allocation is read from in the loop, if it isn't loop
+    // invariant itself.
+    llvm::GlobalVariable *mAllocationGlobal;
+    // The allocation and the coordinates, as available in the preheader.
+    llvm::Value *mAllocation;
+    llvm::Value *mFirstXValue;
+    llvm::Value *mLastXValue;
+    llvm::SmallVector<llvm::Value *, 2> mOtherCoords;
+
+    Access() : mCall(nullptr), mIsSet(false), mIsTyped(false), mNumCoords(0),
+               mPreheaderTerm(nullptr), mFirstX(nullptr), mLastX(nullptr),
+               mAllocationGlobal(nullptr), mAllocation(nullptr), mFirstXValue(nullptr),
+               mLastXValue(nullptr) { }
+  };
+
+  // Is Name the mangled name of an allocation accessor? Sets IsSet and
+  // IsTyped according to which of them it is.
+  static bool parseAccessorName(llvm::StringRef Name, bool &IsSet, bool &IsTyped) {
+    if (!Name.startswith("_Z"))
+      return false;
+    size_t Pos = 2, Length = 0;
+    while (Pos < Name.size() && isdigit(Name[Pos]))
+      Length = Length * 10 + (Name[Pos++] - '0');
+    llvm::StringRef Ident = Name.substr(Pos, Length);
+    if (Length == 0 || Ident.size() != Length ||
+        !Name.substr(Pos + Length).startswith("13rs_allocation"))
+      return false;
+
+    if (Ident == "rsGetElementAt" || Ident == "rsSetElementAt") {
+      IsTyped = false;
+    } else if (Ident.startswith("rsGetElementAt_") || Ident.startswith("rsSetElementAt_")) {
+      IsTyped = true;
+    } else {
+      return false;
+    }
+    IsSet = Ident.startswith("rsSet");
+    return true;
+  }
+
+  // The stored or loaded type of a typed accessor call, or nullptr if it
+  // passes its value indirectly.
+  static llvm::Type *getTypedAccessType(const llvm::CallInst *Call, bool IsSet) {
+    llvm::Type *T = IsSet ? Call->getArgOperand(1)->getType() : Call->getType();
+    if (T->isVoidTy() || T->isPointerTy() || !T->isSized() ||
+        (!T->isIntegerTy() && !T->isFloatingPointTy() && !T->isVectorTy()))
+      return nullptr;
+    return T;
+  }
+
+  // Does L leave the global G unmodified, only loading it or copying it?
+  static bool isUnmodifiedInLoop(const llvm::Value *G, const llvm::Loop *L) {
+    for (const llvm::User *U : G->users()) {
+      if (llvm::isa<llvm::ConstantExpr>(U)) {
+        if (!isUnmodifiedInLoop(U, L))
+          return false;
+        continue;
+      }
+      auto I = llvm::dyn_cast<llvm::Instruction>(U);
+      if (!I || !L->contains(I))
+        continue;
+      if (auto Load = llvm::dyn_cast<llvm::LoadInst>(I)) {
+        if (Load->getPointerOperand() == G && !Load->isVolatile())
+          continue;
+      } else if (auto Copy = llvm::dyn_cast<llvm::MemCpyInst>(I)) {
+        if (Copy->getRawSource() == G && Copy->getRawDest() != G)
+          continue;
+      } else if (auto Cast = llvm::dyn_cast<llvm::BitCastInst>(I)) {
+        if (isUnmodifiedInLoop(Cast, L))
+          continue;
+      }
+      return false;
+    }
+    return true;
+  }
+
+  // The global the allocation argument Alloc of a call in L is read from, if
+  // L leaves it unmodified, so that it may be read in the preheader too.
+  static llvm::GlobalVariable *getAllocationGlobal(llvm::Value *Alloc, const llvm::Loop *L) {
+    llvm::GlobalVariable *G = nullptr;
+    if (auto Load = llvm::dyn_cast<llvm::LoadInst>(Alloc)) {
+      // Passed by value.
+      G = llvm::dyn_cast<llvm::GlobalVariable>(Load->getPointerOperand()->stripPointerCasts());
+    } else if (auto Copy = llvm::dyn_cast<llvm::AllocaInst>(Alloc->stripPointerCasts())) {
+      // Passed indirectly, through a copy that must only be written by a
+      // single memcpy of the global.
+      llvm::SmallVector<const llvm::Value *, 4> Worklist(1, Copy);
+      while (!Worklist.empty()) {
+        const llvm::Value *V = Worklist.pop_back_val();
+        for (const llvm::User *U : V->users()) {
+          if (auto Cast = llvm::dyn_cast<llvm::BitCastInst>(U)) {
+            Worklist.push_back(Cast);
+          } else if (auto MemCpy = llvm::dyn_cast<llvm::MemCpyInst>(U)) {
+            if (MemCpy->getRawSource()->stripPointerCasts() == Copy)
+              continue;
+            if (G)
+              return nullptr;
+            G = llvm::dyn_cast<llvm::GlobalVariable>(MemCpy->getRawSource()->stripPointerCasts());
+            if (!G)
+              return nullptr;
+          } else if (auto Intrinsic = llvm::dyn_cast<llvm::IntrinsicInst>(U)) {
+            if (Intrinsic->getIntrinsicID() != llvm::Intrinsic::lifetime_start &&
+                Intrinsic->getIntrinsicID() != llvm::Intrinsic::lifetime_end)
+              return nullptr;
+          } else if (auto Call = llvm::dyn_cast<llvm::CallInst>(U)) {
+            // The runtime's allocation functions only read it.
+            llvm::Function *Callee = Call->getCalledFunction();
+            if (!Callee || Callee->getName().find("13rs_allocation") == llvm::StringRef::npos)
+              return nullptr;
+          } else if (!llvm::isa<llvm::LoadInst>(U)) {
+            return nullptr;
+          }
+        }
+      }
+    }
+    if (!G || !isUnmodifiedInLoop(G, L))
+      return nullptr;
+    return G;
+  }
+
+  // Can Call, in loop L, be checked in the preheader of L? Fills in A if so.
+  static bool analyzeAccess(llvm::CallInst *Call, llvm::Loop *L,
+                            llvm::ScalarEvolution &SE, Access &A) {
+    llvm::Function *Callee = Call->getCalledFunction();
+    if (!Callee || !parseAccessorName(Callee->getName(), A.mIsSet, A.mIsTyped))
+      return false;
+
+    const unsigned FirstCoord = A.mIsSet ? 2 : 1;
+    if (Call->getNumArgOperands() <= FirstCoord ||
+        Call->getNumArgOperands() > FirstCoord + 3)
+      return false;
+    A.mNumCoords = Call->getNumArgOperands() - FirstCoord;
+    for (unsigned i = FirstCoord; i < Call->getNumArgOperands(); ++i) {
+      if (!Call->getArgOperand(i)->getType()->isIntegerTy(32))
+        return false;
+    }
+    if (A.mIsTyped) {
+      if (!getTypedAccessType(Call, A.mIsSet))
+        return false;
+    } else if (!(A.mIsSet ? Call->getArgOperand(1) : Call)->getType()->isPointerTy()) {
+      return false;
+    }
+
+    llvm::Value *Alloc = Call->getArgOperand(0);
+    if (!L->isLoopInvariant(Alloc) || llvm::isa<llvm::AllocaInst>(Alloc->stripPointerCasts())) {
+      A.mAllocationGlobal = getAllocationGlobal(Alloc, L);
+      if (!A.mAllocationGlobal)
+        return false;
+    }
+
+    // The X coordinate may vary with the loop, in steps of a positive
+    // constant; the others must not.
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(Call->getContext());
+    const llvm::SCEV *X = SE.getSCEV(Call->getArgOperand(FirstCoord));
+    if (SE.isLoopInvariant(X, L)) {
+      A.mFirstX = A.mLastX = SE.getZeroExtendExpr(X, Int64Ty);
+    } else {
+      auto AddRec = llvm::dyn_cast<llvm::SCEVAddRecExpr>(X);
+      if (!AddRec || AddRec->getLoop() != L || !AddRec->isAffine())
+        return false;
+      auto Step = llvm::dyn_cast<llvm::SCEVConstant>(AddRec->getStepRecurrence(SE));
+      const llvm::SCEV *BackedgeTakenCount = SE.getBackedgeTakenCount(L);
+      if (!Step || !Step->getValue()->getValue().isStrictlyPositive() ||
+          llvm::isa<llvm::SCEVCouldNotCompute>(BackedgeTakenCount))
+        return false;
+      // Worked out in 64 bits, so that a coordinate that wraps around
+      // cannot pass the check.
+      A.mFirstX = SE.getZeroExtendExpr(AddRec->getStart(), Int64Ty);
+      A.mLastX = SE.getAddExpr(
+          A.mFirstX,
+          SE.getMulExpr(SE.getZeroExtendExpr(Step, Int64Ty),
+                        SE.getNoopOrZeroExtend(BackedgeTakenCount, Int64Ty)));
+    }
+    if (!llvm::isSafeToExpand(A.mFirstX, SE) || !llvm::isSafeToExpand(A.mLastX, SE))
+      return false;
+    for (unsigned i = FirstCoord + 1; i < Call->getNumArgOperands(); ++i) {
+      if (!L->isLoopInvariant(Call->getArgOperand(i)))
+        return false;
+    }
+
+    A.mCall = Call;
+    A.mPreheaderTerm = L->getLoopPreheader()->getTerminator();
+    return true;
+  }
+
+  // Emit the values A needs in the preheader.
+  static bool expandAccess(Access &A, llvm::SCEVExpander &Expander) {
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(A.mCall->getContext());
+    A.mFirstXValue = Expander.expandCodeFor(A.mFirstX, Int64Ty, A.mPreheaderTerm);
+    A.mLastXValue = Expander.expandCodeFor(A.mLastX, Int64Ty, A.mPreheaderTerm);
+
+    const unsigned FirstCoord = A.mIsSet ? 2 : 1;
+    for (unsigned i = FirstCoord + 1; i < A.mCall->getNumArgOperands(); ++i)
+      A.mOtherCoords.push_back(A.mCall->getArgOperand(i));
+
+    llvm::Value *Alloc = A.mCall->getArgOperand(0);
+    llvm::IRBuilder<> Builder(A.mPreheaderTerm);
+    if (llvm::GlobalVariable *G = A.mAllocationGlobal) {
+      if (Alloc->getType()->isPointerTy())
+        A.mAllocation = Builder.CreatePointerCast(G, Alloc->getType(), "alloc");
+      else
+        A.mAllocation = Builder.CreateLoad(
+            Builder.CreatePointerCast(G, Alloc->getType()->getPointerTo()), "alloc");
+    } else {
+      A.mAllocation = Alloc;
+    }
+    return A.mFirstXValue && A.mLastXValue;
+  }
+
+  // Check the range of cells A accesses in its preheader, and replace its
+  // call by a direct access when the range is in bounds.
+  static void hoistCheck(const Access &A, const llvm::DataLayout &DL) {
+    llvm::CallInst *Call = A.mCall;
+    llvm::Module *M = Call->getModule();
+    llvm::LLVMContext &Context = Call->getContext();
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(Context);
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(Context);
+    llvm::Type *Int8PtrTy = llvm::Type::getInt8PtrTy(Context);
+    llvm::Type *AllocTy = A.mAllocation->getType();
+
+    llvm::IRBuilder<> Builder(A.mPreheaderTerm);
+    auto getDim = [&](char Dim) {
+      llvm::Constant *GetDim = M->getOrInsertFunction(
+          std::string(kGetDimPrefix) + Dim + "13rs_allocation",
+          llvm::FunctionType::get(Int32Ty, AllocTy, false));
+      return Builder.CreateZExt(
+          Builder.CreateCall(GetDim, A.mAllocation, std::string("dim") + Dim), Int64Ty);
+    };
+
+    // The cell after the first is needed for the element size.
+    llvm::Value *DimX = getDim('X');
+    llvm::Value *SecondX = Builder.CreateAdd(A.mFirstXValue, Builder.getInt64(1));
+    llvm::Value *InBounds = Builder.CreateAnd(Builder.CreateICmpULT(A.mLastXValue, DimX),
+                                              Builder.CreateICmpULT(SecondX, DimX));
+    for (size_t i = 0; i < A.mOtherCoords.size(); ++i) {
+      InBounds = Builder.CreateAnd(
+          InBounds, Builder.CreateICmpULT(Builder.CreateZExt(A.mOtherCoords[i], Int64Ty),
+                                          getDim(i == 0 ? 'Y' : 'Z')));
+    }
+    InBounds->setName("in.bounds");
+
+    // Only then may the cells be accessed through the checked accessor.
+    llvm::BasicBlock *CheckBB = A.mPreheaderTerm->getParent();
+    llvm::TerminatorInst *BaseTerm =
+        llvm::SplitBlockAndInsertIfThen(InBounds, A.mPreheaderTerm, false);
+    llvm::BasicBlock *BaseBB = BaseTerm->getParent();
+    Builder.SetInsertPoint(BaseTerm);
+    std::vector<llvm::Type *> GetParams(1, AllocTy);
+    GetParams.insert(GetParams.end(), A.mNumCoords, Int32Ty);
+    llvm::Constant *GetElementAt = M->getOrInsertFunction(
+        std::string(kGetElementAtPrefix) + std::string(A.mNumCoords, 'j'),
+        llvm::FunctionType::get(Int8PtrTy, GetParams, false));
+    auto getCell = [&](llvm::Value *X, const char *Name) {
+      std::vector<llvm::Value *> Args(1, A.mAllocation);
+      Args.push_back(Builder.CreateTrunc(X, Int32Ty));
+      Args.insert(Args.end(), A.mOtherCoords.begin(), A.mOtherCoords.end());
+      return Builder.CreatePointerCast(Builder.CreateCall(GetElementAt, Args, Name), Int8PtrTy);
+    };
+    llvm::Value *FirstCell = getCell(A.mFirstXValue, "first.cell");
+    llvm::Value *ElementSize = Builder.CreatePtrDiff(getCell(SecondX, "second.cell"), FirstCell);
+
+    Builder.SetInsertPoint(A.mPreheaderTerm);
+    llvm::PHINode *Base = Builder.CreatePHI(Int8PtrTy, 2, "cell.base");
+    Base->addIncoming(llvm::Constant::getNullValue(Int8PtrTy), CheckBB);
+    Base->addIncoming(FirstCell, BaseBB);
+    llvm::PHINode *Size = Builder.CreatePHI(Int64Ty, 2, "cell.size");
+    Size->addIncoming(Builder.getInt64(0), CheckBB);
+    Size->addIncoming(ElementSize, BaseBB);
+    llvm::Value *Direct = Builder.CreateICmpNE(Base, llvm::Constant::getNullValue(Int8PtrTy));
+    llvm::Type *T = A.mIsTyped ? getTypedAccessType(Call, A.mIsSet) : nullptr;
+    if (T) {
+      Direct = Builder.CreateAnd(
+          Direct, Builder.CreateICmpEQ(Size, Builder.getInt64(DL.getTypeAllocSize(T))));
+    }
+    Direct->setName("direct.access");
+
+    // Access the cell directly in the loop when the check passed.
+    llvm::TerminatorInst *DirectTerm, *CheckedTerm;
+    llvm::SplitBlockAndInsertIfThenElse(Direct, Call, &DirectTerm, &CheckedTerm);
+    llvm::BasicBlock *CheckedBB = CheckedTerm->getParent();
+    llvm::BasicBlock *TailBB = Call->getParent();
+    Call->moveBefore(CheckedTerm);
+
+    Builder.SetInsertPoint(DirectTerm);
+    const unsigned FirstCoord = A.mIsSet ? 2 : 1;
+    llvm::Value *Offset = Builder.CreateMul(
+        Builder.CreateSub(Builder.CreateZExt(Call->getArgOperand(FirstCoord), Int64Ty),
+                          A.mFirstXValue),
+        Size);
+    llvm::Value *Cell = Builder.CreateInBoundsGEP(Base, Offset, "cell");
+    llvm::Value *Result = nullptr;
+    if (T) {
+      llvm::Value *TypedCell = Builder.CreatePointerCast(Cell, T->getPointerTo());
+      const unsigned Align = DL.getABITypeAlignment(T);
+      if (A.mIsSet)
+        Builder.CreateAlignedStore(Call->getArgOperand(1), TypedCell, Align);
+      else
+        Result = Builder.CreateAlignedLoad(TypedCell, Align);
+    } else if (A.mIsSet) {
+      Builder.CreateMemCpy(Cell, Builder.CreatePointerCast(Call->getArgOperand(1), Int8PtrTy),
+                           Size, 1);
+    } else {
+      Result = Builder.CreatePointerCast(Cell, Call->getType());
+    }
+
+    if (Result) {
+      llvm::PHINode *Merged = llvm::PHINode::Create(Call->getType(), 2, "",
+                                                    &TailBB->front());
+      Call->replaceAllUsesWith(Merged);
+      Merged->takeName(Call);
+      Merged->addIncoming(Result, DirectTerm->getParent());
+      Merged->addIncoming(Call, CheckedBB);
+    }
+
+    ALOGV("Hoisted the bounds check of a call to %s in %s",
+          Call->getCalledFunction()->getName().str().c_str(),
+          TailBB->getParent()->getName().str().c_str());
+  }
+}; // end RSHoistBoundsChecksPass
+
+char RSHoistBoundsChecksPass::ID = 0;
+llvm::RegisterPass<RSHoistBoundsChecksPass> X("rs-hoist-bounds-checks",
+                                              "RS Hoist Bounds Checks Pass");
+
+} // end anonymous namespace
+
+namespace bcc {
+
+llvm::FunctionPass *
+createRSHoistBoundsChecksPass() {
+  return new RSHoistBoundsChecksPass();
+}
+
+} // end namespace bcc
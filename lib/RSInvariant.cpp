@@ -17,6 +17,8 @@
 #include "RSTransforms.h"
 #include "RSUtils.h"
 
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Metadata.h>
@@ -43,6 +45,19 @@ namespace {
  * rs_kernel_context_t is opaque to user code, so there cannot be any
  * Loads from it in user code.
  *
+ * Loads of the allocation base pointers (the inPtr and outPtr fields)
+ * of RsExpandKernelDriverInfo are additionally marked "nonnull": the
+ * driver only fills in the entries that the kernel uses, and only
+ * .expand functions generated for such a kernel load them.  When every
+ * use of such a pointer is a cast to one element type, which is how
+ * the .expand functions address the cell at x1, the Load is also
+ * marked "dereferenceable" for and "align"ed to that element type.
+ *
+ * The rs_kernel_context_t query results (dimensions and current lod,
+ * face and array coordinates) are covered by the invariant marking of
+ * the query function bodies, which carries over to their callers when
+ * the queries are inlined.
+ *
  * This pass should be run
  * - after foreachexp, so that it can see the Loads generated within
  *   .expand functions
@@ -65,13 +80,19 @@ class RSInvariantPass : public llvm::FunctionPass {
 public:
   static char ID;
 
-  RSInvariantPass() : FunctionPass(ID), EmptyMDNode(nullptr) { }
+  RSInvariantPass() : FunctionPass(ID), EmptyMDNode(nullptr), DL(nullptr) { }
 
   virtual bool doInitialization(llvm::Module &M) {
     EmptyMDNode = llvm::MDNode::get(M.getContext(), llvm::None);
+    DL = &M.getDataLayout();
     return true;
   }
 
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const {
+    // Only metadata gets added.
+    AU.setPreservesAll();
+  }
+
   virtual bool runOnFunction(llvm::Function &F) {
     bool Changed = false;
 
@@ -127,6 +148,8 @@ private:
       } else if (auto Load = llvm::dyn_cast<llvm::LoadInst>(Inst)) {
         if (Use.get() == Load->getPointerOperand()) {
           Load->setMetadata("invariant.load", EmptyMDNode);
+          if (isAllocationBasePointerLoad(Load))
+            markAllocationBasePointer(Load);
           Changed = true;
         }
       }
@@ -134,8 +157,74 @@ private:
     return Changed;
   }
 
+  /*
+   * Is Load a Load of an inPtr[] or outPtr[] entry, addressed as
+   * &DriverInfo->{inPtr,outPtr}[Index]?
+   */
+  static bool isAllocationBasePointerLoad(const llvm::LoadInst *Load) {
+    if (!Load->getType()->isPointerTy())
+      return false;
+
+    auto GEP = llvm::dyn_cast<llvm::GetElementPtrInst>(Load->getPointerOperand());
+    if (!GEP || GEP->getNumIndices() != 3)
+      return false;
+
+    auto BaseStructType = llvm::dyn_cast<llvm::StructType>(
+        GEP->getPointerOperandType()->getPointerElementType());
+    if (!BaseStructType || BaseStructType->isLiteral() ||
+        !getUnsuffixedStructName(BaseStructType).equals("RsExpandKernelDriverInfoPfx"))
+      return false;
+
+    auto Zero = llvm::dyn_cast<llvm::ConstantInt>(GEP->getOperand(1));
+    auto Field = llvm::dyn_cast<llvm::ConstantInt>(GEP->getOperand(2));
+    if (!Zero || !Zero->isZero() || !Field)
+      return false;
+
+    // Must match RsExpandKernelDriverInfoPfxField* in RSKernelExpand.cpp.
+    const uint64_t FieldInPtr = 0, FieldOutPtr = 3;
+    return Field->getZExtValue() == FieldInPtr || Field->getZExtValue() == FieldOutPtr;
+  }
+
+  void markAllocationBasePointer(llvm::LoadInst *Load) {
+    llvm::LLVMContext &Context = Load->getContext();
+    Load->setMetadata("nonnull", EmptyMDNode);
+
+    // The element type is only known if all uses agree on it.
+    llvm::Type *ElementType = nullptr;
+    for (llvm::User *User : Load->users()) {
+      auto BitCast = llvm::dyn_cast<llvm::BitCastInst>(User);
+      if (!BitCast)
+        return;
+      llvm::Type *CastElementType = BitCast->getType()->getPointerElementType();
+      if (ElementType && ElementType != CastElementType)
+        return;
+      ElementType = CastElementType;
+    }
+    if (!ElementType || !ElementType->isSized())
+      return;
+
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(Context);
+    auto makeIntMD = [&](uint64_t Value) {
+      return llvm::MDNode::get(Context, llvm::ConstantAsMetadata::get(
+                                   llvm::ConstantInt::get(Int64Ty, Value)));
+    };
+
+    // Cells are laid out at multiples of the element's allocation size
+    // from an allocation base that is at least 16-byte aligned.
+    const uint64_t MaxAllocationAlign = 16;
+    uint64_t Align = DL->getABITypeAlignment(ElementType);
+    if (Align > MaxAllocationAlign)
+      Align = MaxAllocationAlign;
+
+    Load->setMetadata("dereferenceable", makeIntMD(DL->getTypeStoreSize(ElementType)));
+    Load->setMetadata("align", makeIntMD(Align));
+  }
+
   // Pointer to empty metadata node used for "invariant.load" marking.
   llvm::MDNode *EmptyMDNode;
+
+  // Data layout of the module being processed.
+  const llvm::DataLayout *DL;
 }; // end RSInvariantPass
 
 char RSInvariantPass::ID = 0;
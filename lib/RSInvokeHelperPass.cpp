@@ -65,8 +65,10 @@ public:
     }
 
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
-    // This pass does not use any other analysis passes, but it does
-    // modify the existing functions in the module (thus altering the CFG).
+    // This pass does not use any other analysis passes.  It only inserts
+    // calls into the existing .helper functions, which leaves their CFG
+    // alone.
+    AU.setPreservesCFG();
   }
 
   virtual bool doInitialization(llvm::Module &M) override {
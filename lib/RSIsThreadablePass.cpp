@@ -16,9 +16,16 @@
 
 #include "Log.h"
 #include "RSTransforms.h"
+#include "RSUtils.h"
+
+#include "bcinfo/MetadataExtractor.h"
 
 #include <cstdlib>
+#include <memory>
 
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/CallSite.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
@@ -27,9 +34,14 @@
 
 namespace { // anonymous namespace
 
-// Create a Module pass that screens all the global functions in the module and
-// check if any non-threadable function is callable.  If so, we mark the
-// Module as non-threadable by adding a metadata flag '#rs_is_threadable'
+// Create a Module pass that finds, through the call graph, which exported
+// kernels (ForEach kernels and general reductions) can reach a non-threadable
+// function.  Their names are listed in the metadata '#rs_non_threadable_kernels'
+// so that the runtime can still run the other kernels on multiple threads.
+// If there is any, the Module as a whole is also marked as non-threadable
+// with the metadata flag '#rs_is_threadable', for runtimes that don't look at
+// individual kernels.  Invokables calling non-threadable functions don't
+// affect either, since they never run on multiple threads.
 
 class RSIsThreadablePass : public llvm::ModulePass {
 private:
@@ -78,6 +90,9 @@ private:
     "_Z9rsgFinishv",
   };
 
+  // Metadata of the module extracted ahead of the pass, or nullptr.
+  const bcinfo::MetadataExtractor *mMetadata;
+
   bool isPresent(std::vector<std::string> &list, const std::string &name) {
     auto lower = std::lower_bound(list.begin(),
                                   list.end(),
@@ -88,9 +103,54 @@ private:
     return false;
   }
 
+  // Collects the functions of M from which a non-threadable function can be
+  // called into Reaching.  Returns false if that can't be determined, because
+  // such a function has its address taken and may be called indirectly.
+  bool findReachingFunctions(
+      llvm::Module &M, llvm::SmallPtrSetImpl<const llvm::Function *> &Reaching) {
+    llvm::SmallVector<const llvm::Function *, 16> Worklist;
+    for (auto &F : M.getFunctionList()) {
+      if (isPresent(nonThreadableFns, F.getName().str()) &&
+          Reaching.insert(&F).second) {
+        Worklist.push_back(&F);
+      }
+    }
+
+    while (!Worklist.empty()) {
+      const llvm::Function *F = Worklist.pop_back_val();
+      for (const llvm::User *U : F->users()) {
+        llvm::ImmutableCallSite CS(U);
+        if (!CS || CS.getCalledValue() != F) {
+          return false;
+        }
+        const llvm::Function *Caller = CS.getInstruction()->getFunction();
+        if (Reaching.insert(Caller).second) {
+          Worklist.push_back(Caller);
+        }
+      }
+    }
+    return true;
+  }
+
+  // Whether one of the functions a kernel has been expanded into, or the
+  // kernel function itself, is in Reaching.
+  static bool kernelReaches(
+      llvm::Module &M, llvm::StringRef Name,
+      const llvm::SmallPtrSetImpl<const llvm::Function *> &Reaching) {
+    static const char *const kSuffixes[] = { "", ".expand", ".expand.tiled" };
+    for (const char *Suffix : kSuffixes) {
+      const llvm::Function *F = M.getFunction((Name + Suffix).str());
+      if (F != nullptr && Reaching.count(F)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
 public:
-  RSIsThreadablePass()
-    : ModulePass (ID) {
+  explicit RSIsThreadablePass(
+      const bcinfo::MetadataExtractor *pMetadata = nullptr)
+    : ModulePass (ID), mMetadata(pMetadata) {
       std::sort(nonThreadableFns.begin(), nonThreadableFns.end());
   }
 
@@ -99,17 +159,73 @@ public:
   }
 
   bool runOnModule(llvm::Module &M) override {
-    bool threadable = true;
-
-    auto &FunctionList(M.getFunctionList());
-    for (auto &F: FunctionList) {
-      if (isPresent(nonThreadableFns, F.getName().str())) {
-        threadable = false;
-        break;
+    std::unique_ptr<bcinfo::MetadataExtractor> extracted;
+    const bcinfo::MetadataExtractor *me = mMetadata;
+    if (me == nullptr) {
+      extracted.reset(new bcinfo::MetadataExtractor(&M));
+      if (!extracted->extract()) {
+        ALOGE("Could not extract RS metadata for module!");
+        return false;
       }
+      me = extracted.get();
     }
 
+    llvm::SmallPtrSet<const llvm::Function *, 16> reaching;
+    const bool precise = findReachingFunctions(M, reaching);
+
     llvm::LLVMContext &context = M.getContext();
+    llvm::NamedMDNode *kernels =
+        M.getOrInsertNamedMetadata("#rs_non_threadable_kernels");
+    auto checkKernel = [&](llvm::StringRef name,
+                           llvm::ArrayRef<llvm::StringRef> fns) {
+      bool threadable = true;
+      for (llvm::StringRef fn : fns) {
+        if (fn.empty()) {
+          continue;
+        }
+        if (!precise || kernelReaches(M, fn, reaching)) {
+          threadable = false;
+          break;
+        }
+      }
+      if (!threadable) {
+        kernels->addOperand(
+            llvm::MDNode::get(context, llvm::MDString::get(context, name)));
+      }
+    };
+
+    const char **forEachNameList = me->getExportForEachNameList();
+    for (size_t i = 0; i < me->getExportForEachSignatureCount(); i++) {
+      llvm::StringRef name(forEachNameList[i]);
+      checkKernel(name, name);
+    }
+
+    const bcinfo::MetadataExtractor::Reduce *reduceList =
+        me->getExportReduceList();
+    for (size_t i = 0; i < me->getExportReduceCount(); i++) {
+      const bcinfo::MetadataExtractor::Reduce &reduce = reduceList[i];
+      auto fnName = [](const char *name) {
+        return llvm::StringRef(name ? name : "");
+      };
+      const std::string combiner =
+          (reduce.mCombinerName != nullptr)
+              ? std::string(reduce.mCombinerName)
+              : nameReduceCombinerFromAccumulator(reduce.mAccumulatorName);
+      const llvm::StringRef fns[] = {
+        fnName(reduce.mInitializerName), fnName(reduce.mAccumulatorName),
+        combiner, fnName(reduce.mOutConverterName),
+        fnName(reduce.mHalterName)
+      };
+      checkKernel(reduce.mReduceName, fns);
+    }
+
+    bool threadable = kernels->getNumOperands() == 0;
+    if (!precise) {
+      ALOGW("A non-threadable function may be called indirectly; assuming "
+            "that no kernel is threadable");
+      threadable = false;
+    }
+
     llvm::MDString *val =
       llvm::MDString::get(context, (threadable) ? "yes" : "no");
     llvm::NamedMDNode *node =
@@ -125,11 +241,14 @@ public:
 
 char RSIsThreadablePass::ID = 0;
 
+static llvm::RegisterPass<RSIsThreadablePass> X("rs-is-threadable",
+                                                "RS Is Threadable Pass");
+
 namespace bcc {
 
 llvm::ModulePass *
-createRSIsThreadablePass () {
-  return new RSIsThreadablePass();
+createRSIsThreadablePass(const bcinfo::MetadataExtractor *pMetadata) {
+  return new RSIsThreadablePass(pMetadata);
 }
 
 }
@@ -24,17 +24,27 @@
 
 #include "slang_version.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <unordered_set>
 
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/MathExtras.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Function.h>
@@ -44,6 +54,7 @@
 #ifndef __DISABLE_ASSERTS
 // Only used in bccAssert()
 const int kNumExpandedForeachParams = 4;
+const int kNumExpandedTiledForeachParams = 6;
 const int kNumExpandedReduceAccumulatorParams = 4;
 #endif
 
@@ -56,6 +67,59 @@ namespace {
 
 static const bool gEnableRsTbaa = true;
 
+// Overrides the vector width requested by the compiler, mostly for testing
+// the expansion with opt.
+static llvm::cl::opt<unsigned> ClKernelVectorWidth(
+    "rs-kernel-vector-width", llvm::cl::Hidden,
+    llvm::cl::desc("Number of elements processed per iteration of the loops "
+                   "in expanded forEach kernels (0 = pick for the target)"));
+
+// Overrides whether tiled entry points are generated, mostly for testing the
+// expansion with opt.
+static llvm::cl::opt<bool> ClKernelTiledExpand(
+    "rs-kernel-tiled-expand", llvm::cl::Hidden,
+    llvm::cl::desc("Also generate <kernel>.expand.tiled entry points that "
+                   "iterate over a 2D tile"));
+
+// Overrides the number of partial accumulators the expanded accumulators of
+// general reductions use, mostly for testing the expansion with opt.
+static llvm::cl::opt<unsigned> ClReduceAccumulators(
+    "rs-kernel-reduce-accumulators", llvm::cl::Hidden,
+    llvm::cl::desc("Number of independent partial accumulators kept by the "
+                   "loops of expanded reduction accumulators"));
+
+// Overrides the prefetch distance (in bytes) of expanded kernel loops, mostly
+// for testing the expansion with opt. 0 disables prefetching.
+static llvm::cl::opt<unsigned> ClKernelPrefetchDistance(
+    "rs-kernel-prefetch-distance", llvm::cl::Hidden,
+    llvm::cl::desc("Distance in bytes ahead of the current element at which "
+                   "expanded kernel loops prefetch their inputs and output"));
+
+// Overrides whether kernels only called from their expanded functions are
+// marked always-inline, mostly for testing the expansion with opt.
+static llvm::cl::opt<bool> ClKernelForceInline(
+    "rs-kernel-force-inline", llvm::cl::Hidden,
+    llvm::cl::desc("Mark kernels only called from their expanded functions "
+                   "as always-inline"));
+
+// Name of the pragma overriding the prefetch distance of a script, either as
+// "#pragma rs_prefetch_distance(<bytes>)" for all of its kernels, or as
+// "#pragma rs_prefetch_distance(<kernel>, <bytes>)" for a single one.
+static const char kPrefetchDistancePragma[] = "rs_prefetch_distance";
+
+// Upper bound for the vector width picked for the target, to keep the size of
+// the unrolled loop body in check for small element types.
+static const unsigned kMaxKernelVectorWidth = 16;
+
+// Upper bound for the X extent declared with the rs_fixed_extent pragma that
+// gets a fully unrolled copy of the expanded loop, to keep its size in check.
+static const unsigned kMaxFixedExtent = 64;
+
+// Upper bound for the accumulator data size of general reductions that get a
+// multi-combiner (see CreateReduceMultiCombiner()): scalars and short
+// vectors, whose partial accumulators can be merged in vector registers.
+static const uint32_t kMaxMultiCombineAccumulatorSize = 16;
+
 /* RSKernelExpandPass
  *
  * This pass generates functions used to implement calls via
@@ -130,6 +194,7 @@ private:
    * the pass is run on.
    */
   llvm::FunctionType *ExpandedForEachType;
+  llvm::FunctionType *ExpandedTiledForEachType;
   llvm::Type *RsExpandKernelDriverInfoPfxTy;
 
   // Initialized when we begin to process each Module
@@ -141,6 +206,37 @@ private:
   // Turns on optimization of allocation stride values.
   bool mEnableStepOpt;
 
+  // Number of elements the main loop of an expanded forEach kernel handles
+  // per iteration; 0 means pick one from the target's vector register width.
+  unsigned mVectorWidth;
+
+  // Also generate a "<NAME>.expand.tiled" entry point for every kernel.
+  bool mEnableTiledExpand;
+
+  // Version the loops of old-style kernels on whether their allocations are
+  // packed, when the steps can't be determined at compile time.
+  bool mSpecializeSteps;
+
+  // Number of independent partial accumulators the loop of an expanded
+  // general reduction accumulator keeps; 1 means a single accumulator.
+  unsigned mReduceAccumulators;
+
+  // Distance in bytes ahead of the current element at which expanded loops
+  // prefetch their inputs and output; 0 disables prefetching. It can be
+  // overridden by the script, for all of its kernels (mScriptPrefetchDistance)
+  // or for single kernels (mKernelPrefetchDistances).
+  unsigned mPrefetchDistance;
+  llvm::Optional<unsigned> mScriptPrefetchDistance;
+  llvm::StringMap<unsigned> mKernelPrefetchDistances;
+
+  // Mark kernels whose only callers are their expanded functions as
+  // always-inline, rather than leaving the decision to the inliner's cost
+  // model.
+  bool mForceInlineKernels;
+
+  // Metadata of the module extracted ahead of the pass, or nullptr.
+  const bcinfo::MetadataExtractor *mMetadata;
+
   uint32_t getRootSignature(llvm::Function *Function) {
     const llvm::NamedMDNode *ExportForEachMetadata =
         Module->getNamedMetadata("#rs_export_foreach");
@@ -248,6 +344,18 @@ private:
     }
   }
 
+  // Get the step through an allocation of type AllocType (a pointer) whose
+  // elements are packed, i.e. the allocation size of the pointee type, or
+  // nullptr if the pointee isn't sized.
+  llvm::Constant *getPackedStepValue(llvm::DataLayout *DL, llvm::Type *AllocType) {
+    llvm::PointerType *PT = llvm::dyn_cast<llvm::PointerType>(AllocType);
+    if (!PT || !PT->getElementType()->isSized()) {
+      return nullptr;
+    }
+    uint64_t ETSize = DL->getTypeAllocSize(PT->getElementType());
+    return llvm::ConstantInt::get(llvm::Type::getInt32Ty(*Context), ETSize);
+  }
+
   /// Builds the types required by the pass for the given context.
   void buildTypes(void) {
     // Create the RsLaunchDimensionsTy and RsExpandKernelDriverInfoPfxTy structs.
@@ -329,6 +437,12 @@ private:
     // void (const RsExpandKernelDriverInfoPfxTy *p, uint32_t x1, uint32_t x2, uint32_t outstep)
     ExpandedForEachType = llvm::FunctionType::get(VoidTy,
         {RsExpandKernelDriverInfoPfxPtrTy, Int32Ty, Int32Ty, Int32Ty}, false);
+
+    // void (const RsExpandKernelDriverInfoPfxTy *p, uint32_t x1, uint32_t x2,
+    //       uint32_t y1, uint32_t y2, const uint32_t *rowPitch)
+    ExpandedTiledForEachType = llvm::FunctionType::get(VoidTy,
+        {RsExpandKernelDriverInfoPfxPtrTy, Int32Ty, Int32Ty, Int32Ty, Int32Ty,
+         Int32Ty->getPointerTo()}, false);
   }
 
   /// @brief Create skeleton of the expanded foreach kernel.
@@ -356,6 +470,38 @@ private:
     return ExpandedFunction;
   }
 
+  /// @brief Create skeleton of the tiled entry point of a foreach kernel.
+  ///
+  /// This creates a function with the following signature:
+  ///
+  ///   void (const RsExpandKernelDriverInfoPfx *p, uint32_t x1, uint32_t x2,
+  ///         uint32_t y1, uint32_t y2, const uint32_t *rowPitch)
+  ///
+  /// It processes the cells [x1, x2) x [y1, y2), which lets the driver hand
+  /// out cache-sized 2D blocks instead of single rows. The input and output
+  /// pointers in p point at cell (x1, y1). rowPitch[0] is the distance in
+  /// bytes between two rows of the output and rowPitch[1 + i] the one of
+  /// input i.
+  llvm::Function *createEmptyExpandedTiledForEachKernel(llvm::StringRef OldName) {
+    llvm::Function *ExpandedFunction =
+      llvm::Function::Create(ExpandedTiledForEachType,
+                             llvm::GlobalValue::ExternalLinkage,
+                             OldName + ".expand.tiled", Module);
+    bccAssert(ExpandedFunction->arg_size() == kNumExpandedTiledForeachParams);
+    llvm::Function::arg_iterator AI = ExpandedFunction->arg_begin();
+    (AI++)->setName("p");
+    (AI++)->setName("x1");
+    (AI++)->setName("x2");
+    (AI++)->setName("y1");
+    (AI++)->setName("y2");
+    (AI++)->setName("row_pitch");
+    llvm::BasicBlock *Begin = llvm::BasicBlock::Create(*Context, "Begin",
+                                                       ExpandedFunction);
+    llvm::IRBuilder<> Builder(Begin);
+    Builder.CreateRetVoid();
+    return ExpandedFunction;
+  }
+
   // Create skeleton of a general reduce kernel's expanded accumulator.
   //
   // This creates a function with the following signature:
@@ -409,9 +555,11 @@ private:
   ///
   /// Create a loop of the form:
   ///
-  /// for (i = LowerBound; i < UpperBound; i++)
+  /// for (i = LowerBound; i < UpperBound; i += Step)
   ///   ;
   ///
+  /// With Step > 1, UpperBound - LowerBound must be a multiple of Step.
+  ///
   /// After the loop has been created, the builder is set such that
   /// instructions can be added to the loop body.
   ///
@@ -421,11 +569,13 @@ private:
   /// @param LowerBound The first value of the loop iterator
   /// @param UpperBound The maximal value of the loop iterator
   /// @param LoopIV A reference that will be set to the loop iterator.
+  /// @param Step The increment of the loop iterator.
   /// @return The BasicBlock that will be executed after the loop.
   llvm::BasicBlock *createLoop(llvm::IRBuilder<> &Builder,
                                llvm::Value *LowerBound,
                                llvm::Value *UpperBound,
-                               llvm::Value **LoopIV) {
+                               llvm::Value **LoopIV,
+                               unsigned Step = 1) {
     bccAssert(LowerBound->getType() == UpperBound->getType());
 
     llvm::BasicBlock *CondBB, *AfterBB, *HeaderBB;
@@ -440,7 +590,16 @@ private:
 
     // decltype(LowerBound) *ivvar = alloca(sizeof(int))
     // *ivvar = LowerBound
-    IVVar = Builder.CreateAlloca(LowerBound->getType(), nullptr, BCC_INDEX_VAR_NAME);
+    //
+    // The alloca always goes into the entry block so that it can be promoted
+    // to a register even when the loop follows another loop.
+    llvm::BasicBlock &EntryBB = CondBB->getParent()->getEntryBlock();
+    if (CondBB == &EntryBB) {
+      IVVar = Builder.CreateAlloca(LowerBound->getType(), nullptr, BCC_INDEX_VAR_NAME);
+    } else {
+      llvm::IRBuilder<> EntryBuilder(&*EntryBB.getFirstInsertionPt());
+      IVVar = EntryBuilder.CreateAlloca(LowerBound->getType(), nullptr, BCC_INDEX_VAR_NAME);
+    }
     Builder.CreateStore(LowerBound, IVVar);
 
     // if (LowerBound < Upperbound)
@@ -453,7 +612,7 @@ private:
     // LoopHeader:
     //   iv = *ivvar
     //   <insertion point here>
-    //   iv.next = iv + 1
+    //   iv.next = iv + Step
     //   *ivvar = iv.next
     //   if (iv.next < Upperbound)
     //     goto LoopHeader
@@ -462,7 +621,7 @@ private:
     // AfterBB:
     Builder.SetInsertPoint(HeaderBB);
     IV = Builder.CreateLoad(IVVar, "X");
-    IVNext = Builder.CreateNUWAdd(IV, Builder.getInt32(1));
+    IVNext = Builder.CreateNUWAdd(IV, Builder.getInt32(Step));
     Builder.CreateStore(IVNext, IVVar);
     Cond = Builder.CreateICmpULT(IVNext, UpperBound);
     Builder.CreateCondBr(Cond, HeaderBB, AfterBB);
@@ -474,6 +633,44 @@ private:
     return AfterBB;
   }
 
+  /// @brief Create a pointer induction variable
+  ///
+  /// Create a pointer into the buffer Base for the loop being built at the
+  /// insertion point of Builder (see createLoop()), whose preheader is
+  /// Preheader. The pointer starts at element Begin of the buffer (or at Base
+  /// if Begin is null) and is advanced by Step elements at the end of every
+  /// iteration, so the loop body does not need to compute the address from
+  /// the loop iterator.
+  ///
+  /// Base and Begin must be available at the end of Preheader, and Step must
+  /// be a constant or loop-invariant.
+  ///
+  /// @return The value of the pointer in the current iteration.
+  llvm::Value *createPointerIV(llvm::IRBuilder<> &Builder,
+                               llvm::BasicBlock *Preheader,
+                               llvm::Value *Base,
+                               llvm::Value *Begin,
+                               llvm::Value *Step,
+                               const llvm::Twine &Name) {
+    llvm::IRBuilder<> PreheaderBuilder(Preheader->getTerminator());
+    llvm::Value *Start = Base;
+    if (Begin) {
+      Start = PreheaderBuilder.CreateInBoundsGEP(Base, Begin, Name + ".begin");
+    }
+
+    // Like the loop iterator, the pointer lives in an alloca in the entry
+    // block until it is promoted to a register.
+    llvm::BasicBlock &EntryBB = Preheader->getParent()->getEntryBlock();
+    llvm::IRBuilder<> EntryBuilder(&*EntryBB.getFirstInsertionPt());
+    llvm::Value *PtrVar = EntryBuilder.CreateAlloca(Base->getType(), nullptr, Name + ".var");
+    PreheaderBuilder.CreateStore(Start, PtrVar);
+
+    llvm::Value *Ptr = Builder.CreateLoad(PtrVar, Name);
+    llvm::IRBuilder<> LatchBuilder(Builder.GetInsertBlock()->getTerminator());
+    LatchBuilder.CreateStore(LatchBuilder.CreateInBoundsGEP(Ptr, Step, Name + ".next"), PtrVar);
+    return Ptr;
+  }
+
   // Finish building the outgoing argument list for calling a ForEach-able function.
   //
   // ArgVector - on input, the non-special arguments
@@ -519,6 +716,16 @@ private:
   // any list of GEP indices it encounters in the code.
   typedef llvm::SmallVector<llvm::Value *, 3> SmallGEPIndices;
 
+  // The alias.scope and noalias lists for the accesses an expanded function
+  // makes to the allocations of a launch: element 0 is for the output, and
+  // element 1 + i for input i. Empty if there are fewer than two
+  // allocations, in which case there is nothing to disambiguate.
+  struct AllocationScope {
+    llvm::MDNode *Scope;
+    llvm::MDNode *NoAlias;
+  };
+  typedef llvm::SmallVector<AllocationScope, 1 + RS_KERNEL_INPUT_LIMIT> AllocationScopeList;
+
   // Helper for turning a list of constant integer GEP indices into a
   // SmallVector of llvm::Value*. The return value is suitable for
   // passing to a GetElementPtrInst constructor or IRBuilder::CreateGEP().
@@ -538,15 +745,108 @@ private:
   }
 
 public:
-  explicit RSKernelExpandPass(bool pEnableStepOpt = true)
+  explicit RSKernelExpandPass(bool pEnableStepOpt = true,
+                              unsigned pVectorWidth = 1,
+                              bool pEnableTiledExpand = false,
+                              bool pSpecializeSteps = true,
+                              unsigned pReduceAccumulators = 1,
+                              unsigned pPrefetchDistance = 0,
+                              bool pForceInlineKernels = false,
+                              const bcinfo::MetadataExtractor *pMetadata = nullptr)
       : ModulePass(ID), Module(nullptr), Context(nullptr),
-        mEnableStepOpt(pEnableStepOpt) {
-
+        mEnableStepOpt(pEnableStepOpt), mVectorWidth(pVectorWidth),
+        mEnableTiledExpand(pEnableTiledExpand),
+        mSpecializeSteps(pSpecializeSteps),
+        mReduceAccumulators(pReduceAccumulators),
+        mPrefetchDistance(pPrefetchDistance),
+        mForceInlineKernels(pForceInlineKernels), mMetadata(pMetadata) {
+    if (ClKernelVectorWidth.getNumOccurrences() > 0) {
+      mVectorWidth = ClKernelVectorWidth;
+    }
+    if (ClKernelTiledExpand.getNumOccurrences() > 0) {
+      mEnableTiledExpand = ClKernelTiledExpand;
+    }
+    if (ClReduceAccumulators.getNumOccurrences() > 0) {
+      mReduceAccumulators = ClReduceAccumulators;
+    }
+    if (ClKernelPrefetchDistance.getNumOccurrences() > 0) {
+      mPrefetchDistance = ClKernelPrefetchDistance;
+    }
+    if (ClKernelForceInline.getNumOccurrences() > 0) {
+      mForceInlineKernels = ClKernelForceInline;
+    }
   }
 
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
-    // This pass does not use any other analysis passes, but it does
+    // This pass only queries the target's vector register width, but it does
     // add/wrap the existing functions in the module (thus altering the CFG).
+    AU.addRequired<llvm::TargetTransformInfoWrapperPass>();
+  }
+
+  // Returns true if the kernel Function writes several outputs, i.e. it has
+  // the kMultipleOutputsAttr attribute and returns a struct of at most
+  // RS_KERNEL_INPUT_LIMIT outputs (the size of the outPtr array).
+  static bool hasMultipleOutputs(const llvm::Function *Function) {
+    if (!Function->hasFnAttribute(kMultipleOutputsAttr)) {
+      return false;
+    }
+    llvm::StructType *OutTy = llvm::dyn_cast<llvm::StructType>(Function->getReturnType());
+    bccAssert(OutTy && OutTy->getNumElements() <= RS_KERNEL_INPUT_LIMIT);
+    return OutTy != nullptr;
+  }
+
+  // Number of elements per main loop iteration to use when expanding the
+  // kernel Function. Kernels whose inputs or output are passed by pointer
+  // (structs) always get the plain scalar loop, since their calls can't be
+  // turned into vector lanes anyway.
+  unsigned getForEachVectorWidth(llvm::Function *Function, uint32_t Signature,
+                                 const llvm::DataLayout &DL) {
+    if (mVectorWidth == 1) {
+      return 1;
+    }
+
+    uint64_t ElementBits = 0;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
+      llvm::Type *OutTy = Function->getReturnType();
+      if (OutTy->isVoidTy()) {
+        return 1;
+      }
+      ElementBits = DL.getTypeSizeInBits(OutTy);
+    }
+
+    // The special arguments (context, x, y, z) follow the inputs.
+    size_t NumInputs = Function->arg_size();
+    if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(Signature))
+      --NumInputs;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signature))
+      --NumInputs;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature))
+      --NumInputs;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureZ(Signature))
+      --NumInputs;
+
+    llvm::Function::arg_iterator ArgIter = Function->arg_begin();
+    for (size_t i = 0; i < NumInputs; ++i, ++ArgIter) {
+      llvm::Type *InTy = ArgIter->getType();
+      if (InTy->isPointerTy()) {
+        return 1;
+      }
+      ElementBits = std::max(ElementBits, DL.getTypeSizeInBits(InTy));
+    }
+
+    if (mVectorWidth != 0) {
+      return mVectorWidth;
+    }
+
+    const llvm::TargetTransformInfo &TTI =
+        getAnalysis<llvm::TargetTransformInfoWrapperPass>().getTTI(*Function);
+    uint64_t RegisterBits = TTI.getRegisterBitWidth(true);
+    if (ElementBits == 0 || RegisterBits < 2 * ElementBits) {
+      return 1;
+    }
+    uint64_t Width = llvm::PowerOf2Floor(RegisterBits / ElementBits);
+    return static_cast<unsigned>(
+        std::min<uint64_t>(Width, kMaxKernelVectorWidth));
   }
 
   // Build contribution to outgoing argument list for calling a
@@ -560,6 +860,8 @@ public:
   // Bump - invoked once for each contributed outgoing argument
   // LoopHeaderInsertionPoint - an Instruction in the loop header, before which
   //                            this function can insert loop-invariant loads
+  // Y - if not null, the Y coordinate to pass instead of the one loaded from
+  //     Arg_p (used by tiled entry points, which iterate over Y themselves)
   //
   // Return value is the (zero-based) position of the context (Arg_p)
   // argument in the CalleeArgs vector, or a negative value if the
@@ -570,7 +872,8 @@ public:
                              llvm::IRBuilder<> &Builder,
                              llvm::SmallVector<llvm::Value*, 8> &CalleeArgs,
                              const std::function<void ()> &Bump,
-                             llvm::Instruction *LoopHeaderInsertionPoint) {
+                             llvm::Instruction *LoopHeaderInsertionPoint,
+                             llvm::Value *Y = nullptr) {
 
     bccAssert(CalleeArgs.empty());
 
@@ -596,10 +899,13 @@ public:
       Builder.SetInsertPoint(LoopHeaderInsertionPoint);
 
       if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
-        SmallGEPIndices YValueGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldCurrent,
-          RsLaunchDimensionsFieldY}));
-        llvm::Value *YAddr = Builder.CreateInBoundsGEP(Arg_p, YValueGEP, "Y.gep");
-        CalleeArgs.push_back(Builder.CreateLoad(YAddr, "Y"));
+        if (Y == nullptr) {
+          SmallGEPIndices YValueGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldCurrent,
+            RsLaunchDimensionsFieldY}));
+          llvm::Value *YAddr = Builder.CreateInBoundsGEP(Arg_p, YValueGEP, "Y.gep");
+          Y = Builder.CreateLoad(YAddr, "Y");
+        }
+        CalleeArgs.push_back(Y);
         Bump();
       }
 
@@ -617,6 +923,38 @@ public:
     return Return;
   }
 
+  // Return true if the kernel can only read through its pointer argument Arg:
+  // every use of Arg, or of a pointer based on it, either loads from it or is
+  // the source of a memcpy or memmove.
+  static bool isReadOnlyArgument(const llvm::Argument *Arg) {
+    if (Arg->onlyReadsMemory() && Arg->hasNoCaptureAttr())
+      return true;
+
+    llvm::SmallVector<const llvm::Value *, 8> Worklist(1, Arg);
+    while (!Worklist.empty()) {
+      const llvm::Value *Ptr = Worklist.pop_back_val();
+      for (const llvm::Use &U : Ptr->uses()) {
+        const llvm::User *User = U.getUser();
+        if (auto Load = llvm::dyn_cast<llvm::LoadInst>(User)) {
+          if (Load->isVolatile())
+            return false;
+        } else if (llvm::isa<llvm::BitCastInst>(User)) {
+          Worklist.push_back(User);
+        } else if (auto GEP = llvm::dyn_cast<llvm::GetElementPtrInst>(User)) {
+          if (U.get() != GEP->getPointerOperand())
+            return false;
+          Worklist.push_back(User);
+        } else if (auto Transfer = llvm::dyn_cast<llvm::MemTransferInst>(User)) {
+          if (U.get() != Transfer->getRawSource() || U.get() == Transfer->getRawDest())
+            return false;
+        } else {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
   // Generate loop-invariant input processing setup code for an expanded
   // ForEach-able function or an expanded general reduction accumulator
   // function.
@@ -635,6 +973,10 @@ public:
   //                       calling convention dictates that a value must be passed
   //                       by reference, and so we need a stacked temporary to hold
   //                       a copy of that value)
+  // InPassedByRef[] - this function sets each array element to whether the input
+  //                   is passed by reference; such an input without a slot in
+  //                   InStructTempSlots[] is passed as a pointer into its
+  //                   allocation, because the kernel only ever reads it
   void ExpandInputsLoopInvariant(llvm::IRBuilder<> &Builder, llvm::BasicBlock *LoopHeader,
                                  llvm::Value *Arg_p,
                                  llvm::MDNode *TBAAPointer,
@@ -642,7 +984,8 @@ public:
                                  const size_t NumInputs,
                                  llvm::SmallVectorImpl<llvm::Type *> &InTypes,
                                  llvm::SmallVectorImpl<llvm::Value *> &InBufPtrs,
-                                 llvm::SmallVectorImpl<llvm::Value *> &InStructTempSlots) {
+                                 llvm::SmallVectorImpl<llvm::Value *> &InStructTempSlots,
+                                 llvm::SmallVectorImpl<bool> &InPassedByRef) {
     bccAssert(NumInputs <= RS_KERNEL_INPUT_LIMIT);
 
     // Extract information about input slots. The work done
@@ -661,15 +1004,23 @@ public:
        * that it is a struct input that has been promoted.  As such we don't
        * need to convert its type to a pointer.  Later we will need to know
        * to create a temporary copy on the stack, so we save this information
-       * in InStructTempSlots.
+       * in InStructTempSlots.  The copy is only there to protect the input
+       * allocation from the kernel, so it is left out when the kernel
+       * provably does not write through the pointer or let it escape.
        */
       if (auto PtrType = llvm::dyn_cast<llvm::PointerType>(InType)) {
         llvm::Type *ElementType = PtrType->getElementType();
-        InStructTempSlots.push_back(Builder.CreateAlloca(ElementType, nullptr,
-                                                         "input_struct_slot"));
+        if (isReadOnlyArgument(&*ArgIter)) {
+          InStructTempSlots.push_back(nullptr);
+        } else {
+          InStructTempSlots.push_back(Builder.CreateAlloca(ElementType, nullptr,
+                                                           "input_struct_slot"));
+        }
+        InPassedByRef.push_back(true);
       } else {
         InType = InType->getPointerTo();
         InStructTempSlots.push_back(nullptr);
+        InPassedByRef.push_back(false);
       }
 
       SmallGEPIndices InBufPtrGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldInPtr,
@@ -701,49 +1052,224 @@ public:
     Builder.restoreIP(OldInsertionPoint);
   }
 
+  // Create an alias scope for each allocation accessed by the expanded
+  // function FunctionName: its output (if HasOut) and NumInputs inputs. The
+  // runtime guarantees that the allocations of a single launch are distinct,
+  // so every access through one scope is marked as not aliasing the others.
+  AllocationScopeList createAllocationScopes(llvm::StringRef FunctionName,
+                                             bool HasOut, size_t NumInputs) {
+    AllocationScopeList Scopes;
+    if ((HasOut ? 1 : 0) + NumInputs < 2) {
+      return Scopes;
+    }
+
+    llvm::MDBuilder MDHelper(*Context);
+    llvm::MDNode *Domain = MDHelper.createAnonymousAliasScopeDomain(FunctionName);
+    llvm::SmallVector<llvm::Metadata *, 1 + RS_KERNEL_INPUT_LIMIT> AllScopes;
+    for (size_t Index = 0; Index < 1 + NumInputs; ++Index) {
+      llvm::MDNode *Scope = nullptr;
+      if (Index > 0 || HasOut) {
+        std::string Name = (Index == 0) ? "out" : "in" + std::to_string(Index - 1);
+        Scope = MDHelper.createAnonymousAliasScope(Domain, Name);
+        AllScopes.push_back(Scope);
+      }
+      Scopes.push_back({Scope, nullptr});
+    }
+
+    for (AllocationScope &S : Scopes) {
+      if (!S.Scope) {
+        continue;
+      }
+      llvm::SmallVector<llvm::Metadata *, 1 + RS_KERNEL_INPUT_LIMIT> Others;
+      for (llvm::Metadata *Other : AllScopes) {
+        if (Other != S.Scope) {
+          Others.push_back(Other);
+        }
+      }
+      S.NoAlias = llvm::MDNode::get(*Context, Others);
+      S.Scope = llvm::MDNode::get(*Context, {S.Scope});
+    }
+    return Scopes;
+  }
+
+  // Mark Access as accessing allocation Index of Scopes (see
+  // createAllocationScopes()).
+  static void setAllocationScope(llvm::Instruction *Access,
+                                 const AllocationScopeList &Scopes, size_t Index) {
+    if (Index < Scopes.size() && Scopes[Index].Scope) {
+      Access->setMetadata(llvm::LLVMContext::MD_alias_scope, Scopes[Index].Scope);
+      Access->setMetadata(llvm::LLVMContext::MD_noalias, Scopes[Index].NoAlias);
+    }
+  }
+
+  // Collect the prefetch distances requested through the
+  // kPrefetchDistancePragma pragma of the script.
+  void readPrefetchPragmas(const bcinfo::MetadataExtractor &me) {
+    mScriptPrefetchDistance.reset();
+    mKernelPrefetchDistances.clear();
+
+    const char **KeyList = me.getPragmaKeyList();
+    const char **ValueList = me.getPragmaValueList();
+    for (size_t i = 0; i < me.getPragmaCount(); ++i) {
+      if (!KeyList[i] || !ValueList[i] ||
+          strcmp(KeyList[i], kPrefetchDistancePragma) != 0) {
+        continue;
+      }
+
+      llvm::StringRef Kernel, Distance = llvm::StringRef(ValueList[i]).trim();
+      size_t Comma = Distance.rfind(',');
+      if (Comma != llvm::StringRef::npos) {
+        Kernel = Distance.substr(0, Comma).trim();
+        Distance = Distance.substr(Comma + 1).trim();
+      }
+
+      unsigned Bytes;
+      if (Distance.getAsInteger(10, Bytes)) {
+        ALOGE("Invalid value '%s' for pragma %s", ValueList[i],
+              kPrefetchDistancePragma);
+        continue;
+      }
+      if (Kernel.empty()) {
+        mScriptPrefetchDistance = Bytes;
+      } else {
+        mKernelPrefetchDistances[Kernel] = Bytes;
+      }
+    }
+  }
+
+  // Prefetch distance to use in the expanded loops of the kernel Name.
+  unsigned getPrefetchDistance(llvm::StringRef Name) const {
+    auto I = mKernelPrefetchDistances.find(Name);
+    if (I != mKernelPrefetchDistances.end()) {
+      return I->getValue();
+    }
+    return mScriptPrefetchDistance.hasValue() ? *mScriptPrefetchDistance
+                                              : mPrefetchDistance;
+  }
+
+  // Prefetch the data Distance bytes past Ptr into the data cache, for a
+  // later read or write. The address is not required to be valid; nothing is
+  // emitted when Distance is 0.
+  void emitPrefetch(llvm::IRBuilder<> &Builder, llvm::Value *Ptr,
+                    unsigned Distance, bool IsWrite) {
+    if (Distance == 0) {
+      return;
+    }
+    llvm::Value *Addr = Builder.CreateGEP(
+        Builder.CreatePointerCast(Ptr, Builder.getInt8PtrTy()),
+        Builder.getInt32(Distance), "prefetch.addr");
+    llvm::Function *Prefetch =
+        llvm::Intrinsic::getDeclaration(Module, llvm::Intrinsic::prefetch);
+    // Arguments: rw (0 = read, 1 = write), locality (3 = keep in all cache
+    // levels), cache type (1 = data).
+    Builder.CreateCall(Prefetch, {Addr, Builder.getInt32(IsWrite ? 1 : 0),
+                                  Builder.getInt32(3), Builder.getInt32(1)});
+  }
+
+  // Create a pointer induction variable (see createPointerIV()) for each of
+  // the buffers BasePtrs[], which point at the element x1 of an input or
+  // output allocation, as set up by ExpandInputsLoopInvariant() and
+  // ExpandForEach(). In each iteration of the loop being built at the
+  // insertion point of Builder, PtrIVs[] then point at the element of the
+  // loop iterator; the loop starts at the X coordinate Begin and processes
+  // Step elements per iteration.
+  //
+  // PtrTys[] are the pointer types of the elements. On x86 the buffers are
+  // byte[] (see ExpandInputsLoopInvariant()), and are advanced by the element
+  // sizes of a datalayout based on X86_CUSTOM_DL_STRING instead.
+  //
+  // Name - name of the pointers in the loop
+  void createBufferIVs(llvm::IRBuilder<> &Builder, llvm::BasicBlock *Preheader,
+                       llvm::Value *Arg_x1, llvm::Value *Begin, unsigned Step,
+                       llvm::ArrayRef<llvm::Type *> PtrTys,
+                       llvm::ArrayRef<llvm::Value *> BasePtrs,
+                       llvm::SmallVectorImpl<llvm::Value *> &PtrIVs,
+                       const char *Name) {
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
+    const bool ByteOffsets = !mStructExplicitlyPaddedBySlang &&
+                             (Module->getTargetTriple() == DEFAULT_X86_TRIPLE_STRING);
+    llvm::DataLayout DL(X86_CUSTOM_DL_STRING);
+
+    llvm::Value *Offset = nullptr;
+    if (Begin != Arg_x1 && !BasePtrs.empty()) {
+      llvm::IRBuilder<> PreheaderBuilder(Preheader->getTerminator());
+      Offset = PreheaderBuilder.CreateSub(Begin, Arg_x1);
+    }
+
+    for (size_t Index = 0; Index < BasePtrs.size(); ++Index) {
+      uint64_t ElementSize = 1;
+      if (ByteOffsets) {
+        ElementSize = DL.getTypeAllocSize(PtrTys[Index]->getPointerElementType());
+      }
+      llvm::Value *BeginOffset = nullptr;
+      if (Offset) {
+        llvm::IRBuilder<> PreheaderBuilder(Preheader->getTerminator());
+        BeginOffset = ElementSize == 1 ? Offset :
+          PreheaderBuilder.CreateMul(Offset, llvm::ConstantInt::get(Int32Ty, ElementSize));
+      }
+      PtrIVs.push_back(createPointerIV(Builder, Preheader, BasePtrs[Index], BeginOffset,
+                                       llvm::ConstantInt::get(Int32Ty, Step * ElementSize),
+                                       Name));
+    }
+  }
+
+  // Pointer to the element Lane elements past PtrIV, a pointer induction
+  // variable of createBufferIVs(), as the element pointer type PtrTy.
+  llvm::Value *getLanePtr(llvm::IRBuilder<> &Builder, llvm::Value *PtrIV,
+                          llvm::Type *PtrTy, unsigned Lane) {
+    if (mStructExplicitlyPaddedBySlang || (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING)) {
+      return Lane == 0 ? PtrIV : Builder.CreateConstInBoundsGEP1_32(nullptr, PtrIV, Lane);
+    }
+    llvm::DataLayout DL(X86_CUSTOM_DL_STRING);
+    uint64_t Offset = Lane * DL.getTypeAllocSize(PtrTy->getPointerElementType());
+    llvm::Value *Ptr = PtrIV;
+    if (Offset != 0) {
+      Ptr = Builder.CreateConstInBoundsGEP1_32(nullptr, PtrIV, Offset);
+    }
+    return Builder.CreatePointerCast(Ptr, PtrTy);
+  }
+
   // Generate loop-varying input processing code for an expanded ForEach-able function
   // or an expanded general reduction accumulator function.  Also, for the call to the
   // UNexpanded function, collect the portion of the argument list corresponding to the
   // inputs.
   //
-  // Arg_x1 - first X coordinate to be processed by the expanded function
   // TBAAAllocation - metadata for marking loads of input values out of allocations
   // NumInputs -- number of inputs (NOT number of ARGUMENTS)
   // InTypes[] - this function uses the saved input types in ExpandInputsLoopInvariant()
   //             to convert the pointer of byte InPtr to its real type.
-  // InBufPtrs[] - this function consumes the information produced by ExpandInputsLoopInvariant()
+  // InPtrIVs[] - pointer induction variables of the inputs in the current loop,
+  //              created by createBufferIVs() from the InBufPtrs[] of
+  //              ExpandInputsLoopInvariant()
   // InStructTempSlots[] - this function consumes the information produced by ExpandInputsLoopInvariant()
-  // IndVar - value of loop induction variable (X coordinate) for a given loop iteration
+  // InPassedByRef[] - this function consumes the information produced by ExpandInputsLoopInvariant()
+  // Lane - position of the element to process after the one InPtrIVs[] point at
   //
   // RootArgs - this function sets this to the list of outgoing argument values corresponding
   //            to the inputs
+  // PrefetchDistance - if not 0, also prefetch each input this many bytes ahead
+  // Scopes - if given, alias scopes of the allocations (see createAllocationScopes())
   void ExpandInputsBody(llvm::IRBuilder<> &Builder,
-                        llvm::Value *Arg_x1,
                         llvm::MDNode *TBAAAllocation,
                         const size_t NumInputs,
                         const llvm::SmallVectorImpl<llvm::Type *> &InTypes,
-                        const llvm::SmallVectorImpl<llvm::Value *> &InBufPtrs,
+                        const llvm::SmallVectorImpl<llvm::Value *> &InPtrIVs,
                         const llvm::SmallVectorImpl<llvm::Value *> &InStructTempSlots,
-                        llvm::Value *IndVar,
-                        llvm::SmallVectorImpl<llvm::Value *> &RootArgs) {
-    llvm::Value *Offset = Builder.CreateSub(IndVar, Arg_x1);
-    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
-
+                        const llvm::SmallVectorImpl<bool> &InPassedByRef,
+                        unsigned Lane,
+                        llvm::SmallVectorImpl<llvm::Value *> &RootArgs,
+                        unsigned PrefetchDistance = 0,
+                        const AllocationScopeList *Scopes = nullptr) {
     for (size_t Index = 0; Index < NumInputs; ++Index) {
 
-      llvm::Value *InPtr = nullptr;
-      if (mStructExplicitlyPaddedBySlang || (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING)) {
-        InPtr = Builder.CreateInBoundsGEP(InBufPtrs[Index], Offset);
-      } else {
-        // Treat x86 input buffer as byte[], get indexed pointer with explicit
-        // byte offset computed using a datalayout based on
-        // X86_CUSTOM_DL_STRING, then bitcast it to actual input type.
-        llvm::DataLayout DL(X86_CUSTOM_DL_STRING);
-        llvm::Type *InTy = InTypes[Index];
-        uint64_t InStep = DL.getTypeAllocSize(InTy->getPointerElementType());
-        llvm::Value *OffsetInBytes = Builder.CreateMul(Offset, llvm::ConstantInt::get(Int32Ty, InStep));
-        InPtr = Builder.CreateInBoundsGEP(InBufPtrs[Index], OffsetInBytes);
-        InPtr = Builder.CreatePointerCast(InPtr, InTy);
+      llvm::Value *InPtr = getLanePtr(Builder, InPtrIVs[Index], InTypes[Index], Lane);
+
+      emitPrefetch(Builder, InPtr, PrefetchDistance, false);
+
+      if (InPassedByRef[Index] && !InStructTempSlots[Index]) {
+        // The kernel only reads the input, so let it read the cell in place.
+        RootArgs.push_back(InPtr);
+        continue;
       }
 
       llvm::Value *Input;
@@ -752,6 +1278,9 @@ public:
       if (gEnableRsTbaa) {
         InputLoad->setMetadata("tbaa", TBAAAllocation);
       }
+      if (Scopes) {
+        setAllocationScope(InputLoad, *Scopes, 1 + Index);
+      }
 
       if (llvm::Value *TemporarySlot = InStructTempSlots[Index]) {
         // Pass a pointer to a temporary on the stack, rather than
@@ -770,11 +1299,33 @@ public:
     }
   }
 
+  // Advance Ptr, which points at row y1 of a buffer, to the row RowIndex rows
+  // further down, using the row pitch in bytes at RowPitch[PitchIndex]
+  // (see createEmptyExpandedTiledForEachKernel).
+  llvm::Value *offsetToRow(llvm::IRBuilder<> &Builder, llvm::Value *Ptr,
+                           llvm::Value *RowPitch, llvm::Value *RowIndex,
+                           unsigned PitchIndex) {
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
+    llvm::Value *PitchAddr =
+      Builder.CreateConstInBoundsGEP1_32(Int32Ty, RowPitch, PitchIndex, "row_pitch.gep");
+    llvm::Value *Pitch = Builder.CreateLoad(PitchAddr, "row_pitch");
+    llvm::Value *RowOffset = Builder.CreateMul(RowIndex, Pitch, "row_offset");
+    llvm::Value *RowPtr = Builder.CreatePointerCast(Ptr, Builder.getInt8PtrTy());
+    RowPtr = Builder.CreateInBoundsGEP(RowPtr, RowOffset, "row_buf");
+    return Builder.CreatePointerCast(RowPtr, Ptr->getType());
+  }
+
   /* Performs the actual optimization on a selected function. On success, the
    * Module will contain a new function of the name "<NAME>.expand" that
    * invokes <NAME>() in a loop with the appropriate parameters.
+   *
+   * With Tiled set, the new function is "<NAME>.expand.tiled" instead, which
+   * runs the same loop for every row of a tile (so one call from the driver
+   * covers many rows). The output step is then read from the driver info
+   * structure, since the tiled signature has no outstep parameter.
    */
-  bool ExpandOldStyleForEach(llvm::Function *Function, uint32_t Signature) {
+  bool ExpandOldStyleForEach(llvm::Function *Function, uint32_t Signature,
+                             bool Tiled = false) {
     ALOGV("Expanding ForEach-able Function %s",
           Function->getName().str().c_str());
 
@@ -792,15 +1343,18 @@ public:
       DL.reset(X86_CUSTOM_DL_STRING);
     }
 
-    llvm::Function *ExpandedFunction =
+    llvm::Function *ExpandedFunction = Tiled ?
+      createEmptyExpandedTiledForEachKernel(Function->getName()) :
       createEmptyExpandedForEachKernel(Function->getName());
 
     /*
      * Extract the expanded function's parameters.  It is guaranteed by
-     * createEmptyExpandedForEachKernel that there will be four parameters.
+     * createEmptyExpandedForEachKernel that there will be four parameters,
+     * and by createEmptyExpandedTiledForEachKernel that there will be six.
      */
 
-    bccAssert(ExpandedFunction->arg_size() == kNumExpandedForeachParams);
+    bccAssert(ExpandedFunction->arg_size() ==
+              (Tiled ? kNumExpandedTiledForeachParams : kNumExpandedForeachParams));
 
     llvm::Function::arg_iterator ExpandedFunctionArgIter =
       ExpandedFunction->arg_begin();
@@ -808,7 +1362,17 @@ public:
     llvm::Value *Arg_p       = &*(ExpandedFunctionArgIter++);
     llvm::Value *Arg_x1      = &*(ExpandedFunctionArgIter++);
     llvm::Value *Arg_x2      = &*(ExpandedFunctionArgIter++);
-    llvm::Value *Arg_outstep = &*(ExpandedFunctionArgIter);
+    llvm::Value *Arg_outstep  = nullptr;
+    llvm::Value *Arg_y1       = nullptr;
+    llvm::Value *Arg_y2       = nullptr;
+    llvm::Value *Arg_rowPitch = nullptr;
+    if (Tiled) {
+      Arg_y1       = &*(ExpandedFunctionArgIter++);
+      Arg_y2       = &*(ExpandedFunctionArgIter++);
+      Arg_rowPitch = &*(ExpandedFunctionArgIter);
+    } else {
+      Arg_outstep  = &*(ExpandedFunctionArgIter);
+    }
 
     llvm::Value *InStep  = nullptr;
     llvm::Value *OutStep = nullptr;
@@ -816,6 +1380,12 @@ public:
     // Construct the actual function body.
     llvm::IRBuilder<> Builder(&*ExpandedFunction->getEntryBlock().begin());
 
+    if (Tiled && bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
+      SmallGEPIndices OutStepGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutStride, 0}));
+      Arg_outstep = Builder.CreateLoad(
+        Builder.CreateInBoundsGEP(Arg_p, OutStepGEP, "outstep_addr.gep"), "outstep_addr");
+    }
+
     // Collect and construct the arguments for the kernel().
     // Note that we load any loop-invariant arguments before entering the Loop.
     llvm::Function::arg_iterator FunctionArgIter = Function->arg_begin();
@@ -855,69 +1425,150 @@ public:
       UsrData->setName("UsrData");
     }
 
-    llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
-    llvm::Value *IV;
-    createLoop(Builder, Arg_x1, Arg_x2, &IV);
+    // For a tiled entry point, the X loop is nested in a loop over the rows
+    // of the tile, and the buffers are advanced to the current row.
+    llvm::Value *Y = nullptr;
+    if (Tiled) {
+      createLoop(Builder, Arg_y1, Arg_y2, &Y);
+      llvm::Value *RowIndex = Builder.CreateSub(Y, Arg_y1, "row");
+      if (InBufPtr) {
+        InBufPtr = offsetToRow(Builder, InBufPtr, Arg_rowPitch, RowIndex, 1);
+      }
+      if (OutBasePtr) {
+        OutBasePtr = offsetToRow(Builder, OutBasePtr, Arg_rowPitch, RowIndex, 0);
+      }
+    }
 
-    llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
-    const int CalleeArgsContextIdx = ExpandSpecialArguments(Signature, IV, Arg_p, Builder, CalleeArgs,
-                                                            [&FunctionArgIter]() { FunctionArgIter++; },
-                                                            LoopHeader->getTerminator());
+    const unsigned PrefetchDistance = getPrefetchDistance(Function->getName());
+
+    // Emit the loop over [x1, x2) at the current insertion point of Builder,
+    // stepping through the input and output with the given steps.
+    const llvm::Function::arg_iterator SpecialArgIter = FunctionArgIter;
+    auto EmitLoop = [&](llvm::Value *LoopInStep, llvm::Value *LoopOutStep) {
+      FunctionArgIter = SpecialArgIter;
+
+      llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
+      llvm::Value *IV;
+      createLoop(Builder, Arg_x1, Arg_x2, &IV);
+
+      llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
+      const int CalleeArgsContextIdx = ExpandSpecialArguments(Signature, IV, Arg_p, Builder, CalleeArgs,
+                                                              [&FunctionArgIter]() { FunctionArgIter++; },
+                                                              LoopHeader->getTerminator(), Y);
+
+      bccAssert(FunctionArgIter == Function->arg_end());
+
+      // Populate the actual call to kernel().
+      llvm::SmallVector<llvm::Value*, 8> RootArgs;
+
+      llvm::Value *InPtr  = nullptr;
+      llvm::Value *OutPtr = nullptr;
+
+      // Calculate the current input and output pointers
+      //
+      // We always calculate the input/output pointers with a GEP operating on i8
+      // values and only cast at the very end to OutTy. This is because the step
+      // between two values is given in bytes. The pointers are induction
+      // variables of the loop, advanced by the steps after every element.
+      //
+      // TODO: We could further optimize the output by using a GEP operation of
+      // type 'OutTy' in cases where the element type of the allocation allows.
+      if (OutBasePtr) {
+        OutPtr = createPointerIV(Builder, LoopHeader, OutBasePtr, nullptr, LoopOutStep, "out_ptr");
+        emitPrefetch(Builder, OutPtr, PrefetchDistance, true);
+        OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
+      }
 
-    bccAssert(FunctionArgIter == Function->arg_end());
+      if (InBufPtr) {
+        InPtr = createPointerIV(Builder, LoopHeader, InBufPtr, nullptr, LoopInStep, "in_ptr");
+        emitPrefetch(Builder, InPtr, PrefetchDistance, false);
+        InPtr = Builder.CreatePointerCast(InPtr, InTy);
+      }
 
-    // Populate the actual call to kernel().
-    llvm::SmallVector<llvm::Value*, 8> RootArgs;
+      if (InPtr) {
+        RootArgs.push_back(InPtr);
+      }
 
-    llvm::Value *InPtr  = nullptr;
-    llvm::Value *OutPtr = nullptr;
+      if (OutPtr) {
+        RootArgs.push_back(OutPtr);
+      }
 
-    // Calculate the current input and output pointers
-    //
-    // We always calculate the input/output pointers with a GEP operating on i8
-    // values and only cast at the very end to OutTy. This is because the step
-    // between two values is given in bytes.
-    //
-    // TODO: We could further optimize the output by using a GEP operation of
-    // type 'OutTy' in cases where the element type of the allocation allows.
-    if (OutBasePtr) {
-      llvm::Value *OutOffset = Builder.CreateSub(IV, Arg_x1);
-      OutOffset = Builder.CreateMul(OutOffset, OutStep);
-      OutPtr = Builder.CreateInBoundsGEP(OutBasePtr, OutOffset);
-      OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
-    }
+      if (UsrData) {
+        RootArgs.push_back(UsrData);
+      }
 
-    if (InBufPtr) {
-      llvm::Value *InOffset = Builder.CreateSub(IV, Arg_x1);
-      InOffset = Builder.CreateMul(InOffset, InStep);
-      InPtr = Builder.CreateInBoundsGEP(InBufPtr, InOffset);
-      InPtr = Builder.CreatePointerCast(InPtr, InTy);
-    }
+      finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *Function, Builder);
 
-    if (InPtr) {
-      RootArgs.push_back(InPtr);
-    }
+      Builder.CreateCall(Function, RootArgs);
+    };
 
-    if (OutPtr) {
-      RootArgs.push_back(OutPtr);
-    }
+    // Unless the steps are already known, version the loop on whether the
+    // allocations are packed: if every step equals the size of its element
+    // type, one copy of the loop uses constant steps that the optimizer can
+    // fold into the address computations, and the generic strided loop is
+    // only used otherwise. The check is cheap and runs once per call.
+    llvm::Value *PackedInStep  = InStep;
+    llvm::Value *PackedOutStep = OutStep;
+    bool NeedsCheck = false;
+    bool CanSpecialize = mSpecializeSteps;
+    auto GetPackedStep = [&](llvm::Value *Step, llvm::Type *AllocType,
+                             llvm::Value **PackedStep) {
+      if (!Step || llvm::isa<llvm::Constant>(Step)) {
+        return;
+      }
+      *PackedStep = getPackedStepValue(&DL, AllocType);
+      if (*PackedStep) {
+        NeedsCheck = true;
+      } else {
+        CanSpecialize = false;
+      }
+    };
+    GetPackedStep(InStep, InTy, &PackedInStep);
+    GetPackedStep(OutStep, OutTy, &PackedOutStep);
 
-    if (UsrData) {
-      RootArgs.push_back(UsrData);
+    llvm::Value *IsPacked = nullptr;
+    if (CanSpecialize && NeedsCheck) {
+      if (PackedInStep != InStep) {
+        IsPacked = Builder.CreateICmpEQ(InStep, PackedInStep);
+      }
+      if (PackedOutStep != OutStep) {
+        llvm::Value *Check = Builder.CreateICmpEQ(OutStep, PackedOutStep);
+        IsPacked = IsPacked ? Builder.CreateAnd(IsPacked, Check) : Check;
+      }
     }
 
-    finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *Function, Builder);
-
-    Builder.CreateCall(Function, RootArgs);
+    if (IsPacked) {
+      IsPacked->setName("packed");
+      llvm::TerminatorInst *PackedTerm, *StridedTerm;
+      llvm::SplitBlockAndInsertIfThenElse(IsPacked, &*Builder.GetInsertPoint(),
+                                          &PackedTerm, &StridedTerm);
+      Builder.SetInsertPoint(PackedTerm);
+      EmitLoop(PackedInStep, PackedOutStep);
+      Builder.SetInsertPoint(StridedTerm);
+      EmitLoop(InStep, OutStep);
+    } else {
+      EmitLoop(InStep, OutStep);
+    }
 
     return true;
   }
 
   /* Expand a pass-by-value foreach kernel.
+   *
+   * With Tiled set, this creates the "<NAME>.expand.tiled" entry point
+   * instead of "<NAME>.expand": the same X loop, nested in a loop over the
+   * rows [y1, y2) of the tile.
+   *
+   * A non-zero FixedExtent is the X extent the kernel is declared to be
+   * launched over (see MetadataExtractor::getExportForEachFixedExtentList()):
+   * calls over exactly that many elements then take a fully unrolled copy of
+   * the loop instead.
    */
-  bool ExpandForEach(llvm::Function *Function, uint32_t Signature) {
+  bool ExpandForEach(llvm::Function *Function, uint32_t Signature,
+                     bool Tiled = false, unsigned FixedExtent = 0) {
     bccAssert(bcinfo::MetadataExtractor::hasForEachSignatureKernel(Signature));
-    ALOGV("Expanding kernel Function %s", Function->getName().str().c_str());
+    ALOGV("Expanding kernel Function %s%s", Function->getName().str().c_str(),
+          Tiled ? " (tiled)" : "");
 
     // TODO: Refactor this to share functionality with ExpandOldStyleForEach.
     llvm::DataLayout DL(Module);
@@ -926,15 +1577,18 @@ public:
     }
     llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
 
-    llvm::Function *ExpandedFunction =
+    llvm::Function *ExpandedFunction = Tiled ?
+      createEmptyExpandedTiledForEachKernel(Function->getName()) :
       createEmptyExpandedForEachKernel(Function->getName());
 
     /*
      * Extract the expanded function's parameters.  It is guaranteed by
-     * createEmptyExpandedForEachKernel that there will be four parameters.
+     * createEmptyExpandedForEachKernel that there will be four parameters,
+     * and by createEmptyExpandedTiledForEachKernel that there will be six.
      */
 
-    bccAssert(ExpandedFunction->arg_size() == kNumExpandedForeachParams);
+    bccAssert(ExpandedFunction->arg_size() ==
+              (Tiled ? kNumExpandedTiledForeachParams : kNumExpandedForeachParams));
 
     llvm::Function::arg_iterator ExpandedFunctionArgIter =
       ExpandedFunction->arg_begin();
@@ -943,6 +1597,14 @@ public:
     llvm::Value *Arg_x1      = &*(ExpandedFunctionArgIter++);
     llvm::Value *Arg_x2      = &*(ExpandedFunctionArgIter++);
     // Arg_outstep is not used by expanded new-style forEach kernels.
+    llvm::Value *Arg_y1       = nullptr;
+    llvm::Value *Arg_y2       = nullptr;
+    llvm::Value *Arg_rowPitch = nullptr;
+    if (Tiled) {
+      Arg_y1       = &*(ExpandedFunctionArgIter++);
+      Arg_y2       = &*(ExpandedFunctionArgIter++);
+      Arg_rowPitch = &*(ExpandedFunctionArgIter++);
+    }
 
     // Construct the actual function body.
     llvm::IRBuilder<> Builder(&*ExpandedFunction->getEntryBlock().begin());
@@ -964,6 +1626,16 @@ public:
                                                     TBAARenderScript);
     TBAAPointer = MDHelper.createTBAAStructTagNode(TBAAPointer, TBAAPointer, 0);
 
+    // For a tiled entry point, everything below is emitted into the body of
+    // a loop over the rows of the tile. Y is the row being processed and
+    // RowIndex its position in the tile.
+    llvm::Value *Y = nullptr;
+    llvm::Value *RowIndex = nullptr;
+    if (Tiled) {
+      createLoop(Builder, Arg_y1, Arg_y2, &Y);
+      RowIndex = Builder.CreateSub(Y, Arg_y1, "row");
+    }
+
     /*
      * Collect and construct the arguments for the kernel().
      *
@@ -977,63 +1649,99 @@ public:
 
     llvm::Function::arg_iterator ArgIter = Function->arg_begin();
 
-    // Check the return type
-    llvm::Type     *OutTy            = nullptr;
-    llvm::LoadInst *OutBasePtr       = nullptr;
-    llvm::Value    *CastedOutBasePtr = nullptr;
+    // Check the return type. A kernel with multiple outputs (see
+    // kMultipleOutputsAttr) returns a struct with one element per output, and
+    // element i goes to outPtr[i].
+    llvm::SmallVector<llvm::Type*,  8> OutTys;
+    llvm::SmallVector<llvm::Value*, 8> CastedOutBasePtrs;
 
     bool PassOutByPointer = false;
+    const bool MultipleOutputs = hasMultipleOutputs(Function);
 
     if (bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
       llvm::Type *OutBaseTy = Function->getReturnType();
 
       if (OutBaseTy->isVoidTy()) {
         PassOutByPointer = true;
-        OutTy = ArgIter->getType();
+        OutTys.push_back(ArgIter->getType());
 
         ArgIter++;
         --NumRemainingInputs;
+      } else if (MultipleOutputs) {
+        for (llvm::Type *ElementTy : OutBaseTy->subtypes()) {
+          OutTys.push_back(ElementTy->getPointerTo());
+        }
       } else {
         // We don't increment Args, since we are using the actual return type.
-        OutTy = OutBaseTy->getPointerTo();
+        OutTys.push_back(OutBaseTy->getPointerTo());
       }
 
-      SmallGEPIndices OutBaseGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutPtr, 0}));
-      OutBasePtr = Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, OutBaseGEP, "out_buf.gep"));
+      for (size_t Index = 0; Index < OutTys.size(); ++Index) {
+        SmallGEPIndices OutBaseGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutPtr,
+                                              static_cast<int32_t>(Index)}));
+        llvm::LoadInst *OutBasePtr =
+          Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, OutBaseGEP, "out_buf.gep"));
 
-      if (gEnableRsTbaa) {
-        OutBasePtr->setMetadata("tbaa", TBAAPointer);
-      }
+        if (gEnableRsTbaa) {
+          OutBasePtr->setMetadata("tbaa", TBAAPointer);
+        }
 
-      if (mStructExplicitlyPaddedBySlang || (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING)) {
-        CastedOutBasePtr = Builder.CreatePointerCast(OutBasePtr, OutTy, "casted_out");
-      } else {
-        // The disagreement between module and x86 target machine datalayout
-        // causes mismatched input/output data offset between slang reflected
-        // code and bcc codegen for GetElementPtr. To solve this issue, skip the
-        // cast to OutTy and leave CastedOutBasePtr as an int8_t*.  The buffer
-        // is later indexed with an explicit byte offset computed based on
-        // X86_CUSTOM_DL_STRING and then bitcast to actual output type.
-        CastedOutBasePtr = OutBasePtr;
+        llvm::Value *OutRowPtr = OutBasePtr;
+        if (Tiled) {
+          OutRowPtr = offsetToRow(Builder, OutBasePtr, Arg_rowPitch, RowIndex, 0);
+        }
+
+        if (mStructExplicitlyPaddedBySlang || (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING)) {
+          CastedOutBasePtrs.push_back(
+            Builder.CreatePointerCast(OutRowPtr, OutTys[Index], "casted_out"));
+        } else {
+          // The disagreement between module and x86 target machine datalayout
+          // causes mismatched input/output data offset between slang reflected
+          // code and bcc codegen for GetElementPtr. To solve this issue, skip the
+          // cast to OutTy and leave the casted output pointer as an int8_t*.  The
+          // buffer is later indexed with an explicit byte offset computed based on
+          // X86_CUSTOM_DL_STRING and then bitcast to actual output type.
+          CastedOutBasePtrs.push_back(OutRowPtr);
+        }
       }
     }
 
     llvm::SmallVector<llvm::Type*,  8> InTypes;
     llvm::SmallVector<llvm::Value*, 8> InBufPtrs;
     llvm::SmallVector<llvm::Value*, 8> InStructTempSlots;
+    llvm::SmallVector<bool, 8> InPassedByRef;
 
     bccAssert(NumRemainingInputs <= RS_KERNEL_INPUT_LIMIT);
 
-    // Create the loop structure.
+    // Create the loop structure. With a vector width VF > 1, the main loop
+    // covers the largest multiple of VF elements and calls the kernel for VF
+    // consecutive elements per iteration; a scalar loop handles the rest.
     llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
+    const unsigned VF = getForEachVectorWidth(Function, Signature, DL);
+
+    llvm::Value *ScalarBegin = Arg_x1;
     llvm::Value *IV;
-    createLoop(Builder, Arg_x1, Arg_x2, &IV);
+    if (VF > 1) {
+      llvm::Value *VFVal = llvm::ConstantInt::get(Int32Ty, VF);
+      llvm::Value *Count = Builder.CreateSub(Arg_x2, Arg_x1);
+      llvm::Value *Rem = Builder.CreateURem(Count, VFVal);
+      ScalarBegin = Builder.CreateSub(Arg_x2, Rem, "vector.end");
+    }
+    llvm::BasicBlock *LoopExit = createLoop(Builder, Arg_x1, ScalarBegin, &IV, VF);
 
     llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
     const int CalleeArgsContextIdx =
       ExpandSpecialArguments(Signature, IV, Arg_p, Builder, CalleeArgs,
                              [&NumRemainingInputs]() { --NumRemainingInputs; },
-                             LoopHeader->getTerminator());
+                             LoopHeader->getTerminator(), Y);
+
+    // Position of the X coordinate in CalleeArgs, which is the only special
+    // argument that differs between the calls emitted below.
+    int CalleeArgsXIdx = -1;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signature)) {
+      CalleeArgsXIdx =
+          bcinfo::MetadataExtractor::hasForEachSignatureCtxt(Signature) ? 1 : 0;
+    }
 
     // After ExpandSpecialArguments() gets called, NumRemainingInputs
     // counts the number of arguments to the kernel that correspond to
@@ -1043,54 +1751,162 @@ public:
 
     if (NumInPtrArguments > 0) {
       ExpandInputsLoopInvariant(Builder, LoopHeader, Arg_p, TBAAPointer, ArgIter, NumInPtrArguments,
-                                InTypes, InBufPtrs, InStructTempSlots);
+                                InTypes, InBufPtrs, InStructTempSlots, InPassedByRef);
+    }
+
+    if (Tiled && NumInPtrArguments > 0) {
+      auto OldInsertionPoint = Builder.saveIP();
+      Builder.SetInsertPoint(LoopHeader->getTerminator());
+      llvm::Instruction *EntryInsertionPoint =
+        &*ExpandedFunction->getEntryBlock().getFirstInsertionPt();
+      for (size_t Index = 0; Index < NumInPtrArguments; ++Index) {
+        InBufPtrs[Index] = offsetToRow(Builder, InBufPtrs[Index], Arg_rowPitch, RowIndex, 1 + Index);
+        // Keep the struct temporaries out of the row loop, so the stack
+        // doesn't grow with every row.
+        if (InStructTempSlots[Index]) {
+          llvm::cast<llvm::Instruction>(InStructTempSlots[Index])->moveBefore(EntryInsertionPoint);
+        }
+      }
+      Builder.restoreIP(OldInsertionPoint);
     }
 
-    // Populate the actual call to kernel().
-    llvm::SmallVector<llvm::Value*, 8> RootArgs;
+    const unsigned PrefetchDistance = getPrefetchDistance(Function->getName());
+    const AllocationScopeList Scopes =
+      createAllocationScopes(ExpandedFunction->getName(), !CastedOutBasePtrs.empty(),
+                             NumInPtrArguments);
+
+    // Pointer induction variables of the outputs and inputs in the loop
+    // being emitted, so that the loop body only adds constant lane offsets
+    // to them.
+    llvm::SmallVector<llvm::Value*, 8> OutPtrIVs;
+    llvm::SmallVector<llvm::Value*, 8> InPtrIVs;
+    auto CreatePtrIVs = [&](llvm::BasicBlock *Preheader, llvm::Value *Begin, unsigned Step) {
+      OutPtrIVs.clear();
+      InPtrIVs.clear();
+      createBufferIVs(Builder, Preheader, Arg_x1, Begin, Step, OutTys, CastedOutBasePtrs,
+                      OutPtrIVs, "out_ptr");
+      createBufferIVs(Builder, Preheader, Arg_x1, Begin, Step, InTypes, InBufPtrs,
+                      InPtrIVs, "in_ptr");
+    };
 
-    // Calculate the current input and output pointers.
+    // Emit the call to kernel() for the element at X, Lane elements past the
+    // one the pointer induction variables point at, at the current insertion
+    // point of Builder, prefetching ahead of it if Prefetch is set.
+    auto EmitKernelCall = [&](llvm::Value *X, unsigned Lane, bool Prefetch) {
+      const unsigned Distance = Prefetch ? PrefetchDistance : 0;
 
-    // Output
+      // Populate the actual call to kernel().
+      llvm::SmallVector<llvm::Value*, 8> RootArgs;
 
-    llvm::Value *OutPtr = nullptr;
-    if (CastedOutBasePtr) {
-      llvm::Value *OutOffset = Builder.CreateSub(IV, Arg_x1);
+      // Calculate the current input and output pointers.
 
-      if (mStructExplicitlyPaddedBySlang || (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING)) {
-        OutPtr = Builder.CreateInBoundsGEP(CastedOutBasePtr, OutOffset);
-      } else {
-        // Treat x86 output buffer as byte[], get indexed pointer with explicit
-        // byte offset computed using a datalayout based on
-        // X86_CUSTOM_DL_STRING, then bitcast it to actual output type.
-        uint64_t OutStep = DL.getTypeAllocSize(OutTy->getPointerElementType());
-        llvm::Value *OutOffsetInBytes = Builder.CreateMul(OutOffset, llvm::ConstantInt::get(Int32Ty, OutStep));
-        OutPtr = Builder.CreateInBoundsGEP(CastedOutBasePtr, OutOffsetInBytes);
-        OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
+      // Output
+
+      llvm::SmallVector<llvm::Value*, 8> OutPtrs;
+      for (size_t Index = 0; Index < OutPtrIVs.size(); ++Index) {
+        llvm::Value *OutPtr = getLanePtr(Builder, OutPtrIVs[Index], OutTys[Index], Lane);
+
+        emitPrefetch(Builder, OutPtr, Distance, true);
+        OutPtrs.push_back(OutPtr);
       }
 
       if (PassOutByPointer) {
-        RootArgs.push_back(OutPtr);
+        RootArgs.push_back(OutPtrs.front());
       }
-    }
 
-    // Inputs
+      // Inputs
 
-    if (NumInPtrArguments > 0) {
-      ExpandInputsBody(Builder, Arg_x1, TBAAAllocation, NumInPtrArguments,
-                       InTypes, InBufPtrs, InStructTempSlots, IV, RootArgs);
-    }
+      if (NumInPtrArguments > 0) {
+        ExpandInputsBody(Builder, TBAAAllocation, NumInPtrArguments,
+                         InTypes, InPtrIVs, InStructTempSlots, InPassedByRef, Lane, RootArgs,
+                         Distance, &Scopes);
+      }
 
-    finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *Function, Builder);
+      llvm::SmallVector<llvm::Value*, 8> SpecialArgs(CalleeArgs);
+      if (CalleeArgsXIdx >= 0) {
+        SpecialArgs[CalleeArgsXIdx] = X;
+      }
+      finishArgList(RootArgs, SpecialArgs, CalleeArgsContextIdx, *Function, Builder);
+
+      llvm::Value *RetVal = Builder.CreateCall(Function, RootArgs);
+
+      if (!OutPtrs.empty() && !PassOutByPointer) {
+        RetVal->setName("call.result");
+        for (size_t Index = 0; Index < OutPtrs.size(); ++Index) {
+          llvm::Value *OutVal = MultipleOutputs ?
+            Builder.CreateExtractValue(RetVal, Index) : RetVal;
+          llvm::StoreInst *Store = Builder.CreateStore(OutVal, OutPtrs[Index]);
+          if (gEnableRsTbaa) {
+            Store->setMetadata("tbaa", TBAAAllocation);
+          }
+          // The alias scopes only tell the first output apart from the inputs.
+          if (Index == 0) {
+            setAllocationScope(Store, Scopes, 0);
+          }
+        }
+      }
+    };
 
-    llvm::Value *RetVal = Builder.CreateCall(Function, RootArgs);
+    CreatePtrIVs(LoopHeader, Arg_x1, VF);
 
-    if (OutPtr && !PassOutByPointer) {
-      RetVal->setName("call.result");
-      llvm::StoreInst *Store = Builder.CreateStore(RetVal, OutPtr);
-      if (gEnableRsTbaa) {
-        Store->setMetadata("tbaa", TBAAAllocation);
+    if (VF == 1) {
+      EmitKernelCall(IV, 0, true);
+    } else {
+      // The lanes of one iteration share cache lines, so only the first one
+      // prefetches; the short remainder loop doesn't prefetch at all.
+      for (unsigned Lane = 0; Lane < VF; ++Lane) {
+        EmitKernelCall(Lane == 0 ? IV : Builder.CreateNUWAdd(IV, Builder.getInt32(Lane)),
+                       Lane, Lane == 0);
       }
+
+      // Remainder loop for the last (x2 - x1) % VF elements.
+      Builder.SetInsertPoint(&*LoopExit->begin());
+      llvm::Value *ScalarIV;
+      createLoop(Builder, ScalarBegin, Arg_x2, &ScalarIV);
+      CreatePtrIVs(LoopExit, ScalarBegin, 1);
+      EmitKernelCall(ScalarIV, 0, false);
+    }
+
+    if (FixedExtent == 0 || Tiled) {
+      return true;
+    }
+    if (FixedExtent > kMaxFixedExtent) {
+      ALOGW("Not unrolling kernel %s over its fixed extent %u (more than %u)",
+            Function->getName().str().c_str(), FixedExtent, kMaxFixedExtent);
+      return true;
+    }
+
+    // Dispatch calls over exactly FixedExtent elements, before the loops
+    // above, to a copy of the loop body for each of them. The loop-invariant
+    // values computed ahead of the loops are shared, and the buffers start
+    // at x1, so the pointers need no induction variables.
+    llvm::BasicBlock *ReturnBB = nullptr;
+    for (llvm::BasicBlock &BB : *ExpandedFunction) {
+      if (llvm::isa<llvm::ReturnInst>(BB.getTerminator())) {
+        ReturnBB = &BB;
+      }
+    }
+    bccAssert(ReturnBB != nullptr);
+
+    llvm::BasicBlock *GenericBB =
+        LoopHeader->splitBasicBlock(LoopHeader->getTerminator()->getIterator(), "Generic");
+    llvm::BasicBlock *FixedBB =
+        llvm::BasicBlock::Create(*Context, "Fixed", ExpandedFunction, GenericBB);
+    llvm::TerminatorInst *ToGeneric = LoopHeader->getTerminator();
+    Builder.SetInsertPoint(ToGeneric);
+    llvm::Value *IsFixed =
+        Builder.CreateICmpEQ(Builder.CreateSub(Arg_x2, Arg_x1, "extent"),
+                             Builder.getInt32(FixedExtent), "fixed.extent");
+    Builder.CreateCondBr(IsFixed, FixedBB, GenericBB);
+    ToGeneric->eraseFromParent();
+
+    Builder.SetInsertPoint(FixedBB);
+    Builder.SetInsertPoint(Builder.CreateBr(ReturnBB));
+    OutPtrIVs.assign(CastedOutBasePtrs.begin(), CastedOutBasePtrs.end());
+    InPtrIVs.assign(InBufPtrs.begin(), InBufPtrs.end());
+    for (unsigned Lane = 0; Lane < FixedExtent; ++Lane) {
+      EmitKernelCall(Lane == 0 ? Arg_x1 : Builder.CreateNUWAdd(Arg_x1, Builder.getInt32(Lane)),
+                     Lane, false);
     }
 
     return true;
@@ -1142,7 +1958,8 @@ public:
   //   }
   //
   // This is very similar to foreach kernel expansion with no output.
-  bool ExpandReduceAccumulator(llvm::Function *FnAccumulator, uint32_t Signature, size_t NumInputs) {
+  bool ExpandReduceAccumulator(llvm::Function *FnAccumulator, uint32_t Signature, size_t NumInputs,
+                               llvm::Function *FnInitializer, llvm::Function *FnCombiner) {
     ALOGV("Expanding accumulator %s for general reduce kernel",
           FnAccumulator->getName().str().c_str());
 
@@ -1182,10 +1999,41 @@ public:
     // Construct the actual function body.
     llvm::IRBuilder<> Builder(&*FnExpandedAccumulator->getEntryBlock().begin());
 
+    // With several accumulators, the main loop covers the largest multiple of
+    // NumAccums elements and feeds consecutive elements into independent
+    // partial accumulators, so the accumulator calls of one iteration don't
+    // depend on each other. The partial accumulators start out like the one
+    // the driver passes in (through the initializer, or zeroed), and are
+    // merged into it with the combiner after the loop. The remaining
+    // elements are accumulated directly by a scalar loop.
+    unsigned NumAccums = 1;
+    llvm::Type *AccumTy = Arg_accum->getType()->getPointerElementType();
+    if (FnCombiner && mReduceAccumulators > 1 && AccumTy->isSized()) {
+      NumAccums = std::min(mReduceAccumulators, kMaxKernelVectorWidth);
+    }
+
     // Create the loop structure.
     llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
+    llvm::Value *LoopEnd = Arg_x2;
+    llvm::SmallVector<llvm::Value*, 8> Accums{Arg_accum};
+    if (NumAccums > 1) {
+      llvm::Value *Count = Builder.CreateSub(Arg_x2, Arg_x1);
+      llvm::Value *Rem = Builder.CreateURem(Count, Builder.getInt32(NumAccums));
+      LoopEnd = Builder.CreateSub(Arg_x2, Rem, "vector.end");
+
+      for (unsigned i = 1; i < NumAccums; ++i) {
+        llvm::Value *Partial = Builder.CreateAlloca(AccumTy, nullptr, "partial_accum");
+        if (FnInitializer) {
+          Builder.CreateCall(FnInitializer, {Builder.CreatePointerCast(
+              Partial, FnInitializer->arg_begin()->getType())});
+        } else {
+          Builder.CreateStore(llvm::Constant::getNullValue(AccumTy), Partial);
+        }
+        Accums.push_back(Partial);
+      }
+    }
     llvm::Value *IndVar;
-    createLoop(Builder, Arg_x1, Arg_x2, &IndVar);
+    llvm::BasicBlock *LoopExit = createLoop(Builder, Arg_x1, LoopEnd, &IndVar, NumAccums);
 
     llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
     const int CalleeArgsContextIdx =
@@ -1195,16 +2043,71 @@ public:
     llvm::SmallVector<llvm::Type*,  8> InTypes;
     llvm::SmallVector<llvm::Value*, 8> InBufPtrs;
     llvm::SmallVector<llvm::Value*, 8> InStructTempSlots;
+    llvm::SmallVector<bool, 8> InPassedByRef;
     ExpandInputsLoopInvariant(Builder, LoopHeader, Arg_p, TBAAPointer, AccumulatorArgIter, NumInputs,
-                              InTypes, InBufPtrs, InStructTempSlots);
+                              InTypes, InBufPtrs, InStructTempSlots, InPassedByRef);
+
+    // Position of the X coordinate in CalleeArgs, which is the only special
+    // argument that differs between the calls emitted below.
+    int CalleeArgsXIdx = -1;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signature)) {
+      CalleeArgsXIdx =
+          bcinfo::MetadataExtractor::hasForEachSignatureCtxt(Signature) ? 1 : 0;
+    }
+
+    const unsigned PrefetchDistance = getPrefetchDistance(FnAccumulator->getName());
+    const AllocationScopeList Scopes =
+      createAllocationScopes(FnExpandedAccumulator->getName(), false, NumInputs);
+
+    // Pointer induction variables of the inputs in the loop being emitted.
+    llvm::SmallVector<llvm::Value*, 8> InPtrIVs;
+
+    // Populate the actual call to the original accumulator, accumulating the
+    // element at X into Accum, prefetching ahead of it if Prefetch is set.
+    // The inputs of the element are Lane elements past the ones InPtrIVs[]
+    // point at.
+    auto EmitAccumulatorCall = [&](llvm::Value *Accum, llvm::Value *X, unsigned Lane, bool Prefetch) {
+      llvm::SmallVector<llvm::Value*, 8> RootArgs;
+      RootArgs.push_back(Accum);
+      ExpandInputsBody(Builder, TBAAAllocation, NumInputs, InTypes, InPtrIVs, InStructTempSlots,
+                       InPassedByRef, Lane, RootArgs, Prefetch ? PrefetchDistance : 0, &Scopes);
+      llvm::SmallVector<llvm::Value*, 8> SpecialArgs(CalleeArgs);
+      if (CalleeArgsXIdx >= 0) {
+        SpecialArgs[CalleeArgsXIdx] = X;
+      }
+      finishArgList(RootArgs, SpecialArgs, CalleeArgsContextIdx, *FnAccumulator, Builder);
+      Builder.CreateCall(FnAccumulator, RootArgs);
+    };
 
-    // Populate the actual call to the original accumulator.
-    llvm::SmallVector<llvm::Value*, 8> RootArgs;
-    RootArgs.push_back(Arg_accum);
-    ExpandInputsBody(Builder, Arg_x1, TBAAAllocation, NumInputs, InTypes, InBufPtrs, InStructTempSlots,
-                     IndVar, RootArgs);
-    finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *FnAccumulator, Builder);
-    Builder.CreateCall(FnAccumulator, RootArgs);
+    createBufferIVs(Builder, LoopHeader, Arg_x1, Arg_x1, NumAccums, InTypes, InBufPtrs,
+                    InPtrIVs, "in_ptr");
+
+    if (NumAccums == 1) {
+      EmitAccumulatorCall(Arg_accum, IndVar, 0, true);
+      return true;
+    }
+
+    for (unsigned i = 0; i < NumAccums; ++i) {
+      EmitAccumulatorCall(Accums[i], i == 0 ? IndVar : Builder.CreateNUWAdd(IndVar, Builder.getInt32(i)),
+                          i, i == 0);
+    }
+
+    // Merge the partial accumulators, then accumulate the remaining elements.
+    Builder.SetInsertPoint(&*LoopExit->begin());
+    llvm::Function::arg_iterator CombinerArgIter = FnCombiner->arg_begin();
+    llvm::Type *CombinerAccumTy = (CombinerArgIter++)->getType();
+    llvm::Type *CombinerOtherTy = CombinerArgIter->getType();
+    for (unsigned i = 1; i < NumAccums; ++i) {
+      Builder.CreateCall(FnCombiner, {Builder.CreatePointerCast(Arg_accum, CombinerAccumTy),
+                                      Builder.CreatePointerCast(Accums[i], CombinerOtherTy)});
+    }
+
+    llvm::Value *ScalarIndVar;
+    createLoop(Builder, LoopEnd, Arg_x2, &ScalarIndVar);
+    InPtrIVs.clear();
+    createBufferIVs(Builder, LoopExit, Arg_x1, LoopEnd, 1, InTypes, InBufPtrs,
+                    InPtrIVs, "in_ptr");
+    EmitAccumulatorCall(Arg_accum, ScalarIndVar, 0, false);
 
     return true;
   }
@@ -1238,10 +2141,11 @@ public:
     llvm::Type *VoidTy = llvm::Type::getVoidTy(*Context);
     llvm::FunctionType *CombinerType =
         llvm::FunctionType::get(VoidTy, { AccumulatorArgType, AccumulatorArgType }, false);
-    llvm::Function *FnCombiner =
-        llvm::Function::Create(CombinerType, llvm::GlobalValue::ExternalLinkage,
-                               nameReduceCombinerFromAccumulator(FnAccumulator->getName()),
-                               Module);
+    // Kernel fusion may already have declared the combiner to call it from
+    // the combiner of a fused reduction.
+    llvm::Function *FnCombiner = llvm::cast<llvm::Function>(
+        Module->getOrInsertFunction(
+            nameReduceCombinerFromAccumulator(FnAccumulator->getName()), CombinerType));
 
     auto CombinerArgIter = FnCombiner->arg_begin();
 
@@ -1283,6 +2187,133 @@ public:
     return true;
   }
 
+  // Create a multi-combiner for a general reduce-style kernel with a small
+  // accumulator, which merges many partial accumulators at once instead of
+  // one combiner call from the runtime per partial accumulator.
+  //
+  // The combiner function must be of the form
+  //
+  //   define void @combinerFn(accumType* %accum, accumType* %other)
+  //
+  // A multi-combiner function will be generated of the form
+  //
+  //   define void @combinerFn.multi(accumType* noalias %accum, i8* noalias %others,
+  //                                 i32 %count, i32 %stride) {
+  //     for (i = 0; i < %count; ++i)
+  //       combinerFn(%accum, (accumType *)(%others + i * %stride));
+  //   }
+  //
+  // which merges the %count partial accumulators found %stride bytes apart
+  // from %others, none of them overlapping %accum, into %accum. Like the
+  // loops of old-style kernels, the loop is versioned on whether the partial
+  // accumulators are packed (%stride is the size of accumType): once the
+  // combiner is inlined, the packed copy is a plain reduction over an array
+  // that the loop vectorizer can turn into a vector one.
+  bool CreateReduceMultiCombiner(llvm::Function *FnCombiner) {
+    ALOGV("Creating multi-combiner from combiner %s for general reduce kernel",
+          FnCombiner->getName().str().c_str());
+
+    bccAssert(FnCombiner->arg_size() == 2);
+    auto CombinerArgIter = FnCombiner->arg_begin();
+    llvm::Type *CombinerAccumTy = (CombinerArgIter++)->getType();
+    llvm::Type *CombinerOtherTy = CombinerArgIter->getType();
+    llvm::Type *AccumTy = CombinerOtherTy->getPointerElementType();
+
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
+    llvm::Type *Int8PtrTy = llvm::Type::getInt8PtrTy(*Context);
+    llvm::FunctionType *MultiCombinerType = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(*Context), { CombinerAccumTy, Int8PtrTy, Int32Ty, Int32Ty }, false);
+    llvm::Function *FnMultiCombiner = llvm::Function::Create(
+        MultiCombinerType, llvm::GlobalValue::ExternalLinkage,
+        nameReduceMultiCombiner(FnCombiner->getName()), Module);
+
+    auto MultiCombinerArgIter = FnMultiCombiner->arg_begin();
+    llvm::Argument *Arg_accum  = &*(MultiCombinerArgIter++);
+    llvm::Argument *Arg_others = &*(MultiCombinerArgIter++);
+    llvm::Argument *Arg_count  = &*(MultiCombinerArgIter++);
+    llvm::Argument *Arg_stride = &*(MultiCombinerArgIter++);
+    Arg_accum->setName("accum");
+    Arg_others->setName("others");
+    Arg_count->setName("count");
+    Arg_stride->setName("stride");
+    for (llvm::Argument *Arg : { Arg_accum, Arg_others }) {
+      Arg->addAttr(llvm::AttributeSet::get(*Context, Arg->getArgNo() + 1,
+                                           { llvm::Attribute::NoAlias,
+                                             llvm::Attribute::NoCapture }));
+    }
+
+    llvm::BasicBlock *BB = llvm::BasicBlock::Create(*Context, "entry", FnMultiCombiner);
+    llvm::IRBuilder<> Builder(llvm::ReturnInst::Create(*Context, BB));
+
+    llvm::DataLayout DL(Module);
+    llvm::Value *PackedStride = llvm::ConstantInt::get(Int32Ty, DL.getTypeAllocSize(AccumTy));
+
+    // Emit the loop merging the partial accumulators at the current
+    // insertion point of Builder, Stride bytes apart.
+    auto EmitLoop = [&](llvm::Value *Stride) {
+      llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
+      llvm::Value *IV;
+      createLoop(Builder, Builder.getInt32(0), Arg_count, &IV);
+      llvm::Value *Other = createPointerIV(Builder, LoopHeader, Arg_others, nullptr, Stride, "other");
+      Builder.CreateCall(FnCombiner, { Arg_accum, Builder.CreatePointerCast(Other, CombinerOtherTy) });
+    };
+
+    llvm::Value *IsPacked = Builder.CreateICmpEQ(Arg_stride, PackedStride, "packed");
+    llvm::TerminatorInst *PackedTerm, *StridedTerm;
+    llvm::SplitBlockAndInsertIfThenElse(IsPacked, &*Builder.GetInsertPoint(),
+                                        &PackedTerm, &StridedTerm);
+    Builder.SetInsertPoint(PackedTerm);
+    EmitLoop(PackedStride);
+    Builder.SetInsertPoint(StridedTerm);
+    EmitLoop(Arg_stride);
+
+    return true;
+  }
+
+  // Mark Kernel as always-inline if all of its uses are calls from its
+  // expanded functions (or from the combiner generated from it), so that the
+  // expanded loops never end up calling it once per element. Kernels that are
+  // also called from elsewhere, whose address is taken, or that are marked
+  // noinline are left to the inliner's cost model.
+  bool forceInlineIntoExpansion(llvm::Function *Kernel) {
+    if (Kernel->isDeclaration() || Kernel->use_empty() ||
+        Kernel->hasFnAttribute(llvm::Attribute::NoInline) ||
+        Kernel->hasFnAttribute(llvm::Attribute::AlwaysInline)) {
+      return false;
+    }
+
+    const std::string Expanded = Kernel->getName().str() + ".expand";
+    const std::string ExpandedTiled = Expanded + ".tiled";
+    const std::string Combiner = nameReduceCombinerFromAccumulator(Kernel->getName());
+    for (const llvm::Use &U : Kernel->uses()) {
+      llvm::CallInst *Call = llvm::dyn_cast<llvm::CallInst>(U.getUser());
+      if (!Call || Call->getCalledFunction() != Kernel) {
+        return false;
+      }
+      llvm::StringRef Caller = Call->getParent()->getParent()->getName();
+      if (Caller != Expanded && Caller != ExpandedTiled && Caller != Combiner) {
+        return false;
+      }
+    }
+
+    ALOGV("Forcing kernel %s to be inlined into its expansion",
+          Kernel->getName().str().c_str());
+    Kernel->addFnAttr(llvm::Attribute::AlwaysInline);
+    return true;
+  }
+
+  // Whether reduction Index is the only one using its accumulator function.
+  static bool isAccumulatorUnshared(const bcinfo::MetadataExtractor::Reduce *Reductions,
+                                    size_t NumReductions, size_t Index) {
+    for (size_t i = 0; i < NumReductions; ++i) {
+      if (i != Index &&
+          !strcmp(Reductions[i].mAccumulatorName, Reductions[Index].mAccumulatorName)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   /// @brief Checks if pointers to allocation internals are exposed
   ///
   /// This function verifies if through the parameters passed to the kernel
@@ -1372,18 +2403,29 @@ public:
 
     buildTypes();
 
-    bcinfo::MetadataExtractor me(&Module);
-    if (!me.extract()) {
-      ALOGE("Could not extract metadata from module!");
-      return false;
+    std::unique_ptr<bcinfo::MetadataExtractor> ExtractedMetadata;
+    if (mMetadata == nullptr) {
+      ExtractedMetadata.reset(new bcinfo::MetadataExtractor(&Module));
+      if (!ExtractedMetadata->extract()) {
+        ALOGE("Could not extract metadata from module!");
+        return false;
+      }
     }
+    const bcinfo::MetadataExtractor &me =
+        mMetadata != nullptr ? *mMetadata : *ExtractedMetadata;
 
     mStructExplicitlyPaddedBySlang = (me.getCompilerVersion() >= SlangVersion::N_STRUCT_EXPLICIT_PADDING);
 
+    readPrefetchPragmas(me);
+
     // Expand forEach_* style kernels.
     mExportForEachCount = me.getExportForEachSignatureCount();
     mExportForEachNameList = me.getExportForEachNameList();
     mExportForEachSignatureList = me.getExportForEachSignatureList();
+    const uint32_t *FixedExtents = me.getExportForEachFixedExtentList();
+
+    // Kernels that got expanded, and that may be forced to be inlined.
+    FunctionSet ExpandedKernels;
 
     for (size_t i = 0; i < mExportForEachCount; ++i) {
       const char *name = mExportForEachNameList[i];
@@ -1391,11 +2433,21 @@ public:
       llvm::Function *kernel = Module.getFunction(name);
       if (kernel) {
         if (bcinfo::MetadataExtractor::hasForEachSignatureKernel(signature)) {
-          Changed |= ExpandForEach(kernel, signature);
+          Changed |= ExpandForEach(kernel, signature, /* Tiled */false,
+                                   FixedExtents ? FixedExtents[i] : 0);
+          // The row pitches of a tile only cover a single output.
+          if (mEnableTiledExpand && !hasMultipleOutputs(kernel)) {
+            Changed |= ExpandForEach(kernel, signature, /* Tiled */true);
+          }
           kernel->setLinkage(llvm::GlobalValue::InternalLinkage);
+          ExpandedKernels.insert(kernel);
         } else if (kernel->getReturnType()->isVoidTy()) {
           Changed |= ExpandOldStyleForEach(kernel, signature);
+          if (mEnableTiledExpand) {
+            Changed |= ExpandOldStyleForEach(kernel, signature, /* Tiled */true);
+          }
           kernel->setLinkage(llvm::GlobalValue::InternalLinkage);
+          ExpandedKernels.insert(kernel);
         } else {
           // There are some graphics root functions that are not
           // expanded, but that will be called directly. For those
@@ -1408,24 +2460,61 @@ public:
     const size_t ExportReduceCount = me.getExportReduceCount();
     const bcinfo::MetadataExtractor::Reduce *ExportReduceList = me.getExportReduceList();
     //   Note that functions can be shared between kernels
-    FunctionSet PromotedFunctions, ExpandedAccumulators, AccumulatorsForCombiners;
+    FunctionSet PromotedFunctions, ExpandedAccumulators, AccumulatorsForCombiners,
+                MultiCombinedCombiners;
 
     for (size_t i = 0; i < ExportReduceCount; ++i) {
       Changed |= PromoteReduceFunction(ExportReduceList[i].mInitializerName, PromotedFunctions);
       Changed |= PromoteReduceFunction(ExportReduceList[i].mCombinerName, PromotedFunctions);
       Changed |= PromoteReduceFunction(ExportReduceList[i].mOutConverterName, PromotedFunctions);
 
-      // Accumulator
       llvm::Function *accumulator = Module.getFunction(ExportReduceList[i].mAccumulatorName);
       bccAssert(accumulator != nullptr);
-      if (ExpandedAccumulators.insert(accumulator).second)
-        Changed |= ExpandReduceAccumulator(accumulator,
-                                           ExportReduceList[i].mSignature,
-                                           ExportReduceList[i].mInputCount);
+
+      // Combiner
       if (!ExportReduceList[i].mCombinerName) {
         if (AccumulatorsForCombiners.insert(accumulator).second)
           Changed |= CreateReduceCombinerFromAccumulator(accumulator);
       }
+
+      // Accumulator
+      if (ExpandedAccumulators.insert(accumulator).second) {
+        // Partial accumulators must be initialized and combined the way the
+        // reduction does it, which is only known if no other reduction
+        // shares the accumulator.
+        llvm::Function *initializer = nullptr, *combiner = nullptr;
+        if (isAccumulatorUnshared(ExportReduceList, ExportReduceCount, i)) {
+          if (ExportReduceList[i].mInitializerName) {
+            initializer = Module.getFunction(ExportReduceList[i].mInitializerName);
+          }
+          combiner = Module.getFunction(ExportReduceList[i].mCombinerName ?
+              std::string(ExportReduceList[i].mCombinerName) :
+              nameReduceCombinerFromAccumulator(ExportReduceList[i].mAccumulatorName));
+        }
+        Changed |= ExpandReduceAccumulator(accumulator,
+                                           ExportReduceList[i].mSignature,
+                                           ExportReduceList[i].mInputCount,
+                                           initializer, combiner);
+        ExpandedKernels.insert(accumulator);
+      }
+
+      // Multi-combiner
+      const uint32_t AccumulatorDataSize = ExportReduceList[i].mAccumulatorDataSize;
+      if (AccumulatorDataSize > 0 && AccumulatorDataSize <= kMaxMultiCombineAccumulatorSize) {
+        llvm::Function *combiner = Module.getFunction(ExportReduceList[i].mCombinerName ?
+            std::string(ExportReduceList[i].mCombinerName) :
+            nameReduceCombinerFromAccumulator(ExportReduceList[i].mAccumulatorName));
+        if (combiner && !combiner->isDeclaration() &&
+            MultiCombinedCombiners.insert(combiner).second) {
+          Changed |= CreateReduceMultiCombiner(combiner);
+        }
+      }
+    }
+
+    if (mForceInlineKernels) {
+      for (llvm::Function *kernel : ExpandedKernels) {
+        Changed |= forceInlineIntoExpansion(kernel);
+      }
     }
 
     if (gEnableRsTbaa && !allocPointersExposed(Module)) {
@@ -1451,8 +2540,16 @@ namespace bcc {
 const char BCC_INDEX_VAR_NAME[] = "rsIndex";
 
 llvm::ModulePass *
-createRSKernelExpandPass(bool pEnableStepOpt) {
-  return new RSKernelExpandPass(pEnableStepOpt);
+createRSKernelExpandPass(bool pEnableStepOpt, unsigned pVectorWidth,
+                         bool pEnableTiledExpand, bool pSpecializeSteps,
+                         unsigned pReduceAccumulators,
+                         unsigned pPrefetchDistance,
+                         bool pForceInlineKernels,
+                         const bcinfo::MetadataExtractor *pMetadata) {
+  return new RSKernelExpandPass(pEnableStepOpt, pVectorWidth,
+                                pEnableTiledExpand, pSpecializeSteps,
+                                pReduceAccumulators, pPrefetchDistance,
+                                pForceInlineKernels, pMetadata);
 }
 
 } // end namespace bcc
@@ -0,0 +1,285 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Log.h"
+#include "RSTransforms.h"
+
+#include "bcinfo/MetadataExtractor.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalIFunc.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// For testing with opt: "<cpu>:<features>", e.g. "cortex-a55:+lse,+fullfp16".
+llvm::cl::list<std::string> ClKernelVariants(
+    "rs-kernel-variant", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Additional version of the expanded kernels, as "
+                   "<cpu>:<features>, best first"));
+
+// AT_HWCAP bits of the arm64 Linux kernel for the target features that a
+// kernel variant may require.
+struct FeatureHWCaps {
+  const char *mFeature;
+  uint64_t mHWCaps;
+};
+
+const FeatureHWCaps kFeatureHWCaps[] = {
+  { "fp-armv8", 1 << 0 },                                   // HWCAP_FP
+  { "neon",     1 << 1 },                                   // HWCAP_ASIMD
+  { "crypto",   (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) },  // AES..SHA2
+  { "crc",      1 << 7 },                                   // HWCAP_CRC32
+  { "lse",      1 << 8 },                                   // HWCAP_ATOMICS
+  { "fullfp16", (1 << 9) | (1 << 10) },                     // FPHP, ASIMDHP
+  { "rdm",      1 << 12 },                                  // HWCAP_ASIMDRDM
+};
+
+const uint64_t kAT_HWCAP = 16;
+
+/* This pass emits several versions of the expanded functions of each kernel,
+ * one per target CPU/feature set given, and lets the dynamic linker pick the
+ * best one the device supports when the script is loaded.
+ *
+ * "<name>.expand" (and likewise "<name>.expand.tiled") becomes an ELF
+ * indirect function, so the kernel table and the driver keep using the same
+ * symbol. Its resolver reads AT_HWCAP and returns the first variant whose
+ * features are all present, in the order given, or else the original
+ * function, now "<name>.expand.default". The variants are internal copies of
+ * the original that only differ in their "target-cpu" and "target-features"
+ * attributes, which code generation honors per function.
+ *
+ * The features of a variant are checked against AT_HWCAP, so only those the
+ * kernel reports (see kFeatureHWCaps) can be used, and the CPU of a variant
+ * should not imply other features. This is only done for arm64.
+ */
+class RSKernelMultiVersionPass : public llvm::ModulePass {
+private:
+  // CPU name and "+feature,..." string of each variant, best first.
+  std::vector<std::pair<std::string, std::string>> mVariants;
+
+  // Target features of the module, which the variants add to.
+  std::string mBaseFeatures;
+
+  const bcinfo::MetadataExtractor *mMetadata;
+
+  // The AT_HWCAP bits the features enabled by pFeatures require, or 0 if one
+  // of them cannot be detected that way.
+  static uint64_t getRequiredHWCaps(llvm::StringRef pFeatures) {
+    llvm::SmallVector<llvm::StringRef, 4> features;
+    pFeatures.split(features, ',', -1, /* KeepEmpty */ false);
+
+    uint64_t hwcaps = 0;
+    for (llvm::StringRef feature : features) {
+      feature = feature.trim();
+      if (feature.startswith("-")) {
+        continue;
+      }
+      if (feature.startswith("+")) {
+        feature = feature.drop_front();
+      }
+      bool found = false;
+      for (const FeatureHWCaps &entry : kFeatureHWCaps) {
+        if (feature == entry.mFeature) {
+          hwcaps |= entry.mHWCaps;
+          found = true;
+          break;
+        }
+      }
+      if (!found) {
+        ALOGE("Kernel variant feature %s cannot be detected at load time",
+              feature.str().c_str());
+        return 0;
+      }
+    }
+    return hwcaps;
+  }
+
+  // Replace pFunction with an indirect function of the same name choosing
+  // between it and one copy per entry of pVariants.
+  void multiVersion(llvm::Function *pFunction,
+                    llvm::ArrayRef<std::pair<size_t, uint64_t>> pVariants) {
+    llvm::Module &M = *pFunction->getParent();
+    llvm::LLVMContext &context = M.getContext();
+    const std::string name = pFunction->getName();
+    const llvm::GlobalValue::LinkageTypes linkage = pFunction->getLinkage();
+    const llvm::GlobalValue::VisibilityTypes visibility =
+        pFunction->getVisibility();
+
+    pFunction->setName(name + ".default");
+    pFunction->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+    std::vector<llvm::Function *> clones;
+    for (const auto &variant : pVariants) {
+      const std::pair<std::string, std::string> &target =
+          mVariants[variant.first];
+      llvm::ValueToValueMapTy VMap;
+      llvm::Function *clone = llvm::CloneFunction(pFunction, VMap);
+      clone->setName(name + ".v" + std::to_string(variant.first + 1));
+      if (!target.first.empty()) {
+        clone->addFnAttr("target-cpu", target.first);
+      }
+      clone->addFnAttr("target-features", mBaseFeatures.empty() ?
+                           target.second : mBaseFeatures + "," + target.second);
+      clones.push_back(clone);
+    }
+
+    llvm::PointerType *pointerTy = pFunction->getType();
+    llvm::Type *int64Ty = llvm::Type::getInt64Ty(context);
+    llvm::Constant *getauxval = M.getOrInsertFunction(
+        "getauxval", llvm::FunctionType::get(int64Ty, int64Ty, false));
+
+    llvm::Function *resolver = llvm::Function::Create(
+        llvm::FunctionType::get(pointerTy, false),
+        llvm::GlobalValue::InternalLinkage, name + ".resolver", &M);
+    llvm::IRBuilder<> builder(
+        llvm::BasicBlock::Create(context, "entry", resolver));
+    llvm::Value *hwcaps =
+        builder.CreateCall(getauxval, llvm::ConstantInt::get(int64Ty, kAT_HWCAP),
+                           "hwcaps");
+    llvm::Value *chosen = pFunction;
+    for (size_t i = clones.size(); i-- != 0;) {
+      llvm::Constant *required =
+          llvm::ConstantInt::get(int64Ty, pVariants[i].second);
+      llvm::Value *supported = builder.CreateICmpEQ(
+          builder.CreateAnd(hwcaps, required), required);
+      chosen = builder.CreateSelect(supported, clones[i], chosen);
+    }
+    builder.CreateRet(chosen);
+
+    llvm::GlobalIFunc *ifunc = llvm::GlobalIFunc::create(
+        pFunction->getValueType(), pointerTy->getAddressSpace(), linkage, name,
+        resolver, &M);
+    ifunc->setVisibility(visibility);
+  }
+
+public:
+  static char ID;
+
+  RSKernelMultiVersionPass()
+      : ModulePass(ID), mMetadata(nullptr) {
+    for (const std::string &spec : ClKernelVariants) {
+      const size_t colon = spec.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      mVariants.emplace_back(spec.substr(0, colon), spec.substr(colon + 1));
+    }
+  }
+
+  RSKernelMultiVersionPass(
+      const std::vector<std::pair<std::string, std::string>> &pVariants,
+      const std::string &pBaseFeatures,
+      const bcinfo::MetadataExtractor *pMetadata)
+      : ModulePass(ID), mVariants(pVariants), mBaseFeatures(pBaseFeatures),
+        mMetadata(pMetadata) {
+  }
+
+  bool runOnModule(llvm::Module &M) override {
+    if (llvm::Triple(M.getTargetTriple()).getArch() != llvm::Triple::aarch64) {
+      ALOGW("Kernel variants are only supported on arm64");
+      return false;
+    }
+
+    // The variants that can be selected at load time, with the AT_HWCAP bits
+    // they require.
+    llvm::SmallVector<std::pair<size_t, uint64_t>, 4> variants;
+    for (size_t i = 0; i < mVariants.size(); i++) {
+      const uint64_t hwcaps = getRequiredHWCaps(mVariants[i].second);
+      if (hwcaps == 0) {
+        ALOGW("Ignoring kernel variant %s:%s", mVariants[i].first.c_str(),
+              mVariants[i].second.c_str());
+        continue;
+      }
+      variants.emplace_back(i, hwcaps);
+    }
+    if (variants.empty()) {
+      return false;
+    }
+
+    std::unique_ptr<bcinfo::MetadataExtractor> extracted;
+    const bcinfo::MetadataExtractor *me = mMetadata;
+    if (me == nullptr) {
+      extracted.reset(new bcinfo::MetadataExtractor(&M));
+      if (!extracted->extract()) {
+        ALOGE("Could not extract RS metadata for module!");
+        return false;
+      }
+      me = extracted.get();
+    }
+
+    std::vector<std::string> names;
+    const char **forEachNameList = me->getExportForEachNameList();
+    for (size_t i = 0; i < me->getExportForEachSignatureCount(); i++) {
+      names.push_back(std::string(forEachNameList[i]) + ".expand");
+      names.push_back(std::string(forEachNameList[i]) + ".expand.tiled");
+    }
+    const bcinfo::MetadataExtractor::Reduce *reduceList =
+        me->getExportReduceList();
+    for (size_t i = 0; i < me->getExportReduceCount(); i++) {
+      names.push_back(std::string(reduceList[i].mAccumulatorName) + ".expand");
+    }
+
+    bool changed = false;
+    for (const std::string &name : names) {
+      llvm::Function *function = M.getFunction(name);
+      if (function == nullptr || function->isDeclaration()) {
+        continue;
+      }
+      multiVersion(function, variants);
+      changed = true;
+    }
+    return changed;
+  }
+
+  virtual const char *getPassName() const override {
+    return "Emit kernel versions for several target CPUs";
+  }
+};
+
+}
+
+char RSKernelMultiVersionPass::ID = 0;
+
+static llvm::RegisterPass<RSKernelMultiVersionPass> X("rs-kernel-multiversion",
+                                                      "RS Kernel Multiversion Pass");
+
+namespace bcc {
+
+llvm::ModulePass *
+createRSKernelMultiVersionPass(
+    const std::vector<std::pair<std::string, std::string>> &pVariants,
+    const std::string &pBaseFeatures,
+    const bcinfo::MetadataExtractor *pMetadata) {
+  return new RSKernelMultiVersionPass(pVariants, pBaseFeatures, pMetadata);
+}
+
+}
@@ -18,8 +18,11 @@
 #include "RSTransforms.h"
 #include "RSStubsWhiteList.h"
 
+#include <algorithm>
+#include <cassert>
 #include <cstdlib>
 
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Function.h>
@@ -34,16 +37,15 @@ class RSScreenFunctionsPass : public llvm::ModulePass {
 private:
   static char ID;
 
-  std::vector<std::string> &whiteList = stubList;
-
-  bool isPresent(std::vector<std::string> &list, const std::string &name) {
-    auto lower = std::lower_bound(list.begin(),
-                                  list.end(),
-                                  name);
-
-    if (lower != list.end() && name.compare(*lower) == 0)
-      return true;
-    return false;
+  // The white list is a static table sorted at generation time, so a
+  // binary search over it needs neither setup nor allocation.
+  static bool isWhiteListed(llvm::StringRef Name) {
+    const char *const *End = stubList + stubListSize;
+    const char *const *Lower = std::lower_bound(
+        stubList, End, Name, [](const char *Entry, llvm::StringRef Key) {
+          return llvm::StringRef(Entry) < Key;
+        });
+    return Lower != End && Name == *Lower;
   }
 
   bool isLegal(llvm::Function &F) {
@@ -59,7 +61,7 @@ private:
     if (FName.startswith("llvm."))
       return true;
 
-    if (isPresent(whiteList, FName.str()))
+    if (isWhiteListed(FName))
       return true;
 
     return false;
@@ -68,7 +70,11 @@ private:
 public:
   RSScreenFunctionsPass()
     : ModulePass (ID) {
-      std::sort(whiteList.begin(), whiteList.end());
+      assert(std::is_sorted(stubList, stubList + stubListSize,
+                            [](const char *A, const char *B) {
+                              return llvm::StringRef(A) < llvm::StringRef(B);
+                            }) &&
+             "RSStubsWhiteList must be sorted");
   }
 
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
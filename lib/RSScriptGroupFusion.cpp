@@ -18,14 +18,24 @@
 
 #include "Assert.h"
 #include "Log.h"
+#include "RSUtils.h"
 #include "bcc/BCCContext.h"
+#include "bcc/RSCompilerDriver.h"
 #include "bcc/Source.h"
 #include "bcinfo/MetadataExtractor.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
 
 using llvm::Function;
 using llvm::Module;
@@ -44,7 +54,9 @@ const Function* getInvokeFunction(const Source& source, const int slot,
   Function* func = newModule->getFunction(functionName);
   // Materialize the function so that later the caller can inspect its argument
   // and return types.
-  newModule->materialize(func);
+  if (func != nullptr) {
+    newModule->materialize(func);
+  }
   return func;
 }
 
@@ -60,12 +72,6 @@ getFunction(Module* mergedModule, const Source* source, const int slot,
     return nullptr;
   }
 
-  if (metadata.getExportForEachInputCountList()[slot] > 1) {
-    ALOGE("Kernel fusion (module %s function %s): cannot handle multiple inputs",
-          source->getName().c_str(), functionName);
-    return nullptr;
-  }
-
   if (signature != nullptr) {
     *signature = metadata.getExportForEachSignatureList()[slot];
   }
@@ -75,33 +81,60 @@ getFunction(Module* mergedModule, const Source* source, const int slot,
   return function;
 }
 
-// The whitelist of supported signature bits. Context or user data arguments are
-// not currently supported in kernel fusion. To support them or any new kinds of
+// The whitelist of supported signature bits. User data arguments are not
+// currently supported in kernel fusion. To support them or any new kinds of
 // arguments in the future, it requires not only listing the signature bits here,
 // but also implementing additional necessary fusion logic in the getFusedFuncSig(),
 // getFusedFuncType(), and fuseKernels() functions below.
+//
+// Kernels may have several inputs. The first input of every kernel but the
+// first one is the result of the previous kernel; all other inputs become
+// inputs of the fused kernel, in order: those of the first kernel, then the
+// remaining ones of each later kernel.
+//
+// The fused kernel takes a context argument if any of the kernels does, and
+// passes it on to every kernel that takes one.
 constexpr uint32_t ExpectedSignatureBits =
         bcinfo::MD_SIG_In |
         bcinfo::MD_SIG_Out |
+        bcinfo::MD_SIG_Ctxt |
         bcinfo::MD_SIG_X |
         bcinfo::MD_SIG_Y |
         bcinfo::MD_SIG_Z |
         bcinfo::MD_SIG_Kernel;
 
+// Maximum number of inputs of a kernel, and thus of a fused kernel too (see
+// RsExpandKernelDriverInfoPfx in rsCpuCoreRuntime.h).
+constexpr size_t kMaxFusedKernelInputs = 8;
+
+// Maximum number of outputs of a kernel fused from a kernel and its
+// consumers, which is the size of the outPtr array of the same structure.
+constexpr size_t kMaxFusedKernelOutputs = 8;
+
+// Number of inputs of the kernel in slot of source.
+uint32_t getInputCount(const Source* source, const int slot) {
+  return source->getMetadata()->getExportForEachInputCountList()[slot];
+}
+
 int getFusedFuncSig(const std::vector<Source*>& sources,
                     const std::vector<int>& slots,
                     uint32_t* retSig) {
   *retSig = 0;
-  uint32_t firstSignature = 0;
   uint32_t signature = 0;
+  size_t numFusedInputs = 0;
   auto slotIter = slots.begin();
   for (const Source* source : sources) {
+    const bool isFirst = (slotIter == slots.begin());
     const int slot = *slotIter++;
     bcinfo::MetadataExtractor &metadata = *source->getMetadata();
 
-    if (metadata.getExportForEachInputCountList()[slot] > 1) {
-      ALOGE("Kernel fusion (module %s slot %d): cannot handle multiple inputs",
-            source->getName().c_str(), slot);
+    // Every kernel but the first gets its first input from the previous one.
+    const uint32_t numInputs = getInputCount(source, slot);
+    numFusedInputs += (isFirst || numInputs == 0) ?
+            numInputs : numInputs - 1;
+    if (numFusedInputs > kMaxFusedKernelInputs) {
+      ALOGE("Kernel fusion (module %s slot %d): more than %zu inputs in total",
+            source->getName().c_str(), slot, kMaxFusedKernelInputs);
       return -1;
     }
 
@@ -112,14 +145,10 @@ int getFusedFuncSig(const std::vector<Source*>& sources,
       return -1;
     }
 
-    if (firstSignature == 0) {
-      firstSignature = signature;
-    }
-
     *retSig |= signature;
   }
 
-  if (!bcinfo::MetadataExtractor::hasForEachSignatureIn(firstSignature)) {
+  if (numFusedInputs == 0) {
     *retSig &= ~bcinfo::MD_SIG_In;
   }
 
@@ -147,8 +176,31 @@ llvm::FunctionType* getFusedFuncType(bcc::BCCContext& Context,
 
   llvm::SmallVector<llvm::Type*, 8> ArgTys;
 
-  if (bcinfo::MetadataExtractor::hasForEachSignatureIn(*signature)) {
-    ArgTys.push_back(firstF->arg_begin()->getType());
+  for (size_t k = 0; k < sources.size(); k++) {
+    const Function* F = (k == 0) ?
+            firstF : getFunction(M, sources[k], slots[k], nullptr);
+    bccAssert (F != nullptr);
+
+    const uint32_t numInputs = getInputCount(sources[k], slots[k]);
+    for (uint32_t i = (k == 0) ? 0 : 1; i < numInputs; i++) {
+      ArgTys.push_back(F->getFunctionType()->getParamType(i));
+    }
+  }
+
+  // The context argument follows the inputs. Take its type from the first
+  // kernel that has one.
+  if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(*signature)) {
+    for (size_t k = 0; k < sources.size(); k++) {
+      const uint32_t kernelSignature =
+              sources[k]->getMetadata()->getExportForEachSignatureList()[slots[k]];
+      if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(kernelSignature)) {
+        const Function* F = getFunction(M, sources[k], slots[k], nullptr);
+        bccAssert (F != nullptr);
+        ArgTys.push_back(F->getFunctionType()->getParamType(
+                getInputCount(sources[k], slots[k])));
+        break;
+      }
+    }
   }
 
   llvm::Type* I32Ty = llvm::IntegerType::get(Context.getLLVMContext(), 32);
@@ -171,22 +223,36 @@ llvm::FunctionType* getFusedFuncType(bcc::BCCContext& Context,
   return llvm::FunctionType::get(retTy, ArgTys, false);
 }
 
-}  // anonymous namespace
+// Number of inputs of a kernel of type funcTy and signature signature.
+size_t getNumInputs(const llvm::FunctionType* funcTy, uint32_t signature) {
+  if (!bcinfo::MetadataExtractor::hasForEachSignatureIn(signature)) {
+    return 0;
+  }
+  size_t numInputs = funcTy->getNumParams();
+  numInputs -= bcinfo::MetadataExtractor::hasForEachSignatureCtxt(signature);
+  numInputs -= bcinfo::MetadataExtractor::hasForEachSignatureX(signature);
+  numInputs -= bcinfo::MetadataExtractor::hasForEachSignatureY(signature);
+  numInputs -= bcinfo::MetadataExtractor::hasForEachSignatureZ(signature);
+  return numInputs;
+}
 
-bool fuseKernels(bcc::BCCContext& Context,
-                 const std::vector<Source *>& sources,
-                 const std::vector<int>& slots,
-                 const std::string& fusedName,
-                 Module* mergedModule) {
+// Creates the function fusedName calling the kernels in order, and returns it
+// along with its signature, or nullptr if the kernels cannot be fused.
+Function* createFusedKernel(bcc::BCCContext& Context,
+                            const std::vector<Source *>& sources,
+                            const std::vector<int>& slots,
+                            const std::string& fusedName,
+                            Module* mergedModule,
+                            uint32_t* signature) {
   bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
 
-  uint32_t fusedFunctionSignature;
+  uint32_t& fusedFunctionSignature = *signature;
 
   llvm::FunctionType* fusedType =
           getFusedFuncType(Context, sources, slots, mergedModule, &fusedFunctionSignature);
 
   if (fusedType == nullptr) {
-    return false;
+    return nullptr;
   }
 
   Function* fusedKernel =
@@ -199,10 +265,27 @@ bool fuseKernels(bcc::BCCContext& Context,
 
   Function::arg_iterator argIter = fusedKernel->arg_begin();
 
+  // Inputs of the fused kernel, in the order getFusedFuncType() declared them.
+  const size_t numFusedInputs = getNumInputs(fusedType, fusedFunctionSignature);
+  std::vector<llvm::Value*> fusedInputs;
+  for (size_t i = 0; i < numFusedInputs; i++) {
+    llvm::Value* input = &*(argIter++);
+    input->setName((i == 0) ? "DataIn" : "DataIn" + llvm::utostr(i));
+    fusedInputs.push_back(input);
+  }
+  auto nextFusedInput = fusedInputs.begin();
+
+  // The first input of the next kernel: the first input of the fused kernel
+  // for the first kernel, and the result of the previous kernel afterwards.
   llvm::Value* dataElement = nullptr;
-  if (bcinfo::MetadataExtractor::hasForEachSignatureIn(fusedFunctionSignature)) {
-    dataElement = &*(argIter++);
-    dataElement->setName("DataIn");
+  if (getInputCount(sources.front(), slots.front()) > 0) {
+    dataElement = *nextFusedInput++;
+  }
+
+  llvm::Value* KernelContext = nullptr;
+  if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(fusedFunctionSignature)) {
+    KernelContext = &*(argIter++);
+    KernelContext->setName("context");
   }
 
   llvm::Value* X = nullptr;
@@ -231,15 +314,15 @@ bool fuseKernels(bcc::BCCContext& Context,
     const Function* inputFunction =
             getFunction(mergedModule, source, slot, &inputFunctionSignature);
     if (inputFunction == nullptr) {
-      // Either failed to find the kernel function, or the function has multiple inputs.
-      return false;
+      // Failed to find the kernel function.
+      return nullptr;
     }
 
     // Don't try to fuse a non-kernel
     if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(inputFunctionSignature)) {
       ALOGE("Kernel fusion (module %s function %s): not a kernel",
             source->getName().c_str(), inputFunction->getName().str().c_str());
-      return false;
+      return nullptr;
     }
 
     std::vector<llvm::Value*> args;
@@ -248,7 +331,7 @@ bool fuseKernels(bcc::BCCContext& Context,
       if (dataElement == nullptr) {
         ALOGE("Kernel fusion (module %s function %s): expected input, but got null",
               source->getName().c_str(), inputFunction->getName().str().c_str());
-        return false;
+        return nullptr;
       }
 
       const llvm::FunctionType* funcTy = inputFunction->getFunctionType();
@@ -263,19 +346,39 @@ bool fuseKernels(bcc::BCCContext& Context,
         dataElement->getType()->print(rso);
         ALOGE("Kernel fusion (module %s function %s): %s", source->getName().c_str(),
               inputFunction->getName().str().c_str(), rso.str().c_str());
-        return false;
+        return nullptr;
       }
 
       args.push_back(dataElement);
+
+      // The other inputs come straight from the fused kernel's inputs.
+      const uint32_t numInputs = getInputCount(source, slot);
+      for (uint32_t i = 1; i < numInputs; i++) {
+        bccAssert(nextFusedInput != fusedInputs.end());
+        if ((*nextFusedInput)->getType() != funcTy->getParamType(i)) {
+          ALOGE("Kernel fusion (module %s function %s): mismatching type of input %u",
+                source->getName().c_str(), inputFunction->getName().str().c_str(), i);
+          return nullptr;
+        }
+        args.push_back(*nextFusedInput++);
+      }
     } else {
       // Only the first kernel in a batch is allowed to have no input
       if (slotIter != slots.begin()) {
         ALOGE("Kernel fusion (module %s function %s): function not first in batch takes no input",
               source->getName().c_str(), inputFunction->getName().str().c_str());
-        return false;
+        return nullptr;
       }
     }
 
+    if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(inputFunctionSignature)) {
+      // Each script declares its own copy of the opaque context type, which
+      // linking may have renamed, so cast the shared context if needed.
+      llvm::Type* contextType =
+              inputFunction->getFunctionType()->getParamType(args.size());
+      args.push_back(builder.CreatePointerCast(KernelContext, contextType));
+    }
+
     if (bcinfo::MetadataExtractor::hasForEachSignatureX(inputFunctionSignature)) {
       args.push_back(X);
     }
@@ -299,6 +402,24 @@ bool fuseKernels(bcc::BCCContext& Context,
     builder.CreateRet(dataElement);
   }
 
+  return fusedKernel;
+}
+
+}  // anonymous namespace
+
+bool fuseKernels(bcc::BCCContext& Context,
+                 const std::vector<Source *>& sources,
+                 const std::vector<int>& slots,
+                 const std::string& fusedName,
+                 Module* mergedModule) {
+  uint32_t fusedFunctionSignature;
+  if (createFusedKernel(Context, sources, slots, fusedName, mergedModule,
+                        &fusedFunctionSignature) == nullptr) {
+    return false;
+  }
+
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+
   llvm::NamedMDNode* ExportForEachNameMD =
     mergedModule->getOrInsertNamedMetadata("#rs_export_foreach_name");
 
@@ -316,30 +437,657 @@ bool fuseKernels(bcc::BCCContext& Context,
   return true;
 }
 
-bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
-                  const std::string& newName, Module* module) {
-  const llvm::Function* F = getInvokeFunction(*source, slot, module);
-  std::vector<llvm::Type*> params;
-  for (auto I = F->arg_begin(), E = F->arg_end(); I != E; ++I) {
-    params.push_back(I->getType());
+bool fuseKernelsIntoReduce(bcc::BCCContext& Context,
+                           const std::vector<Source *>& sources,
+                           const std::vector<int>& slots,
+                           const Source* reduceSource, const int reduceSlot,
+                           const std::string& fusedName,
+                           Module* mergedModule) {
+  const bcinfo::MetadataExtractor::Reduce& reduce =
+          reduceSource->getMetadata()->getExportReduceList()[reduceSlot];
+  Function* accumulator = mergedModule->getFunction(reduce.mAccumulatorName);
+  if (accumulator == nullptr) {
+    ALOGE("Kernel fusion (module %s reduction %d): failed to find accumulator function",
+          reduceSource->getName().c_str(), reduceSlot);
+    return false;
+  }
+  const uint32_t accumulatorSignature = reduce.mSignature;
+  if (!bcinfo::MetadataExtractor::hasForEachSignatureIn(accumulatorSignature) ||
+      (accumulatorSignature &
+       ~(ExpectedSignatureBits & ~bcinfo::MD_SIG_Out & ~bcinfo::MD_SIG_Kernel))) {
+    ALOGE("Kernel fusion (module %s reduction %s): Unexpected signature %x",
+          reduceSource->getName().c_str(), reduce.mReduceName, accumulatorSignature);
+    return false;
+  }
+
+  // The forEach kernels are fused as usual into a function internal to the
+  // accumulator, whose result is the first input of the original accumulator.
+  uint32_t mapSignature;
+  Function* map = createFusedKernel(Context, sources, slots, fusedName + ".map",
+                                    mergedModule, &mapSignature);
+  if (map == nullptr) {
+    return false;
+  }
+  map->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+  const llvm::FunctionType* mapTy = map->getFunctionType();
+  const llvm::FunctionType* accumulatorTy = accumulator->getFunctionType();
+  const size_t numMapInputs = getNumInputs(mapTy, mapSignature);
+  // The first parameter of the accumulator is the accumulator data itself.
+  const size_t numAccumulatorInputs = reduce.mInputCount;
+  if (numAccumulatorInputs == 0 ||
+      mapTy->getReturnType() != accumulatorTy->getParamType(1)) {
+    ALOGE("Kernel fusion (module %s reduction %s): accumulator does not take "
+          "the result of the kernels as its first input",
+          reduceSource->getName().c_str(), reduce.mReduceName);
+    return false;
+  }
+  if (numMapInputs + numAccumulatorInputs - 1 > kMaxFusedKernelInputs) {
+    ALOGE("Kernel fusion (module %s reduction %s): more than %zu inputs in total",
+          reduceSource->getName().c_str(), reduce.mReduceName, kMaxFusedKernelInputs);
+    return false;
+  }
+
+  // The fused accumulator takes the accumulator data, the inputs of the
+  // kernels, the other inputs of the original accumulator and the special
+  // arguments of either.
+  const uint32_t specialBits = bcinfo::MD_SIG_Ctxt | bcinfo::MD_SIG_X |
+                               bcinfo::MD_SIG_Y | bcinfo::MD_SIG_Z;
+  const uint32_t fusedSignature = bcinfo::MD_SIG_In |
+          ((mapSignature | accumulatorSignature) & specialBits);
+
+  llvm::SmallVector<llvm::Type*, 8> ArgTys;
+  ArgTys.push_back(accumulatorTy->getParamType(0));
+  for (size_t i = 0; i < numMapInputs; i++) {
+    ArgTys.push_back(mapTy->getParamType(i));
+  }
+  for (size_t i = 2; i <= numAccumulatorInputs; i++) {
+    ArgTys.push_back(accumulatorTy->getParamType(i));
+  }
+  if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(fusedSignature)) {
+    ArgTys.push_back(bcinfo::MetadataExtractor::hasForEachSignatureCtxt(mapSignature) ?
+                     mapTy->getParamType(numMapInputs) :
+                     accumulatorTy->getParamType(numAccumulatorInputs + 1));
+  }
+  llvm::Type* I32Ty = llvm::IntegerType::get(Context.getLLVMContext(), 32);
+  for (uint32_t bit : { bcinfo::MD_SIG_X, bcinfo::MD_SIG_Y, bcinfo::MD_SIG_Z }) {
+    if (fusedSignature & bit) {
+      ArgTys.push_back(I32Ty);
+    }
+  }
+
+  llvm::FunctionType* fusedType = llvm::FunctionType::get(
+          llvm::Type::getVoidTy(Context.getLLVMContext()), ArgTys, false);
+  Function* fusedAccumulator =
+          (Function*)(mergedModule->getOrInsertFunction(fusedName, fusedType));
+
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(ctxt, "entry", fusedAccumulator);
+  llvm::IRBuilder<> builder(block);
+
+  Function::arg_iterator argIter = fusedAccumulator->arg_begin();
+  llvm::Value* accum = &*(argIter++);
+  accum->setName("accum");
+
+  std::vector<llvm::Value*> mapArgs;
+  for (size_t i = 0; i < numMapInputs; i++) {
+    mapArgs.push_back(&*(argIter++));
+  }
+  std::vector<llvm::Value*> accumulatorArgs = { accum, nullptr };
+  for (size_t i = 2; i <= numAccumulatorInputs; i++) {
+    accumulatorArgs.push_back(&*(argIter++));
+  }
+
+  // Pass the special arguments on to whichever function takes them, casting
+  // the context like fuseKernels() does.
+  auto addSpecialArg = [&](uint32_t bit, llvm::Value* arg) {
+    if (mapSignature & bit) {
+      mapArgs.push_back(builder.CreatePointerCast(
+              arg, mapTy->getParamType(mapArgs.size())));
+    }
+    if (accumulatorSignature & bit) {
+      accumulatorArgs.push_back(builder.CreatePointerCast(
+              arg, accumulatorTy->getParamType(accumulatorArgs.size())));
+    }
+  };
+  const std::pair<uint32_t, const char*> specialArgs[] = {
+    { bcinfo::MD_SIG_Ctxt, "context" },
+    { bcinfo::MD_SIG_X, "x" },
+    { bcinfo::MD_SIG_Y, "y" },
+    { bcinfo::MD_SIG_Z, "z" },
+  };
+  for (const auto& special : specialArgs) {
+    if (fusedSignature & special.first) {
+      llvm::Value* arg = &*(argIter++);
+      arg->setName(special.second);
+      addSpecialArg(special.first, arg);
+    }
+  }
+
+  accumulatorArgs[1] = builder.CreateCall(map, mapArgs);
+  builder.CreateCall(accumulator, accumulatorArgs);
+  builder.CreateRetVoid();
+
+  // A combiner gets synthesized from the original accumulator if the original
+  // reduction has none (see RSKernelExpandPass), but that cannot be done from
+  // the fused accumulator. Forward to the one synthesized for the original.
+  std::string combinerName = reduce.mCombinerName ? reduce.mCombinerName : "";
+  if (combinerName.empty()) {
+    llvm::Type* accumTy = accumulatorTy->getParamType(0);
+    llvm::FunctionType* combinerTy = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(ctxt), { accumTy, accumTy }, false);
+    Function* originalCombiner = (Function*)(mergedModule->getOrInsertFunction(
+            nameReduceCombinerFromAccumulator(reduce.mAccumulatorName), combinerTy));
+    combinerName = nameReduceCombinerFromAccumulator(fusedName);
+    Function* combiner = Function::Create(combinerTy, llvm::GlobalValue::InternalLinkage,
+                                          combinerName, mergedModule);
+    llvm::IRBuilder<> combinerBuilder(llvm::BasicBlock::Create(ctxt, "entry", combiner));
+    std::vector<llvm::Value*> combinerArgs;
+    for (llvm::Argument& arg : combiner->args()) {
+      combinerArgs.push_back(&arg);
+    }
+    combinerBuilder.CreateCall(originalCombiner, combinerArgs);
+    combinerBuilder.CreateRetVoid();
+  }
+
+  // Export the fused accumulator as a new general reduction sharing the other
+  // functions of the original one.
+  auto optionalName = [&](const char* name) -> llvm::Metadata* {
+    return name ? llvm::MDString::get(ctxt, name) : nullptr;
+  };
+  llvm::Metadata* accumulatorMD[] = {
+    llvm::MDString::get(ctxt, fusedName),
+    llvm::MDString::get(ctxt, llvm::utostr(fusedSignature)),
+  };
+  llvm::SmallVector<llvm::Metadata*, 7> reduceMD = {
+    llvm::MDString::get(ctxt, fusedName),
+    llvm::MDString::get(ctxt, llvm::utostr(reduce.mAccumulatorDataSize)),
+    llvm::MDNode::get(ctxt, accumulatorMD),
+    optionalName(reduce.mInitializerName),
+    llvm::MDString::get(ctxt, combinerName),
+    optionalName(reduce.mOutConverterName),
+    optionalName(reduce.mHalterName),
+  };
+  while (reduceMD.back() == nullptr) {
+    reduceMD.pop_back();
+  }
+
+  llvm::NamedMDNode* ExportReduceMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_reduce");
+  ExportReduceMD->addOperand(llvm::MDNode::get(ctxt, reduceMD));
+
+  return true;
+}
+
+bool fuseFanOutKernels(bcc::BCCContext& Context,
+                       const std::vector<Source *>& sources,
+                       const std::vector<int>& slots,
+                       const std::string& fusedName,
+                       Module* mergedModule) {
+  bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
+
+  // The first kernel is the producer, and each of the others a consumer
+  // taking its result as first input and writing one output of the fused
+  // kernel (see kMultipleOutputsAttr).
+  if (sources.size() < 3 || sources.size() - 1 > kMaxFusedKernelOutputs) {
+    ALOGE("Kernel fusion (%s): expected a kernel and 2 to %zu consumers",
+          fusedName.c_str(), kMaxFusedKernelOutputs);
+    return false;
   }
-  llvm::Type* returnTy = F->getReturnType();
 
+  std::vector<const Function*> kernels;
+  std::vector<uint32_t> signatures;
+  uint32_t fusedSignature = bcinfo::MD_SIG_Out | bcinfo::MD_SIG_Kernel;
+  size_t numFusedInputs = 0;
+  for (size_t k = 0; k < sources.size(); k++) {
+    uint32_t signature;
+    const Function* F = getFunction(mergedModule, sources[k], slots[k], &signature);
+    if (F == nullptr) {
+      return false;
+    }
+    const uint32_t numInputs = getInputCount(sources[k], slots[k]);
+    if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(signature) ||
+        (signature & ~ExpectedSignatureBits) || F->getReturnType()->isVoidTy()) {
+      ALOGE("Kernel fusion (module %s function %s): Unexpected signature %x",
+            sources[k]->getName().c_str(), F->getName().str().c_str(), signature);
+      return false;
+    }
+    if (k > 0 && (numInputs == 0 ||
+                  F->getFunctionType()->getParamType(0) != kernels.front()->getReturnType())) {
+      ALOGE("Kernel fusion (module %s function %s): does not take the result of %s "
+            "as its first input", sources[k]->getName().c_str(),
+            F->getName().str().c_str(), kernels.front()->getName().str().c_str());
+      return false;
+    }
+    numFusedInputs += (k == 0) ? numInputs : numInputs - 1;
+    fusedSignature |= signature & ~bcinfo::MD_SIG_In;
+    kernels.push_back(F);
+    signatures.push_back(signature);
+  }
+  if (numFusedInputs > kMaxFusedKernelInputs) {
+    ALOGE("Kernel fusion (%s): more than %zu inputs in total", fusedName.c_str(),
+          kMaxFusedKernelInputs);
+    return false;
+  }
+  if (numFusedInputs > 0) {
+    fusedSignature |= bcinfo::MD_SIG_In;
+  }
+
+  // The fused kernel takes the inputs of the producer, the other inputs of
+  // each consumer and the special arguments of any, and returns the results
+  // of the consumers.
+  llvm::SmallVector<llvm::Type*, 8> ArgTys;
+  llvm::SmallVector<llvm::Type*, 8> RetTys;
+  for (size_t k = 0; k < kernels.size(); k++) {
+    for (uint32_t i = (k == 0) ? 0 : 1; i < getInputCount(sources[k], slots[k]); i++) {
+      ArgTys.push_back(kernels[k]->getFunctionType()->getParamType(i));
+    }
+    if (k > 0) {
+      RetTys.push_back(kernels[k]->getReturnType());
+    }
+  }
+  if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(fusedSignature)) {
+    for (size_t k = 0; k < kernels.size(); k++) {
+      if (bcinfo::MetadataExtractor::hasForEachSignatureCtxt(signatures[k])) {
+        ArgTys.push_back(kernels[k]->getFunctionType()->getParamType(
+                getInputCount(sources[k], slots[k])));
+        break;
+      }
+    }
+  }
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+  llvm::Type* I32Ty = llvm::IntegerType::get(ctxt, 32);
+  for (uint32_t bit : { bcinfo::MD_SIG_X, bcinfo::MD_SIG_Y, bcinfo::MD_SIG_Z }) {
+    if (fusedSignature & bit) {
+      ArgTys.push_back(I32Ty);
+    }
+  }
+
+  llvm::StructType* fusedRetTy = llvm::StructType::get(ctxt, RetTys);
+  llvm::FunctionType* fusedType = llvm::FunctionType::get(fusedRetTy, ArgTys, false);
+  Function* fusedKernel =
+          (Function*)(mergedModule->getOrInsertFunction(fusedName, fusedType));
+  fusedKernel->addFnAttr(kMultipleOutputsAttr);
+
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(ctxt, "entry", fusedKernel);
+  llvm::IRBuilder<> builder(block);
+
+  Function::arg_iterator argIter = fusedKernel->arg_begin();
+  std::vector<std::vector<llvm::Value*>> args(kernels.size());
+  for (size_t k = 0; k < kernels.size(); k++) {
+    for (uint32_t i = (k == 0) ? 0 : 1; i < getInputCount(sources[k], slots[k]); i++) {
+      llvm::Value* input = &*(argIter++);
+      input->setName("DataIn");
+      args[k].push_back(input);
+    }
+  }
+
+  // Pass the special arguments on to every kernel that takes them, casting
+  // the context like fuseKernels() does.
+  const std::pair<uint32_t, const char*> specialArgs[] = {
+    { bcinfo::MD_SIG_Ctxt, "context" },
+    { bcinfo::MD_SIG_X, "x" },
+    { bcinfo::MD_SIG_Y, "y" },
+    { bcinfo::MD_SIG_Z, "z" },
+  };
+  for (const auto& special : specialArgs) {
+    if (!(fusedSignature & special.first)) {
+      continue;
+    }
+    llvm::Value* arg = &*(argIter++);
+    arg->setName(special.second);
+    for (size_t k = 0; k < kernels.size(); k++) {
+      if (signatures[k] & special.first) {
+        // The consumers still lack their first input at this point.
+        const size_t index = args[k].size() + ((k == 0) ? 0 : 1);
+        args[k].push_back(builder.CreatePointerCast(
+                arg, kernels[k]->getFunctionType()->getParamType(index)));
+      }
+    }
+  }
+
+  // Call the producer once, and each consumer on its result.
+  llvm::Value* produced = builder.CreateCall((llvm::Value*)kernels.front(), args.front());
+  llvm::Value* result = llvm::UndefValue::get(fusedRetTy);
+  for (size_t k = 1; k < kernels.size(); k++) {
+    args[k].insert(args[k].begin(), produced);
+    llvm::Value* output = builder.CreateCall((llvm::Value*)kernels[k], args[k]);
+    result = builder.CreateInsertValue(result, output, k - 1);
+  }
+  builder.CreateRet(result);
+
+  llvm::NamedMDNode* ExportForEachNameMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach_name");
+  ExportForEachNameMD->addOperand(
+          llvm::MDNode::get(ctxt, llvm::MDString::get(ctxt, fusedName)));
+
+  llvm::NamedMDNode* ExportForEachMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach");
+  ExportForEachMD->addOperand(llvm::MDNode::get(
+          ctxt, llvm::MDString::get(ctxt, llvm::utostr(fusedSignature))));
+
+  return true;
+}
+
+namespace {
+
+// Return true if Alloc, an rs_allocation argument of a runtime call, is (a
+// copy of) the global G: depending on the ABI, either a value loaded from G
+// or a pointer to G or to a temporary copied from G.
+bool isAllocationFromGlobal(llvm::Value* Alloc, const llvm::GlobalVariable* G) {
+  Alloc = Alloc->stripPointerCasts();
+  if (Alloc == G) {
+    return true;
+  }
+  if (auto* LI = llvm::dyn_cast<llvm::LoadInst>(Alloc)) {
+    return LI->getPointerOperand()->stripPointerCasts() == G;
+  }
+  if (llvm::isa<llvm::AllocaInst>(Alloc)) {
+    std::vector<llvm::User*> users(Alloc->user_begin(), Alloc->user_end());
+    while (!users.empty()) {
+      llvm::User* U = users.back();
+      users.pop_back();
+      if (llvm::isa<llvm::BitCastInst>(U)) {
+        users.insert(users.end(), U->user_begin(), U->user_end());
+      } else if (auto* MCI = llvm::dyn_cast<llvm::MemCpyInst>(U)) {
+        if (MCI->getDest()->stripPointerCasts() == Alloc &&
+            MCI->getSource()->stripPointerCasts() == G) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// Runtime functions that may still be called on the allocation of the
+// producer once the consumer no longer reads its elements: they only look at
+// the allocation itself, which the runtime still provides.
+bool isAllocationQuery(llvm::StringRef Name) {
+  return Name.find("rsAllocationGet") != llvm::StringRef::npos;
+}
+
+}  // anonymous namespace
+
+bool fuseStencilKernels(bcc::BCCContext& Context,
+                        const Source* producerSource, const int producerSlot,
+                        const Source* consumerSource, const int consumerSlot,
+                        const std::string& allocationName,
+                        const std::string& fusedName,
+                        Module* mergedModule) {
+  uint32_t producerSignature, consumerSignature;
+  const Function* producer = getFunction(mergedModule, producerSource,
+                                         producerSlot, &producerSignature);
+  const Function* consumer = getFunction(mergedModule, consumerSource,
+                                         consumerSlot, &consumerSignature);
+  if (producer == nullptr || consumer == nullptr) {
+    return false;
+  }
+
+  // The producer is called again for every element the consumer reads, from
+  // the coordinates of that element: it can take at most one input, which is
+  // then read from the allocation bound to <fusedName>.in.
+  const uint32_t producerBits = bcinfo::MD_SIG_In | bcinfo::MD_SIG_Out |
+                                bcinfo::MD_SIG_X | bcinfo::MD_SIG_Y |
+                                bcinfo::MD_SIG_Kernel;
+  const uint32_t numProducerInputs = getInputCount(producerSource, producerSlot);
+  if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(producerSignature) ||
+      (producerSignature & ~producerBits) || numProducerInputs > 1 ||
+      producer->getReturnType()->isVoidTy()) {
+    ALOGE("Stencil fusion (module %s function %s): unsupported producer signature %x",
+          producerSource->getName().c_str(), producer->getName().str().c_str(),
+          producerSignature);
+    return false;
+  }
+  if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(consumerSignature)) {
+    ALOGE("Stencil fusion (module %s function %s): not a kernel",
+          consumerSource->getName().c_str(), consumer->getName().str().c_str());
+    return false;
+  }
+
+  llvm::GlobalVariable* allocation = mergedModule->getGlobalVariable(allocationName);
+  if (allocation == nullptr ||
+      getRsDataTypeForType(allocation->getValueType()) != RS_TYPE_ALLOCATION) {
+    ALOGE("Stencil fusion (module %s function %s): %s is not an rs_allocation",
+          consumerSource->getName().c_str(), consumer->getName().str().c_str(),
+          allocationName.c_str());
+    return false;
+  }
+
+  // Every element read of the allocation has to be replaced, so it must only
+  // be used directly by the consumer.
+  std::vector<const llvm::User*> users(allocation->user_begin(), allocation->user_end());
+  while (!users.empty()) {
+    const llvm::User* U = users.back();
+    users.pop_back();
+    if (llvm::isa<llvm::ConstantExpr>(U)) {
+      users.insert(users.end(), U->user_begin(), U->user_end());
+    } else if (!llvm::isa<llvm::Instruction>(U) ||
+               llvm::cast<llvm::Instruction>(U)->getFunction() != consumer) {
+      ALOGE("Stencil fusion (module %s function %s): %s is used outside of the kernel",
+            consumerSource->getName().c_str(), consumer->getName().str().c_str(),
+            allocationName.c_str());
+      return false;
+    }
+  }
+
+  // The fused kernel is a copy of the consumer ...
+  llvm::ValueToValueMapTy VMap;
+  Function* fusedKernel = llvm::CloneFunction(const_cast<Function*>(consumer), VMap);
+  fusedKernel->setName(fusedName);
+  fusedKernel->setLinkage(llvm::GlobalValue::ExternalLinkage);
+
+  // ... with a new exported rs_allocation the runtime binds to the input of
+  // the producer ...
+  llvm::GlobalVariable* input = nullptr;
+  if (numProducerInputs != 0) {
+    input = new llvm::GlobalVariable(
+            *mergedModule, allocation->getValueType(), false,
+            llvm::GlobalValue::ExternalLinkage,
+            llvm::Constant::getNullValue(allocation->getValueType()),
+            fusedName + ".in");
+    input->setAlignment(allocation->getAlignment());
+  }
+
+  // ... in which each element read of the allocation by rsGetElementAt_<type>
+  // calls the producer instead.
+  llvm::FunctionType* producerTy = producer->getFunctionType();
+  std::vector<llvm::CallInst*> reads;
+  bool replaceable = true;
+  for (llvm::Instruction& I : llvm::instructions(fusedKernel)) {
+    auto* CI = llvm::dyn_cast<llvm::CallInst>(&I);
+    if (CI == nullptr) {
+      continue;
+    }
+    bool usesAllocation = false;
+    for (unsigned i = 0; i < CI->getNumArgOperands(); i++) {
+      usesAllocation |= isAllocationFromGlobal(CI->getArgOperand(i), allocation);
+    }
+    const Function* callee = CI->getCalledFunction();
+    llvm::StringRef calleeName = callee ? callee->getName() : "";
+    if (!usesAllocation || llvm::isa<llvm::IntrinsicInst>(CI) ||
+        isAllocationQuery(calleeName)) {
+      continue;
+    }
+
+    const unsigned numCoords = CI->getNumArgOperands() - 1;
+    bool isRead = (numCoords == 1 || numCoords == 2) &&
+                  isAllocationFromGlobal(CI->getArgOperand(0), allocation) &&
+                  calleeName.find("rsGetElementAt_") != llvm::StringRef::npos &&
+                  CI->getType() == producerTy->getReturnType();
+    for (unsigned i = 1; isRead && i <= numCoords; i++) {
+      isRead = CI->getArgOperand(i)->getType()->isIntegerTy(32);
+    }
+    if (!isRead) {
+      ALOGE("Stencil fusion (module %s function %s): cannot replace access to %s "
+            "through %s", consumerSource->getName().c_str(),
+            consumer->getName().str().c_str(), allocationName.c_str(),
+            calleeName.str().c_str());
+      replaceable = false;
+      break;
+    }
+    reads.push_back(CI);
+  }
+  if (!replaceable) {
+    fusedKernel->eraseFromParent();
+    if (input != nullptr) {
+      input->eraseFromParent();
+    }
+    return false;
+  }
+
+  for (llvm::CallInst* CI : reads) {
+    llvm::IRBuilder<> builder(CI);
+    const unsigned numCoords = CI->getNumArgOperands() - 1;
+    llvm::Value* X = CI->getArgOperand(1);
+    llvm::Value* Y = (numCoords == 2) ? CI->getArgOperand(2) : builder.getInt32(0);
+
+    std::vector<llvm::Value*> args;
+    if (input != nullptr) {
+      // Read the input element with the generic rsGetElementAt(), passing
+      // the new allocation the same way the consumer passes its own.
+      llvm::Value* alloc = CI->getArgOperand(0);
+      llvm::Value* inputAlloc;
+      if (alloc->getType()->isPointerTy()) {
+        inputAlloc = builder.CreatePointerCast(input, alloc->getType());
+      } else {
+        auto* LI = llvm::cast<llvm::LoadInst>(alloc->stripPointerCasts());
+        inputAlloc = builder.CreateLoad(
+                builder.CreatePointerCast(input, LI->getPointerOperand()->getType()));
+      }
+
+      std::vector<llvm::Type*> getterParams = { inputAlloc->getType() };
+      std::vector<llvm::Value*> getterArgs = { inputAlloc };
+      for (unsigned i = 1; i <= numCoords; i++) {
+        getterParams.push_back(builder.getInt32Ty());
+        getterArgs.push_back(CI->getArgOperand(i));
+      }
+      llvm::FunctionType* getterTy = llvm::FunctionType::get(
+              builder.getInt8PtrTy(), getterParams, false);
+      llvm::Constant* getter = mergedModule->getOrInsertFunction(
+              (numCoords == 2) ? "_Z14rsGetElementAt13rs_allocationjj" :
+                                 "_Z14rsGetElementAt13rs_allocationj", getterTy);
+      llvm::Value* element = builder.CreateCall(getter, getterArgs);
+
+      llvm::Type* inputTy = producerTy->getParamType(0);
+      if (inputTy->isPointerTy()) {
+        // Large inputs are passed by reference.
+        args.push_back(builder.CreatePointerCast(element, inputTy));
+      } else {
+        args.push_back(builder.CreateLoad(
+                builder.CreatePointerCast(element, inputTy->getPointerTo())));
+      }
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(producerSignature)) {
+      args.push_back(X);
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(producerSignature)) {
+      args.push_back(Y);
+    }
+
+    CI->replaceAllUsesWith(builder.CreateCall(const_cast<Function*>(producer), args));
+    CI->eraseFromParent();
+  }
+
+  // Export the fused kernel with the signature of the consumer, and the new
+  // allocation as an object variable.
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+
+  llvm::NamedMDNode* ExportForEachNameMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach_name");
+  ExportForEachNameMD->addOperand(
+          llvm::MDNode::get(ctxt, llvm::MDString::get(ctxt, fusedName)));
+
+  llvm::NamedMDNode* ExportForEachMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach");
+  ExportForEachMD->addOperand(llvm::MDNode::get(
+          ctxt, llvm::MDString::get(ctxt, llvm::utostr(consumerSignature))));
+
+  if (input != nullptr) {
+    llvm::NamedMDNode* ExportVarMD =
+      mergedModule->getOrInsertNamedMetadata("#rs_export_var");
+    const unsigned slot = ExportVarMD->getNumOperands();
+    llvm::Metadata* varMD[] = {
+      llvm::MDString::get(ctxt, input->getName()),
+      llvm::MDString::get(ctxt, llvm::utostr(RS_TYPE_ALLOCATION)),
+    };
+    ExportVarMD->addOperand(llvm::MDNode::get(ctxt, varMD));
+
+    llvm::NamedMDNode* ObjectSlotsMD =
+      mergedModule->getOrInsertNamedMetadata("#rs_object_slots");
+    ObjectSlotsMD->addOperand(
+            llvm::MDNode::get(ctxt, llvm::MDString::get(ctxt, llvm::utostr(slot))));
+  }
+
+  return true;
+}
+
+bool fuseInvokes(BCCContext& Context, const std::vector<Source *>& sources,
+                 const std::vector<int>& slots, const std::string& newName,
+                 Module* module) {
+  bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
+
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+  const llvm::DataLayout& DL = module->getDataLayout();
+
+  // Lay out the param structs of the invokes one after the other in a single
+  // blob, each at the alignment of its own struct.
+  std::vector<const llvm::Function*> invokes;
+  std::vector<unsigned> offsets;
+  unsigned offset = 0;
+  for (size_t i = 0; i < sources.size(); i++) {
+    const llvm::Function* F = getInvokeFunction(*sources[i], slots[i], module);
+    if (F == nullptr) {
+      ALOGE("Invoke fusion (module %s slot %d): failed to find invokable function",
+            sources[i]->getName().c_str(), slots[i]);
+      return false;
+    }
+    if (F->arg_size() > 1 ||
+        (F->arg_size() == 1 && !F->arg_begin()->getType()->isPointerTy())) {
+      ALOGE("Invoke fusion (module %s slot %d): unexpected parameters of %s",
+            sources[i]->getName().c_str(), slots[i], F->getName().str().c_str());
+      return false;
+    }
+    if (F->arg_size() == 1) {
+      llvm::Type* paramsTy = F->arg_begin()->getType()->getPointerElementType();
+      offset = llvm::alignTo(offset, DL.getABITypeAlignment(paramsTy));
+      offsets.push_back(offset);
+      offset += DL.getTypeAllocSize(paramsTy);
+    } else {
+      offsets.push_back(offset);
+    }
+    invokes.push_back(F);
+  }
+
+  llvm::Type* int8PtrTy = llvm::Type::getInt8PtrTy(ctxt);
   llvm::FunctionType* batchFuncTy =
-          llvm::FunctionType::get(returnTy, params, false);
+          llvm::FunctionType::get(llvm::Type::getVoidTy(ctxt), int8PtrTy, false);
 
   llvm::Function* newF =
           llvm::Function::Create(batchFuncTy,
                                  llvm::GlobalValue::ExternalLinkage, newName,
                                  module);
 
-  llvm::BasicBlock* block = llvm::BasicBlock::Create(Context.getLLVMContext(),
-                                                     "entry", newF);
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(ctxt, "entry", newF);
   llvm::IRBuilder<> builder(block);
 
-  llvm::Function::arg_iterator argIter = newF->arg_begin();
-  llvm::Value* arg1 = &*(argIter++);
-  builder.CreateCall((llvm::Value*)F, arg1);
+  // Call the invokes one after the other, each with a pointer to its own
+  // params in the blob; LTO can then inline them all into the batch function.
+  llvm::Value* params = &*newF->arg_begin();
+  for (size_t i = 0; i < invokes.size(); i++) {
+    const llvm::Function* F = invokes[i];
+    if (F->arg_size() == 0) {
+      builder.CreateCall((llvm::Value*)F);
+      continue;
+    }
+    llvm::Value* invokeParams =
+        builder.CreateConstInBoundsGEP1_32(builder.getInt8Ty(), params,
+                                           offsets[i]);
+    builder.CreateCall((llvm::Value*)F,
+                       builder.CreateBitCast(invokeParams,
+                                             F->arg_begin()->getType()));
+  }
 
   builder.CreateRetVoid();
 
@@ -352,4 +1100,162 @@ bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
   return true;
 }
 
+namespace {
+
+typedef std::pair<int, int> KernelID;
+
+// The kernel in the slot named by id, in its own (not yet linked) module, or
+// nullptr with its signature if it cannot take part in fusion at all.
+const Function* getPlannableKernel(const std::vector<Source*>& sources,
+                                   const KernelID& id, uint32_t* signature) {
+  if (id.first < 0 || static_cast<size_t>(id.first) >= sources.size()) {
+    return nullptr;
+  }
+  Source* source = sources[id.first];
+  if (source->getMetadata() == nullptr && !source->extractMetadata()) {
+    return nullptr;
+  }
+  const bcinfo::MetadataExtractor& metadata = *source->getMetadata();
+  if (id.second < 0 ||
+      static_cast<size_t>(id.second) >= metadata.getExportForEachSignatureCount()) {
+    return nullptr;
+  }
+  *signature = metadata.getExportForEachSignatureList()[id.second];
+  if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(*signature) ||
+      (*signature & ~ExpectedSignatureBits)) {
+    return nullptr;
+  }
+  const char* name = metadata.getExportForEachNameList()[id.second];
+  Function* F = source->getModule().getFunction(name);
+  if (F == nullptr || F->isDeclaration()) {
+    return nullptr;
+  }
+  return F;
+}
+
+}  // anonymous namespace
+
+bool planKernelFusion(const std::vector<Source*>& sources,
+                      const std::vector<ScriptGroupEdge>& edges,
+                      const std::vector<std::pair<int, int>>& groupOutputs,
+                      std::list<std::list<std::pair<int, int>>>* toFuse,
+                      std::list<std::string>* fused,
+                      std::list<size_t>* bytesSaved) {
+  // Fusing an edge saves writing the intermediate element and reading it back.
+  struct Candidate {
+    KernelID producer, consumer;
+    size_t bytesSaved;
+  };
+  std::vector<Candidate> candidates;
+
+  std::map<KernelID, unsigned> numConsumers;
+  for (const ScriptGroupEdge& edge : edges) {
+    numConsumers[edge.mProducer]++;
+  }
+  const std::set<KernelID> outputs(groupOutputs.begin(), groupOutputs.end());
+
+  for (const ScriptGroupEdge& edge : edges) {
+    // The value must only flow into the first input of the consumer, which is
+    // where fuseKernels() passes the result of the previous kernel.
+    if (edge.mInput != 0 || numConsumers[edge.mProducer] != 1 ||
+        outputs.count(edge.mProducer)) {
+      continue;
+    }
+    uint32_t producerSignature, consumerSignature;
+    const Function* producer = getPlannableKernel(sources, edge.mProducer,
+                                                  &producerSignature);
+    const Function* consumer = getPlannableKernel(sources, edge.mConsumer,
+                                                  &consumerSignature);
+    if (producer == nullptr || consumer == nullptr ||
+        !bcinfo::MetadataExtractor::hasForEachSignatureIn(consumerSignature)) {
+      continue;
+    }
+    llvm::Type* valueTy = producer->getReturnType();
+    if (valueTy->isVoidTy() || consumer->arg_empty() ||
+        consumer->getFunctionType()->getParamType(0) != valueTy) {
+      continue;
+    }
+    const llvm::DataLayout& DL = producer->getParent()->getDataLayout();
+    candidates.push_back({ edge.mProducer, edge.mConsumer,
+                           2 * static_cast<size_t>(DL.getTypeAllocSize(valueTy)) });
+  }
+
+  // Greedily fuse the most profitable edges first, growing chains of kernels
+  // as long as the fused kernel does not take too many inputs.
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const Candidate& a, const Candidate& b) {
+                     return a.bytesSaved > b.bytesSaved;
+                   });
+
+  std::map<KernelID, KernelID> next, prev;
+  std::map<KernelID, size_t> savedBy;
+  auto chainHead = [&](KernelID id) {
+    for (auto it = prev.find(id); it != prev.end(); it = prev.find(id)) {
+      id = it->second;
+    }
+    return id;
+  };
+  auto chainInputs = [&](KernelID id) {
+    size_t numInputs = getInputCount(sources[id.first], id.second);
+    for (auto it = next.find(id); it != next.end(); it = next.find(id)) {
+      id = it->second;
+      numInputs += getInputCount(sources[id.first], id.second) - 1;
+    }
+    return numInputs;
+  };
+
+  for (const Candidate& candidate : candidates) {
+    if (next.count(candidate.producer) || prev.count(candidate.consumer)) {
+      continue;
+    }
+    next[candidate.producer] = candidate.consumer;
+    prev[candidate.consumer] = candidate.producer;
+    if (chainInputs(chainHead(candidate.producer)) > kMaxFusedKernelInputs) {
+      next.erase(candidate.producer);
+      prev.erase(candidate.consumer);
+      continue;
+    }
+    savedBy[candidate.producer] = candidate.bytesSaved;
+  }
+
+  // Emit one fusion per chain, named after the kernels it is made of.
+  std::set<std::string> names;
+  for (const auto& link : next) {
+    KernelID id = link.first;
+    if (prev.count(id)) {
+      continue;
+    }
+
+    std::list<std::pair<int, int>> plan;
+    std::string name;
+    size_t saved = 0;
+    for (;;) {
+      plan.push_back(id);
+      if (!name.empty()) {
+        name += "_";
+      }
+      name += sources[id.first]->getMetadata()->getExportForEachNameList()[id.second];
+      auto it = next.find(id);
+      if (it == next.end()) {
+        break;
+      }
+      saved += savedBy[id];
+      id = it->second;
+    }
+
+    std::string uniqueName = name;
+    for (unsigned i = 1; !names.insert(uniqueName).second; i++) {
+      uniqueName = name + llvm::utostr(i);
+    }
+
+    toFuse->push_back(plan);
+    fused->push_back(uniqueName);
+    if (bytesSaved != nullptr) {
+      bytesSaved->push_back(saved);
+    }
+  }
+
+  return true;
+}
+
 }  // namespace bcc
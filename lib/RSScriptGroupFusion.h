@@ -17,6 +17,8 @@
 #ifndef BCC_RS_SCRIPT_GROUP_FUSION_H
 #define BCC_RS_SCRIPT_GROUP_FUSION_H
 
+#include <list>
+#include <utility>
 #include <vector>
 #include <string>
 
@@ -28,6 +30,7 @@ namespace bcc {
 
 class Source;
 class BCCContext;
+struct ScriptGroupEdge;
 
 /// @brief Fuse kernels
 ///
@@ -44,8 +47,88 @@ bool fuseKernels(BCCContext& Context,
                  const std::string& fusedName,
                  llvm::Module* mergedModule);
 
-bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
-                  const std::string& newName, llvm::Module* mergedModule);
+/// @brief Fuse kernels into a general reduction
+///
+/// Creates a new general reduction fusedName whose accumulator applies the
+/// fused kernels to its inputs and passes the result as the first input to
+/// the accumulator of the given reduction. The new reduction shares the
+/// initializer, combiner, outconverter and halter of that reduction.
+///
+/// @param Context bcc context.
+/// @param sources The Sources containing the kernels.
+/// @param slots The slots where the kernels are located.
+/// @param reduceSource The Source containing the reduction.
+/// @param reduceSlot The slot where the reduction is located.
+/// @param fusedName
+/// @return True, if kernels are successfully fused. False, otherwise.
+bool fuseKernelsIntoReduce(BCCContext& Context,
+                           const std::vector<Source *>& sources,
+                           const std::vector<int>& slots,
+                           const Source* reduceSource, const int reduceSlot,
+                           const std::string& fusedName,
+                           llvm::Module* mergedModule);
+
+/// @brief Fuse a kernel with the kernels consuming its output
+///
+/// Creates a kernel fusedName that calls the first kernel, passes its result
+/// as the first input to each of the other kernels, and returns all of their
+/// results: output i of the fused kernel is the result of kernel i + 1, which
+/// the expanded kernel writes through outPtr[i] of the driver info.
+///
+/// @param Context bcc context.
+/// @param sources The Sources containing the kernels.
+/// @param slots The slots where the kernels are located.
+/// @param fusedName
+/// @return True, if kernels are successfully fused. False, otherwise.
+bool fuseFanOutKernels(BCCContext& Context,
+                       const std::vector<Source *>& sources,
+                       const std::vector<int>& slots,
+                       const std::string& fusedName,
+                       llvm::Module* mergedModule);
+
+/// @brief Pick kernels to fuse
+///
+/// See RSCompilerDriver::planScriptGroupFusion().
+bool planKernelFusion(const std::vector<Source *>& sources,
+                      const std::vector<ScriptGroupEdge>& edges,
+                      const std::vector<std::pair<int, int>>& groupOutputs,
+                      std::list<std::list<std::pair<int, int>>>* toFuse,
+                      std::list<std::string>* fused,
+                      std::list<size_t>* bytesSaved);
+
+/// @brief Fuse a kernel into a consumer that reads its output at any cells
+///
+/// Creates a kernel fusedName that is a copy of the consumer in which each
+/// rsGetElementAt_<type>() read of the rs_allocation global allocationName,
+/// bound to the output of the producer, calls the producer for that cell
+/// instead. If the producer has an input, it reads it from the new
+/// rs_allocation global "<fusedName>.in", which the runtime must bind to the
+/// input of the producer.
+///
+/// @return True, if kernels are successfully fused. False, otherwise.
+bool fuseStencilKernels(BCCContext& Context,
+                        const Source* producerSource, const int producerSlot,
+                        const Source* consumerSource, const int consumerSlot,
+                        const std::string& allocationName,
+                        const std::string& fusedName,
+                        llvm::Module* mergedModule);
+
+/// @brief Fuse invokes
+///
+/// Creates an invokable function newName that calls the invokes one after the
+/// other. Like any invokable, it takes a single pointer to its packed params:
+/// the param structs of the invokes, in order, each at the next offset
+/// aligned to its own struct's ABI alignment. Invokes without params take no
+/// space. Each invoke gets a pointer to its own struct in the blob.
+///
+/// @param Context bcc context.
+/// @param sources The Sources containing the invokes.
+/// @param slots The slots where the invokes are located.
+/// @param newName
+/// @return True, if invokes are successfully fused. False, otherwise.
+bool fuseInvokes(BCCContext& Context, const std::vector<Source *>& sources,
+                 const std::vector<int>& slots, const std::string& newName,
+                 llvm::Module* mergedModule);
 }
 
 #endif /* BCC_RS_SCRIPT_GROUP_FUSION_H */
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Log.h"
+#include "RSTransforms.h"
+
+#include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+// For testing with opt: "name:hexbytes", e.g. "radius:05000000".
+llvm::cl::list<std::string> ClSpecializedGlobals(
+    "rs-specialize-global", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Exported global to specialize, as <name>:<value in hex "
+                   "bytes, in memory order>"));
+
+/* This pass specializes a script on the values of some of its exported
+ * globals, which the runtime promises to set once and never change. All uses
+ * of such a global in the script are redirected to an internal constant copy
+ * holding the given value, so that the optimizer can fold it (loop bounds,
+ * filter weights...). The exported global itself stays, with the value as its
+ * initializer, so the runtime can still find and read it.
+ *
+ * Globals that the script itself writes to, or whose value cannot be
+ * represented (e.g. RenderScript objects or pointers), are left unchanged.
+ */
+class RSSpecializeGlobalsPass : public llvm::ModulePass {
+private:
+  static char ID;
+
+  std::map<std::string, std::vector<uint8_t>> mValues;
+
+  // Build a constant of type Ty from the bytes at Offset in Bytes, laid out
+  // according to DL, or return nullptr if Ty cannot be built from bytes.
+  static llvm::Constant *getConstant(const llvm::DataLayout &DL, llvm::Type *Ty,
+                                     const std::vector<uint8_t> &Bytes,
+                                     uint64_t Offset) {
+    if (Offset + DL.getTypeStoreSize(Ty) > Bytes.size()) {
+      return nullptr;
+    }
+
+    if (Ty->isIntegerTy() || Ty->isFloatingPointTy()) {
+      const unsigned Bits = Ty->getPrimitiveSizeInBits();
+      llvm::APInt Value(Bits, 0);
+      for (unsigned i = 0; i < (Bits + 7) / 8; i++) {
+        llvm::APInt Byte(Bits, Bytes[Offset + i]);
+        Value |= Byte.shl(8 * i);
+      }
+      if (Ty->isIntegerTy()) {
+        return llvm::ConstantInt::get(Ty, Value);
+      }
+      return llvm::ConstantFP::get(Ty->getContext(),
+                                   llvm::APFloat(Ty->getFltSemantics(), Value));
+    }
+
+    llvm::SmallVector<llvm::Constant *, 16> Elements;
+    if (llvm::StructType *STy = llvm::dyn_cast<llvm::StructType>(Ty)) {
+      const llvm::StructLayout *SL = DL.getStructLayout(STy);
+      for (unsigned i = 0; i < STy->getNumElements(); i++) {
+        llvm::Constant *Element = getConstant(DL, STy->getElementType(i), Bytes,
+                                              Offset + SL->getElementOffset(i));
+        if (Element == nullptr) {
+          return nullptr;
+        }
+        Elements.push_back(Element);
+      }
+      return llvm::ConstantStruct::get(STy, Elements);
+    }
+
+    if (llvm::SequentialType *SeqTy = llvm::dyn_cast<llvm::SequentialType>(Ty)) {
+      llvm::Type *ElementTy = SeqTy->getElementType();
+      const uint64_t Stride = llvm::isa<llvm::VectorType>(Ty) ?
+          DL.getTypeStoreSize(ElementTy) : DL.getTypeAllocSize(ElementTy);
+      const uint64_t Count = llvm::isa<llvm::VectorType>(Ty) ?
+          Ty->getVectorNumElements() : Ty->getArrayNumElements();
+      for (uint64_t i = 0; i < Count; i++) {
+        llvm::Constant *Element = getConstant(DL, ElementTy, Bytes,
+                                              Offset + i * Stride);
+        if (Element == nullptr) {
+          return nullptr;
+        }
+        Elements.push_back(Element);
+      }
+      if (llvm::ArrayType *ATy = llvm::dyn_cast<llvm::ArrayType>(Ty)) {
+        return llvm::ConstantArray::get(ATy, Elements);
+      }
+      return llvm::ConstantVector::get(Elements);
+    }
+
+    return nullptr;
+  }
+
+  // Return true if V, an address within a specialized global, is only read.
+  static bool isOnlyRead(const llvm::Value *V) {
+    for (const llvm::User *U : V->users()) {
+      if (llvm::isa<llvm::LoadInst>(U)) {
+        continue;
+      }
+      if (llvm::isa<llvm::GEPOperator>(U) || llvm::isa<llvm::BitCastOperator>(U)) {
+        if (!isOnlyRead(U)) {
+          return false;
+        }
+        continue;
+      }
+      return false;
+    }
+    return true;
+  }
+
+public:
+  RSSpecializeGlobalsPass()
+      : ModulePass(ID) {
+    for (const std::string &Spec : ClSpecializedGlobals) {
+      const size_t Colon = Spec.find(':');
+      if (Colon == std::string::npos) {
+        continue;
+      }
+      std::vector<uint8_t> &Bytes = mValues[Spec.substr(0, Colon)];
+      for (size_t i = Colon + 1; i + 1 < Spec.size(); i += 2) {
+        Bytes.push_back(static_cast<uint8_t>(
+            std::stoul(Spec.substr(i, 2), nullptr, 16)));
+      }
+    }
+  }
+
+  explicit RSSpecializeGlobalsPass(
+      const std::map<std::string, std::vector<uint8_t>> &pValues)
+      : ModulePass(ID), mValues(pValues) {
+  }
+
+  bool runOnModule(llvm::Module &M) override {
+    const llvm::DataLayout &DL = M.getDataLayout();
+    bool Changed = false;
+
+    for (const auto &Entry : mValues) {
+      llvm::GlobalVariable *GV = M.getGlobalVariable(Entry.first);
+      if (GV == nullptr || GV->isDeclaration()) {
+        ALOGW("Cannot specialize unknown global %s", Entry.first.c_str());
+        continue;
+      }
+
+      llvm::Type *Ty = GV->getValueType();
+      if (Entry.second.size() != DL.getTypeAllocSize(Ty) &&
+          Entry.second.size() != DL.getTypeStoreSize(Ty)) {
+        ALOGW("Cannot specialize global %s: expected %u bytes, got %zu",
+              Entry.first.c_str(), (unsigned)DL.getTypeAllocSize(Ty),
+              Entry.second.size());
+        continue;
+      }
+
+      if (!isOnlyRead(GV)) {
+        ALOGW("Cannot specialize global %s: the script modifies it",
+              Entry.first.c_str());
+        continue;
+      }
+
+      llvm::Constant *Init = getConstant(DL, Ty, Entry.second, 0);
+      if (Init == nullptr) {
+        ALOGW("Cannot specialize global %s of this type", Entry.first.c_str());
+        continue;
+      }
+
+      llvm::GlobalVariable *Specialized = new llvm::GlobalVariable(
+          M, Ty, /* isConstant */ true, llvm::GlobalValue::InternalLinkage,
+          Init, GV->getName() + ".specialized");
+      Specialized->setAlignment(GV->getAlignment());
+      Specialized->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+      GV->replaceAllUsesWith(Specialized);
+      // Common globals must be zero-initialized.
+      if (GV->hasCommonLinkage()) {
+        GV->setLinkage(llvm::GlobalValue::ExternalLinkage);
+      }
+      GV->setInitializer(Init);
+      Changed = true;
+    }
+
+    return Changed;
+  }
+
+  virtual const char *getPassName() const override {
+    return "Specialize scripts on bound globals";
+  }
+};
+
+}
+
+char RSSpecializeGlobalsPass::ID = 0;
+
+static llvm::RegisterPass<RSSpecializeGlobalsPass> X("rs-specialize-globals",
+                                                     "Specialize RS Globals Pass");
+
+namespace bcc {
+
+llvm::ModulePass *
+createRSSpecializeGlobalsPass(
+    const std::map<std::string, std::vector<uint8_t>> &pValues) {
+  return new RSSpecializeGlobalsPass(pValues);
+}
+
+}
@@ -18,7 +18,8 @@
 
 #include "RSStubsWhiteList.h"
 
-std::vector<std::string> stubList = {
+// Sorted, so that it can be searched without building any index first.
+const char *const stubList[] = {
 "_Z10half_recipDv2_f",
 "_Z10half_recipDv3_f",
 "_Z10half_recipDv4_f",
@@ -2348,3 +2349,5 @@ std::vector<std::string> stubList = {
 "_Z9rsgFinishv",
 "rsUnpackColor8888",
 };
+
+const size_t stubListSize = sizeof(stubList) / sizeof(stubList[0]);
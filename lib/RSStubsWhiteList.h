@@ -17,10 +17,10 @@
 #ifndef RSStubsWhiteList_H
 #define RSStubsWhiteList_H
 
-#include <cstdlib>
-#include <vector>
-#include <string>
+#include <cstddef>
 
-extern std::vector<std::string> stubList;
+// Mangled names of the runtime functions scripts may call, in strcmp order.
+extern const char *const stubList[];
+extern const size_t stubListSize;
 
 #endif // RSStubsWhiteList_H
@@ -17,17 +17,48 @@
 #ifndef BCC_RS_TRANSFORMS_H
 #define BCC_RS_TRANSFORMS_H
 
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace llvm {
   class ModulePass;
   class FunctionPass;
 }
 
+namespace bcinfo {
+  class MetadataExtractor;
+}
+
 namespace bcc {
 
 extern const char BCC_INDEX_VAR_NAME[];
 
+// pVectorWidth is the number of elements the main loop of each expanded
+// forEach kernel processes per iteration (followed by a scalar remainder
+// loop). 0 picks a width from the target's vector registers; 1 disables this.
+// pEnableTiledExpand additionally generates a "<kernel>.expand.tiled" entry
+// point per kernel that processes a 2D tile of cells. pSpecializeSteps
+// versions the loops of old-style kernels on whether the allocations are
+// packed, so the common case gets constant steps. pReduceAccumulators is the
+// number of independent partial accumulators the loops of general reduction
+// accumulators keep before merging them with the combiner. pPrefetchDistance
+// is the distance in bytes at which the expanded loops prefetch their inputs
+// and output (0 disables this); scripts can override it per kernel with the
+// rs_prefetch_distance pragma. pForceInlineKernels marks kernels that are only
+// called from their expanded functions as always-inline. pMetadata, if given,
+// is the metadata already extracted from the module the pass runs on, and
+// must outlive the pass; otherwise the pass extracts it itself.
 llvm::ModulePass *
-createRSKernelExpandPass(bool pEnableStepOpt);
+createRSKernelExpandPass(bool pEnableStepOpt, unsigned pVectorWidth = 1,
+                         bool pEnableTiledExpand = false,
+                         bool pSpecializeSteps = true,
+                         unsigned pReduceAccumulators = 1,
+                         unsigned pPrefetchDistance = 0,
+                         bool pForceInlineKernels = false,
+                         const bcinfo::MetadataExtractor *pMetadata = nullptr);
 
 llvm::FunctionPass *
 createRSInvariantPass();
@@ -35,13 +66,42 @@ createRSInvariantPass();
 llvm::FunctionPass *
 createRSInvokeHelperPass();
 
-llvm::ModulePass * createRSEmbedInfoPass();
+// Checks the cells that allocation accessor calls in a loop access once per
+// loop, in its preheader, and accesses them directly when they are in
+// bounds. For builds against the debug runtime, whose accessors check every
+// access; runs after inlining.
+llvm::FunctionPass *
+createRSHoistBoundsChecksPass();
+
+// pMetadata is as for createRSKernelExpandPass(). pBinary also embeds the
+// information as an RSInfoBinaryHeader blob (see bcc/RSInfoBinary.h).
+llvm::ModulePass *
+createRSEmbedInfoPass(const bcinfo::MetadataExtractor *pMetadata = nullptr,
+                      bool pBinary = false);
+
+// Name of the hash table over the global names that RSGlobalInfoPass emits.
+extern const char kRsGlobalNameIndex[];
 
 llvm::ModulePass * createRSGlobalInfoPass(bool pSkipConstants);
 
+// Moves the globals each expanded kernel reads in its loops into a
+// cache-line-aligned block, most read first. Runs after LTO.
+llvm::ModulePass *createRSGlobalLayoutPass();
+
 llvm::ModulePass * createRSScreenFunctionsPass();
 
-llvm::ModulePass * createRSIsThreadablePass();
+// pMetadata is as for createRSKernelExpandPass().
+llvm::ModulePass *
+createRSIsThreadablePass(const bcinfo::MetadataExtractor *pMetadata = nullptr);
+
+// pVariants lists the target CPU and "+feature,..." string of each extra
+// version of the expanded kernels to emit, best first; pBaseFeatures are the
+// target features of the module, which the variants add to. pMetadata is as
+// for createRSKernelExpandPass().
+llvm::ModulePass *createRSKernelMultiVersionPass(
+    const std::vector<std::pair<std::string, std::string>> &pVariants,
+    const std::string &pBaseFeatures,
+    const bcinfo::MetadataExtractor *pMetadata = nullptr);
 
 llvm::ModulePass * createRSX86_64CallConvPass();
 
@@ -49,6 +109,11 @@ llvm::ModulePass * createRSAddDebugInfoPass();
 
 llvm::FunctionPass *createRSX86TranslateGEPPass();
 
+// pValues maps the names of exported globals to the bytes of the value the
+// script is specialized on.
+llvm::ModulePass *createRSSpecializeGlobalsPass(
+    const std::map<std::string, std::vector<uint8_t>> &pValues);
+
 } // end namespace bcc
 
 #endif // BCC_RS_TRANSFORMS_H
@@ -113,4 +113,17 @@ static inline std::string nameReduceCombinerFromAccumulator(llvm::StringRef accu
   return std::string(accumName) + ".combiner";
 }
 
+// For a general reduction kernel with a small accumulator, we also
+// generate a function merging many partial accumulators at once with
+// the combiner function (see RSKernelExpandPass). Given the combiner
+// function name, what should be the name of that function?
+static inline std::string nameReduceMultiCombiner(llvm::StringRef combinerName) {
+  return std::string(combinerName) + ".multi";
+}
+
+// A kernel with several outputs, as created by fan-out kernel fusion, has
+// this function attribute and returns a literal struct of its outputs. The
+// expanded kernel stores output i through outPtr[i] of the driver info.
+const char kMultipleOutputsAttr[] = "rs-multiple-outputs";
+
 #endif // BCC_RS_UTILS_H
@@ -21,6 +21,10 @@
 
 #include <cstdlib>
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
@@ -29,17 +33,34 @@
 
 namespace { // anonymous namespace
 
-/* This pass translates GEPs that index into structs or arrays of structs to
- * GEPs with an int8* operand and a byte offset.  This translation is done to
- * enforce on x86 the ARM alignment rule that 64-bit scalars be 8-byte aligned
- * for structs with such scalars.
+/* This pass translates GEPs that index into structs or arrays of structs so
+ * that they follow the ARM alignment rule that 64-bit scalars be 8-byte
+ * aligned for structs with such scalars, which x86 does not enforce.
+ *
+ * Where possible, a GEP is rewritten into a GEP over an explicitly padded
+ * counterpart of its source element type: a packed struct with [N x i8]
+ * fields standing for the padding that the ARM-like X86_CUSTOM_DL_STRING
+ * layout would insert.  This keeps the indexing typed, so alias analysis and
+ * the loop vectorizer still see the access pattern.  Other GEPs (on vectors
+ * of pointers, or on types that cannot be padded this way) are rewritten into
+ * a GEP with an int8* operand and a byte offset instead.
  */
 class RSX86TranslateGEPPass : public llvm::FunctionPass {
 private:
-  static char ID;
   llvm::LLVMContext *Context;
   const llvm::DataLayout DL;
 
+  // Data layout of the module, which is the x86 default.
+  const llvm::DataLayout *ModuleDL;
+
+  // Padded counterparts of types, or nullptr for types that cannot be
+  // padded.
+  llvm::DenseMap<llvm::Type *, llvm::Type *> PaddedTypes;
+
+  // For each struct type, the index of each of its fields in its padded
+  // counterpart.
+  llvm::DenseMap<llvm::StructType *, llvm::SmallVector<unsigned, 8>> PaddedFieldIndices;
+
   // Walk a GEP instruction and return true if any type indexed is a struct.
   bool GEPIndexesStructType(const llvm::GetElementPtrInst *GEP) {
     for (llvm::gep_type_iterator GTI = gep_type_begin(GEP),
@@ -100,7 +121,122 @@ private:
     return Offset;
   }
 
+  // Return a type whose layout under the module's data layout matches the
+  // layout of Ty under X86_CUSTOM_DL_STRING, or nullptr if there is none.
+  llvm::Type *getPaddedType(llvm::Type *Ty) {
+    auto Cached = PaddedTypes.find(Ty);
+    if (Cached != PaddedTypes.end())
+      return Cached->second;
+
+    llvm::Type *Padded = nullptr;
+    if (llvm::StructType *STy = llvm::dyn_cast<llvm::StructType>(Ty)) {
+      Padded = createPaddedStructType(STy);
+    } else if (llvm::ArrayType *ATy = llvm::dyn_cast<llvm::ArrayType>(Ty)) {
+      if (llvm::Type *PaddedElement = getPaddedType(ATy->getElementType()))
+        Padded = llvm::ArrayType::get(PaddedElement, ATy->getNumElements());
+    } else if (Ty->isSized() &&
+               ModuleDL->getTypeAllocSize(Ty) == DL.getTypeAllocSize(Ty)) {
+      Padded = Ty;
+    }
+
+    PaddedTypes[Ty] = Padded;
+    return Padded;
+  }
+
+  llvm::Type *createPaddedStructType(llvm::StructType *STy) {
+    if (STy->isOpaque())
+      return nullptr;
+
+    const llvm::StructLayout *SL = DL.getStructLayout(STy);
+    llvm::Type *Int8Ty = llvm::Type::getInt8Ty(*Context);
+    llvm::SmallVector<llvm::Type *, 8> Elements;
+    llvm::SmallVector<unsigned, 8> FieldIndices;
+    uint64_t Offset = 0;
+
+    auto addPadding = [&](uint64_t To) {
+      if (To > Offset) {
+        Elements.push_back(llvm::ArrayType::get(Int8Ty, To - Offset));
+        Offset = To;
+      }
+    };
+
+    for (unsigned I = 0, E = STy->getNumElements(); I != E; ++I) {
+      llvm::Type *Element = STy->getElementType(I);
+      llvm::Type *PaddedElement = getPaddedType(Element);
+      if (!PaddedElement)
+        return nullptr;
+
+      addPadding(SL->getElementOffset(I));
+      FieldIndices.push_back(Elements.size());
+      Elements.push_back(PaddedElement);
+      Offset += ModuleDL->getTypeAllocSize(PaddedElement);
+      if (Offset != SL->getElementOffset(I) + DL.getTypeAllocSize(Element))
+        return nullptr;
+    }
+    addPadding(SL->getSizeInBytes());
+
+    PaddedFieldIndices[STy] = FieldIndices;
+    if (STy->hasName())
+      return llvm::StructType::create(*Context, Elements,
+                                      (STy->getName() + ".padded").str(),
+                                      true /* isPacked */);
+    return llvm::StructType::get(*Context, Elements, true /* isPacked */);
+  }
+
+  // Rewrite GEP into a GEP over the padded counterpart of its source element
+  // type.  Return false if there is no such counterpart.
+  bool translateGEPToPaddedType(llvm::GetElementPtrInst *GEP) {
+    if (GEP->getType()->isVectorTy())
+      return false;
+
+    llvm::Type *PaddedTy = getPaddedType(GEP->getSourceElementType());
+    if (!PaddedTy)
+      return false;
+
+    llvm::SmallVector<llvm::Value *, 8> Indices;
+    for (llvm::gep_type_iterator GTI = gep_type_begin(GEP),
+                                 GTE = gep_type_end(GEP);
+         GTI != GTE; ++GTI) {
+      llvm::StructType *STy = llvm::dyn_cast<llvm::StructType>(*GTI);
+      if (!STy) {
+        Indices.push_back(GTI.getOperand());
+        continue;
+      }
+
+      llvm::ConstantInt *OpC = llvm::dyn_cast<llvm::ConstantInt>(GTI.getOperand());
+      if (!OpC) {
+        ALOGE("Operand for struct type is not constant!");
+        bccAssert(false);
+      }
+      unsigned FieldIndex = PaddedFieldIndices[STy][OpC->getZExtValue()];
+      Indices.push_back(llvm::ConstantInt::get(llvm::Type::getInt32Ty(*Context),
+                                               FieldIndex));
+    }
+
+    llvm::CastInst *PaddedPtr = llvm::CastInst::CreatePointerCast(
+        GEP->getPointerOperand(),
+        PaddedTy->getPointerTo(GEP->getPointerAddressSpace()),
+        "to.padded", GEP);
+
+    llvm::GetElementPtrInst *PaddedGEP = llvm::GetElementPtrInst::Create(
+        PaddedTy, PaddedPtr, Indices, "padded.indexed", GEP);
+    PaddedGEP->setIsInBounds(GEP->isInBounds());
+
+    // The indexed type is itself padded if it is an aggregate.
+    llvm::Value *Result = PaddedGEP;
+    if (PaddedGEP->getType() != GEP->getType()) {
+      Result = llvm::CastInst::CreatePointerCast(
+          PaddedGEP, GEP->getType(), "to.orig.geptype", GEP);
+    }
+
+    GEP->replaceAllUsesWith(Result);
+    return true;
+  }
+
   void translateGEP(llvm::GetElementPtrInst *GEP) {
+    if (translateGEPToPaddedType(GEP))
+      return;
+
     // cast GEP pointer operand to int8*
     llvm::CastInst *Int8Ptr = llvm::CastInst::CreatePointerCast(
                                   GEP->getPointerOperand(),
@@ -123,8 +259,10 @@ private:
   }
 
 public:
+  static char ID;
+
   RSX86TranslateGEPPass()
-    : FunctionPass (ID), DL(X86_CUSTOM_DL_STRING) {
+    : FunctionPass (ID), DL(X86_CUSTOM_DL_STRING), ModuleDL(nullptr) {
   }
 
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
@@ -136,6 +274,7 @@ public:
   virtual bool runOnFunction(llvm::Function &F) override {
     bool changed = false;
     Context = &F.getParent()->getContext();
+    ModuleDL = &F.getParent()->getDataLayout();
 
     // To avoid updating/deleting instructions while walking a BasicBlock's instructions,
     // collect the GEPs that need to be translated and process them
@@ -170,6 +309,8 @@ public:
 }
 
 char RSX86TranslateGEPPass::ID = 0;
+static llvm::RegisterPass<RSX86TranslateGEPPass>
+    X("rs-x86-translate-gep", "Translate GEPs on structs for x86");
 
 namespace bcc {
 
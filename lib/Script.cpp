@@ -19,20 +19,39 @@
 #include "Assert.h"
 #include "Log.h"
 
+#include "bcc/BCCContext.h"
 #include "bcc/CompilerConfig.h"
+#include "bcc/RuntimeSnapshot.h"
 #include "bcc/Source.h"
 
 #include "bcinfo/MetadataExtractor.h"
 
+#include <llvm/ADT/Triple.h>
 #include <llvm/IR/Module.h>
 
+#include <sys/stat.h>
+
 using namespace bcc;
 
 Script::Script(Source *pSource)
     : mSource(pSource),
       mOptimizationLevel(llvm::CodeGenOpt::Aggressive),
       mLinkRuntimeCallback(nullptr), mEmbedInfo(false), mEmbedGlobalInfo(false),
-      mEmbedGlobalInfoSkipConstant(false) {}
+      mEmbedGlobalInfoSkipConstant(false), mEmbedBinaryInfo(false),
+      mOptimizedDebug(false), mDebugContext(false), mRuntimeImportLimit(0) {}
+
+namespace {
+
+// Whether pSnapshot exists and is at least as recent as pLibrary, i.e. was
+// presumably made from it.
+bool isUpToDateSnapshot(const std::string &pSnapshot, const char *pLibrary) {
+  struct stat snapshot_stat, library_stat;
+  return ::stat(pSnapshot.c_str(), &snapshot_stat) == 0 &&
+         ::stat(pLibrary, &library_stat) == 0 &&
+         snapshot_stat.st_mtime >= library_stat.st_mtime;
+}
+
+} // end anonymous namespace
 
 bool Script::LinkRuntime(const char *core_lib) {
   bccAssert(core_lib != nullptr);
@@ -40,7 +59,32 @@ bool Script::LinkRuntime(const char *core_lib) {
   // Using the same context with the source.
   BCCContext &context = mSource->getContext();
 
-  Source *libclcore_source = Source::CreateFromFile(context, core_lib);
+  // The context keeps the library around, so this is a copy rather than a
+  // fresh read of the bitcode file. Unless the callback below gets to see it,
+  // it is loaded lazily: the script only needs few of its functions.
+  //
+  // A runtime snapshot of the library (see bcc/RuntimeSnapshot.h) is
+  // preferred, as long as it was made for the script's architecture.
+  const bool lazy = mLinkRuntimeCallback == nullptr;
+  Source *libclcore_source = nullptr;
+  const std::string snapshot = std::string(core_lib) + kRuntimeSnapshotSuffix;
+  if (isUpToDateSnapshot(snapshot, core_lib)) {
+    libclcore_source = context.loadRuntimeLibrary(snapshot, lazy,
+                                                  mRuntimeImportLimit);
+    const llvm::Triple script_triple(mSource->getModule().getTargetTriple());
+    if (libclcore_source != nullptr &&
+        llvm::Triple(libclcore_source->getModule().getTargetTriple())
+                .getArch() != script_triple.getArch()) {
+      ALOGW("Ignoring runtime snapshot '%s' made for %s", snapshot.c_str(),
+            libclcore_source->getModule().getTargetTriple().c_str());
+      delete libclcore_source;
+      libclcore_source = nullptr;
+    }
+  }
+  if (libclcore_source == nullptr) {
+    libclcore_source = context.loadRuntimeLibrary(core_lib, lazy,
+                                                  mRuntimeImportLimit);
+  }
   if (libclcore_source == nullptr) {
     ALOGE("Failed to load Renderscript library '%s' to link!", core_lib);
     return false;
@@ -78,7 +122,23 @@ bool Script::LinkRuntime(const char *core_lib) {
       libclcore_module.getNamedMetadata(bcinfo::MetadataExtractor::kWrapperMetadataName);
   bccAssert(wrapperMDNode != nullptr);
   libclcore_module.eraseNamedMetadata(wrapperMDNode);
-  if (!mSource->merge(*libclcore_source)) {
+
+  // Tell the script's own functions apart from the runtime's once they are
+  // in the same module.
+  mScriptFunctions.clear();
+  for (const llvm::Function &F : mSource->getModule()) {
+    if (!F.isDeclaration()) {
+      mScriptFunctions.insert(F.getName());
+    }
+  }
+
+  // Only link in what the script refers to: internalize and global DCE would
+  // throw the rest away anyway, but only after every pass before them ran
+  // over it. The runtime functions that passes add calls to later on (e.g.
+  // rsSetObject() for RSInvokeHelperPass) are all stubs of RSStubsWhiteList,
+  // which the driver resolves when loading the script if they are not linked
+  // in here.
+  if (!mSource->merge(*libclcore_source, /* pOnlyNeeded */true)) {
     ALOGE("Failed to link Renderscript library '%s'!", core_lib);
     delete libclcore_source;
     return false;
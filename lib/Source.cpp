@@ -20,6 +20,9 @@
 #include "bcc/BCCContext.h"
 
 #include <new>
+#include <string>
+#include <unordered_set>
+#include <vector>
 
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringExtras.h>
@@ -32,6 +35,7 @@
 #include "llvm/Support/raw_ostream.h"
 
 #include "Assert.h"
+#include "bcinfo/BitcodeTranslator.h"
 #include "bcinfo/BitcodeWrapper.h"
 #include "bcinfo/MetadataExtractor.h"
 
@@ -84,11 +88,19 @@ static void helper_set_module_metadata_from_bitcode_wrapper(llvm::Module &module
 namespace bcc {
 
 unsigned Source::getCompilerVersion() const {
+  if (mMetadata != nullptr) {
+    return mMetadata->getCompilerVersion();
+  }
   return bcinfo::MetadataExtractor(&getModule()).getCompilerVersion();
 }
 
 void Source::getWrapperInformation(unsigned *compilerVersion,
                                    unsigned *optimizationLevel) const {
+  if (mMetadata != nullptr) {
+    *compilerVersion = mMetadata->getCompilerVersion();
+    *optimizationLevel = mMetadata->getOptimizationLevel();
+    return;
+  }
   const bcinfo::MetadataExtractor &me = bcinfo::MetadataExtractor(&getModule());
   *compilerVersion = me.getCompilerVersion();
   *optimizationLevel = me.getOptimizationLevel();
@@ -99,12 +111,44 @@ void Source::setModule(llvm::Module *pModule) {
   mModule = pModule;
 }
 
+// Legacy bitcode (targeting API 11 to 15) can't be read by the bitcode reader.
+// Have libbcinfo upgrade it straight into pContext, rather than into modern
+// bitcode that would then have to be parsed again.
+static Source *helper_create_from_legacy_bitcode(BCCContext &pContext,
+                                                 const char *pName,
+                                                 const char *pBitcode,
+                                                 size_t pBitcodeSize,
+                                                 const bcinfo::BitcodeWrapper &pWrapper) {
+  bcinfo::BitcodeTranslator translator(pBitcode, pBitcodeSize,
+                                       pWrapper.getTargetAPI());
+  pContext.mImpl->mRetainedBitcodeSize += pBitcodeSize;
+  std::unique_ptr<llvm::Module> module =
+      translator.translateToModule(*pContext.mImpl->mLLVMContext);
+  if (module == nullptr) {
+    ALOGE("Unable to translate the legacy bitcode `%s'!", pName);
+    return nullptr;
+  }
+  module->setModuleIdentifier(pName);
+
+  Source *result = Source::CreateFromModule(pContext, pName, *module,
+                                            pWrapper.getCompilerVersion(),
+                                            pWrapper.getOptimizationLevel(),
+                                            /* pNoDelete */false);
+  if (result != nullptr) {
+    module.release();
+  }
+  return result;
+}
+
 Source *Source::CreateFromBuffer(BCCContext &pContext,
                                  const char *pName,
                                  const char *pBitcode,
-                                 size_t pBitcodeSize) {
+                                 size_t pBitcodeSize,
+                                 bool pLazy) {
   llvm::StringRef input_data(pBitcode, pBitcodeSize);
-  std::unique_ptr<llvm::MemoryBuffer> input_memory =
+  // A lazily loaded module keeps reading its bitcode after this returns.
+  std::unique_ptr<llvm::MemoryBuffer> input_memory = pLazy ?
+      llvm::MemoryBuffer::getMemBufferCopy(input_data, "") :
       llvm::MemoryBuffer::getMemBuffer(input_data, "", false);
 
   if (input_memory == nullptr) {
@@ -112,48 +156,75 @@ Source *Source::CreateFromBuffer(BCCContext &pContext,
     return nullptr;
   }
 
-  auto managedModule = helper_load_bitcode(pContext.mImpl->mLLVMContext,
-                                           std::move(input_memory));
+  return CreateFromMemoryBuffer(pContext, pName, std::move(input_memory), pLazy);
+}
 
-  // Release the managed llvm::Module* since this object gets deleted either in
-  // the error check below or in ~Source() (since pNoDelete is false).
-  llvm::Module *module = managedModule.release();
-  if (module == nullptr) {
+Source *Source::CreateFromFile(BCCContext &pContext, const std::string &pPath,
+                               bool pLazy) {
+  // The bitcode reader doesn't need a null terminator, and requiring one may
+  // keep the file from being mapped.
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+      llvm::MemoryBuffer::getFile(pPath, /* FileSize */-1,
+                                  /* RequiresNullTerminator */false);
+  if (mb_or_error.getError()) {
+    ALOGE("Failed to load bitcode from path %s! (%s)", pPath.c_str(),
+          mb_or_error.getError().message().c_str());
     return nullptr;
   }
 
-  uint32_t compilerVersion, optimizationLevel;
-  helper_get_module_metadata_from_bitcode_wrapper(&compilerVersion, &optimizationLevel,
-                                                  bcinfo::BitcodeWrapper(pBitcode, pBitcodeSize));
-  Source *result = CreateFromModule(pContext, pName, *module,
-                                    compilerVersion, optimizationLevel,
-                                    /* pNoDelete */false);
-  if (result == nullptr) {
-    delete module;
-  }
-
-  return result;
+  return CreateFromMemoryBuffer(pContext, pPath.c_str(),
+                                std::move(mb_or_error.get()), pLazy);
 }
 
-Source *Source::CreateFromFile(BCCContext &pContext, const std::string &pPath) {
-
+Source *Source::CreateFromFd(BCCContext &pContext, const char *pName, int pFd,
+                             size_t pSize, off_t pOffset, bool pLazy) {
   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
-      llvm::MemoryBuffer::getFile(pPath);
+      llvm::MemoryBuffer::getOpenFileSlice(pFd, pName, pSize, pOffset);
   if (mb_or_error.getError()) {
-    ALOGE("Failed to load bitcode from path %s! (%s)", pPath.c_str(),
-          mb_or_error.getError().message().c_str());
+    ALOGE("Failed to load bitcode `%s' from file descriptor %d! (%s)", pName,
+          pFd, mb_or_error.getError().message().c_str());
     return nullptr;
   }
-  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
+
+  return CreateFromMemoryBuffer(pContext, pName, std::move(mb_or_error.get()),
+                                pLazy);
+}
+
+Source *Source::CreateFromMemoryBuffer(BCCContext &pContext, const char *pName,
+                                       std::unique_ptr<llvm::MemoryBuffer> pInput,
+                                       bool pLazy) {
+  const bcinfo::BitcodeWrapper wrapper(pInput->getBufferStart(),
+                                       pInput->getBufferSize());
+  if (wrapper.getBCFileType() == bcinfo::BC_WRAPPER && wrapper.isCompressed()) {
+    // Continue with the uncompressed bitcode, in a plain wrapper.
+    std::vector<char> uncompressed;
+    if (!bcinfo::decompressBitcode(pInput->getBufferStart(),
+                                   pInput->getBufferSize(), &uncompressed)) {
+      ALOGE("Unable to decompress the bitcode of `%s'!", pName);
+      return nullptr;
+    }
+    return CreateFromMemoryBuffer(
+        pContext, pName,
+        llvm::MemoryBuffer::getMemBufferCopy(
+            llvm::StringRef(uncompressed.data(), uncompressed.size()), pName),
+        pLazy);
+  }
+
+  if (wrapper.getBCFileType() == bcinfo::BC_WRAPPER &&
+      bcinfo::BitcodeTranslator::needsTranslation(wrapper.getTargetAPI())) {
+    return helper_create_from_legacy_bitcode(pContext, pName,
+                                             pInput->getBufferStart(),
+                                             pInput->getBufferSize(),
+                                             wrapper);
+  }
 
   uint32_t compilerVersion, optimizationLevel;
   helper_get_module_metadata_from_bitcode_wrapper(&compilerVersion, &optimizationLevel,
-                                                  bcinfo::BitcodeWrapper(input_data->getBufferStart(),
-                                                                         input_data->getBufferSize()));
+                                                  wrapper);
 
-  std::unique_ptr<llvm::MemoryBuffer> input_memory(input_data.release());
-  auto managedModule = helper_load_bitcode(pContext.mImpl->mLLVMContext,
-                                           std::move(input_memory));
+  pContext.mImpl->mRetainedBitcodeSize += pInput->getBufferSize();
+  auto managedModule = helper_load_bitcode(*pContext.mImpl->mLLVMContext,
+                                           std::move(pInput));
 
   // Release the managed llvm::Module* since this object gets deleted either in
   // the error check below or in ~Source() (since pNoDelete is false).
@@ -162,9 +233,12 @@ Source *Source::CreateFromFile(BCCContext &pContext, const std::string &pPath) {
     return nullptr;
   }
 
-  Source *result = CreateFromModule(pContext, pPath.c_str(), *module,
-                                    compilerVersion, optimizationLevel,
-                                    /* pNoDelete */false);
+  Source *result = pLazy ?
+      CreateFromLazyModule(pContext, pName, *module,
+                           compilerVersion, optimizationLevel) :
+      CreateFromModule(pContext, pName, *module,
+                       compilerVersion, optimizationLevel,
+                       /* pNoDelete */false);
   if (result == nullptr) {
     delete module;
   }
@@ -194,29 +268,136 @@ Source *Source::CreateFromModule(BCCContext &pContext, const char* name, llvm::M
   return result;
 }
 
+Source *Source::CreateFromLazyModule(BCCContext &pContext, const char *name,
+                                     llvm::Module &pModule,
+                                     const uint32_t compilerVersion,
+                                     const uint32_t optimizationLevel) {
+  // Function bodies are verified once they get materialized by merge(), but
+  // the wrapper metadata can only be added once the module's own is loaded.
+  if (std::error_code ec = pModule.materializeMetadata()) {
+    ALOGE("Unable to load the metadata of `%s'! (%s)",
+          pModule.getModuleIdentifier().c_str(), ec.message().c_str());
+    return nullptr;
+  }
+
+  Source *result = new (std::nothrow) Source(name, pContext, pModule,
+                                             /* pNoDelete */false);
+  if (result == nullptr) {
+    ALOGE("Out of memory during Source object allocation for `%s'!",
+          pModule.getModuleIdentifier().c_str());
+    return nullptr;
+  }
+  result->mIsLazy = true;
+  helper_set_module_metadata_from_bitcode_wrapper(pModule, compilerVersion, optimizationLevel);
+  return result;
+}
+
 Source::Source(const char* name, BCCContext &pContext, llvm::Module &pModule,
                bool pNoDelete)
     : mName(name), mContext(pContext), mModule(&pModule), mMetadata(nullptr),
-      mNoDelete(pNoDelete), mIsModuleDestroyed(false) {
+      mNoDelete(pNoDelete), mIsModuleDestroyed(false), mIsLazy(false),
+      mIsPreverified(false) {
     pContext.addSource(*this);
 }
 
 Source::~Source() {
-  mContext.removeSource(*this);
   if (!mNoDelete && !mIsModuleDestroyed)
     delete mModule;
   delete mMetadata;
+  // Last, as this may recycle the LLVMContext of mModule.
+  mContext.removeSource(*this);
+}
+
+bool Source::materializeNeededBy(const llvm::Module &pUser) {
+  // A function is needed if pUser declares it, or if anything already loaded
+  // (a global initializer or a materialized function) uses it. Materializing
+  // a function adds uses to the functions it refers to, so repeat until no
+  // needed function is left unmaterialized.
+  std::unordered_set<std::string> declared;
+  for (const llvm::Function &F : pUser) {
+    if (F.isDeclaration()) {
+      declared.insert(F.getName());
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (llvm::Function &F : *mModule) {
+      if (!F.isMaterializable() ||
+          (F.use_empty() && declared.count(F.getName()) == 0)) {
+        continue;
+      }
+      if (std::error_code ec = F.materialize()) {
+        ALOGE("Unable to materialize function `%s' of `%s'! (%s)",
+              F.getName().str().c_str(), getIdentifier().c_str(),
+              ec.message().c_str());
+        return false;
+      }
+      changed = true;
+    }
+  }
+
+  // What is left is of no use to pUser. As declarations, linking neither
+  // reads nor copies them.
+  for (llvm::Function &F : *mModule) {
+    if (F.isMaterializable()) {
+      F.deleteBody();
+    }
+  }
+
+  if (std::error_code ec = mModule->materializeAll()) {
+    ALOGE("Unable to materialize `%s'! (%s)", getIdentifier().c_str(),
+          ec.message().c_str());
+    return false;
+  }
+  mIsLazy = false;
+  if (mIsPreverified) {
+    return true;
+  }
+
+  std::string ErrorInfo;
+  llvm::raw_string_ostream ErrorStream(ErrorInfo);
+  if (llvm::verifyModule(*mModule, &ErrorStream)) {
+    ALOGE("Bitcode of RenderScript module does not pass verification: `%s'!",
+          ErrorStream.str().c_str());
+    return false;
+  }
+  return true;
 }
 
-bool Source::merge(Source &pSource) {
+bool Source::merge(Source &pSource, bool pOnlyNeeded) {
+  if (pSource.mIsLazy && !pSource.materializeNeededBy(*mModule)) {
+    ALOGE("Failed to load source `%s' to link with `%s'!",
+          pSource.getIdentifier().c_str(), getIdentifier().c_str());
+    return false;
+  }
+
+  // Linking appends the named metadata of pSource to that of mModule. Only
+  // the RenderScript ("#rs_*") nodes and llvm.dbg.cu matter to the cached
+  // metadata.
+  bool changesMetadata = false;
+  for (const llvm::NamedMDNode &node : pSource.getModule().named_metadata()) {
+    if (node.getName().startswith("#") || node.getName() == "llvm.dbg.cu") {
+      changesMetadata = true;
+      break;
+    }
+  }
+
   // TODO(srhines): Add back logging of actual diagnostics from linking.
-  if (llvm::Linker::linkModules(*mModule, std::unique_ptr<llvm::Module>(&pSource.getModule())) != 0) {
+  const unsigned flags = pOnlyNeeded ? llvm::Linker::Flags::LinkOnlyNeeded
+                                     : llvm::Linker::Flags::None;
+  if (llvm::Linker::linkModules(*mModule, std::unique_ptr<llvm::Module>(&pSource.getModule()),
+                                flags) != 0) {
     ALOGE("Failed to link source `%s' with `%s'!",
           getIdentifier().c_str(), pSource.getIdentifier().c_str());
     return false;
   }
   // pSource.getModule() is destroyed after linking.
   pSource.markModuleDestroyed();
+  if (changesMetadata) {
+    invalidateMetadata();
+  }
 
   return true;
 }
@@ -225,12 +406,13 @@ const std::string &Source::getIdentifier() const {
   return mModule->getModuleIdentifier();
 }
 
-void Source::addBuildChecksumMetadata(const char *buildChecksum) const {
-    llvm::LLVMContext &context = mContext.mImpl->mLLVMContext;
+void Source::addBuildChecksumMetadata(const char *buildChecksum) {
+    llvm::LLVMContext &context = *mContext.mImpl->mLLVMContext;
     llvm::MDString *val = llvm::MDString::get(context, buildChecksum);
     llvm::NamedMDNode *node =
         mModule->getOrInsertNamedMetadata("#rs_build_checksum");
     node->addOperand(llvm::MDNode::get(context, val));
+    invalidateMetadata();
 }
 
 bool Source::getDebugInfoEnabled() const {
@@ -238,8 +420,20 @@ bool Source::getDebugInfoEnabled() const {
 }
 
 bool Source::extractMetadata() {
+  if (mMetadata != nullptr) {
+    return true;
+  }
   mMetadata = new bcinfo::MetadataExtractor(mModule);
-  return mMetadata->extract();
+  if (!mMetadata->extract()) {
+    invalidateMetadata();
+    return false;
+  }
+  return true;
+}
+
+void Source::invalidateMetadata() {
+  delete mMetadata;
+  mMetadata = nullptr;
 }
 
 } // namespace bcc
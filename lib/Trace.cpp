@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Trace.h"
+
+#include <atomic>
+
+#ifdef __ANDROID__
+#define ATRACE_TAG ATRACE_TAG_RS
+#include <cutils/trace.h>
+#endif
+
+namespace {
+
+std::atomic<bcc::TraceBeginCallback> gTraceBegin(nullptr);
+std::atomic<bcc::TraceEndCallback> gTraceEnd(nullptr);
+
+} // end anonymous namespace
+
+namespace bcc {
+
+void setTraceCallbacks(TraceBeginCallback pBegin, TraceEndCallback pEnd) {
+  gTraceBegin.store(pBegin);
+  gTraceEnd.store(pEnd);
+}
+
+bool isTraceEnabled() {
+#ifdef __ANDROID__
+  if (atrace_is_tag_enabled(ATRACE_TAG)) {
+    return true;
+  }
+#endif
+  return gTraceBegin.load() != nullptr;
+}
+
+void beginTraceSection(const char *pName) {
+#ifdef __ANDROID__
+  atrace_begin(ATRACE_TAG, pName);
+#endif
+  if (TraceBeginCallback begin = gTraceBegin.load()) {
+    begin(pName);
+  }
+}
+
+void endTraceSection() {
+#ifdef __ANDROID__
+  atrace_end(ATRACE_TAG);
+#endif
+  if (TraceEndCallback end = gTraceEnd.load()) {
+    end();
+  }
+}
+
+} // end namespace bcc
@@ -0,0 +1,35 @@
+; This checks that RSEmbedInfo can also embed the RS info as a binary blob,
+; starting with a versioned header and ending with the interned string pool.
+
+; RUN: opt -load libbcc.so -rs-embed-info -rs-embed-binary-info -S < %s | FileCheck %s
+
+; ModuleID = 'embed-binary-info.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; CHECK: @.rs.info = constant
+; CHECK: @.rs.info.bin = constant [{{[0-9]+}} x i8] c"RSIB\01\00\00\00h\00\00\00{{.*}}x\00root\00version\001\00java_package_name\00foo\00", align 8
+
+@x = common global i32 0, align 4
+
+define i32 @root(i32 %in) {
+  ret i32 %in
+}
+
+!\23pragma = !{!0, !1}
+!\23rs_export_var = !{!2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!5}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"x", !"5"}
+!3 = !{!"root"}
+!4 = !{!"35"}
+!5 = !{!"0", !"3"}
@@ -0,0 +1,51 @@
+; This checks that RSEmbedInfo appends a static per-element cost estimate of
+; each kernel, taken from the loop of its expanded function, to the RS info.
+
+; RUN: opt -load libbcc.so -rs-embed-info -S < %s | FileCheck %s
+
+; ModuleID = 'embed-kernel-costs.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; CHECK: @.rs.info = constant {{.*}}nonThreadableKernelCount: 0\0AkernelCostCount: 1\0Aroot - 9 - 2 - 2\0AtreeCombinableReduceCount: 0\0A\00"
+
+declare i32 @helper(i32)
+
+define i32 @root(i32 %in) {
+  ret i32 %in
+}
+
+define void @root.expand(i32* %in, i32* %out, i32 %x1, i32 %x2) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ %x1, %entry ], [ %next, %loop ]
+  %in.ptr = getelementptr inbounds i32, i32* %in, i32 %i
+  %value = load i32, i32* %in.ptr
+  %result = call i32 @helper(i32 %value)
+  %out.ptr = getelementptr inbounds i32, i32* %out, i32 %i
+  store i32 %result, i32* %out.ptr
+  %next = add i32 %i, 1
+  %more = icmp ult i32 %next, %x2
+  br i1 %more, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"root"}
+!3 = !{!"35"}
+!4 = !{!"0", !"3"}
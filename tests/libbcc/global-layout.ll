@@ -0,0 +1,87 @@
+; This checks that RSGlobalLayout moves the globals each expanded kernel
+; reads in its loop into a cache-line-aligned block, the hottest kernel and
+; the most read globals first, and keeps the symbols of exported globals.
+
+; RUN: opt -load libbcc.so -rs-global-layout -S < %s | FileCheck %s
+
+; ModuleID = 'global-layout.bc'
+target datalayout = "e-m:e-p:32:32-i64:64-v128:64:128-a:0:32-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; CHECK-DAG: @gInit = internal global i32 7, align 4
+; CHECK-DAG: @gTable = internal constant [4 x i32] [i32 1, i32 2, i32 3, i32 4], align 4
+; CHECK-DAG: @root.expand.globals = internal global { i32, float } { i32 3, float 2.000000e+00 }, align 64
+; CHECK-DAG: @other.expand.globals = internal global { float, i32 } { float 5.000000e-01, i32 5 }, align 64
+; CHECK-DAG: @gScale = alias float, getelementptr inbounds ({ i32, float }, { i32, float }* @root.expand.globals, i32 0, i32 1)
+; CHECK-NOT: @gOffset =
+; CHECK-NOT: @gCount =
+; CHECK-NOT: @gBias =
+
+@gScale = global float 2.000000e+00, align 4
+@gOffset = internal global i32 3, align 4
+@gCount = internal global i32 5, align 4
+@gBias = internal global float 5.000000e-01, align 4
+@gInit = internal global i32 7, align 4
+@gTable = internal constant [4 x i32] [i32 1, i32 2, i32 3, i32 4], align 4
+
+; CHECK-LABEL: define void @root.expand(i32* %out, i32 %x1, i32 %x2)
+; CHECK: load i32, i32* @gInit
+; CHECK: loop:
+; CHECK: load i32, i32* getelementptr inbounds ({ i32, float }, { i32, float }* @root.expand.globals, i32 0, i32 0)
+; CHECK: load float, float* getelementptr inbounds ({ i32, float }, { i32, float }* @root.expand.globals, i32 0, i32 1)
+define void @root.expand(i32* %out, i32 %x1, i32 %x2) {
+entry:
+  %init = load i32, i32* @gInit, align 4
+  br label %loop
+
+loop:
+  %x = phi i32 [ %x1, %entry ], [ %x.next, %loop ]
+  %offset1 = load i32, i32* @gOffset, align 4
+  %scale = load float, float* @gScale, align 4
+  %offset2 = load i32, i32* @gOffset, align 4
+  %offset3 = load i32, i32* @gOffset, align 4
+  %index = and i32 %x, 3
+  %entry.ptr = getelementptr inbounds [4 x i32], [4 x i32]* @gTable, i32 0, i32 %index
+  %table = load i32, i32* %entry.ptr, align 4
+  %xf = sitofp i32 %x to float
+  %scaled = fmul float %xf, %scale
+  %xi = fptosi float %scaled to i32
+  %sum1 = add i32 %xi, %offset1
+  %sum2 = add i32 %sum1, %offset2
+  %sum3 = add i32 %sum2, %offset3
+  %sum4 = add i32 %sum3, %table
+  %sum5 = add i32 %sum4, %init
+  %out.ptr = getelementptr inbounds i32, i32* %out, i32 %x
+  store i32 %sum5, i32* %out.ptr, align 4
+  %x.next = add i32 %x, 1
+  %done = icmp eq i32 %x.next, %x2
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; CHECK-LABEL: define void @other.expand(float* %out, i32 %x1, i32 %x2)
+; CHECK: load i32, i32* getelementptr inbounds ({ float, i32 }, { float, i32 }* @other.expand.globals, i32 0, i32 1)
+; CHECK: load float, float* getelementptr inbounds ({ float, i32 }, { float, i32 }* @other.expand.globals, i32 0, i32 0)
+define void @other.expand(float* %out, i32 %x1, i32 %x2) {
+entry:
+  br label %loop
+
+loop:
+  %x = phi i32 [ %x1, %entry ], [ %x.next, %loop ]
+  %count = load i32, i32* @gCount, align 4
+  %bias1 = load float, float* @gBias, align 4
+  %bias2 = load float, float* @gBias, align 4
+  %countf = sitofp i32 %count to float
+  %sum1 = fadd float %countf, %bias1
+  %sum2 = fadd float %sum1, %bias2
+  %out.ptr = getelementptr inbounds float, float* %out, i32 %x
+  store float %sum2, float* %out.ptr, align 4
+  %x.next = add i32 %x, 1
+  %done = icmp eq i32 %x.next, %x2
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
@@ -0,0 +1,16 @@
+; This checks that RSGlobalInfoPass emits a hash table over the names of the
+; globals it describes, with linear probing on collisions ("radius" and
+; "counter" both hash to slot 3).
+
+; RUN: opt -load libbcc.so -embed-rs-global-info -S < %s | FileCheck %s
+
+; ModuleID = 'global-name-index.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+@radius = global i32 0, align 4
+@weights = global [3 x float] zeroinitializer, align 4
+@counter = internal global i32 0, align 4
+
+; CHECK: @.rs.global_entries = constant i32 3
+; CHECK: @.rs.global_name_index = constant [9 x i32] [i32 8, i32 0, i32 0, i32 0, i32 1, i32 3, i32 0, i32 2, i32 0]
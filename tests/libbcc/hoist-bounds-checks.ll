@@ -0,0 +1,75 @@
+; This checks that RSHoistBoundsChecks checks the cells an allocation
+; accessor call in a loop accesses once, in the preheader, and accesses them
+; directly when they are in bounds.
+
+; RUN: opt -load libbcc.so -rs-hoist-bounds-checks -S < %s | FileCheck %s
+
+; ModuleID = 'hoist-bounds-checks.bc'
+target datalayout = "e-m:e-p:32:32-i64:64-v128:64:128-a:0:32-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+@gIn = internal global [1 x i32] zeroinitializer, align 4
+
+declare i32 @_Z18rsGetElementAt_int13rs_allocationjj([1 x i32], i32, i32)
+declare void @_Z18rsSetElementAt_int13rs_allocationijj([1 x i32], i32, i32, i32)
+
+; CHECK-LABEL: define void @root.expand(i32 %x1, i32 %x2, i32 %y)
+; CHECK: %alloc = load [1 x i32], [1 x i32]* @gIn
+; CHECK: %dimX = call i32 @_Z19rsAllocationGetDimX13rs_allocation([1 x i32] %alloc)
+; CHECK: %dimY = call i32 @_Z19rsAllocationGetDimY13rs_allocation([1 x i32] %alloc)
+; CHECK: %in.bounds = and i1
+; CHECK: br i1 %in.bounds
+; CHECK: %first.cell = call i8* @_Z14rsGetElementAt13rs_allocationjj([1 x i32] %alloc, i32 %{{[^,]+}}, i32 %y)
+; CHECK: %second.cell = call i8* @_Z14rsGetElementAt13rs_allocationjj([1 x i32] %alloc, i32 %{{[^,]+}}, i32 %y)
+; CHECK: %cell.base = phi i8*
+; CHECK: %cell.size = phi i64
+; CHECK: %direct.access = and i1
+; CHECK: loop:
+; CHECK: br i1 %direct.access
+; CHECK: %cell = getelementptr inbounds i8, i8* %cell.base
+; CHECK: load i32, i32* %{{[^,]+}}, align 4
+; CHECK: call i32 @_Z18rsGetElementAt_int13rs_allocationjj([1 x i32] %a, i32 %x, i32 %y)
+; CHECK: %value = phi i32
+; CHECK: br i1 %direct.access
+; CHECK: store i32 %value, i32* %{{[^,]+}}, align 4
+; CHECK: call void @_Z18rsSetElementAt_int13rs_allocationijj([1 x i32] %a, i32 %value, i32 %x.next, i32 %y)
+define void @root.expand(i32 %x1, i32 %x2, i32 %y) {
+entry:
+  %empty = icmp uge i32 %x1, %x2
+  br i1 %empty, label %exit, label %loop
+
+loop:
+  %x = phi i32 [ %x1, %entry ], [ %x.next, %loop ]
+  %a = load [1 x i32], [1 x i32]* @gIn, align 4
+  %value = call i32 @_Z18rsGetElementAt_int13rs_allocationjj([1 x i32] %a, i32 %x, i32 %y)
+  %x.next = add nuw i32 %x, 1
+  call void @_Z18rsSetElementAt_int13rs_allocationijj([1 x i32] %a, i32 %value, i32 %x.next, i32 %y)
+  %more = icmp ult i32 %x.next, %x2
+  br i1 %more, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+; Accesses at coordinates that are not affine in the induction variable
+; stay checked one by one.
+; CHECK-LABEL: define void @gather.expand(i32 %x1, i32 %x2)
+; CHECK-NOT: rsAllocationGetDimX
+; CHECK: call i32 @_Z18rsGetElementAt_int13rs_allocationjj
+define void @gather.expand(i32 %x1, i32 %x2) {
+entry:
+  %empty = icmp uge i32 %x1, %x2
+  br i1 %empty, label %exit, label %loop
+
+loop:
+  %x = phi i32 [ %x1, %entry ], [ %x.next, %loop ]
+  %a = load [1 x i32], [1 x i32]* @gIn, align 4
+  %sq = mul i32 %x, %x
+  %value = call i32 @_Z18rsGetElementAt_int13rs_allocationjj([1 x i32] %a, i32 %sq, i32 0)
+  %x.next = add nuw i32 %x, 1
+  %more = icmp ult i32 %x.next, %x2
+  br i1 %more, label %loop, label %exit
+
+exit:
+  ret void
+}
@@ -0,0 +1,31 @@
+; This checks that RSInvariantPass marks the loads of allocation base pointers
+; from RsExpandKernelDriverInfoPfx as nonnull, and as dereferenceable and
+; aligned for the element type when all of their uses agree on it.
+
+; RUN: opt -load libbcc.so -rsinvariant -S < %s | FileCheck %s
+
+; ModuleID = 'invariant-pointers.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+%RsLaunchDimensions = type { i32, i32, i32, i32, i32, [4 x i32] }
+%RsExpandKernelDriverInfoPfx = type { [8 x i8*], [8 x i32], i32, [8 x i8*], [8 x i32], i32, %RsLaunchDimensions, %RsLaunchDimensions, i8*, i32 }
+
+define void @root.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %outstep) {
+; CHECK-LABEL: define void @root.expand
+; CHECK: %in_buf = load i8*, i8** %in_buf.gep, !invariant.load [[EMPTY:![0-9]+]], !nonnull [[EMPTY]], !dereferenceable [[SIXTEEN:![0-9]+]], !align [[SIXTEEN]]
+; CHECK: %out_buf = load i8*, i8** %out_buf.gep, !invariant.load [[EMPTY]], !nonnull [[EMPTY]]{{$}}
+; CHECK: %usr = load i8*, i8** %usr.gep, !invariant.load [[EMPTY]]{{$}}
+  %in_buf.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 0, i32 0
+  %in_buf = load i8*, i8** %in_buf.gep
+  %in = bitcast i8* %in_buf to <4 x float>*
+  %out_buf.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 0
+  %out_buf = load i8*, i8** %out_buf.gep
+  %out = getelementptr inbounds i8, i8* %out_buf, i32 %outstep
+  %usr.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 8
+  %usr = load i8*, i8** %usr.gep
+  ret void
+}
+
+; CHECK: [[EMPTY]] = !{}
+; CHECK: [[SIXTEEN]] = !{i64 16}
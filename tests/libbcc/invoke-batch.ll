@@ -0,0 +1,67 @@
+; Check that a batch of invokes takes a single pointer to their packed params,
+; and that each invoke gets a pointer to its own param struct in the blob, at
+; an offset aligned for that struct.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o invoke-batch -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -emit-llvm -invoke batch:0,0.0,1 %t
+; RUN: FileCheck %s < %T/invoke-batch.o.ll
+
+; The params of first take 2 bytes; those of second are 8-byte aligned.
+; CHECK-LABEL: define void @batch(i8*
+; CHECK: call void @.helper_first(%struct.first_params*
+; CHECK: getelementptr inbounds i8, i8* %0, i32 8
+; CHECK: call void @.helper_second(%struct.second_params*
+
+; ModuleID = 'invoke-batch.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+%struct.first_params = type { i8, i8 }
+%struct.second_params = type { i64, i32 }
+
+@a = global i8 0, align 1
+@b = global i8 0, align 1
+@c = global i64 0, align 8
+@d = global i32 0, align 4
+
+; Function Attrs: noinline nounwind
+define void @.helper_first(%struct.first_params* nocapture readonly %p) #0 {
+  %1 = getelementptr inbounds %struct.first_params, %struct.first_params* %p, i32 0, i32 0
+  %2 = load i8, i8* %1, align 1
+  store i8 %2, i8* @a, align 1
+  %3 = getelementptr inbounds %struct.first_params, %struct.first_params* %p, i32 0, i32 1
+  %4 = load i8, i8* %3, align 1
+  store i8 %4, i8* @b, align 1
+  ret void
+}
+
+; Function Attrs: noinline nounwind
+define void @.helper_second(%struct.second_params* nocapture readonly %p) #0 {
+  %1 = getelementptr inbounds %struct.second_params, %struct.second_params* %p, i32 0, i32 0
+  %2 = load i64, i64* %1, align 8
+  store i64 %2, i64* @c, align 8
+  %3 = getelementptr inbounds %struct.second_params, %struct.second_params* %p, i32 0, i32 1
+  %4 = load i32, i32* %3, align 8
+  store i32 %4, i32* @d, align 4
+  ret void
+}
+
+attributes #0 = { noinline nounwind }
+
+!llvm.module.flags = !{!0, !1}
+!llvm.ident = !{!2}
+!\23pragma = !{!3, !4}
+!\23rs_export_var = !{!7, !8, !9, !10}
+!\23rs_export_func = !{!5, !6}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 1, !"min_enum_size", i32 4}
+!2 = !{!"clang version 3.6 "}
+!3 = !{!"version", !"1"}
+!4 = !{!"java_package_name", !"foo"}
+!5 = !{!".helper_first"}
+!6 = !{!".helper_second"}
+!7 = !{!"a", !"4"}
+!8 = !{!"b", !"4"}
+!9 = !{!"c", !"7"}
+!10 = !{!"d", !"6"}
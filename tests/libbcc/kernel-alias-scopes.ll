@@ -0,0 +1,55 @@
+; This checks that RSKernelExpand puts the accesses of an expanded kernel to
+; each of its allocations into a separate alias scope, marked as not aliasing
+; the other allocations of the launch.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-alias-scopes.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @add(i32 %a, i32 %b) {
+  %1 = add i32 %a, %b
+  ret i32 %1
+}
+
+; CHECK: define void @add.expand(
+; CHECK: load i32, i32* %{{[^,]+}}{{.*}}, !alias.scope [[IN0:![0-9]+]], !noalias [[NOT_IN0:![0-9]+]]
+; CHECK: load i32, i32* %{{[^,]+}}{{.*}}, !alias.scope [[IN1:![0-9]+]], !noalias [[NOT_IN1:![0-9]+]]
+; CHECK: store i32 %call.result, i32* %{{[^,]+}}{{.*}}, !alias.scope [[OUT:![0-9]+]], !noalias [[NOT_OUT:![0-9]+]]
+
+; CHECK-DAG: [[IN0]] = !{[[IN0_SCOPE:![0-9]+]]}
+; CHECK-DAG: [[IN0_SCOPE]] = distinct !{[[IN0_SCOPE]], [[DOMAIN:![0-9]+]], !"in0"}
+; CHECK-DAG: [[DOMAIN]] = distinct !{[[DOMAIN]], !"add.expand"}
+; CHECK-DAG: [[NOT_IN0]] = !{[[OUT_SCOPE:![0-9]+]], [[IN1_SCOPE:![0-9]+]]}
+; CHECK-DAG: [[IN1]] = !{[[IN1_SCOPE]]}
+; CHECK-DAG: [[NOT_IN1]] = !{[[OUT_SCOPE]], [[IN0_SCOPE]]}
+; CHECK-DAG: [[OUT]] = !{[[OUT_SCOPE]]}
+; CHECK-DAG: [[NOT_OUT]] = !{[[IN0_SCOPE]], [[IN1_SCOPE]]}
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"add"}
+!3 = !{!"35"}
+!4 = !{!"0", !"3"}
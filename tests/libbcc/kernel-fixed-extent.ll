@@ -0,0 +1,72 @@
+; This checks that RSKernelExpand gives a kernel declared with the
+; rs_fixed_extent pragma a fully unrolled copy of its loop, taken when the
+; call covers exactly the declared number of elements, and that the other
+; kernels only get the generic loop.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-fixed-extent.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @lut(i32 %in, i32 %x) {
+  %1 = add i32 %in, %x
+  ret i32 %1
+}
+
+define i32 @other(i32 %in, i32 %x) {
+  %1 = sub i32 %in, %x
+  ret i32 %1
+}
+
+; CHECK-LABEL: define void @lut.expand(
+; CHECK: %extent = sub i32 %x2, %x1
+; CHECK: %fixed.extent = icmp eq i32 %extent, 4
+; CHECK: br i1 %fixed.extent, label %Fixed, label %Generic
+; CHECK: Fixed:
+; CHECK: call i32 @lut(i32 %{{[^,]+}}, i32 %x1)
+; CHECK: [[X1:%[0-9]+]] = add nuw i32 %x1, 1
+; CHECK: call i32 @lut(i32 %{{[^,]+}}, i32 [[X1]])
+; CHECK: [[X2:%[0-9]+]] = add nuw i32 %x1, 2
+; CHECK: call i32 @lut(i32 %{{[^,]+}}, i32 [[X2]])
+; CHECK: [[X3:%[0-9]+]] = add nuw i32 %x1, 3
+; CHECK: call i32 @lut(i32 %{{[^,]+}}, i32 [[X3]])
+; CHECK-NOT: call i32 @lut(
+; CHECK: br label %Exit
+; CHECK: Generic:
+; CHECK: Loop:
+; CHECK: call i32 @lut(
+
+; CHECK-LABEL: define void @other.expand(
+; CHECK-NOT: fixed.extent
+; CHECK: Loop:
+; CHECK: call i32 @other(
+
+!\23pragma = !{!0, !1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !5}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!6}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"rs_fixed_extent", !"lut, 4"}
+!3 = !{!"lut"}
+!4 = !{!"other"}
+!5 = !{!"43"}
+!6 = !{!"0", !"3"}
@@ -0,0 +1,54 @@
+; This checks that RSKernelExpand marks a kernel that is only called from its
+; expanded function as always-inline, and leaves a kernel that is also called
+; from elsewhere to the inliner.
+
+; RUN: opt -load libbcc.so -kernelexp -rs-kernel-force-inline -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-force-inline.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; CHECK: define internal i32 @foo(i32 %in) [[FOO_ATTRS:#[0-9]+]]
+define i32 @foo(i32 %in) {
+  ret i32 %in
+}
+
+; CHECK: define internal i32 @bar(i32 %in) {
+define i32 @bar(i32 %in) {
+  ret i32 %in
+}
+
+define i32 @callsBar(i32 %in) {
+  %1 = call i32 @bar(i32 %in)
+  ret i32 %1
+}
+
+; CHECK: attributes [[FOO_ATTRS]] = { alwaysinline }
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2, !3}
+!\23rs_export_foreach = !{!4, !4}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!5}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"foo"}
+!3 = !{!"bar"}
+!4 = !{!"35"}
+!5 = !{!"0", !"3"}
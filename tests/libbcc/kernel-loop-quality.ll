@@ -0,0 +1,66 @@
+; This checks the shape of the loops RSKernelExpand generates: everything
+; read from the driver info (the allocation pointers and the steps) is read
+; once before the loop, and the loop body allocates nothing, so that later
+; passes are left with a loop that only walks the allocations.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-loop-quality.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @add(i32 %a, i32 %b) {
+  %1 = add i32 %a, %b
+  ret i32 %1
+}
+
+define float @scale(float %in) {
+  %1 = fmul float %in, 2.000000e+00
+  ret float %1
+}
+
+; CHECK-LABEL: define void @add.expand(
+; CHECK: Loop:
+; CHECK-NOT: alloca
+; CHECK-NOT: %RsExpandKernelDriverInfoPfx
+; CHECK: call i32 @add(
+; CHECK-NOT: alloca
+; CHECK-NOT: %RsExpandKernelDriverInfoPfx
+; CHECK: Exit:
+
+; CHECK-LABEL: define void @scale.expand(
+; CHECK: Loop:
+; CHECK-NOT: alloca
+; CHECK-NOT: %RsExpandKernelDriverInfoPfx
+; CHECK: call float @scale(
+; CHECK-NOT: alloca
+; CHECK-NOT: %RsExpandKernelDriverInfoPfx
+; CHECK: Exit:
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2, !3}
+!\23rs_export_foreach = !{!4, !4}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!5}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"add"}
+!3 = !{!"scale"}
+!4 = !{!"35"}
+!5 = !{!"0", !"3"}
@@ -0,0 +1,57 @@
+; This checks that RSKernelExpand stores each element of the struct returned
+; by a kernel with multiple outputs, as created by fan-out kernel fusion,
+; through the matching output pointer of the driver info.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-multiple-outputs.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define { i32, float } @split(i32 %in, i32 %x) #0 {
+  %1 = add i32 %in, %x
+  %2 = sitofp i32 %in to float
+  %3 = insertvalue { i32, float } undef, i32 %1, 0
+  %4 = insertvalue { i32, float } %3, float %2, 1
+  ret { i32, float } %4
+}
+
+; CHECK: define void @split.expand(
+; CHECK: %out_buf.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 0
+; CHECK: %[[OUT0:[^ ]+]] = bitcast i8* %{{[^ ]+}} to i32*
+; CHECK: %out_buf.gep{{[0-9]+}} = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 1
+; CHECK: %[[OUT1:[^ ]+]] = bitcast i8* %{{[^ ]+}} to float*
+; CHECK: %call.result = call { i32, float } @split(
+; CHECK: %[[VAL0:[^ ]+]] = extractvalue { i32, float } %call.result, 0
+; CHECK: store i32 %[[VAL0]], i32*
+; CHECK: %[[VAL1:[^ ]+]] = extractvalue { i32, float } %call.result, 1
+; CHECK: store float %[[VAL1]], float*
+
+attributes #0 = { "rs-multiple-outputs" }
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"split"}
+!3 = !{!"43"}
+!4 = !{!"0", !"3"}
@@ -0,0 +1,57 @@
+; This checks that RSKernelMultiVersionPass turns the expanded kernels into
+; indirect functions whose resolver picks, from AT_HWCAP, the first variant
+; the device supports, or the original function otherwise.
+
+; RUN: opt -load libbcc.so -rs-kernel-multiversion -rs-kernel-variant=cortex-a55:+lse,+fullfp16 -rs-kernel-variant=:+crc -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-multiversion.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+%RsExpandKernelDriverInfoPfx = type { [8 x i8*], [8 x i32], i32, [8 x i8*], [8 x i32], i32, [9 x i32], [9 x i32], i8*, i32 }
+
+; CHECK: @root.expand = ifunc {{.*}} @root.expand.resolver
+
+define i32 @root(i32 %in) {
+  ret i32 %in
+}
+
+; CHECK: define internal void @root.expand.default(
+; CHECK-NOT: #
+; CHECK-SAME: {
+
+define void @root.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %outstep) {
+  ret void
+}
+
+; CHECK: define internal void @root.expand.v1({{.*}}) [[A55:#[0-9]+]]
+; CHECK: define internal void @root.expand.v2({{.*}}) [[CRC:#[0-9]+]]
+
+; CHECK-LABEL: define internal void (%RsExpandKernelDriverInfoPfx*, i32, i32, i32)* @root.expand.resolver()
+; CHECK: %hwcaps = call i64 @getauxval(i64 16)
+; CHECK: [[CRCBITS:%[0-9]+]] = and i64 %hwcaps, 128
+; CHECK: [[HASCRC:%[0-9]+]] = icmp eq i64 [[CRCBITS]], 128
+; CHECK: [[NOTA55:%[0-9]+]] = select i1 [[HASCRC]], {{.*}} @root.expand.v2, {{.*}} @root.expand.default
+; CHECK: [[A55BITS:%[0-9]+]] = and i64 %hwcaps, 1792
+; CHECK: [[HASA55:%[0-9]+]] = icmp eq i64 [[A55BITS]], 1792
+; CHECK: [[CHOSEN:%[0-9]+]] = select i1 [[HASA55]], {{.*}} @root.expand.v1, {{.*}} [[NOTA55]]
+; CHECK: ret {{.*}} [[CHOSEN]]
+
+; CHECK: attributes [[A55]] = { "target-cpu"="cortex-a55" "target-features"="+lse,+fullfp16" }
+; CHECK: attributes [[CRC]] = { "target-features"="+crc" }
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"root"}
+!3 = !{!"35"}
+!4 = !{!"0", !"3"}
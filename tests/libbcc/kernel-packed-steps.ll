@@ -0,0 +1,62 @@
+; This checks that RSKernelExpand versions the loop of an old-style kernel on
+; whether its allocations are packed: one loop uses the element sizes as
+; constant steps, the other the steps passed by the driver.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-packed-steps.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define void @root(float* nocapture %ain, <4 x i16>* nocapture %out, i32 %x) {
+  ret void
+}
+
+; CHECK: define void @root.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %outstep)
+; CHECK: Begin:
+; CHECK: %instep = load i32, i32* %instep_addr.gep
+; CHECK: icmp eq i32 %instep, 4
+; CHECK: icmp eq i32 %outstep, 8
+; CHECK: %packed = and i1
+; CHECK: br i1 %packed
+
+; The packed loop steps by the element sizes.
+; CHECK: Loop:
+; CHECK-NOT: mul
+; CHECK: call void @root(
+; CHECK: %out_ptr.next = getelementptr inbounds i8, i8* %out_ptr, i32 8
+; CHECK: %in_ptr.next = getelementptr inbounds i8, i8* %in_ptr, i32 4
+
+; The strided loop steps by the driver's values.
+; CHECK: Loop{{[0-9]+}}:
+; CHECK-NOT: mul
+; CHECK: call void @root(
+; CHECK: getelementptr inbounds i8, i8* %out_ptr{{[0-9]+}}, i32 %outstep
+; CHECK: getelementptr inbounds i8, i8* %in_ptr{{[0-9]+}}, i32 %instep
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"root"}
+!3 = !{!"11"}
+!4 = !{!"0", !"3"}
@@ -0,0 +1,58 @@
+; This checks that RSKernelExpand steps through the allocations of an
+; expanded kernel with a pointer per allocation, advanced by the element size
+; at the end of every iteration, rather than addressing each element from the
+; loop iterator.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-pointer-induction.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @add(i32 %a, i32 %b) {
+  %1 = add i32 %a, %b
+  ret i32 %1
+}
+
+; CHECK: define void @add.expand(
+; CHECK: store i32* %casted_out, i32** %out_ptr.var
+; CHECK: store i32* %casted_in, i32** %in_ptr.var
+; CHECK: store i32* %casted_in{{[0-9]+}}, i32** %in_ptr.var{{[0-9]+}}
+; CHECK: Loop:
+; CHECK-NOT: sub i32
+; CHECK-NOT: mul i32
+; CHECK: %input = load i32, i32* %in_ptr{{(,|$)}}
+; CHECK: %input{{[0-9]+}} = load i32, i32* %in_ptr{{[0-9]+}}{{(,|$)}}
+; CHECK: store i32 %call.result, i32* %out_ptr{{(,|$)}}
+; CHECK: %out_ptr.next = getelementptr inbounds i32, i32* %out_ptr, i32 1
+; CHECK: %in_ptr.next = getelementptr inbounds i32, i32* %in_ptr, i32 1
+; CHECK: getelementptr inbounds i32, i32* %in_ptr{{[0-9]+}}, i32 1
+; CHECK: Exit:
+
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"add"}
+!3 = !{!"35"}
+!4 = !{!"0", !"3"}
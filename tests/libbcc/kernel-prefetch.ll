@@ -0,0 +1,58 @@
+; This checks that RSKernelExpand prefetches the output and inputs of an
+; expanded kernel loop at the requested distance, and that the
+; rs_prefetch_distance pragma overrides it for a single kernel.
+
+; RUN: opt -load libbcc.so -kernelexp -rs-kernel-prefetch-distance=128 -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-prefetch.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @foo(i32 %in) {
+  ret i32 %in
+}
+
+define i32 @bar(i32 %in) {
+  ret i32 %in
+}
+
+; CHECK: define void @foo.expand(
+; CHECK: Loop:
+; CHECK: %prefetch.addr = getelementptr i8, i8* %{{[^,]+}}, i32 128
+; CHECK: call void @llvm.prefetch(i8* %prefetch.addr, i32 1, i32 3, i32 1)
+; CHECK: %prefetch.addr{{[0-9]+}} = getelementptr i8, i8* %{{[^,]+}}, i32 128
+; CHECK: call void @llvm.prefetch(i8* %prefetch.addr{{[0-9]+}}, i32 0, i32 3, i32 1)
+; CHECK: call i32 @foo(
+
+; CHECK: define void @bar.expand(
+; CHECK-NOT: @llvm.prefetch
+; CHECK: call i32 @bar(
+
+!\23pragma = !{!0, !1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !5}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!6}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"rs_prefetch_distance", !"bar, 0"}
+!3 = !{!"foo"}
+!4 = !{!"bar"}
+!5 = !{!"35"}
+!6 = !{!"0", !"3"}
@@ -0,0 +1,60 @@
+; This checks that RSKernelExpand passes a struct input that the kernel takes
+; by reference as a pointer into its allocation when the kernel only reads
+; it, and through a stack copy otherwise.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-struct-input-by-ref.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+%struct.Big = type { [8 x i32] }
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @reads(%struct.Big* %in) {
+  %gep = getelementptr inbounds %struct.Big, %struct.Big* %in, i32 0, i32 0, i32 3
+  %val = load i32, i32* %gep
+  ret i32 %val
+}
+
+define i32 @writes(%struct.Big* %in) {
+  %gep = getelementptr inbounds %struct.Big, %struct.Big* %in, i32 0, i32 0, i32 3
+  store i32 0, i32* %gep
+  ret i32 0
+}
+
+; CHECK-LABEL: define void @reads.expand(
+; CHECK-NOT: alloca %struct.Big
+; CHECK-NOT: load %struct.Big
+; CHECK: call i32 @reads(%struct.Big* %{{[^)]+}})
+; CHECK-LABEL: define void @writes.expand(
+; CHECK: %input_struct_slot = alloca %struct.Big
+; CHECK: store %struct.Big %input, %struct.Big* %input_struct_slot
+; CHECK: call i32 @writes(%struct.Big* %input_struct_slot)
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2, !3}
+!\23rs_export_foreach = !{!4, !4}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!5}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"reads"}
+!3 = !{!"writes"}
+!4 = !{!"35"}
+!5 = !{!"0", !"3"}
@@ -0,0 +1,59 @@
+; This checks that RSKernelExpand also generates a multi-row tiled entry point
+; for old-style kernels: the output step comes from the driver info structure,
+; the buffers are advanced by the row pitches, and Y comes from the row loop.
+
+; RUN: opt -load libbcc.so -kernelexp -rs-kernel-tiled-expand -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-tiled-old-style.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define void @root(i32* nocapture %ain, i32* nocapture %out, i32 %x, i32 %y) {
+  ret void
+}
+
+; CHECK: define void @root.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+
+; CHECK: define void @root.expand.tiled(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %y1, i32 %y2, i32* %row_pitch)
+; CHECK: Begin:
+; CHECK: %outstep_addr.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 4, i32 0
+; CHECK: %input_buf.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 0, i32 0
+; CHECK: %out_buf.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 0
+; CHECK: icmp ult i32 %y1, %y2
+; CHECK: Loop:
+; CHECK: %[[Y:.*]] = load i32, i32* %rsIndex
+; CHECK: %row = sub i32 %[[Y]], %y1
+; CHECK: getelementptr inbounds i32, i32* %row_pitch, i32 1
+; CHECK: getelementptr inbounds i32, i32* %row_pitch, i32 0
+; CHECK-NOT: Y.gep
+; CHECK: Loop{{[0-9]+}}:
+; CHECK: call void @root(i32* %{{.*}}, i32* %{{.*}}, i32 %{{.*}}, i32 %[[Y]])
+; CHECK: icmp ult i32 %{{.*}}, %x2
+; CHECK: icmp ult i32 %{{.*}}, %y2
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"root"}
+!3 = !{!"27"}
+!4 = !{!"0", !"3"}
@@ -0,0 +1,62 @@
+; This checks that RSKernelExpand generates a tiled entry point that loops
+; over the rows of a tile: the Y argument comes from the row loop instead of
+; the driver info structure, the buffers are advanced by the row pitches, and
+; Z is still loaded outside the X loop.
+
+; RUN: opt -load libbcc.so -kernelexp -rs-kernel-tiled-expand -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-tiled.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @foo(i32 %in, i32 %x, i32 %y, i32 %z) {
+  ret i32 %in
+}
+
+; The row-at-a-time entry point is still generated.
+; CHECK: define void @foo.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+
+; CHECK: define void @foo.expand.tiled(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %y1, i32 %y2, i32* %row_pitch)
+; CHECK: Begin:
+; CHECK: icmp ult i32 %y1, %y2
+; CHECK: Loop:
+; CHECK: %[[Y:.*]] = load i32, i32* %rsIndex
+; CHECK: %row = sub i32 %[[Y]], %y1
+; CHECK: load i8*, i8** %out_buf.gep
+; CHECK: getelementptr inbounds i32, i32* %row_pitch, i32 0
+; CHECK: %row_offset = mul i32 %row
+; CHECK-NOT: Y.gep
+; CHECK: %Z.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 7, i32 2
+; CHECK: load i8*, i8** %input_buf.gep
+; CHECK: getelementptr inbounds i32, i32* %row_pitch, i32 1
+; CHECK: Loop{{[0-9]+}}:
+; CHECK: call i32 @foo(i32 %{{.*}}, i32 %{{.*}}, i32 %[[Y]], i32 %Z)
+; CHECK: icmp ult i32 %{{.*}}, %x2
+; CHECK: icmp ult i32 %{{.*}}, %y2
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"foo"}
+!3 = !{!"123"}
+!4 = !{!"0", !"3"}
@@ -0,0 +1,62 @@
+; This checks that RSKernelExpand can widen the loop of an expanded kernel:
+; the main loop calls the kernel for four consecutive elements per
+; iteration, and a scalar remainder loop handles the elements left over.
+
+; RUN: opt -load libbcc.so -kernelexp -rs-kernel-vector-width=4 -S < %s | FileCheck %s
+
+; ModuleID = 'kernel-vector-width.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define i32 @foo(i32 %in) {
+  ret i32 %in
+}
+
+; CHECK: define void @foo.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+; CHECK: Begin:
+; CHECK: %vector.end = sub i32 %x2
+; CHECK: icmp ult i32 %x1, %vector.end
+; CHECK: Loop:
+; CHECK: call i32 @foo(
+; CHECK: add nuw i32 %X, 1
+; CHECK: call i32 @foo(
+; CHECK: add nuw i32 %X, 2
+; CHECK: call i32 @foo(
+; CHECK: add nuw i32 %X, 3
+; CHECK: call i32 @foo(
+; CHECK-NOT: call i32 @foo(
+; CHECK: add nuw i32 %X, 4
+; CHECK: icmp ult i32 %{{.*}}, %vector.end
+; CHECK: Exit:
+; CHECK: icmp ult i32 %vector.end, %x2
+; CHECK: Loop{{[0-9]+}}:
+; CHECK: call i32 @foo(
+; CHECK: add nuw i32 %X{{[0-9]+}}, 1
+; CHECK: icmp ult i32 %{{.*}}, %x2
+
+!\23pragma = !{!0, !1}
+!\23rs_export_foreach_name = !{!2}
+!\23rs_export_foreach = !{!3}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"foo"}
+!3 = !{!"35"}
+!4 = !{!"0", !"3"}
@@ -0,0 +1,36 @@
+; Check that an instrumented build gives the expanded kernels profile counters
+; and pulls in the profile runtime.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o profile-generate -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -rs-profile-generate=%T/profile-generate.profraw %t
+; RUN: llvm-objdump -t %T/profile-generate.o | FileCheck %s
+
+; CHECK: __llvm_profile_runtime
+; CHECK: __profc_root.expand
+
+; ModuleID = 'profile-generate.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: norecurse nounwind readnone
+define i32 @root(i32 %in) #0 {
+  %1 = icmp sgt i32 %in, 0
+  %2 = select i1 %1, i32 %in, i32 0
+  ret i32 %2
+}
+
+attributes #0 = { norecurse nounwind readnone }
+
+!llvm.module.flags = !{!0, !1}
+!llvm.ident = !{!2}
+!\23pragma = !{!3, !4}
+!\23rs_export_foreach_name = !{!5}
+!\23rs_export_foreach = !{!6}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 1, !"min_enum_size", i32 4}
+!2 = !{!"clang version 3.6 "}
+!3 = !{!"version", !"1"}
+!4 = !{!"java_package_name", !"foo"}
+!5 = !{!"root"}
+!6 = !{!"35"}
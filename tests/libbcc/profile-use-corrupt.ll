@@ -0,0 +1,35 @@
+; Check that a build given a corrupt profile fails with an error, instead of
+; the profile use pass taking the whole process down.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: echo "not an indexed profile" > %t.profdata
+; RUN: not bcc -o profile-use-corrupt -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -rs-profile-use=%t.profdata %t 2>&1 | FileCheck %s
+
+; CHECK: Unable to read profile
+
+; ModuleID = 'profile-use-corrupt.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: norecurse nounwind readnone
+define i32 @root(i32 %in) #0 {
+  %1 = icmp sgt i32 %in, 0
+  %2 = select i1 %1, i32 %in, i32 0
+  ret i32 %2
+}
+
+attributes #0 = { norecurse nounwind readnone }
+
+!llvm.module.flags = !{!0, !1}
+!llvm.ident = !{!2}
+!\23pragma = !{!3, !4}
+!\23rs_export_foreach_name = !{!5}
+!\23rs_export_foreach = !{!6}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 1, !"min_enum_size", i32 4}
+!2 = !{!"clang version 3.6 "}
+!3 = !{!"version", !"1"}
+!4 = !{!"java_package_name", !"foo"}
+!5 = !{!"root"}
+!6 = !{!"35"}
@@ -0,0 +1,89 @@
+; This checks that RSKernelExpand can spread the loop of an expanded
+; general reduction accumulator over several partial accumulators, which
+; are initialized like the reduction's own accumulator and merged into it
+; with the combiner before a scalar loop handles the remaining elements.
+
+; RUN: opt -load libbcc.so -kernelexp -rs-kernel-reduce-accumulators=4 -S < %s | FileCheck %s
+
+; ModuleID = 'reduce-accumulators.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+define internal void @fzInit(i32* nocapture %accumIdx) {
+  store i32 -1, i32* %accumIdx, align 4
+  ret void
+}
+
+define internal void @fzAccum(i32* nocapture %accumIdx, i32 %inVal, i32 %x) {
+  ret void
+}
+
+define internal void @fzCombine(i32* nocapture %accumIdx, i32* nocapture %accumIdx2) {
+  ret void
+}
+
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+; The partial accumulators of a reduction with an initializer are initialized
+; through it, and merged with the reduction's combiner.
+; CHECK: define void @fzAccum.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32* {{.*}}%accum)
+; CHECK: %vector.end = sub i32 %x2
+; CHECK: %partial_accum = alloca i32
+; CHECK: call void @fzInit(i32* %partial_accum)
+; CHECK: %partial_accum1 = alloca i32
+; CHECK: call void @fzInit(i32* %partial_accum1)
+; CHECK: %partial_accum2 = alloca i32
+; CHECK: call void @fzInit(i32* %partial_accum2)
+; CHECK: Loop:
+; CHECK: call void @fzAccum(i32* %accum, i32 %{{[^,]+}}, i32 %X)
+; CHECK: call void @fzAccum(i32* %partial_accum, i32 %{{[^,]+}}, i32 %{{[^)]+}})
+; CHECK: call void @fzAccum(i32* %partial_accum1, i32 %{{[^,]+}}, i32 %{{[^)]+}})
+; CHECK: call void @fzAccum(i32* %partial_accum2, i32 %{{[^,]+}}, i32 %{{[^)]+}})
+; CHECK: add nuw i32 %X, 4
+; CHECK: Exit:
+; CHECK: call void @fzCombine(i32* %accum, i32* %partial_accum)
+; CHECK: call void @fzCombine(i32* %accum, i32* %partial_accum1)
+; CHECK: call void @fzCombine(i32* %accum, i32* %partial_accum2)
+; CHECK: icmp ult i32 %vector.end, %x2
+; CHECK: call void @fzAccum(i32* %accum,
+
+; Without an initializer the partial accumulators start out zeroed, and are
+; merged with the generated combiner.
+; CHECK: define void @aiAccum.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32* {{.*}}%accum)
+; CHECK: %partial_accum = alloca i32
+; CHECK: store i32 0, i32* %partial_accum
+; CHECK: Exit:
+; CHECK: call void @aiAccum.combiner(i32* %accum, i32* %partial_accum)
+
+!\23pragma = !{!0, !1}
+!\23rs_export_reduce = !{!2, !4}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!6}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"fz", !"4", !3, !"fzInit", !"fzCombine"}
+!3 = !{!"fzAccum", !"9"}
+!4 = !{!"addint", !"4", !5}
+!5 = !{!"aiAccum", !"1"}
+!6 = !{!"0", !"3"}
@@ -0,0 +1,61 @@
+; This checks that RSKernelExpand generates a multi-combiner for general
+; reductions with small accumulators, merging a run of partial accumulators
+; into one with a loop that is versioned for packed partials, and none for
+; reductions with larger accumulators.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'reduce-multi-combiner.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+%struct.big = type { [8 x i32] }
+
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+define internal void @bigAccum(%struct.big* nocapture %accum, i32 %val) {
+  ret void
+}
+
+define internal void @bigCombine(%struct.big* nocapture %accum, %struct.big* nocapture %other) {
+  ret void
+}
+
+; CHECK: define void @aiAccum.combiner.multi(i32* noalias nocapture %accum, i8* noalias nocapture %others, i32 %count, i32 %stride)
+; CHECK: %packed = icmp eq i32 %stride, 4
+; CHECK: call void @aiAccum.combiner(i32* %accum, i32* %{{[^)]+}})
+; CHECK: call void @aiAccum.combiner(i32* %accum, i32* %{{[^)]+}})
+; CHECK-NOT: define void @bigCombine.multi(
+
+!\23pragma = !{!0, !1}
+!\23rs_export_reduce = !{!2, !4}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!6}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"addint", !"4", !3}
+!3 = !{!"aiAccum", !"1"}
+!4 = !{!"big", !"32", !5, null, !"bigCombine"}
+!5 = !{!"bigAccum", !"1"}
+!6 = !{!"0", !"3"}
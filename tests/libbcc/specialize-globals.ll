@@ -0,0 +1,51 @@
+; This checks that RSSpecializeGlobals redirects the uses of exported globals
+; bound to a value to an internal constant holding it, and leaves globals the
+; script writes to alone.
+
+; RUN: opt -load libbcc.so -rs-specialize-globals -rs-specialize-global=radius:05000000 -rs-specialize-global=weights:0000803f000000400000003f -rs-specialize-global=counter:07000000 -S < %s | FileCheck %s
+
+; ModuleID = 'specialize-globals.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; The exported globals keep their names and get the bound values.
+; CHECK: @radius = global i32 5, align 4
+; CHECK: @weights = global [3 x float] [float 1.000000e+00, float 2.000000e+00, float 5.000000e-01], align 4
+; CHECK: @counter = common global i32 0, align 4
+@radius = common global i32 0, align 4
+@weights = global [3 x float] zeroinitializer, align 4
+@counter = common global i32 0, align 4
+
+; CHECK: @radius.specialized = internal unnamed_addr constant i32 5, align 4
+; CHECK: @weights.specialized = internal unnamed_addr constant [3 x float] [float 1.000000e+00, float 2.000000e+00, float 5.000000e-01], align 4
+; CHECK-NOT: @counter.specialized
+
+; CHECK-LABEL: define float @weight(i32 %i)
+; CHECK: load i32, i32* @radius.specialized
+; CHECK: getelementptr inbounds [3 x float], [3 x float]* @weights.specialized
+define float @weight(i32 %i) {
+  %radius = load i32, i32* @radius, align 4
+  %index = add i32 %i, %radius
+  %ptr = getelementptr inbounds [3 x float], [3 x float]* @weights, i32 0, i32 %index
+  %weight = load float, float* %ptr, align 4
+  ret float %weight
+}
+
+; CHECK-LABEL: define void @count()
+; CHECK: load i32, i32* @counter
+; CHECK: store i32 %{{.*}}, i32* @counter
+define void @count() {
+  %1 = load i32, i32* @counter, align 4
+  %2 = add i32 %1, 1
+  store i32 %2, i32* @counter, align 4
+  ret void
+}
+
+!\23pragma = !{!0, !1}
+!\23rs_export_var = !{!2, !3, !4}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"radius", !"5"}
+!3 = !{!"weights", !"1"}
+!4 = !{!"counter", !"5"}
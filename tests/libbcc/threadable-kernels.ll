@@ -0,0 +1,65 @@
+; This checks that RSIsThreadablePass only marks the exported kernels that can
+; reach a non-threadable function as non-threadable, and ignores invokables
+; that call one.
+
+; RUN: opt -load libbcc.so -rs-is-threadable -S < %s | FileCheck %s
+
+; ModuleID = 'threadable-kernels.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+declare void @_Z9rsgFinishv()
+declare i32 @_Z11rsgGetWidthv()
+
+define internal void @helper() {
+  call void @_Z9rsgFinishv()
+  ret void
+}
+
+define i32 @safe(i32 %in) {
+  ret i32 %in
+}
+
+define i32 @draws(i32 %in) {
+  call void @helper()
+  ret i32 %in
+}
+
+define void @width() {
+  %1 = call i32 @_Z11rsgGetWidthv()
+  ret void
+}
+
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) {
+  call void @helper()
+  ret void
+}
+
+; CHECK: !\23rs_non_threadable_kernels = !{![[DRAWS:[0-9]+]], ![[ADDINT:[0-9]+]]}
+; CHECK: !\23rs_is_threadable = !{![[NO:[0-9]+]]}
+; CHECK-DAG: ![[DRAWS]] = !{!"draws"}
+; CHECK-DAG: ![[ADDINT]] = !{!"addint"}
+; CHECK-DAG: ![[NO]] = !{!"no"}
+; CHECK-NOT: !{!"safe"}
+
+!\23pragma = !{!0, !1}
+!\23rs_export_func = !{!2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !5}
+!\23rs_export_reduce = !{!6}
+
+; The following named metadata would not be present in a bitcode file,
+; but instead synthesized by bcc from the bitcode wrapper.  However,
+; for this test case, we're not running bcc, but instead opt, and so
+; we never get the opportunity to synthesize this named metadata.
+!\23rs_wrapper = !{!8}
+
+!0 = !{!"version", !"1"}
+!1 = !{!"java_package_name", !"foo"}
+!2 = !{!"width"}
+!3 = !{!"safe"}
+!4 = !{!"draws"}
+!5 = !{!"35"}
+!6 = !{!"addint", !"4", !7}
+!7 = !{!"aiAccum", !"1"}
+!8 = !{!"0", !"3"}
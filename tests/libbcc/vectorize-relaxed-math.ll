@@ -0,0 +1,47 @@
+; Check that when the loop vectorizer switches a relaxed-precision kernel to the
+; vector variant of a runtime math function, the script defines that variant
+; rather than leaving a call to an undefined symbol. This is the first build of
+; the driver, so what gets linked in has to follow the configuration set up for
+; this script rather than the one bcc started with (full precision).
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o vectorize-relaxed-math -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -rs-vectorize=true -emit-llvm %t
+; RUN: FileCheck %s < %T/vectorize-relaxed-math.o.ll
+; RUN: llvm-objdump -t %T/vectorize-relaxed-math.o | FileCheck --check-prefix=OBJ %s
+
+; CHECK-NOT: declare {{.*}}@_Z10native_expDv{{[24]}}_f(
+; CHECK: call {{.*}}<[[W:[24]]] x float> @_Z10native_expDv[[W]]_f(
+; CHECK: define internal {{.*}}<[[W]] x float> @_Z10native_expDv[[W]]_f(
+; CHECK-NOT: declare {{.*}}@_Z10native_expDv{{[24]}}_f(
+
+; OBJ-NOT: *UND*{{.*}}_Z10native_expDv
+
+; ModuleID = 'vectorize-relaxed-math.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+declare float @_Z10native_expf(float) #1
+
+; Function Attrs: nounwind readnone
+define float @root(float %in) #0 {
+  %1 = tail call float @_Z10native_expf(float %in) #1
+  ret float %1
+}
+
+attributes #0 = { nounwind readnone }
+attributes #1 = { nounwind readnone }
+
+!llvm.module.flags = !{!0, !1}
+!llvm.ident = !{!2}
+!\23pragma = !{!3, !4, !7}
+!\23rs_export_foreach_name = !{!5}
+!\23rs_export_foreach = !{!6}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 1, !"min_enum_size", i32 4}
+!2 = !{!"clang version 3.6 "}
+!3 = !{!"version", !"1"}
+!4 = !{!"java_package_name", !"foo"}
+!5 = !{!"root"}
+!6 = !{!"35"}
+!7 = !{!"rs_fp_relaxed", !""}
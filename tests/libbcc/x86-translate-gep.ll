@@ -0,0 +1,34 @@
+; This checks that RSX86TranslateGEPPass rewrites GEPs on structs with 64-bit
+; scalars into typed GEPs over explicitly padded struct types that follow the
+; ARM layout.
+
+; RUN: opt -load libbcc.so -rs-x86-translate-gep -S < %s | FileCheck %s
+
+; ModuleID = 'x86-translate-gep.bc'
+target datalayout = "e-m:e-p:32:32-f64:32:64-f80:32-n8:16:32-S128"
+target triple = "i686-unknown-linux"
+
+%struct.S = type { i32, i64, i8 }
+%struct.T = type { i32, %struct.S }
+
+; CHECK-DAG: %struct.S.padded = type <{ i32, [4 x i8], i64, i8, [7 x i8] }>
+; CHECK-DAG: %struct.T.padded = type <{ i32, [4 x i8], %struct.S.padded }>
+
+define i64* @field(%struct.S* %p, i32 %i) {
+; CHECK-LABEL: define i64* @field
+; CHECK: %to.padded = bitcast %struct.S* %p to %struct.S.padded*
+; CHECK: %padded.indexed = getelementptr inbounds %struct.S.padded, %struct.S.padded* %to.padded, i32 %i, i32 2
+; CHECK: ret i64* %padded.indexed
+  %f = getelementptr inbounds %struct.S, %struct.S* %p, i32 %i, i32 1
+  ret i64* %f
+}
+
+define %struct.S* @nested(%struct.T* %p) {
+; CHECK-LABEL: define %struct.S* @nested
+; CHECK: %to.padded = bitcast %struct.T* %p to %struct.T.padded*
+; CHECK: %padded.indexed = getelementptr %struct.T.padded, %struct.T.padded* %to.padded, i32 0, i32 2
+; CHECK: %to.orig.geptype = bitcast %struct.S.padded* %padded.indexed to %struct.S*
+; CHECK: ret %struct.S* %to.orig.geptype
+  %f = getelementptr %struct.T, %struct.T* %p, i32 0, i32 1
+  ret %struct.S* %f
+}
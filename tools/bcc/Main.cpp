@@ -14,11 +14,17 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <map>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <dlfcn.h>
@@ -44,6 +50,8 @@
 #include <bcc/RSCompilerDriver.h>
 #include <bcc/Source.h>
 
+#include "Server.h"
+
 #ifdef __ANDROID__
 #include <vndksupport/linker.h>
 #endif
@@ -59,7 +67,7 @@ using namespace bcc;
 namespace {
 
 llvm::cl::list<std::string>
-OptInputFilenames(llvm::cl::Positional, llvm::cl::OneOrMore,
+OptInputFilenames(llvm::cl::Positional, llvm::cl::ZeroOrMore,
                   llvm::cl::desc("<input bitcode files>"));
 
 llvm::cl::list<std::string>
@@ -67,6 +75,44 @@ OptMergePlans("merge", llvm::cl::ZeroOrMore,
                llvm::cl::desc("Lists of kernels to merge (as source-and-slot "
                               "pairs) and names for the final merged kernels"));
 
+llvm::cl::list<std::string>
+OptMergeReducePlans("merge-reduce", llvm::cl::ZeroOrMore,
+                    llvm::cl::desc("Lists of kernels to merge into a general "
+                                   "reduction (as source-and-slot pairs, the "
+                                   "reduction last) and names for the final "
+                                   "merged reductions"));
+
+llvm::cl::list<std::string>
+OptMergeStencilPlans("merge-stencil", llvm::cl::ZeroOrMore,
+                     llvm::cl::desc("Kernel to merge into a kernel reading its "
+                                    "output through an rs_allocation global, "
+                                    "as <name>:<source>,<slot>.<source>,<slot>:"
+                                    "<global>"));
+
+llvm::cl::list<std::string>
+OptMergeFanOutPlans("merge-fan-out", llvm::cl::ZeroOrMore,
+                    llvm::cl::desc("Lists of a kernel followed by kernels "
+                                   "consuming its output (as source-and-slot "
+                                   "pairs) and names for the final merged "
+                                   "kernels with one output per consumer"));
+
+llvm::cl::list<std::string>
+OptGroupEdges("group-edge", llvm::cl::ZeroOrMore,
+              llvm::cl::desc("Data edge of the script group, as "
+                             "<source>,<slot>:<source>,<slot>[:<input>]; "
+                             "without -merge, kernels to merge are picked "
+                             "from these edges"));
+
+llvm::cl::list<std::string>
+OptGroupOutputs("group-output", llvm::cl::ZeroOrMore,
+                llvm::cl::desc("Kernel (as <source>,<slot>) whose output is "
+                               "an output of the script group"));
+
+llvm::cl::opt<bool>
+OptPrintFusionPlan("print-fusion-plan",
+                   llvm::cl::desc("Print the kernels picked for merging from "
+                                  "the -group-edge options"));
+
 llvm::cl::list<std::string>
 OptInvokes("invoke", llvm::cl::ZeroOrMore,
            llvm::cl::desc("Invocable functions"));
@@ -110,6 +156,11 @@ llvm::cl::opt<bool>
 OptRSDebugContext("rs-debug-ctx",
     llvm::cl::desc("Enable build to work with a RenderScript debug context"));
 
+llvm::cl::opt<bool>
+OptRSOptimizedDebug("rs-debug-opt",
+    llvm::cl::desc("Optimize scripts built with debug information, keeping "
+                   "the debug information usable (like -Og)"));
+
 llvm::cl::opt<bool>
 OptRSGlobalInfo("rs-global-info",
     llvm::cl::desc("Embed information about global variables in the code"));
@@ -119,12 +170,108 @@ OptRSGlobalInfoSkipConstant("rs-global-info-skip-constant",
     llvm::cl::desc("Skip embedding information about constant global "
                    "variables in the code"));
 
+llvm::cl::opt<std::string>
+OptProfileGenerate("rs-profile-generate",
+    llvm::cl::desc("Instrument the kernels and invokables to write a raw "
+                   "profile to this file"),
+    llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<std::string>
+OptProfileUse("rs-profile-use",
+    llvm::cl::desc("Optimize for the indexed profile in this file"),
+    llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<std::string>
+OptStatsFilename("stats-json",
+    llvm::cl::desc("Write per-phase build statistics as JSON to this file "
+                   "(\"-\" for stdout)"),
+    llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<bool>
+OptKernelReport("kernel-report",
+    llvm::cl::desc("Print the stack frame size, spills, reloads and machine "
+                   "instructions of each expanded kernel"));
+
+llvm::cl::list<std::string>
+OptDumpIRAt("dump-ir-at", llvm::cl::CommaSeparated,
+    llvm::cl::desc("Write the IR to <output>.<point>.ll at these points of "
+                   "the pipeline: after-expand, after-lto, before-codegen"),
+    llvm::cl::value_desc("points"));
+
+llvm::cl::list<std::string>
+OptDumpIRKernels("dump-ir-kernels", llvm::cl::CommaSeparated,
+    llvm::cl::desc("Only dump and measure the IR of these kernels (default: "
+                   "every function)"),
+    llvm::cl::value_desc("kernels"));
+
+llvm::cl::opt<bool>
+OptPrintIRSizes("print-ir-sizes",
+    llvm::cl::desc("Print the IR instruction count of each function at the "
+                   "-dump-ir-at points (default: all points)"));
+
+llvm::cl::opt<bool>
+OptRemarks("opt-remarks",
+    llvm::cl::desc("Write the optimization remarks about the script's "
+                   "functions to <output>.opt.yaml"));
+
+llvm::cl::opt<bool>
+OptStreamingCodeGen("streaming-codegen",
+    llvm::cl::desc("Release the IR of each function once its code is "
+                   "emitted, to lower peak memory use"));
+
+llvm::cl::opt<unsigned>
+OptMemoryBudget("memory-budget",
+    llvm::cl::desc("Trade optimizations for memory to keep each build within "
+                   "about this many MiB (0: no budget)"),
+    llvm::cl::value_desc("MiB"), llvm::cl::init(0));
+
+llvm::cl::opt<unsigned>
+OptCacheBudget("cache-budget",
+    llvm::cl::desc("Evict the least recently used objects from the output "
+                   "directory to keep it within this many MiB (0: no budget)"),
+    llvm::cl::value_desc("MiB"), llvm::cl::init(0));
+
+llvm::cl::opt<bool>
+OptIndependent("independent",
+    llvm::cl::desc("Compile each input on its own into <output path>/<input "
+                   "name>.o, in parallel, rather than as a script group"));
+
+llvm::cl::opt<std::string>
+OptAppRuntime("app-runtime",
+    llvm::cl::desc("Compile each input into <output path>/<input name>.o, "
+                   "linked against one shared runtime object <output "
+                   "path>/<name>.o built along with them"),
+    llvm::cl::value_desc("name"));
+
+llvm::cl::opt<unsigned>
+OptJobs("j",
+    llvm::cl::desc("Number of inputs compiled in parallel (implies "
+                   "-independent; default: 0, one per CPU)"),
+    llvm::cl::init(0));
+
+llvm::cl::opt<std::string>
+OptServerSocket("server",
+    llvm::cl::desc("Stay resident and serve compile requests on the Unix "
+                   "socket at this path instead of compiling the inputs"),
+    llvm::cl::value_desc("socket"));
+
+llvm::cl::opt<unsigned>
+OptServerJobs("server-jobs",
+    llvm::cl::desc("Number of requests the server compiles in parallel "
+                   "(default: 0, one per CPU)"),
+    llvm::cl::init(0));
+
 llvm::cl::opt<std::string>
 OptChecksum("build-checksum",
             llvm::cl::desc("Embed a checksum of this compiler invocation for"
                            " cache invalidation at a later time"),
             llvm::cl::value_desc("checksum"));
 
+llvm::cl::opt<bool>
+OptComputeChecksum("compute-build-checksum",
+    llvm::cl::desc("Embed a checksum computed from the inputs and the "
+                   "compiler settings when -build-checksum is not given"));
+
 #ifdef __ANDROID__
 llvm::cl::opt<std::string>
 OptVendorPlugin("plugin", llvm::cl::ZeroOrMore,
@@ -147,12 +294,87 @@ OptEmbedRSInfo("embedRSInfo",
     llvm::cl::desc("Embed RS Info into the object file instead of generating"
                    " a separate .o.info file"));
 
+// If set along with -embedRSInfo, also embed the RS info in binary form, as the
+// .rs.info.bin variable.
+llvm::cl::opt<bool>
+OptEmbedRSBinaryInfo("embedRSBinaryInfo",
+    llvm::cl::desc("Also embed the RS Info in a binary form that the runtime "
+                   "can use without parsing it"));
+
 // RenderScript uses -O3 by default
 llvm::cl::opt<char>
 OptOptLevel("O", llvm::cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] "
                                 "(default: -O3)"),
             llvm::cl::Prefix, llvm::cl::ZeroOrMore, llvm::cl::init('3'));
 
+llvm::cl::opt<unsigned>
+OptScriptGroupPreOptJobs("script-group-jobs",
+    llvm::cl::desc("Optimize the sources of a script group on their own with "
+                   "this many threads before linking them (default: 0, off)"),
+    llvm::cl::init(0));
+
+llvm::cl::opt<unsigned>
+OptRuntimeImportLimit("rs-runtime-import-limit",
+    llvm::cl::desc("Only import runtime functions of at most this many "
+                   "instructions; the output must be linked against a shared "
+                   "build of the runtime (default: 0, import all)"),
+    llvm::cl::init(0));
+
+llvm::cl::opt<bool>
+OptTiledKernels("rs-tiled-kernels",
+    llvm::cl::desc("Also generate <kernel>.expand.tiled entry points that "
+                   "process 2D tiles of cells"));
+
+llvm::cl::opt<unsigned>
+OptReduceAccumulators("rs-reduce-accumulators",
+    llvm::cl::desc("Number of partial accumulators the loops of general "
+                   "reduction accumulators keep (default: 1)"),
+    llvm::cl::init(1));
+
+llvm::cl::opt<unsigned>
+OptPrefetchDistance("rs-prefetch-distance",
+    llvm::cl::desc("Distance in bytes at which expanded kernel loops prefetch "
+                   "their inputs and output, 0 to disable (default: depends "
+                   "on the target CPU)"));
+
+// Auto-vectorization defaults to on for arm64 and x86_64 only; these allow
+// A/B comparisons of kernel throughput on any target.
+llvm::cl::opt<llvm::cl::boolOrDefault>
+OptAutoVectorize("rs-vectorize",
+    llvm::cl::desc("Run the loop unroll and SLP vectorizer passes after LTO "
+                   "(default: on for arm64 and x86_64)"));
+
+llvm::cl::opt<bool>
+OptGlobalLayout("rs-global-layout",
+    llvm::cl::desc("Group the globals each expanded kernel reads in its loops "
+                   "into one cache-line-aligned block (default: on)"),
+    llvm::cl::init(true));
+
+llvm::cl::opt<bool>
+OptHostCPU("rs-host-cpu",
+    llvm::cl::desc("Generate code for the CPU bcc runs on, using the "
+                   "features it reports (when it matches the target)"));
+
+llvm::cl::opt<bool>
+OptOptimizeForSize("rs-optimize-size",
+    llvm::cl::desc("Emit every function and global in its own section and "
+                   "merge identical functions"));
+
+llvm::cl::list<std::string>
+OptKernelTargets("rs-kernel-target", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Also emit the kernels for <cpu>:<features> and pick the "
+                   "best supported version at load time (arm64; best first)"));
+
+llvm::cl::opt<unsigned>
+OptLoopUnrollThreshold("rs-unroll-threshold",
+    llvm::cl::desc("Cost threshold of the loop unroller when auto-vectorizing "
+                   "(default: LLVM's)"));
+
+llvm::cl::opt<int>
+OptSLPVectorizeThreshold("rs-slp-threshold",
+    llvm::cl::desc("Cost threshold of the SLP vectorizer when auto-vectorizing "
+                   "(default: LLVM's)"));
+
 // Override "bcc -version" since the LLVM version information is not correct on
 // Android build.
 void BCCVersionPrinter() {
@@ -194,6 +416,56 @@ void extractSourcesAndSlots(const llvm::cl::list<std::string>& optList,
   }
 }
 
+std::pair<int, int> parseSourceAndSlot(const std::string& str) {
+  size_t found = str.find(',');
+  return std::make_pair(std::stoi(str.substr(0, found)),
+                        std::stoi(str.substr(found + 1)));
+}
+
+// Let the driver pick the kernels to merge from the -group-edge options.
+bool planFusionFromEdges(const std::vector<bcc::Source*>& sources,
+                         std::list<std::string>* fusedKernelNames,
+                         std::list<std::list<std::pair<int, int>>>* sourcesAndSlots) {
+  std::vector<ScriptGroupEdge> edges;
+  for (const std::string& edgeStr : OptGroupEdges) {
+    size_t found = edgeStr.find(':');
+    size_t inputFound = edgeStr.find(':', found + 1);
+    ScriptGroupEdge edge;
+    edge.mProducer = parseSourceAndSlot(edgeStr.substr(0, found));
+    edge.mConsumer = parseSourceAndSlot(edgeStr.substr(found + 1, inputFound - found - 1));
+    edge.mInput = (inputFound == std::string::npos) ? 0 :
+                  std::stoi(edgeStr.substr(inputFound + 1));
+    edges.push_back(edge);
+  }
+
+  std::vector<std::pair<int, int>> outputs;
+  for (const std::string& outputStr : OptGroupOutputs) {
+    outputs.push_back(parseSourceAndSlot(outputStr));
+  }
+
+  std::list<size_t> bytesSaved;
+  if (!RSCompilerDriver::planScriptGroupFusion(sources, edges, outputs, sourcesAndSlots,
+                                              fusedKernelNames, &bytesSaved)) {
+    return false;
+  }
+
+  if (OptPrintFusionPlan) {
+    // Print the plan using the -merge syntax.
+    auto planIter = sourcesAndSlots->begin();
+    auto savedIter = bytesSaved.begin();
+    for (const std::string& name : *fusedKernelNames) {
+      llvm::outs() << "-merge " << name << ":";
+      const char* separator = "";
+      for (const std::pair<int, int>& kernel : *planIter++) {
+        llvm::outs() << separator << kernel.first << "," << kernel.second;
+        separator = ".";
+      }
+      llvm::outs() << "  # saves " << *savedIter++ << " bytes per cell\n";
+    }
+  }
+  return true;
+}
+
 bool compileScriptGroup(BCCContext& Context, RSCompilerDriver& RSCD) {
   std::vector<bcc::Source*> sources;
   for (unsigned i = 0; i < OptInputFilenames.size(); ++i) {
@@ -209,11 +481,36 @@ bool compileScriptGroup(BCCContext& Context, RSCompilerDriver& RSCD) {
   std::list<std::string> fusedKernelNames;
   std::list<std::list<std::pair<int, int>>> sourcesAndSlots;
   extractSourcesAndSlots(OptMergePlans, &fusedKernelNames, &sourcesAndSlots);
+  if (OptMergePlans.empty() &&
+      !planFusionFromEdges(sources, &fusedKernelNames, &sourcesAndSlots)) {
+    return false;
+  }
+
+  std::list<std::string> fusedReduceNames;
+  std::list<std::list<std::pair<int, int>>> reduceSourcesAndSlots;
+  extractSourcesAndSlots(OptMergeReducePlans, &fusedReduceNames, &reduceSourcesAndSlots);
+
+  std::list<std::string> fusedFanOutNames;
+  std::list<std::list<std::pair<int, int>>> fanOutSourcesAndSlots;
+  extractSourcesAndSlots(OptMergeFanOutPlans, &fusedFanOutNames, &fanOutSourcesAndSlots);
 
   std::list<std::string> invokeBatchNames;
   std::list<std::list<std::pair<int, int>>> invokeSourcesAndSlots;
   extractSourcesAndSlots(OptInvokes, &invokeBatchNames, &invokeSourcesAndSlots);
 
+  std::list<ScriptGroupStencilFusion> stencilFusions;
+  for (const std::string& plan : OptMergeStencilPlans) {
+    size_t nameEnd = plan.find(':');
+    size_t kernelsEnd = plan.find(':', nameEnd + 1);
+    size_t dot = plan.find('.', nameEnd + 1);
+    ScriptGroupStencilFusion stencil;
+    stencil.mName = plan.substr(0, nameEnd);
+    stencil.mProducer = parseSourceAndSlot(plan.substr(nameEnd + 1, dot - nameEnd - 1));
+    stencil.mConsumer = parseSourceAndSlot(plan.substr(dot + 1, kernelsEnd - dot - 1));
+    stencil.mAllocation = plan.substr(kernelsEnd + 1);
+    stencilFusions.push_back(stencil);
+  }
+
   std::string outputFilepath(OptOutputPath);
   outputFilepath.append("/");
   outputFilepath.append(OptOutputFilename);
@@ -222,11 +519,124 @@ bool compileScriptGroup(BCCContext& Context, RSCompilerDriver& RSCD) {
     Context, outputFilepath.c_str(), OptBCLibFilename.c_str(),
     OptBCLibRelaxedFilename.c_str(), OptEmitLLVM, OptChecksum.c_str(),
     sources, sourcesAndSlots, fusedKernelNames,
-    invokeSourcesAndSlots, invokeBatchNames);
+    invokeSourcesAndSlots, invokeBatchNames,
+    reduceSourcesAndSlots, fusedReduceNames, stencilFusions,
+    fanOutSourcesAndSlots, fusedFanOutNames);
 
   return success;
 }
 
+// Write the statistics of the last build if -stats-json was given. Statistics
+// are written for failed builds too, since those are often the slow ones.
+void writeBuildStats(const RSCompilerDriver &RSCD) {
+  if (OptStatsFilename.empty()) {
+    return;
+  }
+
+  std::error_code error;
+  llvm::raw_fd_ostream out(OptStatsFilename, error, llvm::sys::fs::F_Text);
+  if (error) {
+    ALOGE("Unable to open %s for write! (%s)", OptStatsFilename.c_str(),
+          error.message().c_str());
+    return;
+  }
+  RSCD.getLastBuildStats().writeJSON(out);
+}
+
+// Print the machine code statistics of the kernels if -kernel-report was
+// given.
+void writeKernelReport(const RSCompilerDriver &RSCD) {
+  if (!OptKernelReport) {
+    return;
+  }
+
+  const BuildStats &stats = RSCD.getLastBuildStats();
+  if (stats.isCacheHit()) {
+    llvm::errs() << "No kernel report: the object came from the cache\n";
+    return;
+  }
+  for (const BuildStats::KernelCodeStats &kernel : stats.getKernelCodeStats()) {
+    llvm::errs() << kernel.mFunction << ": stack " << kernel.mStackSize
+                 << " bytes, " << kernel.mSpills << " spills, "
+                 << kernel.mReloads << " reloads, " << kernel.mInstructions
+                 << " instructions\n";
+  }
+}
+
+// Print the IR instruction counts of the functions if -print-ir-sizes was
+// given.
+void writeIRSizes(const RSCompilerDriver &RSCD) {
+  if (!OptPrintIRSizes) {
+    return;
+  }
+
+  const BuildStats &stats = RSCD.getLastBuildStats();
+  if (stats.isCacheHit()) {
+    llvm::errs() << "No IR sizes: the object came from the cache\n";
+    return;
+  }
+  for (const BuildStats::IRSize &size : stats.getIRSizes()) {
+    llvm::errs() << size.mPoint << ": " << size.mFunction << ": "
+                 << size.mInstructions << " instructions\n";
+  }
+}
+
+// Compile the bitcode file pInput on its own into the object pOutputName in
+// OptOutputPath.
+bool compileInput(BCCContext &Context, RSCompilerDriver &RSCD,
+                  const std::string &pInput, const std::string &pOutputName) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+      llvm::MemoryBuffer::getFile(pInput.c_str(), /* FileSize */-1,
+                                  /* RequiresNullTerminator */false);
+  if (mb_or_error.getError()) {
+    ALOGE("Failed to load bitcode from path %s! (%s)",
+          pInput.c_str(), mb_or_error.getError().message().c_str());
+    return false;
+  }
+  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
+
+  const char *bitcode = input_data->getBufferStart();
+  size_t bitcodeSize = input_data->getBufferSize();
+
+  if (!OptEmbedRSInfo) {
+    return RSCD.build(Context, OptOutputPath.c_str(), pOutputName.c_str(),
+                      bitcode, bitcodeSize,
+                      OptChecksum.c_str(), OptBCLibFilename.c_str(),
+                      nullptr, OptEmitLLVM);
+  }
+
+  // embedRSInfo is set.  Use buildForCompatLib to embed RS symbol information
+  // into the .rs.info symbol.
+  Source *source = Source::CreateFromBuffer(Context, pInput.c_str(),
+                                            bitcode, bitcodeSize);
+
+  // If the bitcode fails verification in the bitcode loader, the returned Source is set to NULL.
+  if (!source) {
+    ALOGE("Failed to load source from file %s", pInput.c_str());
+    return false;
+  }
+
+  std::unique_ptr<Script> s(new (std::nothrow) Script(source));
+  if (s == nullptr) {
+    llvm::errs() << "Out of memory when creating script for file `"
+                 << pInput << "'!\n";
+    delete source;
+    return false;
+  }
+
+  s->setOptimizationLevel(RSCD.getConfig()->getOptimizationLevel());
+  llvm::SmallString<80> output(OptOutputPath);
+  llvm::sys::path::append(output, "/", pOutputName);
+  llvm::sys::path::replace_extension(output, ".o");
+
+  if (!RSCD.buildForCompatLib(*s, output.c_str(), OptChecksum.c_str(),
+                              OptBCLibFilename.c_str(), OptEmitLLVM)) {
+    fprintf(stderr, "Failed to compile script!");
+    return false;
+  }
+  return true;
+}
+
 } // end anonymous namespace
 
 static inline
@@ -260,6 +670,38 @@ bool ConfigCompiler(RSCompilerDriver &pRSCD) {
     }
   }
 
+  if (OptTiledKernels) {
+    config->setTiledKernels(true);
+  }
+  config->setReduceAccumulators(OptReduceAccumulators);
+  if (OptPrefetchDistance.getNumOccurrences() > 0) {
+    config->setPrefetchDistance(OptPrefetchDistance);
+  }
+  if (OptHostCPU) {
+    config->setUseHostCPU(true);
+  }
+  if (OptOptimizeForSize) {
+    config->setOptimizeForSize(true);
+  }
+  for (const std::string &target : OptKernelTargets) {
+    const size_t colon = target.find(':');
+    if (colon == std::string::npos) {
+      llvm::errs() << "Invalid kernel target (expected <cpu>:<features>): "
+                   << target << '\n';
+      continue;
+    }
+    config->addKernelVariant(target.substr(0, colon), target.substr(colon + 1));
+  }
+  if (OptAutoVectorize != llvm::cl::BOU_UNSET) {
+    config->setAutoVectorize(OptAutoVectorize == llvm::cl::BOU_TRUE);
+  }
+  if (OptLoopUnrollThreshold.getNumOccurrences() > 0) {
+    config->setLoopUnrollThreshold(OptLoopUnrollThreshold);
+  }
+  if (OptSLPVectorizeThreshold.getNumOccurrences() > 0) {
+    config->setSLPVectorizeThreshold(OptSLPVectorizeThreshold);
+  }
+
   pRSCD.setConfig(config);
   Compiler::ErrorCode result = RSC->config(*config);
 
@@ -267,6 +709,10 @@ bool ConfigCompiler(RSCompilerDriver &pRSCD) {
     pRSCD.setDebugContext(true);
   }
 
+  if (OptRSOptimizedDebug) {
+    pRSCD.setOptimizedDebug(true);
+  }
+
   if (OptRSGlobalInfo) {
     pRSCD.setEmbedGlobalInfo(true);
   }
@@ -275,6 +721,48 @@ bool ConfigCompiler(RSCompilerDriver &pRSCD) {
     pRSCD.setEmbedGlobalInfoSkipConstant(true);
   }
 
+  if (OptEmbedRSBinaryInfo) {
+    pRSCD.setEmbedBinaryInfo(true);
+  }
+
+  pRSCD.setScriptGroupPreOptJobs(OptScriptGroupPreOptJobs);
+  pRSCD.setRuntimeImportLimit(OptRuntimeImportLimit);
+  pRSCD.setProfileGenerate(OptProfileGenerate);
+  pRSCD.setProfileUse(OptProfileUse);
+  pRSCD.setKernelReport(OptKernelReport);
+  pRSCD.setStreamingCodeGen(OptStreamingCodeGen);
+  pRSCD.setEnableGlobalLayout(OptGlobalLayout);
+  pRSCD.setOptimizationRemarks(OptRemarks);
+
+  unsigned dumpPoints = 0;
+  for (const std::string &point : OptDumpIRAt) {
+    const Compiler::IRDumpPoint points[] = {
+      Compiler::kIRDumpAfterExpand, Compiler::kIRDumpAfterLTO,
+      Compiler::kIRDumpBeforeCodeGen
+    };
+    unsigned found = 0;
+    for (Compiler::IRDumpPoint p : points) {
+      if (point == Compiler::GetIRDumpPointName(p)) {
+        found = p;
+      }
+    }
+    if (found == 0) {
+      llvm::errs() << "Invalid IR dump point: " << point << '\n';
+      return false;
+    }
+    dumpPoints |= found;
+  }
+  if (dumpPoints == 0 && OptPrintIRSizes) {
+    pRSCD.setIRDump(Compiler::kIRDumpAllPoints, OptDumpIRKernels,
+                    /* pDumpFiles */false, /* pCountInstructions */true);
+  } else {
+    pRSCD.setIRDump(dumpPoints, OptDumpIRKernels, /* pDumpFiles */true,
+                    OptPrintIRSizes);
+  }
+  pRSCD.setMemoryBudget(static_cast<size_t>(OptMemoryBudget) * 1024 * 1024);
+  pRSCD.setCacheBudget(static_cast<uint64_t>(OptCacheBudget) * 1024 * 1024);
+  pRSCD.setComputeBuildChecksum(OptComputeChecksum);
+
   if (result != Compiler::kSuccess) {
     llvm::errs() << "Failed to configure the compiler! (detail: "
                  << Compiler::GetErrorString(result) << ")\n";
@@ -284,6 +772,113 @@ bool ConfigCompiler(RSCompilerDriver &pRSCD) {
   return true;
 }
 
+// Compile every input on its own (see -independent) with pNumJobs threads,
+// each with its own context and driver, set up by pSetup.
+static
+bool compileIndependentInputs(unsigned pNumJobs,
+                              const std::function<bool(RSCompilerDriver &)> &pSetup) {
+  // Name each object after its input, which must not clash.
+  std::vector<std::string> outputNames;
+  std::set<std::string> seen;
+  for (const std::string &input : OptInputFilenames) {
+    std::string name = llvm::sys::path::stem(input);
+    if (!seen.insert(name).second) {
+      ALOGE("Inputs would both be compiled into %s.o", name.c_str());
+      return false;
+    }
+    outputNames.push_back(name);
+  }
+
+  if (pNumJobs == 0) {
+    pNumJobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  pNumJobs = std::min<size_t>(pNumJobs, OptInputFilenames.size());
+
+  struct Worker {
+    BCCContext mContext;
+    RSCompilerDriver mDriver;
+  };
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (unsigned i = 0; i < pNumJobs; i++) {
+    std::unique_ptr<Worker> worker(new (std::nothrow) Worker());
+    if (worker == nullptr) {
+      llvm::errs() << "Out of memory when creating the compiler workers!\n";
+      return false;
+    }
+    if (!pSetup(worker->mDriver)) {
+      return false;
+    }
+    workers.push_back(std::move(worker));
+  }
+
+  std::atomic<size_t> nextInput(0);
+  std::atomic<bool> success(true);
+  std::mutex reportLock;
+  std::vector<std::thread> threads;
+  for (std::unique_ptr<Worker> &worker : workers) {
+    Worker *w = worker.get();
+    threads.emplace_back([&, w] {
+      for (size_t i = nextInput++; i < OptInputFilenames.size(); i = nextInput++) {
+        const std::string &input = OptInputFilenames[i];
+        if (!compileInput(w->mContext, w->mDriver, input, outputNames[i])) {
+          ALOGE("Failed to compile %s", input.c_str());
+          success = false;
+        }
+        if (OptKernelReport) {
+          std::lock_guard<std::mutex> lock(reportLock);
+          llvm::errs() << input << ":\n";
+          writeKernelReport(w->mDriver);
+        }
+        if (OptPrintIRSizes) {
+          std::lock_guard<std::mutex> lock(reportLock);
+          llvm::errs() << input << ":\n";
+          writeIRSizes(w->mDriver);
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return success;
+}
+
+// Compile every input, and the shared runtime they use (see -app-runtime),
+// with pRSCD.
+static
+bool compileApp(BCCContext &pContext, RSCompilerDriver &pRSCD) {
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> inputs;
+  std::vector<RSAppScript> scripts;
+  std::set<std::string> seen;
+  for (const std::string &input : OptInputFilenames) {
+    std::string name = llvm::sys::path::stem(input);
+    if (!seen.insert(name).second || name == OptAppRuntime) {
+      ALOGE("Inputs would both be compiled into %s.o", name.c_str());
+      return false;
+    }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+        llvm::MemoryBuffer::getFile(input.c_str(), /* FileSize */-1,
+                                    /* RequiresNullTerminator */false);
+    if (mb_or_error.getError()) {
+      ALOGE("Failed to load bitcode from path %s! (%s)",
+            input.c_str(), mb_or_error.getError().message().c_str());
+      return false;
+    }
+    inputs.push_back(std::move(mb_or_error.get()));
+
+    RSAppScript script;
+    script.mResName = name;
+    script.mBitcode = inputs.back()->getBufferStart();
+    script.mBitcodeSize = inputs.back()->getBufferSize();
+    script.mBuildChecksum = OptChecksum;
+    scripts.push_back(script);
+  }
+
+  return pRSCD.buildApp(pContext, OptOutputPath.c_str(), scripts,
+                        OptBCLibFilename.c_str(), OptAppRuntime.c_str());
+}
+
 int main(int argc, char **argv) {
 
   llvm::llvm_shutdown_obj Y;
@@ -314,81 +909,92 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  if (!ConfigCompiler(RSCD)) {
-    ALOGE("Failed to configure compiler");
-    return EXIT_FAILURE;
-  }
-
   // Attempt to dynamically initialize the compiler driver if such a function
   // is present. It is only present if passed via "-load libFOO.so".
   RSCompilerDriverInit_t rscdi = (RSCompilerDriverInit_t)
       dlsym(RTLD_DEFAULT, STR(RS_COMPILER_DRIVER_INIT_FN));
-  if (rscdi != nullptr) {
-    rscdi(&RSCD);
-  }
-
-  if (OptMergePlans.size() > 0) {
-    bool success = compileScriptGroup(context, RSCD);
 
-    if (!success) {
-      return EXIT_FAILURE;
+  auto SetupDriver = [rscdi](RSCompilerDriver &pRSCD) {
+    if (!ConfigCompiler(pRSCD)) {
+      ALOGE("Failed to configure compiler");
+      return false;
     }
+    if (rscdi != nullptr) {
+      rscdi(&pRSCD);
+    }
+    return true;
+  };
 
-    return EXIT_SUCCESS;
+  if (!OptServerSocket.empty()) {
+    return runCompileServer(OptServerSocket, OptServerJobs, OptBCLibFilename,
+                            SetupDriver);
   }
 
-  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
-      llvm::MemoryBuffer::getFile(OptInputFilenames[0].c_str());
-  if (mb_or_error.getError()) {
-    ALOGE("Failed to load bitcode from path %s! (%s)",
-          OptInputFilenames[0].c_str(), mb_or_error.getError().message().c_str());
+  if (OptInputFilenames.empty()) {
+    ALOGE("Failed to compile bitcode, no input file was specified");
     return EXIT_FAILURE;
   }
-  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
 
-  const char *bitcode = input_data->getBufferStart();
-  size_t bitcodeSize = input_data->getBufferSize();
-
-  if (!OptEmbedRSInfo) {
-    bool built = RSCD.build(context, OptOutputPath.c_str(),
-                            OptOutputFilename.c_str(),
-                            bitcode, bitcodeSize,
-                            OptChecksum.c_str(), OptBCLibFilename.c_str(),
-                            nullptr, OptEmitLLVM);
+  const bool isScriptGroup =
+      OptMergePlans.size() > 0 || OptMergeReducePlans.size() > 0 ||
+      OptMergeStencilPlans.size() > 0 || OptMergeFanOutPlans.size() > 0 ||
+      OptInvokes.size() > 0 || OptGroupEdges.size() > 0;
 
-    if (!built) {
+  if (OptIndependent || OptJobs.getNumOccurrences() > 0) {
+    if (!OptAppRuntime.empty()) {
+      ALOGE("-app-runtime builds its inputs in one session, not independently");
       return EXIT_FAILURE;
     }
-  } else {
-    // embedRSInfo is set.  Use buildForCompatLib to embed RS symbol information
-    // into the .rs.info symbol.
-    Source *source = Source::CreateFromBuffer(context, OptInputFilenames[0].c_str(),
-                                              bitcode, bitcodeSize);
-
-    // If the bitcode fails verification in the bitcode loader, the returned Source is set to NULL.
-    if (!source) {
-      ALOGE("Failed to load source from file %s", OptInputFilenames[0].c_str());
+    if (isScriptGroup) {
+      ALOGE("Independent inputs cannot be merged into a script group");
       return EXIT_FAILURE;
     }
+    if (!OptStatsFilename.empty()) {
+      ALOGW("Build statistics are not written for independent inputs");
+    }
+    return compileIndependentInputs(OptJobs, SetupDriver) ? EXIT_SUCCESS
+                                                          : EXIT_FAILURE;
+  }
 
-    std::unique_ptr<Script> s(new (std::nothrow) Script(source));
-    if (s == nullptr) {
-      llvm::errs() << "Out of memory when creating script for file `"
-                   << OptInputFilenames[0] << "'!\n";
-      delete source;
+  if (!SetupDriver(RSCD)) {
+    return EXIT_FAILURE;
+  }
+
+  if (!OptAppRuntime.empty()) {
+    if (isScriptGroup) {
+      ALOGE("The inputs of an app cannot be merged into a script group");
       return EXIT_FAILURE;
     }
+    if (OptEmbedRSInfo || OptEmitLLVM) {
+      ALOGW("-embedRSInfo and -emit-llvm are ignored with -app-runtime");
+    }
+    bool success = compileApp(context, RSCD);
+    writeKernelReport(RSCD);
+    writeIRSizes(RSCD);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-    s->setOptimizationLevel(RSCD.getConfig()->getOptimizationLevel());
-    llvm::SmallString<80> output(OptOutputPath);
-    llvm::sys::path::append(output, "/", OptOutputFilename);
-    llvm::sys::path::replace_extension(output, ".o");
+  if (isScriptGroup) {
+    bool success = compileScriptGroup(context, RSCD);
+    writeBuildStats(RSCD);
+    writeKernelReport(RSCD);
+    writeIRSizes(RSCD);
 
-    if (!RSCD.buildForCompatLib(*s, output.c_str(), OptChecksum.c_str(),
-                                OptBCLibFilename.c_str(), OptEmitLLVM)) {
-      fprintf(stderr, "Failed to compile script!");
+    if (!success) {
       return EXIT_FAILURE;
     }
+
+    return EXIT_SUCCESS;
+  }
+
+  bool built = compileInput(context, RSCD, OptInputFilenames[0],
+                            OptOutputFilename);
+  writeBuildStats(RSCD);
+  writeKernelReport(RSCD);
+  writeIRSizes(RSCD);
+
+  if (!built) {
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
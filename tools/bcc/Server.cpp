@@ -0,0 +1,366 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Server.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <bcc/BCCContext.h>
+#include <bcc/RSCompilerDriver.h>
+#include <bcc/Source.h>
+
+using namespace bcc;
+
+namespace {
+
+// Upper bound of the size of the options of a request.
+const uint32_t kMaxRequestOptionsSize = 64 * 1024;
+
+// Bytes of bitcode a worker's context loads before it is recycled (see
+// BCCContext::setRecycleThreshold()), so that a long-running server doesn't
+// keep growing.
+const size_t kWorkerContextRecycleThreshold = 64 * 1024 * 1024;
+
+// A compile request read from a client connection.
+struct CompileRequest {
+  int mInputFd;
+  int mOutputFd;
+  std::string mName;
+  std::string mChecksum;
+
+  CompileRequest() : mInputFd(-1), mOutputFd(-1), mName("bcc_output") { }
+
+  ~CompileRequest() {
+    if (mInputFd >= 0) {
+      ::close(mInputFd);
+    }
+    if (mOutputFd >= 0) {
+      ::close(mOutputFd);
+    }
+  }
+};
+
+bool readFully(int pFd, void *pBuffer, size_t pSize) {
+  char *buffer = static_cast<char *>(pBuffer);
+  while (pSize > 0) {
+    ssize_t n = ::read(pFd, buffer, pSize);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buffer += n;
+    pSize -= n;
+  }
+  return true;
+}
+
+bool writeFully(int pFd, const void *pBuffer, size_t pSize) {
+  const char *buffer = static_cast<const char *>(pBuffer);
+  while (pSize > 0) {
+    ssize_t n = ::write(pFd, buffer, pSize);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buffer += n;
+    pSize -= n;
+  }
+  return true;
+}
+
+// Read the file descriptors and the options of a request from pConnection
+// (see runCompileServer()). On error, pError is set to the reason.
+bool readRequest(int pConnection, CompileRequest &pRequest, std::string &pError) {
+  uint32_t length;
+  struct iovec iov;
+  iov.iov_base = &length;
+  iov.iov_len = sizeof(length);
+
+  union {
+    struct cmsghdr mAlign;
+    char mBuffer[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.mBuffer;
+  msg.msg_controllen = sizeof(control.mBuffer);
+
+  ssize_t received;
+  do {
+    received = ::recvmsg(pConnection, &msg, 0);
+  } while (received < 0 && errno == EINTR);
+  if (received <= 0) {
+    pError = "Unable to read the request";
+    return false;
+  }
+
+  std::vector<int> fds;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+    fds.insert(fds.end(), data, data + count);
+  }
+  if (fds.size() >= 1) {
+    pRequest.mInputFd = fds[0];
+  }
+  if (fds.size() >= 2) {
+    pRequest.mOutputFd = fds[1];
+  }
+  for (size_t i = 2; i < fds.size(); i++) {
+    ::close(fds[i]);
+  }
+  if ((msg.msg_flags & MSG_CTRUNC) || fds.size() != 2) {
+    pError = "Expected the input and the output file descriptors";
+    return false;
+  }
+
+  // The rest of the length may come separately from the descriptors.
+  if (static_cast<size_t>(received) < sizeof(length) &&
+      !readFully(pConnection, reinterpret_cast<char *>(&length) + received,
+                 sizeof(length) - received)) {
+    pError = "Unable to read the request";
+    return false;
+  }
+  if (length > kMaxRequestOptionsSize) {
+    pError = "Request options are too large";
+    return false;
+  }
+
+  std::vector<char> options(length);
+  if (length > 0 && !readFully(pConnection, options.data(), length)) {
+    pError = "Unable to read the request options";
+    return false;
+  }
+
+  llvm::SmallVector<llvm::StringRef, 4> entries;
+  llvm::StringRef(options.data(), options.size())
+      .split(entries, '\0', -1, /* KeepEmpty */ false);
+  for (llvm::StringRef entry : entries) {
+    std::pair<llvm::StringRef, llvm::StringRef> option = entry.split('=');
+    if (option.first == "name") {
+      pRequest.mName = option.second;
+    } else if (option.first == "checksum") {
+      pRequest.mChecksum = option.second;
+    } else {
+      pError = "Unknown request option: " + option.first.str();
+      return false;
+    }
+  }
+  if (pRequest.mName.empty() || pRequest.mName.find('/') != std::string::npos) {
+    pError = "Invalid script name: " + pRequest.mName;
+    return false;
+  }
+  return true;
+}
+
+// A worker of the server, with the context and the driver it keeps across
+// requests.
+struct Worker {
+  BCCContext mContext;
+  RSCompilerDriver mDriver;
+};
+
+// Serve the request on pConnection with pWorker, and close the connection.
+void handleConnection(int pConnection, Worker &pWorker,
+                      const std::string &pRuntimePath) {
+  uint32_t status = 1;
+  std::string error;
+
+  {
+    CompileRequest request;
+    if (readRequest(pConnection, request, error)) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> input =
+          llvm::MemoryBuffer::getOpenFile(request.mInputFd, request.mName,
+                                          /* FileSize */-1,
+                                          /* RequiresNullTerminator */false);
+      if (input.getError()) {
+        error = "Unable to read the bitcode: " + input.getError().message();
+      } else {
+        // Compile into memory, so that the output may be a pipe.
+        llvm::SmallVector<char, 0> object;
+        llvm::raw_svector_ostream objectStream(object);
+        if (!pWorker.mDriver.build(pWorker.mContext, request.mName.c_str(),
+                                   (*input)->getBufferStart(),
+                                   (*input)->getBufferSize(),
+                                   request.mChecksum.c_str(),
+                                   pRuntimePath.c_str(), objectStream)) {
+          error = "Failed to compile " + request.mName;
+        } else if (!writeFully(request.mOutputFd, object.data(), object.size())) {
+          error = "Unable to write the object: " + std::string(strerror(errno));
+        } else {
+          status = 0;
+        }
+      }
+    }
+  }
+
+  if (status != 0) {
+    ALOGE("bcc server: %s", error.c_str());
+  }
+  const uint32_t errorLength = error.size();
+  if (!writeFully(pConnection, &status, sizeof(status)) ||
+      !writeFully(pConnection, &errorLength, sizeof(errorLength)) ||
+      !writeFully(pConnection, error.data(), error.size())) {
+    ALOGW("bcc server: unable to reply to the client");
+  }
+  ::close(pConnection);
+}
+
+// Connections accepted by the server and not yet picked up by a worker.
+class ConnectionQueue {
+private:
+  std::mutex mLock;
+  std::condition_variable mAvailable;
+  std::deque<int> mConnections;
+
+public:
+  void push(int pConnection) {
+    {
+      std::lock_guard<std::mutex> lock(mLock);
+      mConnections.push_back(pConnection);
+    }
+    mAvailable.notify_one();
+  }
+
+  int pop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    mAvailable.wait(lock, [this] { return !mConnections.empty(); });
+    int connection = mConnections.front();
+    mConnections.pop_front();
+    return connection;
+  }
+};
+
+} // end anonymous namespace
+
+namespace bcc {
+
+int runCompileServer(const std::string &pSocketPath, unsigned pNumWorkers,
+                     const std::string &pRuntimePath,
+                     const CompileServerSetup &pSetup) {
+  if (pNumWorkers == 0) {
+    pNumWorkers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Clients that go away early must not take the server down.
+  ::signal(SIGPIPE, SIG_IGN);
+
+  // Set all workers up before accepting anything, and read the runtime
+  // library into their caches.
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (unsigned i = 0; i < pNumWorkers; i++) {
+    std::unique_ptr<Worker> worker(new (std::nothrow) Worker());
+    if (worker == nullptr) {
+      llvm::errs() << "Out of memory when creating the server workers!\n";
+      return EXIT_FAILURE;
+    }
+    if (!pSetup(worker->mDriver)) {
+      return EXIT_FAILURE;
+    }
+    worker->mContext.setRecycleThreshold(kWorkerContextRecycleThreshold);
+    delete worker->mContext.loadRuntimeLibrary(pRuntimePath, /* pLazy */true);
+    workers.push_back(std::move(worker));
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (pSocketPath.size() >= sizeof(address.sun_path)) {
+    ALOGE("Server socket path is too long: %s", pSocketPath.c_str());
+    return EXIT_FAILURE;
+  }
+  strncpy(address.sun_path, pSocketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    ALOGE("Unable to create the server socket! (%s)", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  // A socket left behind by a previous server would make bind() fail.
+  ::unlink(pSocketPath.c_str());
+  if (::bind(listener, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+      ::listen(listener, SOMAXCONN) != 0) {
+    ALOGE("Unable to listen on %s! (%s)", pSocketPath.c_str(), strerror(errno));
+    ::close(listener);
+    return EXIT_FAILURE;
+  }
+
+  // The workers run until the process exits, so they and the queue are never
+  // destroyed.
+  ConnectionQueue *queue = new ConnectionQueue();
+  const std::string runtimePath = pRuntimePath;
+  for (std::unique_ptr<Worker> &worker : workers) {
+    Worker *w = worker.release();
+    std::thread([queue, w, runtimePath] {
+      while (true) {
+        handleConnection(queue->pop(), *w, runtimePath);
+      }
+    }).detach();
+  }
+
+  while (true) {
+    int connection = ::accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      ALOGE("Unable to accept a connection on %s! (%s)", pSocketPath.c_str(),
+            strerror(errno));
+      break;
+    }
+    queue->push(connection);
+  }
+
+  ::close(listener);
+  return EXIT_FAILURE;
+}
+
+} // end namespace bcc
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_TOOLS_BCC_SERVER_H
+#define BCC_TOOLS_BCC_SERVER_H
+
+#include <functional>
+#include <string>
+
+namespace bcc {
+
+class RSCompilerDriver;
+
+// Configures the driver of a server worker the way a bcc invocation would
+// configure its own. Returns false on error.
+typedef std::function<bool(RSCompilerDriver &)> CompileServerSetup;
+
+/*
+ * Serve compile requests on the Unix stream socket at pSocketPath until the
+ * process is killed, with pNumWorkers threads. Each worker keeps its own
+ * BCCContext and RSCompilerDriver, configured once by pSetup, so the targets
+ * are initialized and the runtime library at pRuntimePath is parsed only once
+ * per worker rather than once per script. The contexts are recycled from time
+ * to time (see BCCContext::recycle()) to bound their memory use.
+ *
+ * A client sends one request per connection:
+ *
+ *  - a uint32_t length L in host byte order, in a message carrying two file
+ *    descriptors (SCM_RIGHTS): the bitcode to compile, read from its start,
+ *    and the file (or pipe) the object is written to;
+ *  - L bytes of NUL-terminated "key=value" options: "name" gives the
+ *    resource name of the script (default "bcc_output"), and "checksum" the
+ *    build checksum to embed.
+ *
+ * The server answers with a uint32_t status (0 on success) followed by a
+ * uint32_t length and as many bytes of error message, then closes the
+ * connection. The other options of the compilation are those the server was
+ * started with.
+ *
+ * Returns only on error, with a process exit code.
+ */
+int runCompileServer(const std::string &pSocketPath, unsigned pNumWorkers,
+                     const std::string &pRuntimePath,
+                     const CompileServerSetup &pSetup);
+
+} // end namespace bcc
+
+#endif  // BCC_TOOLS_BCC_SERVER_H
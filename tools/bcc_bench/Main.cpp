@@ -0,0 +1,310 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// bcc_bench compiles a corpus of RenderScript bitcode files through
+// RSCompilerDriver a number of times and reports latency percentiles for each
+// build phase, so compile-time regressions (e.g. after an LLVM rebase) can be
+// caught on the host before they reach devices.
+//
+// Every iteration uses a fresh BCCContext and RSCompilerDriver with the
+// object cache disabled, so each sample is a cold compile like the one bcc
+// performs at install time.
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdlib.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <bcc/BCCContext.h>
+#include <bcc/BuildStats.h>
+#include <bcc/CompilerConfig.h>
+#include <bcc/Config.h>
+#include <bcc/Initialization.h>
+#include <bcc/RSCompilerDriver.h>
+#include <bcc/Source.h>
+
+using namespace bcc;
+
+namespace {
+
+llvm::cl::list<std::string>
+OptInputFilenames(llvm::cl::Positional, llvm::cl::OneOrMore,
+                  llvm::cl::desc("<input bitcode files>"));
+
+llvm::cl::opt<std::string>
+OptBCLibFilename("bclib", llvm::cl::desc("Specify the bclib filename"),
+                 llvm::cl::value_desc("bclib"), llvm::cl::Required);
+
+llvm::cl::opt<std::string>
+OptBCLibRelaxedFilename("bclib_relaxed", llvm::cl::desc("Specify the bclib filename optimized for "
+                                                        "relaxed precision floating point maths"),
+                        llvm::cl::init(""),
+                        llvm::cl::value_desc("bclib_relaxed"));
+
+llvm::cl::opt<std::string>
+OptTargetTriple("mtriple",
+                llvm::cl::desc("Specify the target triple (default: "
+                               DEFAULT_TARGET_TRIPLE_STRING ")"),
+                llvm::cl::init(DEFAULT_TARGET_TRIPLE_STRING),
+                llvm::cl::value_desc("triple"));
+
+llvm::cl::opt<unsigned>
+OptIterations("n", llvm::cl::desc("Number of times each input is compiled "
+                                  "(default: 10)"),
+              llvm::cl::init(10));
+
+llvm::cl::opt<std::string>
+OptOutputPath("output_path",
+              llvm::cl::desc("Directory for the objects produced while "
+                             "benchmarking (default: a new temporary "
+                             "directory)"),
+              llvm::cl::value_desc("output path"));
+
+llvm::cl::opt<bool>
+OptScriptGroup("group",
+               llvm::cl::desc("Compile all inputs together as one script "
+                              "group through buildScriptGroup()"));
+
+llvm::cl::list<std::string>
+OptMergePlans("merge", llvm::cl::ZeroOrMore,
+              llvm::cl::desc("With -group, kernels to merge, using the same "
+                             "syntax as bcc"));
+
+// All samples of every measurement for one benchmarked input, keyed by
+// measurement name and kept in the order the names were first seen.
+class Measurements {
+private:
+  std::vector<std::string> mNames;
+  std::map<std::string, std::vector<double>> mSamples;
+  std::vector<long> mPeakRSSDeltas;
+
+  void add(const std::string &pName, double pValue) {
+    std::vector<double> &samples = mSamples[pName];
+    if (samples.empty()) {
+      mNames.push_back(pName);
+    }
+    samples.push_back(pValue);
+  }
+
+  // Nearest-rank percentile of pSamples.
+  static double percentile(std::vector<double> pSamples, double pPercent) {
+    std::sort(pSamples.begin(), pSamples.end());
+    size_t rank = static_cast<size_t>(
+        std::ceil(pPercent / 100.0 * pSamples.size()));
+    return pSamples[(rank == 0) ? 0 : rank - 1];
+  }
+
+public:
+  void record(const BuildStats &pStats) {
+    add("total", pStats.getTotalTime());
+    add("parse", pStats.getParseTime());
+    add("link-runtime", pStats.getLinkRuntimeTime());
+    for (const auto &pass : pStats.getPassTimes()) {
+      add(pass.first, pass.second);
+    }
+    add("codegen", pStats.getCodeGenTime());
+    mPeakRSSDeltas.push_back(pStats.getPeakRSSDelta());
+  }
+
+  void report(llvm::raw_ostream &pOut, const std::string &pInput) const {
+    pOut << pInput << " (" << mPeakRSSDeltas.size() << " runs)\n";
+    pOut << llvm::format("  %-16s %10s %10s %10s\n", "phase (ms)", "p50",
+                         "p90", "p99");
+    for (const std::string &name : mNames) {
+      const std::vector<double> &samples = mSamples.find(name)->second;
+      pOut << llvm::format("  %-16s %10.2f %10.2f %10.2f\n", name.c_str(),
+                           percentile(samples, 50), percentile(samples, 90),
+                           percentile(samples, 99));
+    }
+    // ru_maxrss is a process-wide high-water mark, so memory can only be
+    // attributed to whole builds: the largest growth any single build caused.
+    pOut << "  peak RSS growth: "
+         << *std::max_element(mPeakRSSDeltas.begin(), mPeakRSSDeltas.end())
+         << " KiB\n";
+  }
+};
+
+bool configureDriver(RSCompilerDriver &pRSCD) {
+  CompilerConfig *config = new (std::nothrow) CompilerConfig(OptTargetTriple);
+  if (config == nullptr) {
+    llvm::errs() << "Out of memory when create the compiler configuration!\n";
+    return false;
+  }
+
+  pRSCD.setConfig(config);
+  pRSCD.setEnableCache(false);
+
+  Compiler::ErrorCode result = pRSCD.getCompiler()->config(*config);
+  if (result != Compiler::kSuccess) {
+    llvm::errs() << "Failed to configure the compiler! (detail: "
+                 << Compiler::GetErrorString(result) << ")\n";
+    return false;
+  }
+  return true;
+}
+
+bool benchScript(const std::string &pInput, const std::string &pOutputPath) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+      llvm::MemoryBuffer::getFile(pInput);
+  if (mb_or_error.getError()) {
+    llvm::errs() << "Failed to load bitcode from path " << pInput << "! ("
+                 << mb_or_error.getError().message() << ")\n";
+    return false;
+  }
+  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
+  std::string res_name = llvm::sys::path::stem(pInput);
+
+  Measurements measurements;
+  for (unsigned i = 0; i < OptIterations; i++) {
+    BCCContext context;
+    RSCompilerDriver RSCD;
+    if (!configureDriver(RSCD)) {
+      return false;
+    }
+
+    if (!RSCD.build(context, pOutputPath.c_str(), res_name.c_str(),
+                    input_data->getBufferStart(), input_data->getBufferSize(),
+                    "", OptBCLibFilename.c_str())) {
+      llvm::errs() << "Failed to compile " << pInput << "!\n";
+      return false;
+    }
+    measurements.record(RSCD.getLastBuildStats());
+  }
+
+  measurements.report(llvm::outs(), pInput);
+  return true;
+}
+
+// Parse "-merge name:source,slot.source,slot..." plans like bcc does.
+void parseMergePlans(std::list<std::string> *pNames,
+                     std::list<std::list<std::pair<int, int>>> *pPlans) {
+  for (const std::string &plan : OptMergePlans) {
+    size_t found = plan.find(':');
+    pNames->push_back(plan.substr(0, found));
+
+    std::istringstream iss(plan.substr(found + 1));
+    std::string s;
+    std::list<std::pair<int, int>> plan_list;
+    while (getline(iss, s, '.')) {
+      found = s.find(',');
+      plan_list.push_back(std::make_pair(std::stoi(s.substr(0, found)),
+                                         std::stoi(s.substr(found + 1))));
+    }
+    pPlans->push_back(plan_list);
+  }
+}
+
+bool benchScriptGroup(const std::string &pOutputPath) {
+  std::list<std::string> fused_names;
+  std::list<std::list<std::pair<int, int>>> sources_and_slots;
+  parseMergePlans(&fused_names, &sources_and_slots);
+
+  const std::list<std::string> no_invoke_names;
+  const std::list<std::list<std::pair<int, int>>> no_invokes;
+
+  llvm::SmallString<80> output(pOutputPath);
+  llvm::sys::path::append(output, "script_group.o");
+
+  Measurements measurements;
+  for (unsigned i = 0; i < OptIterations; i++) {
+    BCCContext context;
+    RSCompilerDriver RSCD;
+    if (!configureDriver(RSCD)) {
+      return false;
+    }
+
+    // The sources are consumed by linking, so they are reloaded every time.
+    // They are owned (and freed) by the context.
+    std::vector<Source *> sources;
+    for (const std::string &input : OptInputFilenames) {
+      Source *source = Source::CreateFromFile(context, input);
+      if (source == nullptr) {
+        llvm::errs() << "Error loading file '" << input << "'\n";
+        return false;
+      }
+      sources.push_back(source);
+    }
+
+    if (!RSCD.buildScriptGroup(context, output.c_str(),
+                               OptBCLibFilename.c_str(),
+                               OptBCLibRelaxedFilename.c_str(), false, "",
+                               sources, sources_and_slots, fused_names,
+                               no_invokes, no_invoke_names)) {
+      llvm::errs() << "Failed to compile the script group!\n";
+      return false;
+    }
+    measurements.record(RSCD.getLastBuildStats());
+  }
+
+  measurements.report(llvm::outs(), "script group");
+  return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+  llvm::llvm_shutdown_obj _ShutdownObj;
+  init::Initialize();
+  llvm::cl::ParseCommandLineOptions(argc, argv, "RenderScript compile-latency "
+                                                "benchmark\n");
+
+  if (OptIterations == 0) {
+    llvm::errs() << "-n must be at least 1\n";
+    return EXIT_FAILURE;
+  }
+
+  std::string output_path = OptOutputPath;
+  if (output_path.empty()) {
+    llvm::SmallString<128> temp_dir;
+    std::error_code error =
+        llvm::sys::fs::createUniqueDirectory("bcc_bench", temp_dir);
+    if (error) {
+      llvm::errs() << "Unable to create a scratch directory! ("
+                   << error.message() << ")\n";
+      return EXIT_FAILURE;
+    }
+    output_path = temp_dir.str();
+  }
+
+  if (OptScriptGroup) {
+    return benchScriptGroup(output_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  for (const std::string &input : OptInputFilenames) {
+    if (!benchScript(input, output_path)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
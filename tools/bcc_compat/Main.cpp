@@ -14,14 +14,20 @@
  * limitations under the License.
  */
 
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <stdlib.h>
 
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/Config/config.h>
+#include <llvm/IR/Module.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
@@ -33,6 +39,7 @@
 #include <bcc/Initialization.h>
 #include <bcc/RSCompilerDriver.h>
 #include <bcc/Source.h>
+#include <bcinfo/MetadataExtractor.h>
 
 using namespace bcc;
 
@@ -64,6 +71,15 @@ llvm::cl::alias OptTargetTripleC("C", llvm::cl::NotHidden,
                                  llvm::cl::desc("Alias for -mtriple"),
                                  llvm::cl::aliasopt(OptTargetTriple));
 
+llvm::cl::list<std::string>
+OptTargets("target", llvm::cl::ZeroOrMore,
+           llvm::cl::desc("Compile for <triple> into <output>, against the "
+                          "runtime library <rt-path> (default: -rt-path). May "
+                          "be given once per target: the inputs are then read "
+                          "only once, and the targets compiled in parallel. "
+                          "Replaces -mtriple and -o"),
+           llvm::cl::value_desc("triple,output[,rt-path]"));
+
 //===----------------------------------------------------------------------===//
 // Compiler Options
 //===----------------------------------------------------------------------===//
@@ -144,11 +160,12 @@ Script *PrepareScript(BCCContext &pContext,
 }
 
 static inline
-bool ConfigCompiler(RSCompilerDriver &pCompilerDriver) {
+bool ConfigCompiler(RSCompilerDriver &pCompilerDriver,
+                    const std::string &pTargetTriple) {
   Compiler *compiler = pCompilerDriver.getCompiler();
   CompilerConfig *config = nullptr;
 
-  config = new (std::nothrow) CompilerConfig(OptTargetTriple);
+  config = new (std::nothrow) CompilerConfig(pTargetTriple);
   if (config == nullptr) {
     llvm::errs() << "Out of memory when create the compiler configuration!\n";
     return false;
@@ -246,35 +263,196 @@ std::string DetermineOutputFilename(const std::string &pOutputPath) {
   return output_path.c_str();
 }
 
+namespace {
+
+// A target the inputs are compiled for.
+struct CompatTarget {
+  std::string mTriple;
+  std::string mOutput;
+  std::string mRuntimePath;
+};
+
+// Read the targets from -target, or from -mtriple and -o if there is none.
+bool DetermineTargets(std::vector<CompatTarget> &pTargets) {
+  if (OptTargets.empty()) {
+    CompatTarget target;
+    target.mTriple = OptTargetTriple;
+    target.mOutput = DetermineOutputFilename(OptOutputFilename);
+    target.mRuntimePath = OptRuntimePath;
+    if (target.mOutput.empty()) {
+      return false;
+    }
+    pTargets.push_back(target);
+    return true;
+  }
+
+  if (OptTargetTriple.getNumOccurrences() > 0 ||
+      OptOutputFilename.getNumOccurrences() > 0) {
+    llvm::errs() << "-mtriple and -o can't be combined with -target!\n";
+    return false;
+  }
+
+  for (const std::string &option : OptTargets) {
+    llvm::SmallVector<llvm::StringRef, 3> fields;
+    llvm::StringRef(option).split(fields, ',');
+    if (fields.size() < 2 || fields.size() > 3 ||
+        fields[0].empty() || fields[1].empty()) {
+      llvm::errs() << "Invalid target `" << option
+                   << "' (expected <triple>,<output>[,<rt-path>])!\n";
+      return false;
+    }
+    CompatTarget target;
+    target.mTriple = fields[0];
+    target.mOutput = fields[1];
+    target.mRuntimePath = (fields.size() > 2) ? fields[2].str()
+                                              : OptRuntimePath.getValue();
+    if (target.mRuntimePath.empty()) {
+      llvm::errs() << "No runtime library for target `" << target.mTriple
+                   << "'!\n";
+      return false;
+    }
+    for (const CompatTarget &other : pTargets) {
+      if (other.mOutput == target.mOutput) {
+        llvm::errs() << "Targets `" << other.mTriple << "' and `"
+                     << target.mTriple << "' have the same output `"
+                     << target.mOutput << "'!\n";
+        return false;
+      }
+    }
+    pTargets.push_back(target);
+  }
+  return true;
+}
+
+bool BuildTarget(RSCompilerDriver &pCompilerDriver, Script &pScript,
+                 const CompatTarget &pTarget) {
+  llvm::SmallString<200> output_dir(pTarget.mOutput);
+  llvm::sys::path::remove_filename(output_dir);
+  if (!output_dir.empty()) {
+    std::error_code err = llvm::sys::fs::create_directories(output_dir);
+    if (err) {
+      llvm::errs() << "Failed to create the output directory `" << output_dir
+                   << "'! (detail: " << err.message() << ")\n";
+      return false;
+    }
+  }
+
+  if (!pCompilerDriver.buildForCompatLib(pScript, pTarget.mOutput.c_str(),
+                                         nullptr, pTarget.mRuntimePath.c_str(),
+                                         false)) {
+    llvm::errs() << "Failed to compile script for " << pTarget.mTriple
+                 << "!\n";
+    return false;
+  }
+  return true;
+}
+
+// Compile pBitcode, the merged inputs written out by main(), for pTarget in
+// a context of its own, so that the targets can be compiled concurrently.
+// pBitcode is already translated and verified.
+bool BuildTargetFromBitcode(const CompatTarget &pTarget,
+                            const std::string &pName,
+                            const std::string &pBitcode,
+                            unsigned pCompilerVersion,
+                            unsigned pOptimizationLevel) {
+  BCCContext context;
+  RSCompilerDriver rscd;
+
+  if (!ConfigCompiler(rscd, pTarget.mTriple)) {
+    return false;
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(pBitcode, pName), context.getLLVMContext());
+  if (!module) {
+    llvm::errs() << "Failed to read back the inputs for " << pTarget.mTriple
+                 << "! (detail: " << module.getError().message() << ")\n";
+    return false;
+  }
+
+  // CreateFromModule() adds the wrapper metadata of the original source back.
+  if (llvm::NamedMDNode *wrapper = (*module)->getNamedMetadata(
+          bcinfo::MetadataExtractor::kWrapperMetadataName)) {
+    wrapper->eraseFromParent();
+  }
+
+  Source *source = Source::CreateFromModule(context, pName.c_str(), **module,
+                                            pCompilerVersion,
+                                            pOptimizationLevel);
+  if (source == nullptr) {
+    return false;
+  }
+  // Ownership of the module has been passed to source.
+  module->release();
+
+  Script script(source);
+  return BuildTarget(rscd, script, pTarget);
+}
+
+} // end anonymous namespace
+
 int main(int argc, char **argv) {
   llvm::cl::SetVersionPrinter(BCCVersionPrinter);
   llvm::cl::ParseCommandLineOptions(argc, argv);
   init::Initialize();
 
-  if (OptRuntimePath.empty()) {
+  if (OptRuntimePath.empty() && OptTargets.empty()) {
     fprintf(stderr, "You must set \"-rt-path </path/to/libclcore.bc>\" with "
                     "this tool\n");
     return EXIT_FAILURE;
   }
 
-  BCCContext context;
-  RSCompilerDriver rscd;
-  Compiler compiler;
-
-  if (!ConfigCompiler(rscd)) {
+  std::vector<CompatTarget> targets;
+  if (!DetermineTargets(targets)) {
     return EXIT_FAILURE;
   }
 
-  std::string OutputFilename = DetermineOutputFilename(OptOutputFilename);
-  if (OutputFilename.empty()) {
+  BCCContext context;
+  std::unique_ptr<Script> s(PrepareScript(context, OptInputFilenames));
+  if (s == nullptr) {
     return EXIT_FAILURE;
   }
 
-  std::unique_ptr<Script> s(PrepareScript(context, OptInputFilenames));
-  if (!rscd.buildForCompatLib(*s, OutputFilename.c_str(), nullptr, OptRuntimePath.c_str(), false)) {
-    fprintf(stderr, "Failed to compile script!");
-    return EXIT_FAILURE;
+  if (targets.size() == 1) {
+    RSCompilerDriver rscd;
+    if (!ConfigCompiler(rscd, targets[0].mTriple) ||
+        !BuildTarget(rscd, *s, targets[0])) {
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
   }
 
+  // The inputs are read, translated and merged once. Each target then gets a
+  // copy of the result in a context of its own, as an LLVMContext can't be
+  // used from several threads at once.
+  const Source &source = s->getSource();
+  unsigned compilerVersion, optimizationLevel;
+  source.getWrapperInformation(&compilerVersion, &optimizationLevel);
+  std::string bitcode;
+  {
+    llvm::raw_string_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(&source.getModule(), os);
+  }
+  const std::string name = source.getName();
+  s.reset();
+
+  // Not a vector<bool>: the threads set distinct elements concurrently.
+  std::vector<char> built(targets.size(), false);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < targets.size(); i++) {
+    threads.emplace_back([&, i] {
+      built[i] = BuildTargetFromBitcode(targets[i], name, bitcode,
+                                        compilerVersion, optimizationLevel);
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (char success : built) {
+    if (!success) {
+      return EXIT_FAILURE;
+    }
+  }
   return EXIT_SUCCESS;
 }
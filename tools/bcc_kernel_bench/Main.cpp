@@ -0,0 +1,438 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// bcc_kernel_bench compiles a corpus of RenderScript bitcode files for the
+// machine it runs on through RSCompilerDriver, loads the objects into the
+// process and times the expanded forEach kernels on synthetic allocations of
+// several sizes. It reports ns/element and GB/s for each kernel, so that
+// compiler changes (vectorization, fusion, prefetching, ...) can be judged by
+// the throughput of the code they generate.
+//
+// The objects are loaded with RuntimeDyld rather than linked into shared
+// objects and dlopen()ed, so no linker is needed; symbols the objects don't
+// define are looked up in the process. Each .expand function is called
+// directly with a RsExpandKernelDriverInfoPfx describing a one-dimensional
+// launch, the way the CPU driver calls it for one slice.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ExecutionEngine/RuntimeDyld.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <bcc/BCCContext.h>
+#include <bcc/CompilerConfig.h>
+#include <bcc/Config.h>
+#include <bcc/Initialization.h>
+#include <bcc/RSCompilerDriver.h>
+#include <bcc/Source.h>
+#include <bcinfo/MetadataExtractor.h>
+
+using namespace bcc;
+
+namespace {
+
+llvm::cl::list<std::string>
+OptInputFilenames(llvm::cl::Positional, llvm::cl::OneOrMore,
+                  llvm::cl::desc("<input bitcode files>"));
+
+llvm::cl::opt<std::string>
+OptBCLibFilename("bclib", llvm::cl::desc("Specify the bclib filename"),
+                 llvm::cl::value_desc("bclib"), llvm::cl::Required);
+
+llvm::cl::opt<std::string>
+OptCPU("mcpu", llvm::cl::desc("CPU to generate code for (\"native\": the "
+                              "one running the benchmark; default: that of "
+                              "the compiler configuration)"),
+       llvm::cl::value_desc("cpu"));
+
+llvm::cl::list<unsigned>
+OptSizes("sizes", llvm::cl::CommaSeparated,
+         llvm::cl::desc("Numbers of elements of the allocations each kernel "
+                        "is run on (default: 4096,65536,1048576)"),
+         llvm::cl::value_desc("n,..."));
+
+llvm::cl::opt<unsigned>
+OptIterations("n", llvm::cl::desc("Number of timed launches for each kernel "
+                                  "and size (default: 20)"),
+              llvm::cl::init(20));
+
+// Mirrors of the prefix of RsExpandKernelDriverInfo that generated code
+// reads; see the definition of RsExpandKernelDriverInfoPfxTy in
+// lib/RSKernelExpand.cpp.
+const unsigned kKernelInputLimit = 8;
+
+struct RsLaunchDimensions {
+  uint32_t x;
+  uint32_t y;
+  uint32_t z;
+  uint32_t lod;
+  uint32_t face;
+  uint32_t array[4];
+};
+
+struct RsExpandKernelDriverInfoPfx {
+  const uint8_t *inPtr[kKernelInputLimit];
+  uint32_t inStride[kKernelInputLimit];
+  uint32_t inLen;
+
+  uint8_t *outPtr[kKernelInputLimit];
+  uint32_t outStride[kKernelInputLimit];
+  uint32_t outLen;
+
+  RsLaunchDimensions dim;
+  RsLaunchDimensions current;
+
+  const void *usr;
+  uint32_t usrLen;
+};
+
+// The driver has more fields after the prefix, which runtime functions
+// taking a kernel context may read; keep them zeroed.
+struct RsExpandKernelDriverInfo {
+  RsExpandKernelDriverInfoPfx mPfx;
+  uint8_t mRest[256];
+};
+
+typedef void (*ExpandedKernel)(const RsExpandKernelDriverInfo *pInfo,
+                               uint32_t pX1, uint32_t pX2, uint32_t pOutStep);
+
+// A forEach kernel of an input, with what is needed to run it.
+struct Kernel {
+  std::string mName;
+  ExpandedKernel mFunction;
+  std::vector<llvm::Type *> mInputTypes;
+  llvm::Type *mOutputType;  // nullptr if the kernel has no output.
+};
+
+// Fill pCount elements of type pType at pData with small, ordinary values:
+// random bits would make floating point kernels run on NaNs and denormals.
+void fillElements(const llvm::DataLayout &pDL, llvm::Type *pType,
+                  uint8_t *pData, size_t pCount) {
+  const size_t size = pDL.getTypeAllocSize(pType);
+  llvm::Type *scalar = pType->getScalarType();
+  const unsigned lanes = pType->isVectorTy() ? pType->getVectorNumElements()
+                                             : 1;
+  const size_t scalar_size = pDL.getTypeAllocSize(scalar);
+
+  if (!scalar->isFloatingPointTy() && !scalar->isIntegerTy()) {
+    memset(pData, 0, size * pCount);
+    return;
+  }
+
+  for (size_t i = 0; i < pCount; i++) {
+    uint8_t *element = pData + i * size;
+    memset(element, 0, size);
+    for (unsigned lane = 0; lane < lanes; lane++) {
+      uint8_t *value = element + lane * scalar_size;
+      const unsigned small = (i + lane) % 100;
+      if (scalar->isFloatTy()) {
+        float f = 0.5f + small;
+        memcpy(value, &f, sizeof(f));
+      } else if (scalar->isDoubleTy()) {
+        double d = 0.5 + small;
+        memcpy(value, &d, sizeof(d));
+      } else if (scalar->isIntegerTy()) {
+        // Little or big endian, the low byte alone is a small value.
+        value[pDL.isLittleEndian() ? 0 : scalar_size - 1] =
+            static_cast<uint8_t>(small + 1);
+      }
+    }
+  }
+}
+
+bool configureDriver(RSCompilerDriver &pRSCD) {
+  // The objects are loaded at arbitrary addresses in this process.
+  CompilerConfig *config =
+      new (std::nothrow) CompilerConfig(DEFAULT_TARGET_TRIPLE_STRING);
+  if (config == nullptr) {
+    llvm::errs() << "Out of memory when create the compiler configuration!\n";
+    return false;
+  }
+  config->setRelocationModel(llvm::Reloc::PIC_);
+  config->setCodeModel(llvm::CodeModel::Small);
+  if (OptCPU == "native") {
+    config->setCPU(llvm::sys::getHostCPUName());
+  } else if (!OptCPU.empty()) {
+    config->setCPU(OptCPU);
+  }
+
+  pRSCD.setConfig(config);
+  pRSCD.setEnableCache(false);
+
+  Compiler::ErrorCode result = pRSCD.getCompiler()->config(*config);
+  if (result != Compiler::kSuccess) {
+    llvm::errs() << "Failed to configure the compiler! (detail: "
+                 << Compiler::GetErrorString(result) << ")\n";
+    return false;
+  }
+  return true;
+}
+
+// Collect the kernel-style forEach kernels of pModule whose allocations can
+// be set up from their signature. The others are reported and skipped.
+void findKernels(const llvm::Module &pModule, std::vector<Kernel> *pKernels) {
+  bcinfo::MetadataExtractor metadata(&pModule);
+  if (!metadata.extract()) {
+    llvm::errs() << "Unable to read the metadata of "
+                 << pModule.getModuleIdentifier() << "\n";
+    return;
+  }
+
+  const size_t count = metadata.getExportForEachSignatureCount();
+  const char **names = metadata.getExportForEachNameList();
+  const uint32_t *signatures = metadata.getExportForEachSignatureList();
+  const uint32_t *input_counts = metadata.getExportForEachInputCountList();
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t signature = signatures[i];
+    const char *skipped = nullptr;
+    const llvm::Function *function = pModule.getFunction(names[i]);
+    if (function == nullptr || function->isDeclaration()) {
+      // The dummy root of scripts without one.
+      continue;
+    }
+    if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(signature)) {
+      skipped = "not a kernel-style function";
+    } else if (input_counts[i] > kKernelInputLimit ||
+               input_counts[i] > function->arg_size()) {
+      skipped = "unexpected inputs";
+    } else if (function->getReturnType()->isVoidTy() &&
+               bcinfo::MetadataExtractor::hasForEachSignatureOut(signature)) {
+      skipped = "output returned through a pointer";
+    }
+    if (skipped != nullptr) {
+      llvm::outs() << "Skipping " << names[i] << ": " << skipped << "\n";
+      continue;
+    }
+
+    Kernel kernel;
+    kernel.mName = names[i];
+    kernel.mFunction = nullptr;
+    llvm::FunctionType *type = function->getFunctionType();
+    for (unsigned input = 0; input < input_counts[i]; input++) {
+      // Large inputs are passed by reference.
+      llvm::Type *input_type = type->getParamType(input);
+      if (input_type->isPointerTy()) {
+        input_type = input_type->getPointerElementType();
+      }
+      kernel.mInputTypes.push_back(input_type);
+    }
+    kernel.mOutputType = function->getReturnType()->isVoidTy()
+                             ? nullptr : function->getReturnType();
+    pKernels->push_back(kernel);
+  }
+}
+
+// Time pKernel on allocations of each of the requested sizes and report the
+// median launch.
+void benchKernel(const llvm::DataLayout &pDL, const Kernel &pKernel,
+                 const std::vector<unsigned> &pSizes) {
+  size_t bytes_per_element = 0;
+  for (llvm::Type *type : pKernel.mInputTypes) {
+    bytes_per_element += pDL.getTypeAllocSize(type);
+  }
+  const size_t out_size = (pKernel.mOutputType != nullptr)
+                              ? pDL.getTypeAllocSize(pKernel.mOutputType) : 0;
+  bytes_per_element += out_size;
+
+  llvm::outs() << "  " << pKernel.mName << " (" << pKernel.mInputTypes.size()
+               << " inputs, " << ((out_size > 0) ? 1 : 0) << " output, "
+               << bytes_per_element << " bytes/element)\n";
+  llvm::outs() << llvm::format("    %12s %12s %12s %12s\n", "elements",
+                               "ns/element", "best", "GB/s");
+
+  for (unsigned elements : pSizes) {
+    std::vector<std::vector<uint8_t>> inputs;
+    RsExpandKernelDriverInfo info;
+    memset(&info, 0, sizeof(info));
+    for (llvm::Type *type : pKernel.mInputTypes) {
+      const size_t size = pDL.getTypeAllocSize(type);
+      inputs.emplace_back(size * elements);
+      fillElements(pDL, type, inputs.back().data(), elements);
+      info.mPfx.inPtr[info.mPfx.inLen] = inputs.back().data();
+      info.mPfx.inStride[info.mPfx.inLen] = size;
+      info.mPfx.inLen++;
+    }
+    std::vector<uint8_t> output(out_size * elements);
+    if (out_size > 0) {
+      info.mPfx.outPtr[0] = output.data();
+      info.mPfx.outStride[0] = out_size;
+      info.mPfx.outLen = 1;
+    }
+    info.mPfx.dim.x = elements;
+    info.mPfx.dim.y = 1;
+    info.mPfx.dim.z = 1;
+
+    // The first launch faults the allocations in and warms the caches.
+    pKernel.mFunction(&info, 0, elements, out_size);
+
+    std::vector<double> samples;
+    for (unsigned i = 0; i < OptIterations; i++) {
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      pKernel.mFunction(&info, 0, elements, out_size);
+      samples.push_back(std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    const double median = samples[samples.size() / 2];
+
+    llvm::outs() << llvm::format("    %12u %12.3f %12.3f %12.2f\n", elements,
+                                 median / elements, samples.front() / elements,
+                                 bytes_per_element * elements / median);
+  }
+}
+
+bool benchScript(const std::string &pInput,
+                 const std::vector<unsigned> &pSizes) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+      llvm::MemoryBuffer::getFile(pInput);
+  if (mb_or_error.getError()) {
+    llvm::errs() << "Failed to load bitcode from path " << pInput << "! ("
+                 << mb_or_error.getError().message() << ")\n";
+    return false;
+  }
+  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
+  std::string res_name = llvm::sys::path::stem(pInput);
+
+  // The kernels and the types of their allocations, from a copy of the
+  // module the driver doesn't get to transform.
+  BCCContext context;
+  std::unique_ptr<Source> source(Source::CreateFromBuffer(
+      context, res_name.c_str(), input_data->getBufferStart(),
+      input_data->getBufferSize()));
+  if (source == nullptr) {
+    llvm::errs() << "Error loading file '" << pInput << "'\n";
+    return false;
+  }
+  std::vector<Kernel> kernels;
+  findKernels(source->getModule(), &kernels);
+  const llvm::DataLayout data_layout(&source->getModule());
+
+  llvm::SmallVector<char, 0> object;
+  {
+    BCCContext build_context;
+    RSCompilerDriver RSCD;
+    if (!configureDriver(RSCD)) {
+      return false;
+    }
+    llvm::raw_svector_ostream object_stream(object);
+    if (!RSCD.build(build_context, res_name.c_str(),
+                    input_data->getBufferStart(), input_data->getBufferSize(),
+                    "", OptBCLibFilename.c_str(), object_stream)) {
+      llvm::errs() << "Failed to compile " << pInput << "!\n";
+      return false;
+    }
+  }
+
+  // Load the object. Its code stays mapped until the memory manager goes
+  // away, after the last kernel has run.
+  llvm::Expected<std::unique_ptr<llvm::object::ObjectFile>> object_file =
+      llvm::object::ObjectFile::createObjectFile(
+          llvm::MemoryBufferRef(llvm::StringRef(object.data(), object.size()),
+                                res_name));
+  if (!object_file) {
+    llvm::logAllUnhandledErrors(object_file.takeError(), llvm::errs(),
+                                "Unable to read the object of " + pInput +
+                                    ": ");
+    return false;
+  }
+
+  llvm::SectionMemoryManager memory_manager;
+  llvm::RuntimeDyld dyld(memory_manager, memory_manager);
+  dyld.loadObject(**object_file);
+  dyld.resolveRelocations();
+  dyld.registerEHFrames();
+  std::string error;
+  if (dyld.hasError() || memory_manager.finalizeMemory(&error)) {
+    llvm::errs() << "Unable to load the object of " << pInput << ": "
+                 << (dyld.hasError() ? dyld.getErrorString().str() : error)
+                 << "\n";
+    return false;
+  }
+
+  llvm::outs() << pInput << "\n";
+  for (Kernel &kernel : kernels) {
+    const std::string expanded = kernel.mName + ".expand";
+    void *address = dyld.getSymbolLocalAddress(expanded);
+    if (address == nullptr) {
+      // Mach-O symbols carry a leading underscore.
+      address = dyld.getSymbolLocalAddress("_" + expanded);
+    }
+    if (address == nullptr) {
+      llvm::errs() << "No " << expanded << " in the object of " << pInput
+                   << "\n";
+      return false;
+    }
+    kernel.mFunction = reinterpret_cast<ExpandedKernel>(address);
+    benchKernel(data_layout, kernel, pSizes);
+  }
+
+  return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+  llvm::llvm_shutdown_obj _ShutdownObj;
+  init::Initialize();
+  llvm::cl::ParseCommandLineOptions(argc, argv, "RenderScript kernel "
+                                                "throughput benchmark\n");
+
+  if (OptIterations == 0) {
+    llvm::errs() << "-n must be at least 1\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<unsigned> sizes(OptSizes.begin(), OptSizes.end());
+  if (sizes.empty()) {
+    sizes = { 4096, 65536, 1048576 };
+  }
+  if (std::find(sizes.begin(), sizes.end(), 0u) != sizes.end()) {
+    llvm::errs() << "-sizes must be at least 1\n";
+    return EXIT_FAILURE;
+  }
+
+  for (const std::string &input : OptInputFilenames) {
+    if (!benchScript(input, sizes)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -14,8 +14,13 @@
  * limitations under the License.
  */
 
+#include "bcc/RuntimeSnapshot.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
@@ -43,6 +48,12 @@ static cl::opt<bool>
 OutputAssembly("S",
                cl::desc("Write output as LLVM assembly"), cl::Hidden);
 
+static cl::opt<std::string>
+SnapshotTriple("snapshot-triple",
+               cl::desc("Also make the output a runtime snapshot for this "
+                        "target triple (see bcc/RuntimeSnapshot.h)"),
+               cl::value_desc("triple"));
+
 namespace {
   class StripAttributes : public ModulePass {
   public:
@@ -93,6 +104,37 @@ static RegisterPass<StripAttributes> RPSA("StripAttributes",
     "Strip Function Attributes Pass");
 
 
+// Turn the verified module M into a runtime snapshot for Triple. Returns
+// false if M was built for another architecture.
+static bool MakeSnapshot(Module &M, const std::string &Triple) {
+  if (!M.getTargetTriple().empty() &&
+      llvm::Triple(M.getTargetTriple()).getArch() !=
+          llvm::Triple(Triple).getArch()) {
+    return false;
+  }
+  M.setTargetTriple(Triple);
+
+  LLVMContext &Context = M.getContext();
+  NamedMDNode *Sizes =
+      M.getOrInsertNamedMetadata(bcc::kRuntimeSnapshotSizesMetadataName);
+  for (const Function &F : M) {
+    if (F.isDeclaration() || F.hasLocalLinkage()) {
+      continue;
+    }
+    unsigned Size = 0;
+    for (const BasicBlock &BB : F) {
+      Size += BB.size();
+    }
+    Metadata *Entry[] = { MDString::get(Context, F.getName()),
+                          MDString::get(Context, utostr(Size)) };
+    Sizes->addOperand(MDTuple::get(Context, Entry));
+  }
+
+  M.getOrInsertNamedMetadata(bcc::kRuntimeSnapshotMetadataName)
+      ->addOperand(MDTuple::get(Context, MDString::get(Context, Triple)));
+  return true;
+}
+
 static inline std::unique_ptr<Module> LoadFile(const char *argv0,
                                                const std::string &FN,
                                                LLVMContext& Context) {
@@ -143,6 +185,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (!SnapshotTriple.empty() && !MakeSnapshot(*M, SnapshotTriple)) {
+    errs() << argv[0] << ": '" << InputFilenames[0]
+           << "' was not built for " << SnapshotTriple << "\n";
+    return 1;
+  }
+
   if (OutputAssembly) {
     Out.os() << *M;
   } else if (!CheckBitcodeOutputToConsole(Out.os(), true)) {